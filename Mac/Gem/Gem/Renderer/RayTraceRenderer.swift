@@ -40,6 +40,13 @@ class RayTraceRenderer: Renderer {
         Ray_TraceRayFromViewport(Double(pointOnViewPort.x), Double(pointOnViewPort.y), &color)
         return CGColor(red: CGFloat(color.x), green: CGFloat(color.y), blue: CGFloat(color.z), alpha: 1.0)
     }
+
+    func colors(from pointOnViewPort: CGPoint, step: CGSize, width: Int, height: Int,
+                into rgb: UnsafeMutablePointer<Float>, stride: Int) {
+        Ray_TraceViewportBlock(Double(pointOnViewPort.x), Double(pointOnViewPort.y),
+                               Double(step.width), Double(step.height),
+                               Int32(width), Int32(height), rgb, Int32(stride))
+    }
     
     func finished() {
         scn20_close()
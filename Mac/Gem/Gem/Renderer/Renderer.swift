@@ -14,6 +14,8 @@ protocol Renderer {
     func start()
     func stop()
     func color(at pointOnViewPort: CGPoint) -> CGColor
+    func colors(from pointOnViewPort: CGPoint, step: CGSize, width: Int, height: Int,
+                into rgb: UnsafeMutablePointer<Float>, stride: Int)
     func finished()
 }
 
@@ -30,4 +32,19 @@ extension Renderer {
     func finished() {
         
     }
+
+    // Fills in the RGB colors of a grid of points, a row at a time, "stride" floats apart.
+    func colors(from pointOnViewPort: CGPoint, step: CGSize, width: Int, height: Int,
+                into rgb: UnsafeMutablePointer<Float>, stride: Int) {
+        for y in 0 ..< height {
+            for x in 0 ..< width {
+                let point = CGPoint(x: pointOnViewPort.x + CGFloat(x) * step.width,
+                                    y: pointOnViewPort.y + CGFloat(y) * step.height)
+                let components = color(at: point).components ?? [0.0, 0.0, 0.0]
+                for c in 0 ..< 3 {
+                    rgb[y * stride + x * 3 + c] = Float(components[min(c, components.count - 1)])
+                }
+            }
+        }
+    }
 }
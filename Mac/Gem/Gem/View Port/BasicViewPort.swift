@@ -47,11 +47,17 @@ class BasicViewPort: ViewPort {
             guard let strongSelf = self else { return }
             strongSelf.delegate.viewPortRenderStarted(strongSelf, imageWidth: strongSelf.imageWidth, imageHeight: strongSelf.imageHeight)
         }
+        let step = CGSize(width: bounds.width / CGFloat(imageWidth), height: -bounds.height / CGFloat(imageHeight))
+        var row = [Float](repeating: 0.0, count: imageWidth * 3)
         for y in 0 ..< imageHeight {
             let currentY = bounds.origin.y - (CGFloat(y) / CGFloat(imageHeight) * bounds.height)
+            row.withUnsafeMutableBufferPointer { buffer in
+                renderer.colors(from: CGPoint(x: bounds.origin.x, y: currentY), step: step,
+                                width: imageWidth, height: 1, into: buffer.baseAddress!, stride: imageWidth * 3)
+            }
             for x in 0 ..< imageWidth {
-                let currentX = bounds.origin.x + (CGFloat(x) / CGFloat(imageWidth) * bounds.width)
-                let color = renderer.color(at: CGPoint(x: currentX, y: currentY))
+                let color = CGColor(red: CGFloat(row[x * 3]), green: CGFloat(row[x * 3 + 1]),
+                                    blue: CGFloat(row[x * 3 + 2]), alpha: 1.0)
                 outputFile?.savePixel(color: color)
                 DispatchQueue.main.async { [weak self] in
                     guard let strongSelf = self else { return }
@@ -44,6 +44,7 @@
 #define GEM_REG_RENDERER_AA			_T("Antialiasing")
 #define GEM_REG_RENDERER_AATHRESH	_T("AA Threshold")
 #define GEM_REG_RENDERER_AADEPTH	_T("AA Depth")
+#define GEM_REG_RENDERER_AAVARIANCE	_T("AA Variance")
 #define GEM_REG_RENDERER_JITTER		_T("Jitter")
 #define GEM_REG_RENDERER_JITTERAMT	_T("Jitter Amount")
 #define GEM_REG_RENDERER_ANIM		_T("Animation")
@@ -133,6 +134,8 @@ extern int GemFileOpenDlg(HWND hwnd, LPCTSTR lpszFilename,
  */
 extern int RaytracePixel(double u, double v,
   unsigned char *r, unsigned char *g, unsigned char *b);
+extern int RaytraceBlock(int n, double *u, double *v, unsigned char *rgb);
+extern int RaytracePixelFloat(double u, double v, float *rgb);
 extern BOOL CheckRayError(void);
 extern RaySetupData rsd;       /* Setup info for the ray-tracer. */
 extern Rend2D renderer;        /* Setup info for the 2D renderer. */
@@ -210,6 +213,7 @@ extern int renddlg_output_width;
 extern int renddlg_output_height;
 extern int renddlg_aa_none;
 extern int renddlg_aa_adaptive;
+extern int renddlg_aa_variance;
 extern int renddlg_aa_threshold;
 extern int renddlg_aa_depth;
 extern int renddlg_jitter_on;
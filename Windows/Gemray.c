@@ -12,6 +12,8 @@
  */
 int RaytracePixel(double u, double v,
   unsigned char *r, unsigned char *g, unsigned char *b);
+int RaytraceBlock(int n, double *u, double *v, unsigned char *rgb);
+int RaytracePixelFloat(double u, double v, float *rgb);
 RaySetupData rsd;             /* Setup info for the ray-tracer. */
 Rend2D renderer;              /* Setup info for the 2D renderer. */
 
@@ -41,6 +43,53 @@ int RaytracePixel(double u, double v,
 }
 
 
+/*************************************************************************
+*
+*  int RaytraceBlock(int n, double *u, double *v, unsigned char *rgb)
+*
+*  Block callback function for the 2D renderer. Traces a tile of
+*  pixels at once, as packets of eye rays.
+*
+*  Returns 1 (Rend2D requires a return value for background purposes)
+*
+*************************************************************************/
+int RaytraceBlock(int n, double *u, double *v, unsigned char *rgb)
+{
+  Vec3 color[REND2D_TILE_SIZE * REND2D_TILE_SIZE];
+  int i;
+
+  Ray_TracePacketFromViewport(n, u, v, color);
+  for(i = 0; i < n; i++)
+  {
+    *rgb++ = (unsigned char)(CLAMP(color[i].x, 0.0, 0.999999) * 256.0);
+    *rgb++ = (unsigned char)(CLAMP(color[i].y, 0.0, 0.999999) * 256.0);
+    *rgb++ = (unsigned char)(CLAMP(color[i].z, 0.0, 0.999999) * 256.0);
+  }
+  return 1;
+}
+
+
+/*************************************************************************
+*
+*  int RaytracePixelFloat(double u, double v, float *rgb)
+*
+*  Float color callback function for the 2D renderer. As RaytracePixel(),
+*  but leaving the color unclamped.
+*
+*  Returns 1 (Rend2D requires a return value for background purposes)
+*
+*************************************************************************/
+int RaytracePixelFloat(double u, double v, float *rgb)
+{
+  Vec3 color;
+  Ray_TraceRayFromViewport(u, v, &color);
+  rgb[0] = (float)color.x;
+  rgb[1] = (float)color.y;
+  rgb[2] = (float)color.z;
+  return 1;
+}
+
+
 /*************************************************************************
 *
 *  BOOL CheckRayError(void)
@@ -77,14 +77,22 @@ int BuildScene(LPCTSTR lpszFilename)
 	renderer.ystart = 0;
 	renderer.yres = renderer.yend = 
 		renddlg_use_scn_res ? rsd.yres : renddlg_output_height;
-	renderer.mode = renddlg_aa_adaptive ? REND2D_MODE_ADAPTIVE_ANTIALIAS :
+	renderer.mode = renddlg_aa_variance ? REND2D_MODE_ADAPTIVE_VARIANCE :
+		renddlg_aa_adaptive ? REND2D_MODE_ADAPTIVE_ANTIALIAS :
 		REND2D_MODE_ONCE_PER_PIXEL;
 	renderer.aa_level = renddlg_aa_depth;
 	renderer.aa_threshold = renddlg_aa_threshold;
+	/* Variance anti-aliasing takes its tolerance from the threshold, and
+	 * its sample cap from the depth, 4 samples per level.
+	 */
+	renderer.aa_tolerance = (double)renddlg_aa_threshold / 255.0;
+	renderer.aa_max_samples = 1 << (2 * renddlg_aa_depth);
 	renderer.jitter = renddlg_jitter_on ?
 		(double)renddlg_jitter_percent/100.0 : 0.0;
 
 	renderer.calc_color = RaytracePixel;
+	renderer.calc_colors = RaytraceBlock;
+	renderer.calc_color_f = RaytracePixelFloat;
 	if (renderer.xres < renderer.yres)
 	{
 		renderer.vmin = (double)renderer.yres / (double)renderer.xres;
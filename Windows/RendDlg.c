@@ -13,6 +13,7 @@ int renddlg_output_width;
 int renddlg_output_height;
 int renddlg_aa_none;
 int renddlg_aa_adaptive;
+int renddlg_aa_variance;
 int renddlg_aa_threshold;
 int renddlg_aa_depth;
 int renddlg_jitter_on;
@@ -34,6 +35,7 @@ static void RendDlgSaveState(void)
 		WinUtil_RegSetIntValue(hkey, GEM_REG_RENDERER_PREVIEW, renddlg_preview_mode);
 		WinUtil_RegSetIntValue(hkey, GEM_REG_RENDERER_USESCNRES, renddlg_use_scn_res);
 		WinUtil_RegSetIntValue(hkey, GEM_REG_RENDERER_AA, renddlg_aa_adaptive);
+		WinUtil_RegSetIntValue(hkey, GEM_REG_RENDERER_AAVARIANCE, renddlg_aa_variance);
 		WinUtil_RegSetIntValue(hkey, GEM_REG_RENDERER_AATHRESH, renddlg_aa_threshold);
 		WinUtil_RegSetIntValue(hkey, GEM_REG_RENDERER_AADEPTH, renddlg_aa_depth);
 		WinUtil_RegSetIntValue(hkey, GEM_REG_RENDERER_JITTER, renddlg_jitter_on);
@@ -59,6 +61,7 @@ BOOL RendDlgColdStart(void)
 	renddlg_output_height = 120;
 	renddlg_aa_none = 1;
 	renddlg_aa_adaptive = 0;
+	renddlg_aa_variance = 0;
 	renddlg_aa_threshold = 5;
 	renddlg_aa_depth = 3;
 	renddlg_jitter_on = 0;
@@ -83,6 +86,7 @@ BOOL RendDlgColdStart(void)
 			WinUtil_RegGetIntValue(hkey, GEM_REG_RENDERER_PREVIEW, &renddlg_preview_mode);
 			WinUtil_RegGetIntValue(hkey, GEM_REG_RENDERER_USESCNRES, &renddlg_use_scn_res);
 			WinUtil_RegGetIntValue(hkey, GEM_REG_RENDERER_AA, &renddlg_aa_adaptive);
+			WinUtil_RegGetIntValue(hkey, GEM_REG_RENDERER_AAVARIANCE, &renddlg_aa_variance);
 			WinUtil_RegGetIntValue(hkey, GEM_REG_RENDERER_AATHRESH, &renddlg_aa_threshold);
 			WinUtil_RegGetIntValue(hkey, GEM_REG_RENDERER_AADEPTH, &renddlg_aa_depth);
 			WinUtil_RegGetIntValue(hkey, GEM_REG_RENDERER_JITTER, &renddlg_jitter_on);
@@ -124,7 +128,8 @@ static void CheckState(HWND hdlg, UINT idCtrl)
 			break;
 		case IDC_RENDERER_AA_NONE:
 		case IDC_RENDERER_AA_ADAPT:
-			bResult = ISCHECKED(hdlg, IDC_RENDERER_AA_ADAPT);
+		case IDC_RENDERER_AA_VARIANCE:
+			bResult = !ISCHECKED(hdlg, IDC_RENDERER_AA_NONE);
 			EnableWindow(GetDlgItem(hdlg, IDC_RENDERER_AA_THRESHOLD), bResult);
 			EnableWindow(GetDlgItem(hdlg, IDC_RENDERER_AA_DEPTH), bResult);
 			break;
@@ -178,7 +183,9 @@ BOOL CALLBACK RendDlgProc(HWND hdlg, UINT msg,
 			SETCHECK(hdlg, IDC_RENDERER_PREVIEW, renddlg_preview_mode);
 			SetDlgItemInt(hdlg, IDC_RENDERER_WIDTH, (UINT)renddlg_output_width, 0);
 			SetDlgItemInt(hdlg, IDC_RENDERER_HEIGHT, (UINT)renddlg_output_height, 0);
-			if(renddlg_aa_adaptive)
+			if(renddlg_aa_variance)
+				SETCHECK(hdlg, IDC_RENDERER_AA_VARIANCE, TRUE);
+			else if(renddlg_aa_adaptive)
 				SETCHECK(hdlg, IDC_RENDERER_AA_ADAPT, TRUE);
 			else
 				SETCHECK(hdlg, IDC_RENDERER_AA_NONE, TRUE);
@@ -195,6 +202,7 @@ BOOL CALLBACK RendDlgProc(HWND hdlg, UINT msg,
 				case IDC_RENDERER_USE_SCN_RES:
 				case IDC_RENDERER_AA_NONE:
 				case IDC_RENDERER_AA_ADAPT:
+				case IDC_RENDERER_AA_VARIANCE:
 				case IDC_RENDERER_AA_JITTER:
 				case IDC_RENDERER_ANIMATION:
 					CheckState(hdlg, LOWORD(wParam));
@@ -233,11 +241,13 @@ BOOL CALLBACK RendDlgProc(HWND hdlg, UINT msg,
 					{
 						renddlg_aa_none = 1;
 						renddlg_aa_adaptive = 0;
+						renddlg_aa_variance = 0;
 					}
 					else
 					{
 						renddlg_aa_none = 0;
 						renddlg_aa_adaptive = 1;
+						renddlg_aa_variance = ISCHECKED(hdlg, IDC_RENDERER_AA_VARIANCE);
 					}
 					itmp = (int)GetDlgItemInt(hdlg, IDC_RENDERER_AA_THRESHOLD, &bResult, 0);
 					if (bResult)
@@ -36,6 +36,7 @@
 #define IDC_RENDERER_END_FRAME          1012
 #define IDC_GEM_ABOUT_VERSION           1012
 #define IDC_GEM_ABOUT_BUILDINFO         1013
+#define IDC_RENDERER_AA_VARIANCE        1015
 #define ID_FILE_LOAD                    40002
 #define ID_FILE_RELOAD                  40003
 #define ID_FILE_EXIT                    40004
@@ -67,7 +68,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        111
 #define _APS_NEXT_COMMAND_VALUE         40024
-#define _APS_NEXT_CONTROL_VALUE         1015
+#define _APS_NEXT_CONTROL_VALUE         1016
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif
@@ -275,12 +275,24 @@ extern void RotatePoint3D(Vec3 *P, double angle, Vec3 *axis);
 *	Root solving functions
 *
 *************************************************************************/
+
+/* Root solving methods, for the "solver" fields of objects. */
+#define SOLVER_CLOSED_FORM	0	/* SolvePoly() */
+#define SOLVER_STURM		1	/* SolvePolySturm() */
+
 extern int SolvePoly(double *c, double *s, int order, double lo, double hi);
+extern int SolvePolySturm(double *c, double *s, int order, double lo, double hi);
 extern int SolveLinear(double *c, double *s);
 extern int SolveQuadric(double *c, double *s);
 extern int SolveCubic(double *c, double *s);
 extern int SolveQuartic(double *c, double *s);
 
+/* Most quartics solved at once by SolveQuarticN(). */
+#define QUARTIC_BATCH_MAX	16
+
+extern void SolveQuarticN(double *c0, double *c1, double *c2, double *c3,
+	int n, double *lo, double *hi, double (*s)[4], int *nroots);
+
 /*************************************************************************
 *
 *	Random number functions
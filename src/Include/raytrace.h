@@ -103,6 +103,15 @@ typedef struct tag_raysetupdata
 	/* If true, generate fake caustics in shadows. */
 	int use_fake_caustics;
 
+	/* If true, packets trace their secondary rays a bounce at a time. */
+	int use_wavefront;
+
+	/* If true, packets shade their eye hits grouped by surface. */
+	int use_deferred;
+
+	/* If non-zero, most lights to sample per hit when more can contribute. */
+	int light_samples;
+
 	/* Global index of refraction for the world. */
 	double global_ior;
 
@@ -196,6 +205,10 @@ enum
 	OBJ_SPHERE,
 	OBJ_TORUS,
 	OBJ_TRIANGLE,
+	OBJ_TORUSBATCH,
+	OBJ_SPHEREBATCH,
+	OBJ_BOXBATCH,
+	OBJ_DISCBATCH,
 	OBJ_NUM_OBJECT_TYPES
 };
 
@@ -258,6 +271,9 @@ typedef struct tag_bbox
 	Vec3 bmin, bmax;
 	int num_objects;
 	Object *objects;
+	int num_boxes;		/* Number of bounding boxes in "objects". */
+	Object **boxes;		/* Those bounding boxes, in list order. */
+	double *box_bounds;	/* Their extents by field: min x, y, z, max x, y, z. */
 } BBoxData;
 
 
@@ -323,12 +339,38 @@ typedef struct tag_box
 	float x1, y1, z1, x2, y2, z2;
 } BoxData;
 
+/*
+ * Boxes sharing a bounding box are intersected together, with their
+ * parameters laid out by field so one loop covers the whole batch.
+ */
+#define BOX_BATCH_MAX 16
+
+typedef struct tag_boxbatch
+{
+	int n;							/* Number of boxes in batch. */
+	Object *objects;				/* List of the boxes. */
+	Object *obj[BOX_BATCH_MAX];		/* The boxes, in batch order. */
+	double I[12][BOX_BATCH_MAX];	/* Inverse transforms, rows 0-3, columns 0-2. */
+	double x1[BOX_BATCH_MAX], y1[BOX_BATCH_MAX], z1[BOX_BATCH_MAX];
+	double x2[BOX_BATCH_MAX], y2[BOX_BATCH_MAX], z2[BOX_BATCH_MAX];
+} BoxBatchData;
+
 
 /*************************************************************************
 *
 *	CSG data.
 *
 *************************************************************************/
+typedef struct tag_csgkid
+{
+	Object *obj;		/* Child object. */
+	Vec3 bmin, bmax;	/* Extents of child object. */
+	int bounded;		/* True if child is never inside outside above. */
+	int probe;			/* True if state must be found with IsInside(). */
+	int inside;			/* Inside state along the current ray. */
+	int last;			/* Scratch state for checking its hits alternate. */
+} CSGKid;
+
 typedef struct tag_csg
 {
 	Object *boundobj;	/* User-supplied bounding object. */
@@ -337,6 +379,12 @@ typedef struct tag_csg
 	LightList *litelist;	/* Lights that are part of this object. */
 	Object *objhit;		/* Closest object hit. */
 	HitData *hits;		/* List of all ray/object hits after CSG operation. */
+	CSGKid *kids;		/* Objects in original CSG order, as an array. */
+	int *kidorder;		/* Indices into kids sorted by object address. */
+	int *probes;		/* Indices of kids that need IsInside() tests. */
+	int nprobes;		/* Number of above. */
+	int noshadow;		/* True if any kid has the "no_shadow" flag. */
+	int solid;			/* True if hits always bound a closed solid. */
 	int nchildren;		/* Number of objects in CSG operation. */
 	int nhits;			/* Number of hits in above list. */
 } CSGData;
@@ -375,6 +423,22 @@ typedef struct tag_disc
 	double d, inrsq, outrsq;
 } DiscData;
 
+/*
+ * Discs sharing a bounding box, laid out like box batches.
+ */
+#define DISC_BATCH_MAX 16
+
+typedef struct tag_discbatch
+{
+	int n;							/* Number of discs in batch. */
+	Object *objects;				/* List of the discs. */
+	Object *obj[DISC_BATCH_MAX];	/* The discs, in batch order. */
+	double I[12][DISC_BATCH_MAX];	/* Inverse transforms, rows 0-3, columns 0-2. */
+	double lx[DISC_BATCH_MAX], ly[DISC_BATCH_MAX], lz[DISC_BATCH_MAX];
+	double nx[DISC_BATCH_MAX], ny[DISC_BATCH_MAX], nz[DISC_BATCH_MAX];
+	double d[DISC_BATCH_MAX], inrsq[DISC_BATCH_MAX], outrsq[DISC_BATCH_MAX];
+} DiscBatchData;
+
 
 /*************************************************************************
 *
@@ -420,9 +484,17 @@ typedef struct tag_fnxyz
 	double xinc,		/* Increments in which to... */
 		yinc,			/* ...search for single roots. */
 		zinc;
+	int has_grad;		/* True if fn can be evaluated with its gradient. */
+	unsigned char *grid;	/* Occupancy bits, one per cell, or NULL. */
+	size_t gridsize;	/* Size, in bytes, of occupancy grid. */
+	int nx, ny, nz;		/* Occupancy grid resolution. */
+	Vec3 cell;			/* Size of an occupancy grid cell. */
 	int nrefs;			/* Reference copy copy counter. */
 } FnxyzData;
 
+/* Max # of occupancy grid cells along each axis of a fn_xyz. */
+#define FNXYZ_GRID_MAX	64
+
 
 /*************************************************************************
 *
@@ -450,6 +522,9 @@ typedef struct tag_meshtri
 	int axis;			/* Axis of greatest 2D projection. */
 } MeshTri;
 
+/* Most sub nodes per mesh tree node after collapsing (4 or 8). */
+#define MESH_NODE_WIDTH 4
+
 typedef struct tag_meshnode
 {
 	struct tag_meshnode *next;	/* Next node on this level. */
@@ -489,12 +564,26 @@ typedef struct tag_mesh
 *	Polygon type.
 *
 *************************************************************************/
+/*
+ * Polygons with at least POLYGON_BAND_MIN vertices get their projected edges
+ * sorted into horizontal bands so the inside test only looks at the edges
+ * that straddle the hit point's band.
+ */
+#define POLYGON_BAND_MIN 16
+
 typedef struct tag_polygon
 {
 	int npts;
 	int axis;
 	float *pts;
 	float nx, ny, nz;
+	int nbands;			/* Number of bands, 0 if none. */
+	int nbandedges;		/* Length of band_edges. */
+	int *band_start;	/* band_edges index of each band's first edge (nbands+1). */
+	int *band_edges;	/* Edge indices, grouped by band. */
+	double band_ymin;	/* Bottom of the band range. */
+	double band_ymax;	/* Top of the band range. */
+	double band_scale;	/* Bands per unit of projected y. */
 } PolygonData;
 
 
@@ -508,6 +597,23 @@ typedef struct tag_sphere
 	float x, y, z, r;
 } SphereData;
 
+/*
+ * Spheres sharing a bounding box are intersected together, with their
+ * parameters laid out by field so one loop covers the whole batch.
+ */
+#define SPHERE_BATCH_MAX 16
+
+typedef struct tag_spherebatch
+{
+	int n;							/* Number of spheres in batch. */
+	int nplain;						/* Number without a transform; these come first. */
+	Object *objects;				/* List of the spheres. */
+	Object *obj[SPHERE_BATCH_MAX];	/* The spheres, in batch order. */
+	double I[12][SPHERE_BATCH_MAX];	/* Inverse transforms, rows 0-3, columns 0-2. */
+	double x[SPHERE_BATCH_MAX], y[SPHERE_BATCH_MAX], z[SPHERE_BATCH_MAX];
+	double rsq[SPHERE_BATCH_MAX];	/* Radii squared. */
+} SphereBatchData;
+
 
 /*************************************************************************
 *
@@ -525,6 +631,26 @@ typedef struct tag_torus
 	int solver;			/* What root solving method to use. */
 } TorusData;
 
+/*
+ * Tori that share a bounding tree leaf, laid out one array per field
+ * so that their rays can be set up and culled together.
+ */
+#define TORUS_BATCH_MAX 16
+
+typedef struct tag_torusbatch
+{
+	int n;							/* Number of tori in batch. */
+	Object *objects;				/* List of the tori. */
+	Object *obj[TORUS_BATCH_MAX];	/* The tori, in batch order. */
+	double xform[TORUS_BATCH_MAX];	/* 1 if torus has a transform, else 0. */
+	double I[12][TORUS_BATCH_MAX];	/* Inverse transforms, rows 0-3, columns 0-2. */
+	double lx[TORUS_BATCH_MAX], ly[TORUS_BATCH_MAX], lz[TORUS_BATCH_MAX];
+	double r[TORUS_BATCH_MAX];		/* Minor radii. */
+	double R2[TORUS_BATCH_MAX], dr[TORUS_BATCH_MAX];	/* As in TorusData. */
+	double hole_rsq[TORUS_BATCH_MAX];	/* Hole radius squared, 0 if no hole. */
+	double bound_rsq[TORUS_BATCH_MAX];
+} TorusBatchData;
+
 
 /*************************************************************************
 *
@@ -575,21 +701,26 @@ typedef struct tag_object
 	Surface *surface;	/* Object surface attributes. */
 	unsigned int flags;	/* Special action flags. */
 	Xform *T;			/* Transform data. */
+	unsigned long id;	/* Order made in, for hashing. */
 	union
 	{
 		BBoxData *bbox;
 		BlobData *blob;
 		BoxData *box;
+		BoxBatchData *boxbatch;
 		ColorTriangleData *colortri;
 		ConeData *cone;
 		CSGData *csg;
 		DiscData *disc;
+		DiscBatchData *discbatch;
 		HFieldData *hf;
 		FnxyzData *fnxyz;
 		MeshData *mesh;
 		PolygonData *polygon;
 		SphereData *sphere;
+		SphereBatchData *spherebatch;
 		TorusData *torus;
+		TorusBatchData *torusbatch;
 		TriangleData *triangle;
 	} data;				/* Object-specific data. */
 	union
@@ -636,11 +767,11 @@ typedef struct tag_light
 	Vec3 dir;			/* Direction of light source. */
 	Vec3 color;			/* Color of light source. */
 	Vec3 jitter;		/* Amount of random jitter to add to location. */
+	int samples;		/* Shadow samples across the jitter per point lit. */
 	double falloff;		/* Falloff factor light sources of known distance. */
 	double focus;		/* Power for the angle of distribution of dir. light. */
 	double angle_min, angle_max, angle_diff;	/* Spot light cone angles. */
-	/* Points to an object if last shadow was completely blocked. */
-	Object *block_obj_cached;
+	unsigned int id;	/* Order made in, for contributor filters. */
 } Light;
 
 
@@ -663,6 +794,7 @@ typedef struct tag_surface
 	double outior;		// Index of refraction outside surface.
 	int transmissive;	// True if this surface is transmissive.
 	int nrefs;			// Number of references to this surface.
+	unsigned int id;	// Order made in, for contributor filters.
 
 	// Shaders that procedurally set the lighting attributes for this
 	// surface at runtime.
@@ -708,7 +840,7 @@ extern void Ray_SetCone(ConeData *cone, Vec3 *base, Vec3 *end,
 	double base_rad, double end_rad, int closed); 
 extern Object *Ray_MakeHField(Image *img);
 extern Object *Ray_MakeFnxyz(VMExpr *expr, Vec3 *bmin, Vec3 *bmax,
-	Vec3 *steps);
+	Vec3 *steps, double max_slope);
 extern Object *Ray_MakeTorus(Vec3 *loc, double rmajor, double rminor);
 extern void Ray_SetTorus(TorusData *torus, Vec3 *loc, double rmajor, double rminor);
 extern Object *Ray_MakeTriangle(float *points, float *normals,
@@ -794,6 +926,25 @@ extern void Ray_SetupViewport(Vec3 *fromleft, Vec3 *fromright,
 	Vec3 *at, Vec3 *up, double FOVdegrees, int projection);
 extern int Ray_TraceRayFromViewport(double u, double v,
 	Vec3 *color);
+extern int Ray_TracePacketFromViewport(int n, double *u, double *v,
+	Vec3 *colors);
+extern int Ray_TraceViewportBlock(double u0, double v0, double du, double dv,
+	int w, int h, float *rgb_out, int stride);
+extern int Ray_TraceRays(RayInitData *rays, int n);
+
+/* Contributor filter functions. A filter is a set of surfaces and
+ * lights, as RAY_CONTRIB_WORDS words with a bit set for each member.
+ * Bits are shared, so it may hold more than was put in, never less.
+ */
+#define RAY_CONTRIB_WORDS 4
+extern void Ray_GetContributors(unsigned int *bits);
+extern void Ray_AddSurfaceContributor(Surface *s, unsigned int *bits);
+extern void Ray_AddLightContributor(Light *lite, unsigned int *bits);
+
+/* Shadow rays settled, or not, by a cached blocking object since the
+ * renderer was set up. */
+extern void Ray_GetShadowCacheStats(unsigned long *hits,
+	unsigned long *misses);
 extern void Ray_GetViewportInfo(Viewport *pvp, Vec3 *fromright,
 	int *projection_mode);
 
@@ -872,6 +1023,15 @@ extern int ray_max_trace_depth;
 /* If true, generate fake caustics in shadows. */
 extern int ray_use_fake_caustics;
 
+/* If true, packets trace their secondary rays a bounce at a time. */
+extern int ray_use_wavefront;
+
+/* If true, packets shade their eye hits grouped by surface. */
+extern int ray_use_deferred;
+
+/* If non-zero, most lights to sample per hit when more can contribute. */
+extern int ray_light_samples;
+
 /* Global index of refraction for the world. */
 extern double ray_global_ior;
 
@@ -43,6 +43,60 @@ typedef int (*ColorProc) /* Return non-zero to set current pixel. */
 	);
 
 
+/*************************************************************************
+*
+*  Block color calculation proc (optional).
+*  Generates the colors for "n" screen UV coordinates at once, setting
+*  three bytes, red, green and blue, per point in "rgb". Rend2D passes
+*  the points of a small tile of pixels together, so that the color
+*  proc can take advantage of their coherence.
+*  Return value is as for ColorProc, for all of the points.
+*
+*************************************************************************/
+typedef int (*ColorBlockProc)
+	(
+	int n,               /* Number of points. */
+	double *u,           /* Screen U values. */
+	double *v,           /* Screen V values. */
+	unsigned char *rgb   /* Return "n" RGB levels (0 - 255) */
+	);
+
+/*************************************************************************
+*
+*  Float color calculation proc (optional).
+*  As ColorProc, but setting the red, green and blue of the point in
+*  "rgb" as unclamped floats, 1.0 = max. Colors brighter than max are
+*  kept, so that bright samples count fully toward a pixel's average.
+*
+*************************************************************************/
+typedef int (*ColorFloatProc)
+	(
+	double u,            /* Screen U value: umin <= u < umax */
+	double v,            /* Screen V value: vmin <= v < vmax */
+	float *rgb           /* Return RGB levels (0.0 - 1.0, or more) */
+	);
+
+/* Pixels per side of the tiles passed to a block color proc. */
+#define REND2D_TILE_SIZE  8
+
+/*************************************************************************
+*
+*  Contributor proc (optional).
+*  Set the REND2D_CONTRIB_WORDS words of "bits" to a filter of what went
+*  into the colors found by the color procs since the last call, such as
+*  the surfaces and lights of a ray traced scene, and start over.
+*  Ray_GetContributors() is such a proc.
+*
+*************************************************************************/
+typedef void (*ContribProc)
+	(
+	unsigned int *bits   /* Return the contributor filter. */
+	);
+
+/* Words in a contributor filter. */
+#define REND2D_CONTRIB_WORDS  4
+
+
 /*************************************************************************
 *
 *  Data structure that is passed to Rend2D_SetState() and 
@@ -55,7 +109,10 @@ typedef struct tag_rend2d
 	/* These fields are set by the user to setup the renderer. */
 	/* Rendering mode - see REND2D_MODE_XXX codes below. */
 	int mode;
-	/* True if the renderer is in preview mode. */
+	/* True if the renderer is in preview mode: coarse passes of one
+	 * sample per block of pixels, then a final pass in "mode" that
+	 * reuses the samples of the coarse passes.
+	 */
 	int preview;
 	/* Min and max bounds for the UV values passed to color proc. */
 	double umin, umax, vmin, vmax;
@@ -75,6 +132,25 @@ typedef struct tag_rend2d
 	 * a super-sampled pixel.
 	 */
 	unsigned char bgr, bgg, bgb;
+	/* Block color proc - if set, used instead of "calc_color" when
+	 * rendering once per pixel, a band of tiles at a time.
+	 */
+	ColorBlockProc calc_colors;
+	/* Float color proc - if set, used instead of "calc_color" by
+	 * variance anti-aliasing.
+	 */
+	ColorFloatProc calc_color_f;
+	/* Variance anti-aliasing tolerance - the most standard error
+	 * allowed in the mean of each channel of a pixel, with colors
+	 * scaled by c / (1 + c), so that highlights stay bounded.
+	 */
+	double aa_tolerance;
+	/* Variance anti-aliasing sample cap per pixel, 0 = none. */
+	int aa_max_samples;
+	/* Contributor proc - if set, used by Rend2D_RenderCache() to find
+	 * what went into each tile.
+	 */
+	ContribProc get_contrib;
 
 	/* These fields are set by the renderer. */
 	/* Present state of the renderer - see REND2D_STATUS_XXX codes below. */
@@ -101,9 +177,144 @@ typedef struct tag_pixeldata
 int x, y;               /* Top left corner of pixel. */
 int width, height;      /* Width and height of pixel. */
 unsigned char r, g, b;  /* Color of pixel. */
+float fr, fg, fb;       /* Unclamped color, set by variance anti-aliasing. */
+int samples;            /* Samples taken, set by variance anti-aliasing. */
 } Rend2DPixel;
 
 
+/*************************************************************************
+*
+*  Data structures passed to Rend2D_RenderTile(), which renders one tile
+*    of the frame into a frame buffer, independently of the other tiles
+*    and of the Rend2D_DoPixel() state.
+*
+*  With adaptive anti-aliasing, neighboring tiles share the samples along
+*    their common edges. A tile rendered with the "top_edge" and
+*    "left_edge" of its neighbors above and to the left, from their
+*    results, takes the same samples as Rend2D_DoPixel() would. Without
+*    them, the edge samples are taken again, so tiles may be rendered
+*    concurrently at the cost of a few extra samples.
+*
+*************************************************************************/
+
+/* Points per pixel side of the adaptive anti-aliasing sample grid. */
+#define REND2D_AA_GRID_SIZE  (1 << MAX_AA_DEPTH)
+
+/* Passes, after the first, made by a preview render. */
+#define REND2D_PREVIEW_DEPTH  4
+
+typedef struct tag_rend2dsample
+{
+	unsigned char r, g, b;
+	unsigned char valid;    /* Zero if the point has not been sampled. */
+} Rend2DSample;
+
+typedef struct tag_rend2dtilejob
+{
+	/* Renderer setup, as passed to Rend2D_SetState(). */
+	const Rend2D *rend;
+	/* Top left pixel and size of the tile, within the frame. */
+	int x, y, width, height;
+	/* Preview pass, REND2D_PREVIEW_DEPTH down to 0, if "rend->preview"
+	 * is set. Each pass samples every (1 << pass)th pixel of the frame,
+	 * so tiles on a (1 << REND2D_PREVIEW_DEPTH) pixel grid share none.
+	 */
+	int pass;
+	/* Anti-aliasing samples along the bottom of the tile above,
+	 * "width" + 1 pixel corners, or NULL.
+	 */
+	const Rend2DSample *top_edge;
+	/* Anti-aliasing samples along the right of the tile to the left,
+	 * "height" * REND2D_AA_GRID_SIZE + 1 grid points, or NULL.
+	 */
+	const Rend2DSample *left_edge;
+	/* Frame buffer, with the RGB of pixel (x, y) at
+	 * rgb + y * stride + x * 3.
+	 */
+	unsigned char *rgb;
+	int stride;
+	/* Float frame buffer for variance anti-aliasing, laid out as "rgb"
+	 * but with "hdr_stride" floats per line, or NULL.
+	 */
+	float *hdr;
+	int hdr_stride;
+} Rend2DTileJob;
+
+typedef struct tag_rend2dtileresult
+{
+	/* Set by the caller, if wanted, to arrays to receive the
+	 * anti-aliasing samples along the bottom and right of the tile,
+	 * sized as for the "top_edge" and "left_edge" of a Rend2DTileJob.
+	 */
+	Rend2DSample *bottom_edge;
+	Rend2DSample *right_edge;
+	/* These fields are set by the renderer. */
+	int status;     /* REND2D_STATUS_FINISH or REND2D_STATUS_OUT_OF_MEMORY. */
+	int samples;    /* Calls made to the color proc, per point. */
+} Rend2DTileResult;
+
+
+/*************************************************************************
+*
+*  Progressive rendering state, made by Rend2D_NewProgress() or
+*    Rend2D_LoadProgress(). Each call to Rend2D_ProgressPass() adds a
+*    float sample to every pixel not yet good enough, at the next point
+*    of a sequence spread over the pixel. A pixel is good enough once
+*    the standard error of its mean, with colors scaled as for variance
+*    anti-aliasing, is within "aa_tolerance", or it has
+*    "aa_max_samples" samples.
+*
+*  The samples of a pixel depend only on the pixel and the pass, so a
+*    render saved with Rend2D_SaveProgress() and resumed from the file
+*    ends with exactly the image of an uninterrupted one.
+*
+*************************************************************************/
+typedef struct tag_rend2daccum
+{
+	float sum[3];           /* Sum of the colors of the samples. */
+	float ssum, ssq;        /* Sum and sum of squares of the scaled colors. */
+	unsigned int n;         /* Samples taken. */
+} Rend2DAccum;
+
+typedef struct tag_rend2dprogress
+{
+	Rend2D rend;            /* Renderer setup. */
+	int width, height;      /* Pixels from "xstart", "ystart" to the end. */
+	int passes;             /* Passes made. */
+	Rend2DAccum *accum;     /* Samples of each pixel, a line at a time. */
+} Rend2DProgress;
+
+
+/*************************************************************************
+*
+*  Frame cache, made by Rend2D_NewCache(), for rendering a frame again
+*    after a change to a few of the things that went into it.
+*
+*  Rend2D_RenderCache() renders the frame, from "xstart", "ystart" to
+*    "xend", "yend", in REND2D_CACHE_TILE tiles, and keeps the colors
+*    along with the contributor filter of each tile. Later calls render
+*    again only the tiles whose filters share a bit with the filter of
+*    what has changed, and leave the rest as they were.
+*
+*************************************************************************/
+
+/* Pixels per side of the tiles of a frame cache. */
+#define REND2D_CACHE_TILE  16
+
+typedef struct tag_rend2dcache
+{
+	Rend2D rend;            /* Renderer setup. */
+	int xtiles, ytiles;     /* Tiles across and down. */
+	/* Frame buffer, with the RGB of pixel (x, y) at
+	 * rgb + y * xres * 3 + x * 3.
+	 */
+	unsigned char *rgb;
+	/* Contributor filter of each tile, a line of tiles at a time. */
+	unsigned int *contrib;
+	int rendered;           /* True once the whole frame is rendered. */
+} Rend2DCache;
+
+
 /*************************************************************************
 *
 *  Status codes returned by Rend2D_Init(), Rend2D_DoPixel(), and
@@ -132,6 +343,7 @@ enum
 {
 	REND2D_MODE_ONCE_PER_PIXEL = 0,
 	REND2D_MODE_ADAPTIVE_ANTIALIAS,
+	REND2D_MODE_ADAPTIVE_VARIANCE,
 	REND2D_NUM_MODE_CODES
 };
 
@@ -155,6 +367,20 @@ extern void  Rend2D_Start(void);
 extern int   Rend2D_DoPixel(Rend2DPixel *pixel);
 extern int   Rend2D_EndOfLine(void);
 extern void  Rend2D_Stop(void);
+extern int   Rend2D_RenderTile(const Rend2DTileJob *job,
+	Rend2DTileResult *result);
+
+extern Rend2DProgress *Rend2D_NewProgress(const Rend2D *r);
+extern void  Rend2D_DeleteProgress(Rend2DProgress *p);
+extern int   Rend2D_ProgressPass(Rend2DProgress *p);
+extern void  Rend2D_GetProgressImage(const Rend2DProgress *p,
+	unsigned char *rgb, int stride, float *hdr, int hdr_stride);
+extern int   Rend2D_SaveProgress(const Rend2DProgress *p, const char *filename);
+extern Rend2DProgress *Rend2D_LoadProgress(const Rend2D *r,
+	const char *filename);
+extern Rend2DCache *Rend2D_NewCache(const Rend2D *r);
+extern void  Rend2D_DeleteCache(Rend2DCache *c);
+extern int   Rend2D_RenderCache(Rend2DCache *c, const unsigned int *changed);
 
 
 #ifdef __cplusplus
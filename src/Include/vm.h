@@ -22,6 +22,20 @@
 
 
 
+/*
+ * Value of an expression paired with its partial derivatives with
+ * respect to the object point O (x, y, z). Used by vm_evalgrad().
+ */
+typedef struct tVMDual
+{
+	Vec3	v;		/* Value. Only v.x is used if not a vector. */
+	Vec3	dx;		/* Gradient of v.x. */
+	Vec3	dy;		/* Gradient of v.y. */
+	Vec3	dz;		/* Gradient of v.z. */
+} VMDual;
+
+
+
 /*
  * Data container for a single element on an expression parse tree.
  */
@@ -29,6 +43,7 @@ typedef struct tVMExpr
 {
 	struct tVMExpr *l, *r;
 	void	(*fn)(struct tVMExpr *expr);
+	void	(*dfn)(struct tVMExpr *expr, VMDual *d);	/* Dual-number version of fn. */
 	void	*data;
 	int		isvec;
 	Vec3	v;
@@ -204,6 +219,8 @@ extern void vm_delete(VMStmt *stmthead);
 extern void vm_evalexpr(VMExpr *expr, void *result);
 extern double vm_evaldouble(VMExpr *expr);
 extern void vm_evalvector(VMExpr *expr, Vec3 *vec);
+extern int vm_prepare_evalgrad(VMExpr *expr);
+extern double vm_evalgrad(VMExpr *expr, Vec3 *grad);
 extern VMStmt * vm_alloc_stmt(size_t size, VMStmtMethods *methods);
 extern VMShader * vm_alloc_shader(size_t size, VMStmtMethods *methods);
 extern void vm_free_stmt(VMStmt *stmt);
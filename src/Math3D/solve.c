@@ -44,6 +44,11 @@
 	((x) > 0.0 ? pow((double)(x), 1.0/3.0) : \
 	((x) < 0.0 ? -pow((double)-(x), 1.0/3.0) : 0.0))
 
+static int KeepRoots(double *s, int nroots, double lo, double hi);
+static int CubicRoots(double A, double p, double q, double *s);
+static int QuarticRoots(double A, double p, double q, double r,
+	double cA, double cp, double cq, double *s);
+
 /*************************************************************************
 *
 *  int SolvePoly(double *c, double *s, int order, double lo, double hi)
@@ -66,8 +71,7 @@
 *************************************************************************/
 int SolvePoly(double *c, double *s, int order, double lo, double hi)
 	{
-	int i, nroots, valid_roots;
-	double tmp;
+	int nroots;
 
 	if(order <= 0)
 		return 0;
@@ -98,6 +102,19 @@ int SolvePoly(double *c, double *s, int order, double lo, double hi)
 			break;
 		}
 
+	return KeepRoots(s, nroots, lo, hi);
+	}
+
+
+/*
+ * Keep those of the "nroots" roots in "s" that lie within "lo" to "hi",
+ * sorted from smallest to largest, and return how many there are.
+ */
+static int KeepRoots(double *s, int nroots, double lo, double hi)
+	{
+	int i, valid_roots;
+	double tmp;
+
 	if(nroots == 0)
 		return 0;
 
@@ -186,11 +203,8 @@ int SolveQuadric(double *c, double *s)
 
 int SolveCubic(double *c, double *s)
 	{
-	int     i, num;
-	double  sub;
 	double  A, B, C;
 	double  sq_A, p, q;
-	double  cb_p, D;
 
 	/* normal form: x^3 + Ax^2 + Bx + C = 0 */
 
@@ -205,6 +219,20 @@ int SolveCubic(double *c, double *s)
 	p = 1.0/3 * (- 1.0/3 * sq_A + B);
 	q = 1.0/2 * (2.0/27 * A * sq_A - 1.0/3 * A * B + C);
 
+	return CubicRoots(A, p, q, s);
+	}
+
+
+/*
+ * Roots of the cubic with x^2 coefficient "A" that SolveCubic() has
+ * reduced to y^3 + py + q = 0.
+ */
+static int CubicRoots(double A, double p, double q, double *s)
+	{
+	int     i, num;
+	double  sub;
+	double  cb_p, D;
+
 	/* use Cardano's formula */
 
 	cb_p = p * p * p;
@@ -259,10 +287,9 @@ int SolveCubic(double *c, double *s)
 int SolveQuartic(double *c, double *s)
 	{
 	double  coeffs[4];
-	double  z, u, v, sub;
 	double  A, B, C, D;
 	double  sq_A, p, q, r;
-	int     i, num;
+	double  cA, cp, cq;
 
 	/* normal form: x^4 + Ax^3 + Bx^2 + Cx + D = 0 */
 
@@ -286,11 +313,6 @@ int SolveQuartic(double *c, double *s)
 		coeffs[0] = q;
 		coeffs[1] = p;
 		coeffs[2] = 0;
-		coeffs[3] = 1;
-
-		num = SolveCubic(coeffs, s);
-
-		s[num++] = 0;
 		}
 	else
 		{
@@ -299,9 +321,39 @@ int SolveQuartic(double *c, double *s)
 		coeffs[0] = 1.0/2 * r * p - 1.0/8 * q * q;
 		coeffs[1] = - r;
 		coeffs[2] = - 1.0/2 * p;
-		coeffs[3] = 1;
+		}
 
-		(void)SolveCubic(coeffs, s);
+	/* ... reduced as SolveCubic() would. */
+
+	cA = coeffs[2];
+	cp = 1.0/3 * (- 1.0/3 * (cA * cA) + coeffs[1]);
+	cq = 1.0/2 * (2.0/27 * cA * (cA * cA) - 1.0/3 * cA * coeffs[1] + coeffs[0]);
+
+	return QuarticRoots(A, p, q, r, cA, cp, cq, s);
+	}
+
+
+/*
+ * Roots of the quartic with x^3 coefficient "A" that SolveQuartic() has
+ * reduced to y^4 + py^2 + qy + r = 0, given its cubic reduced to
+ * y^3 + cp y + cq = 0 with x^2 coefficient "cA".
+ */
+static int QuarticRoots(double A, double p, double q, double r,
+	double cA, double cp, double cq, double *s)
+	{
+	double  coeffs[3];
+	double  z, u, v, sub;
+	int     i, num;
+
+	if(is_zero(r))
+		{
+		num = CubicRoots(cA, cp, cq, s);
+
+		s[num++] = 0;
+		}
+	else
+		{
+		(void)CubicRoots(cA, cp, cq, s);
 
 		/* ... and take the one real solution ... */
 
@@ -348,3 +400,357 @@ int SolveQuartic(double *c, double *s)
 
 	return num;
 	}
+
+
+/*
+ * Solve "n" quartics x^4 + c3[i]x^3 + c2[i]x^2 + c1[i]x + c0[i] = 0 at
+ * once, "n" being no more than QUARTIC_BATCH_MAX. The roots of quartic
+ * i within lo[i] to hi[i] are put, sorted, in s[i], and their number in
+ * nroots[i], just as SolvePoly() would. The
+ * reductions of every quartic and of its resolvent cubic are done in
+ * one pass with no branches, which the compiler can vectorize; only the
+ * root extraction that follows works on one quartic at a time.
+ */
+void SolveQuarticN(double *c0, double *c1, double *c2, double *c3, int n,
+	double *lo, double *hi, double (*s)[4], int *nroots)
+	{
+	double  p[QUARTIC_BATCH_MAX], q[QUARTIC_BATCH_MAX], r[QUARTIC_BATCH_MAX];
+	double  cp[QUARTIC_BATCH_MAX], cq[QUARTIC_BATCH_MAX], cA[QUARTIC_BATCH_MAX];
+	double  A, B, C, D, sq_A, k0, k1, k2;
+	int     i, rz;
+
+	for(i = 0; i < n; i++)
+		{
+		A = c3[i];
+		B = c2[i];
+		C = c1[i];
+		D = c0[i];
+
+		sq_A = A * A;
+		p[i] = - 3.0/8 * sq_A + B;
+		q[i] = 1.0/8 * sq_A * A - 1.0/2 * A * B + C;
+		r[i] = - 3.0/256*sq_A*sq_A + 1.0/16*sq_A*B - 1.0/4*A*C + D;
+
+		rz = is_zero(r[i]);
+		k0 = rz ? q[i] : 1.0/2 * r[i] * p[i] - 1.0/8 * q[i] * q[i];
+		k1 = rz ? p[i] : - r[i];
+		k2 = rz ? 0.0 : - 1.0/2 * p[i];
+
+		cA[i] = k2;
+		cp[i] = 1.0/3 * (- 1.0/3 * (k2 * k2) + k1);
+		cq[i] = 1.0/2 * (2.0/27 * k2 * (k2 * k2) - 1.0/3 * k2 * k1 + k0);
+		}
+
+	for(i = 0; i < n; i++)
+		nroots[i] = KeepRoots(s[i], QuarticRoots(c3[i], p[i], q[i], r[i],
+			cA[i], cp[i], cq[i], s[i]), lo[i], hi[i]);
+	}
+
+
+/*************************************************************************
+*
+*  Sturm sequence root isolation with safeguarded Newton polishing.
+*  Slower to set up than the closed form solvers above, but it never
+*  calls pow(), acos() or cos(), rejects polynomials with no roots in
+*  the range after a handful of Horner evaluations and does not lose
+*  roots on grazing rays.
+*
+*************************************************************************/
+
+/* Remainder coefficients smaller than this (relative) are zero. */
+#define STURM_EPS 1e-12
+
+/* Roots are polished to this relative accuracy. */
+#define STURM_TOL 1e-10
+
+/* Maximum number of interval halvings while isolating a root. */
+#define STURM_MAXDEPTH 64
+
+/* Maximum number of Newton/bisection steps while polishing a root. */
+#define STURM_MAXITER 64
+
+typedef struct tag_sturmpoly
+	{
+	int ord;
+	double coef[5];   /* coef[i] multiplies x^i. */
+	} SturmPoly;
+
+
+static double sturm_eval(SturmPoly *p, double x)
+	{
+	int i;
+	double f = p->coef[p->ord];
+
+	for(i = p->ord - 1; i >= 0; i--)
+		f = f * x + p->coef[i];
+	return f;
+	}
+
+
+/* Coefficients "q" of the polynomial "c" in terms of x - m. */
+static void taylor_shift(double *c, double *q, int order, double m)
+	{
+	int i, j;
+
+	for(i = 0; i <= order; i++)
+		q[i] = c[i];
+	for(i = 0; i < order; i++)
+		for(j = order - 1; j >= i; j--)
+			q[j] += m * q[j+1];
+	}
+
+
+/*
+ * Build the Sturm sequence for the polynomial "c" of order "order"
+ * (2..4) into "seq". Returns the number of polynomials in the sequence.
+ */
+static int sturm_build(SturmPoly *seq, double *c, int order)
+	{
+	SturmPoly *p, *q, *r;
+	double scale, f;
+	int i, j, n;
+
+	/* p0 = p, p1 = p'. Every member is scaled so that its leading
+	 * coefficient is +/-1, which keeps the signs intact and turns the
+	 * divisions below into multiplications.
+	 */
+	scale = 1.0 / fabs(c[order]);
+	seq[0].ord = order;
+	for(i = 0; i <= order; i++)
+		seq[0].coef[i] = c[i] * scale;
+	seq[1].ord = order - 1;
+	for(i = 1; i <= order; i++)
+		seq[1].coef[i-1] = i * seq[0].coef[i] / order;
+
+	/* p(k) = -rem(p(k-2), p(k-1)) until the remainder is a constant. */
+	for(n = 2; seq[n-1].ord > 0; n++)
+		{
+		p = &seq[n-2];
+		q = &seq[n-1];
+		r = &seq[n];
+
+		scale = 0.0;
+		for(i = 0; i <= p->ord; i++)
+			{
+			r->coef[i] = p->coef[i];
+			if(fabs(p->coef[i]) > scale)
+				scale = fabs(p->coef[i]);
+			}
+		for(i = p->ord - q->ord; i >= 0; i--)
+			{
+			f = r->coef[q->ord + i] * q->coef[q->ord];
+			for(j = q->ord; j >= 0; j--)
+				r->coef[i + j] -= f * q->coef[j];
+			}
+
+		/* Drop vanishing leading terms of the remainder. */
+		r->ord = q->ord - 1;
+		while(r->ord >= 0 && fabs(r->coef[r->ord]) <= STURM_EPS * scale)
+			r->ord--;
+		if(r->ord < 0)
+			break;  /* p has multiple roots, q is their gcd. */
+
+		scale = -1.0 / fabs(r->coef[r->ord]);
+		for(i = 0; i <= r->ord; i++)
+			r->coef[i] *= scale;
+		}
+
+	return n;
+	}
+
+
+/* Number of sign changes in the sequence at "x". */
+static int sturm_changes(SturmPoly *seq, int n, double x)
+	{
+	int i, changes = 0;
+	double f, last = 0.0;
+
+	for(i = 0; i < n; i++)
+		{
+		f = sturm_eval(&seq[i], x);
+		if(f != 0.0)
+			{
+			if((last < 0.0 && f > 0.0) || (last > 0.0 && f < 0.0))
+				changes++;
+			last = f;
+			}
+		}
+	return changes;
+	}
+
+
+/*
+ * Polish the single distinct root in (a, b]. A sign change across the
+ * interval gets Newton steps that fall back to bisection whenever they
+ * leave the bracket. A root of even multiplicity (a grazing ray) does
+ * not change sign, so it is bisected on the Sturm count instead.
+ */
+static double sturm_polish(SturmPoly *seq, int n, double a, double b,
+	int na)
+	{
+	SturmPoly *p = &seq[0], *dp = &seq[1];
+	double fa, fb, fx, x, dx;
+	int i, nx;
+
+	fa = sturm_eval(p, a);
+	fb = sturm_eval(p, b);
+	if(fb == 0.0)
+		return b;
+
+	if((fa < 0.0) != (fb < 0.0) && fa != 0.0)
+		{
+		/* Orient so that p(a) < 0 < p(b). */
+		if(fa > 0.0)
+			{
+			x = a; a = b; b = x;
+			fx = fa; fa = fb; fb = fx;
+			}
+		/* Start from the secant through the bracket. */
+		x = a - fa * (b - a) / (fb - fa);
+		for(i = 0; i < STURM_MAXITER; i++)
+			{
+			fx = sturm_eval(p, x);
+			if(fx == 0.0)
+				break;
+			if(fx < 0.0)
+				a = x;
+			else
+				b = x;
+			dx = sturm_eval(dp, x) * p->ord;  /* p1 is p' / order. */
+			dx = (dx != 0.0) ? fx / dx : 0.0;
+			x -= dx;
+			if(dx == 0.0 || (x - a) * (x - b) > 0.0)
+				{
+				/* Newton left the bracket, bisect. */
+				x = 0.5 * (a + b);
+				dx = b - a;
+				}
+			if(fabs(dx) <= STURM_TOL * (1.0 + fabs(x)))
+				break;
+			}
+		return x;
+		}
+
+	for(i = 0; i < STURM_MAXITER && b - a > STURM_TOL * (1.0 + fabs(a)); i++)
+		{
+		x = 0.5 * (a + b);
+		nx = sturm_changes(seq, n, x);
+		if(na - nx > 0)
+			b = x;
+		else
+			{
+			a = x;
+			na = nx;
+			}
+		}
+	return 0.5 * (a + b);
+	}
+
+
+/*
+ * Bisect (a, b] until every sub-interval holds one distinct root.
+ * "na" and "nb" are the sign change counts at "a" and "b". Roots are
+ * stored in "s" in increasing order, returns the number found.
+ */
+static int sturm_isolate(SturmPoly *seq, int n, double a, double b,
+	int na, int nb, double *s, int depth)
+	{
+	double m;
+	int nm, k;
+
+	if(na - nb <= 0)
+		return 0;
+	if(na - nb == 1)
+		{
+		s[0] = sturm_polish(seq, n, a, b, na);
+		return 1;
+		}
+	if(depth >= STURM_MAXDEPTH || b - a <= STURM_TOL * (1.0 + fabs(a)))
+		{
+		/* A cluster of roots closer than we can resolve. */
+		s[0] = 0.5 * (a + b);
+		return 1;
+		}
+
+	m = 0.5 * (a + b);
+	nm = sturm_changes(seq, n, m);
+	k = sturm_isolate(seq, n, a, m, na, nm, s, depth + 1);
+	return k + sturm_isolate(seq, n, m, b, nm, nb, s + k, depth + 1);
+	}
+
+
+/*************************************************************************
+*
+*  int SolvePolySturm(double *c, double *s, int order, double lo, double hi)
+*
+*  Same as SolvePoly() above, but cubics and quartics are solved by
+*  isolating the roots in the range with a Sturm sequence and polishing
+*  them with safeguarded Newton iteration.
+*
+*  The range is clipped to a bound on the roots, then the polynomial is
+*  rewritten in terms of a variable that runs from -1 to 1 across the
+*  range. Callers that know a tight range (e.g. from a bounding volume)
+*  get a well conditioned problem and fewer bisection steps this way.
+*
+*************************************************************************/
+int SolvePolySturm(double *c, double *s, int order, double lo, double hi)
+	{
+	SturmPoly seq[5];
+	double q[5], bound, f, m, h;
+	int i, n, nlo, nhi;
+
+	if(order <= 0)
+		return 0;
+
+	while((fabs(c[order]) < COEFF_EPS) && order)
+		order--;
+	if(order < 3)
+		return SolvePoly(c, s, order, lo, hi);
+
+	/* Roots are bounded about their centroid "m" better than about zero,
+	 * so make that the origin first. Fujiwara's bound then says all roots
+	 * lie within 2 * max|q[order-k] / q[order]|^(1/k) of it.
+	 */
+	m = -c[order-1] / (order * c[order]);
+	taylor_shift(c, q, order, m);
+	bound = 0.0;
+	for(i = 2; i <= order; i++)
+		{
+		f = fabs(q[order - i] / q[order]);
+		if(i == order)
+			f *= 0.5;
+		switch(i)
+			{
+			case 2: f = sqrt(f); break;
+			case 3: f = cbrt(f); break;
+			case 4: f = sqrt(sqrt(f)); break;
+			}
+		if(f > bound)
+			bound = f;
+		}
+	bound *= 2.0;
+	if(lo < m - bound)
+		lo = m - bound;
+	if(hi > m + bound)
+		hi = m + bound;
+	if(lo >= hi)
+		return 0;
+
+	/* Substitute x = m + h * u, so that u runs from -1 to 1. */
+	m = 0.5 * (lo + hi);
+	h = 0.5 * (hi - lo);
+	taylor_shift(c, q, order, m);
+	for(i = 1, f = h; i <= order; i++, f *= h)
+		q[i] *= f;
+
+	n = sturm_build(seq, q, order);
+	nlo = sturm_changes(seq, n, -1.0);
+	nhi = sturm_changes(seq, n, 1.0);
+	if(nlo == nhi)
+		return 0;
+
+	n = sturm_isolate(seq, n, -1.0, 1.0, nlo, nhi, s, 0);
+	for(i = 0; i < n; i++)
+		s[i] = m + h * s[i];
+	return n;
+	}
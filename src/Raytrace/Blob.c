@@ -66,7 +66,7 @@ Object *Ray_MakeBlob(double threshold)
 	}
 	blob->nrefs = 1;
 	blob->threshold = threshold;
-	blob->solver = 0;
+	blob->solver = SOLVER_CLOSED_FORM;
 	blob->bound = NULL;
 	blob->elems = NULL;
 
@@ -337,7 +337,7 @@ Object *Ray_MakeBlob(PARAMS *par)
 
 	/* Get threshold... */
 	b->threshold = par->V.x;
-	b->solver = 0;
+	b->solver = SOLVER_CLOSED_FORM;
 	b->bound = NULL;
 
 	/* Get blob elements... */
@@ -601,7 +601,10 @@ int IntersectBlob(Object *obj, HitData *hits)
 
 			if (in && (lo < hi))
 			{
-				nhits = SolvePoly(tc, t, 4, lo, hi);
+				if (bl->solver == SOLVER_STURM)
+					nhits = SolvePolySturm(tc, t, 4, lo, hi);
+				else
+					nhits = SolvePoly(tc, t, 4, lo, hi);
 				if (nhits > 0)
 				{
 					for (i = 0;i < nhits;i++)
@@ -34,6 +34,8 @@ int ray_max_cluster_size;
 
 static void DivideObjectList(Object **olist, Object **new_olist);
 static void DivideObjectList2(Object **olist, Object **new_olist);
+static void PackBBoxBoxes(BBoxData *bb);
+static void FreeBBoxBoxes(BBoxData *bb);
 
 /*************************************************************************
  *  Procs for the bounding box object type.
@@ -219,6 +221,98 @@ void Ray_BuildBounds(Object **root)
 
 }
 
+/*
+ * Object types that are intersected in batches, with the most members
+ * a batch may have and the function that makes one.
+ */
+static struct
+{
+  int type;
+  int max;
+  Object *(*make)(Object *list);
+} batch_types[] =
+{
+  { OBJ_SPHERE, SPHERE_BATCH_MAX, Ray_MakeSphereBatch },
+  { OBJ_TORUS, TORUS_BATCH_MAX, Ray_MakeTorusBatch },
+  { OBJ_BOX, BOX_BATCH_MAX, Ray_MakeBoxBatch },
+  { OBJ_DISC, DISC_BATCH_MAX, Ray_MakeDiscBatch }
+};
+#define NUM_BATCH_TYPES (int)(sizeof(batch_types) / sizeof(batch_types[0]))
+
+/*
+ * Replace the spheres, tori, boxes and discs in each object list of the
+ * bounding tree "root" with batches, so a ray is tested against all of
+ * the objects of a type that share a bounding box in one pass. The
+ * children of a CSG group are batched too, since a group sorts all of
+ * its children's hits; the other CSG operations merge spans child by
+ * child, so their children are left alone.
+ */
+void BatchBoundedObjects(Object **root)
+{
+  Object *o, *list[NUM_BATCH_TYPES], *last[NUM_BATCH_TYPES], *batch, **link;
+  int b, i;
+
+  for(b = 0; b < NUM_BATCH_TYPES; b++)
+    list[b] = last[b] = NULL;
+
+  /* Pull the batched types out of this list, descending in to bounds. */
+  link = root;
+  while((o = *link) != NULL)
+  {
+    for(b = 0; b < NUM_BATCH_TYPES; b++)
+      if(o->procs->type == batch_types[b].type)
+        break;
+    if(b < NUM_BATCH_TYPES)
+    {
+      *link = o->next;
+      o->next = NULL;
+      if(last[b] != NULL)
+        last[b]->next = o;
+      else
+        list[b] = o;
+      last[b] = o;
+      continue;
+    }
+    switch(o->procs->type)
+    {
+      case OBJ_BBOX:
+        BatchBoundedObjects(&o->data.bbox->objects);
+        PackBBoxBoxes(o->data.bbox);
+        break;
+      case OBJ_CSGGROUP:
+        BatchBoundedObjects(&o->data.csg->children);
+        break;
+    }
+    link = &o->next;
+  }
+
+  /* Put them back at the end of the list, batched if there are several. */
+  for(b = 0; b < NUM_BATCH_TYPES; b++)
+  {
+    while(list[b] != NULL)
+    {
+      o = list[b];
+      for(i = 1, last[b] = o; i < batch_types[b].max && last[b]->next != NULL; i++)
+        last[b] = last[b]->next;
+      list[b] = last[b]->next;
+      last[b]->next = NULL;
+
+      /* A lone object is left as it is. */
+      if(o == last[b] || (batch = batch_types[b].make(o)) == NULL)
+      {
+        *link = o;
+        link = &last[b]->next;
+      }
+      else
+      {
+        *link = batch;
+        link = &batch->next;
+      }
+    }
+  }
+}
+
+
 /*
  * Divide the object list "olist" along axis of greatest variation,
  * using median cut, and create a new object list, "new_olist".
@@ -527,6 +621,9 @@ void Ray_SetBBox(BBoxData *bbox)
   o = bbox->objects;
   assert(o != NULL);
 
+  /* Child bounds may have changed; the packed copy is made again later. */
+  FreeBBoxBoxes(bbox);
+
   bbox->bmin.x = HUGE;
   bbox->bmax.x = -HUGE;
   bbox->bmin.y = HUGE;
@@ -571,12 +668,70 @@ Object *Ray_MakeBBox(Object *obj_list)
   newobj->data.bbox = newbb;
   newobj->next = NULL;
   newbb->objects = obj_list;
+  newbb->num_boxes = 0;
+  newbb->boxes = NULL;
+  newbb->box_bounds = NULL;
   Ray_SetBBox(newbb);
   ray_num_bounds++;
 
   return newobj;
 }
 
+/*
+ * Keep a packed copy of the bounds of the bounding boxes in the list of
+ * "bb", so the traversal can test them all at once with IntersectSlabsN().
+ */
+static void PackBBoxBoxes(BBoxData *bb)
+{
+  Object *o;
+  BBoxData *kid;
+  int n, i;
+
+  FreeBBoxBoxes(bb);
+  for(n = 0, o = bb->objects; o != NULL; o = o->next)
+    if(o->procs->type == OBJ_BBOX)
+      n++;
+  if(n == 0)
+    return;
+
+  bb->num_boxes = n;
+  bb->boxes = (Object **)Malloc(n * sizeof(Object *));
+  bb->box_bounds = (double *)Malloc(6 * n * sizeof(double));
+  if(bb->boxes == NULL || bb->box_bounds == NULL)
+  {
+    FreeBBoxBoxes(bb);
+    return;
+  }
+
+  for(i = 0, o = bb->objects; o != NULL; o = o->next)
+  {
+    if(o->procs->type != OBJ_BBOX)
+      continue;
+    kid = o->data.bbox;
+    bb->boxes[i] = o;
+    bb->box_bounds[i] = kid->bmin.x;
+    bb->box_bounds[n + i] = kid->bmin.y;
+    bb->box_bounds[2 * n + i] = kid->bmin.z;
+    bb->box_bounds[3 * n + i] = kid->bmax.x;
+    bb->box_bounds[4 * n + i] = kid->bmax.y;
+    bb->box_bounds[5 * n + i] = kid->bmax.z;
+    i++;
+  }
+}
+
+
+static void FreeBBoxBoxes(BBoxData *bb)
+{
+  if(bb->boxes != NULL)
+    Free(bb->boxes, bb->num_boxes * sizeof(Object *));
+  if(bb->box_bounds != NULL)
+    Free(bb->box_bounds, 6 * bb->num_boxes * sizeof(double));
+  bb->boxes = NULL;
+  bb->box_bounds = NULL;
+  bb->num_boxes = 0;
+}
+
+
 static int IntersectBBox(Object *obj, HitData *hits)
 {
   BBoxData *bb;
@@ -664,6 +819,9 @@ void CopyBBox(Object *destobj, Object *srcobj)
     return;
 
   *destbb = *srcbb;
+  destbb->num_boxes = 0;
+  destbb->boxes = NULL;
+  destbb->box_bounds = NULL;
   desto = NULL;
   for(srco = srcbb->objects; srco != NULL; srco = srco->next)
   {
@@ -680,6 +838,8 @@ void CopyBBox(Object *destobj, Object *srcobj)
     if(desto == NULL)
       return;
   }
+  if(srcbb->boxes != NULL)
+    PackBBoxBoxes(destbb);
   destobj->data.bbox = destbb;
 }
 
@@ -695,6 +855,7 @@ void DeleteBBox(Object *obj)
     bb->objects = o->next;
     Ray_DeleteObject(o);
   }
+  FreeBBoxBoxes(bb);
   Free(bb, sizeof(BBoxData));
 }
 
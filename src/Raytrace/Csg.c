@@ -15,8 +15,6 @@ int csg_nest_level;
 
 static int csg_non_group;
 
-#define USE_IS_INSIDE
-
 static int IntersectCSGGroup(Object *obj, HitData *hits);
 static int IsInsideCSGGroup(Object *obj, Vec3 *P);
 static void DrawCSGGroup(Object *obj);
@@ -148,6 +146,10 @@ Object *Ray_MakeCSG(int type)
 			csg->olist = NULL;   /* Not used in group objects. */
 			csg->litelist = NULL;
 			csg->boundobj = NULL;
+			csg->kids = NULL;      /* Set up in PostProcessCSG(). */
+			csg->kidorder = NULL;
+			csg->probes = NULL;
+			csg->solid = 0;
 			csg->hits = NewHitData();
 			obj->data.csg = csg;
 			obj->procs = (type == OBJ_CSGUNION) ? &csgunion_procs :
@@ -340,340 +342,230 @@ int IntersectCSGGroup(Object *obj, HitData *hits)
 }
 
 
-#ifdef USE_IS_INSIDE
+/*
+ * Union, difference and intersection objects are evaluated by merging
+ * the inside/outside spans of their children along the ray.
+ * Each child's state before its first hit is the opposite of that hit's
+ * entering flag and is updated by every hit after that. Children whose
+ * hits don't bound a closed solid (flat objects, open cones, groups...)
+ * are probed with IsInside() at the hit points instead, as needed.
+ * Running counts of tracked children that are inside let each hit be
+ * classified without looking at every child.
+ */
+#define CSG_OP_UNION         0
+#define CSG_OP_DIFFERENCE    1
+#define CSG_OP_INTERSECTION  2
+
+static int IntersectCSGSpans(Object *obj, HitData *hits, int op);
+
 int IntersectCSGUnion(Object *obj, HitData *hits)
 {
-  CSGData *csg = obj->data.csg;
-  HitData *h, *h2;
-  int i, nhits, inside, entering;
-  double tmp;
-  Vec3 Q;
-  ObjectList *ol;
+  return IntersectCSGSpans(obj, hits, CSG_OP_UNION);
+}
 
-	/* Check user-supplied bound object(s), if present... */
-	if(csg->boundobj != NULL)
-	{
-		Object *o;
-		nhits = 0;
-		for(o = csg->boundobj; o != NULL && nhits == 0; o = o->next)
-		{
-			if(o->procs->Intersect(o, hits))
-			{
-				nhits++;
-				break;
-			}
-		}
-		if(nhits == 0)
-			return 0;
-	}
 
-  /* Get all ray/object intersections for each child... */
-  tmp = ct.tmax;
-  ct.tmax = HUGE;
-  nhits = FindAllIntersections(csg->children, hits);
-  ct.tmax = tmp;
-  if(nhits == 0)
-    return 0;
+int IntersectCSGDifference(Object *obj, HitData *hits)
+{
+  return IntersectCSGSpans(obj, hits, CSG_OP_DIFFERENCE);
+}
 
-  SortHits(hits, nhits);
 
-  /*
-   * Determine if ray is originating from within object...
-   * If inside is positive, ray is originating from within the object.
-   */
-  inside = 0;
-  h = hits;
-  for(i = nhits; i > 0; i--)
-  {
-    if(h->entering)
-      inside--;
-    else
-      inside++;
-    h = h->next;
-  }
+int IntersectCSGIntersection(Object *obj, HitData *hits)
+{
+  return IntersectCSGSpans(obj, hits, CSG_OP_INTERSECTION);
+}
 
-  if(inside > 0)
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 1 : 0;
-  else
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 0 : 1;
 
-  h = hits;
-  h2 = csg->hits;
-  csg->nhits = 0;
-  while(nhits-- && (h->t < ct.tmax))
+/*
+ * Returns true if the hits of an object always alternate between
+ * entering and leaving a closed, bounded solid.
+ */
+static int CSGChildIsSolid(Object *obj)
+{
+  switch(obj->procs->type)
   {
-    Q.x = ct.B.x + ct.D.x * h->t;
-    Q.y = ct.B.y + ct.D.y * h->t;
-    Q.z = ct.B.z + ct.D.z * h->t;
-    /*
-     * If point is not inside any of the other objects,
-     * add it to the final hit list.
-     */
-    for(ol = csg->olist; ol != NULL; ol = ol->next)
-      if(ol->obj != h->obj && ol->obj->procs->IsInside(ol->obj, &Q))
-        break;
-    if(ol == NULL)  /* Point not inside other objects. */
-    {
-      h2->obj = h->obj;
-      hits->obj = obj;
-      h2->entering = hits->entering = entering;
-      h2->t = hits->t = h->t;
-      h2 = GetNextHit(h2);
-      hits = hits->next;
-      csg->nhits++;
-      entering = 1 - entering;
-			if(!ct.calc_all) break;
-    }
-    h = h->next;
+    case OBJ_SPHERE:
+    case OBJ_BOX:
+    case OBJ_BLOB:
+      return 1;
+    case OBJ_CONE:
+      return obj->data.cone->closed;
+    case OBJ_TORUS:
+      /* Torus hits ignore the inverse flag. */
+      return !(obj->flags & OBJ_FLAG_INVERSE);
+    case OBJ_CSGUNION:
+    case OBJ_CSGDIFFERENCE:
+    case OBJ_CSGINTERSECTION:
+      return obj->data.csg->solid;
   }
+  return 0;
+}
 
-  return csg->nhits;
+
+/* A child and its index, sorted by object address for FindCSGKid(). */
+typedef struct tag_csgkidkey
+{
+  Object *obj;
+  int kid;
+} CSGKidKey;
+
+static int CompareCSGKids(const void *a, const void *b)
+{
+  Object *oa = ((const CSGKidKey *)a)->obj;
+  Object *ob = ((const CSGKidKey *)b)->obj;
+
+  return (oa < ob) ? -1 : (oa > ob) ? 1 : 0;
 }
 
-#else
 
-int IntersectCSGUnion(Object *obj, HitData *hits)
+static void DeleteCSGSpans(CSGData *csg)
 {
-  CSGData *csg = obj->data.csg;
-  HitData *h, *h2;
-  int nhits, i, inside;
-  double tmp;
+  if(csg->kids != NULL)
+    Free(csg->kids, csg->nchildren * sizeof(CSGKid));
+  if(csg->kidorder != NULL)
+    Free(csg->kidorder, csg->nchildren * sizeof(int));
+  if(csg->probes != NULL)
+    Free(csg->probes, csg->nchildren * sizeof(int));
+  csg->kids = NULL;
+  csg->kidorder = NULL;
+  csg->probes = NULL;
+  csg->solid = 0;
+}
 
-	/* Check user-supplied bound object(s), if present... */
-	if(csg->boundobj != NULL)
-	{
-		Object *o;
-		nhits = 0;
-		for(o = csg->boundobj; o != NULL && nhits == 0; o = o->next)
-		{
-			if(o->procs->Intersect(o, hits))
-			{
-				nhits++;
-				break;
-			}
-		}
-		if(nhits == 0)
-			return 0;
-	}
 
-  /* Get all ray/object intersections for each child... */
-  tmp = ct.tmax;
-  ct.tmax = HUGE;
-  nhits = FindAllIntersections(csg->children, hits);
-  ct.tmax = tmp;
-  if(nhits == 0)
-    return 0;
+/*
+ * Set up the child array and lookup table used during span merging.
+ */
+static int SetupCSGSpans(Object *obj)
+{
+  CSGData *csg = obj->data.csg;
+  ObjectList *ol;
+  CSGKid *k;
+  CSGKidKey *keys;
+  int i;
 
-  SortHits(hits, nhits);
+  DeleteCSGSpans(csg);
+  if(csg->nchildren == 0)
+    return 0;
 
-  /* Determine if ray is originating from within object... */
-  /* If inside is positive, ray is originating from within the object. */
-  inside = 0;
-  h = hits;
-  for(i = nhits; i > 0; i--)
+  csg->kids = (CSGKid *)Malloc(csg->nchildren * sizeof(CSGKid));
+  csg->kidorder = (int *)Malloc(csg->nchildren * sizeof(int));
+  csg->probes = (int *)Malloc(csg->nchildren * sizeof(int));
+  keys = (CSGKidKey *)Malloc(csg->nchildren * sizeof(CSGKidKey));
+  if(csg->kids == NULL || csg->kidorder == NULL || csg->probes == NULL ||
+    keys == NULL)
   {
-    if(h->entering)
-      inside--;
-    else
-      inside++;
-    h = h->next;
+    DeleteCSGSpans(csg);
+    if(keys != NULL)
+      Free(keys, csg->nchildren * sizeof(CSGKidKey));
+    return 0;
   }
-  if(inside < 0)
-    inside = 0;
-
 
-  /* Cull out hits that are inside other sibling objects. */
-  h = hits;
-  h2 = csg->hits;
-  csg->nhits = 0;
-  for(i = nhits; (i > 0)&&(h->t < ct.tmax); i--)
+  csg->solid = 1;
+  csg->nprobes = 0;
+  csg->noshadow = 0;
+  for(ol = csg->olist, i = 0; ol != NULL; ol = ol->next, i++)
   {
-    if(h->entering)
-    {
-      if(!inside)
-      {
-        h2->obj = h->obj;
-        h2->entering = hits->entering = !(obj->flags & OBJ_FLAG_INVERSE);
-        h2->t = hits->t = h->t;
-        h2 = GetNextHit(h2);
-        hits->obj = obj;
-        hits = hits->next;
-        csg->nhits++;
-				if(!ct.calc_all) break;
-      }
-      inside++;
-    }
-    else
+    k = &csg->kids[i];
+    k->obj = ol->obj;
+    k->inside = 0;
+    k->last = 0;
+    k->probe = !CSGChildIsSolid(ol->obj);
+    k->bounded = !k->probe && !(ol->obj->flags & OBJ_FLAG_INVERSE);
+    ol->obj->procs->CalcExtents(ol->obj, &k->bmin, &k->bmax);
+    if(k->probe)
     {
-      inside--;
-      if(!inside)
-      {
-        h2->obj = h->obj;
-        h2->entering = hits->entering = (obj->flags & OBJ_FLAG_INVERSE);
-        h2->t = hits->t = h->t;
-        h2 = GetNextHit(h2);
-        hits->obj = obj;
-        hits = hits->next;
-        csg->nhits++;
-				if(!ct.calc_all) break;
-      }
+      csg->probes[csg->nprobes++] = i;
+      csg->solid = 0;
     }
-    h = h->next;
+    if(ol->obj->flags & (OBJ_FLAG_NO_SHADOW | OBJ_FLAG_NO_SELF_INTERSECT))
+      csg->noshadow = 1;
+    keys[i].obj = ol->obj;
+    keys[i].kid = i;
   }
-
-  return csg->nhits;
+  qsort(keys, csg->nchildren, sizeof(CSGKidKey), CompareCSGKids);
+  for(i = 0; i < csg->nchildren; i++)
+    csg->kidorder[i] = keys[i].kid;
+  Free(keys, csg->nchildren * sizeof(CSGKidKey));
+  return 1;
 }
 
-#endif
 
-int IntersectCSGDifference(Object *obj, HitData *hits)
+/*
+ * IsInside() for a child, skipping the test if the point is outside
+ * a bounded child's extents.
+ */
+static int CSGKidIsInside(CSGKid *k, Vec3 *P)
 {
-  CSGData *csg = obj->data.csg;
-  HitData *h, *h2;
-  int i, nhits, inside_first, inside_other, entering;
-  double tmp;
-  Vec3 Q;
-  ObjectList *ol;
-
-	/* Check user-supplied bound object(s), if present... */
-	if(csg->boundobj != NULL)
-	{
-		Object *o;
-		nhits = 0;
-		for(o = csg->boundobj; o != NULL && nhits == 0; o = o->next)
-		{
-			if(o->procs->Intersect(o, hits))
-			{
-				nhits++;
-				break;
-			}
-		}
-		if(nhits == 0)
-			return 0;
-	}
-
-  /* Get all ray/object intersections for each child... */
-  tmp = ct.tmax;
-  ct.tmax = HUGE;
-  nhits = FindAllIntersections(csg->children, hits);
-  ct.tmax = tmp;
-  if(nhits == 0)
+  if(k->bounded &&
+    (P->x < k->bmin.x || P->x > k->bmax.x ||
+     P->y < k->bmin.y || P->y > k->bmax.y ||
+     P->z < k->bmin.z || P->z > k->bmax.z))
     return 0;
+  return k->obj->procs->IsInside(k->obj, P) ? 1 : 0;
+}
 
-  SortHits(hits, nhits);
 
-  /* Determine if ray is originating from within object... */
-  /* If inside is positive, ray is originating from within the object. */
-  inside_first = 0;
-  inside_other = 0;
-  h = hits;
-  for(i = nhits; i > 0; i--)
+/* Find the child that a hit belongs to. */
+static CSGKid *FindCSGKid(CSGData *csg, Object *obj)
+{
+  int lo, hi, mid;
+  CSGKid *k;
+
+  lo = 0;
+  hi = csg->nchildren - 1;
+  while(lo <= hi)
   {
-    if(h->obj == csg->olist->obj)
-    {
-      if(h->entering)
-        inside_first--;
-      else
-        inside_first++;
-    }
+    mid = (lo + hi) >> 1;
+    k = &csg->kids[csg->kidorder[mid]];
+    if(k->obj == obj)
+      return k;
+    if(k->obj < obj)
+      lo = mid + 1;
     else
-    {
-      if(h->entering)
-        inside_other--;
-      else
-        inside_other++;
-    }
-    h = h->next;
+      hi = mid - 1;
   }
-  if(inside_first < 0)
-    inside_first = 0;
-  if(inside_other < 0)
-    inside_other = 0;
+  return NULL;
+}
 
-  if(inside_first && !inside_other)
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 1 : 0;
-  else
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 0 : 1;
 
-  h = hits;
-  h2 = csg->hits;
-  csg->nhits = 0;
-  while(nhits-- && (h->t < ct.tmax))
+/*
+ * Returns true if any ("all" false) or all ("all" true) of the probed
+ * children from index "from" on, other than "self", are inside at
+ * point "Q". If "probeall" is set every child is probed.
+ */
+static int ProbeCSGKids(CSGData *csg, CSGKid *self, Vec3 *Q, int all,
+  int from, int probeall)
+{
+  int i, n, kid;
+
+  n = (probeall) ? csg->nchildren : csg->nprobes;
+  for(i = 0; i < n; i++)
   {
-    Q.x = ct.B.x + ct.D.x * h->t;
-    Q.y = ct.B.y + ct.D.y * h->t;
-    Q.z = ct.B.z + ct.D.z * h->t;
-    if(h->obj == csg->olist->obj)
-    {
-      /*
-       * If point is not inside any of the other objects,
-       * add it to the final hit list.
-       */
-      for(ol = csg->olist->next; ol != NULL; ol = ol->next)
-        if(ol->obj->procs->IsInside(ol->obj, &Q))
-          break;
-      if(ol == NULL)  /* Point not inside other objects. */
-      {
-        h2->obj = h->obj;
-        hits->obj = obj;
-        h2->entering = hits->entering = entering;
-        h2->t = hits->t = h->t;
-        h2 = GetNextHit(h2);
-        hits = hits->next;
-        csg->nhits++;
-        entering = 1 - entering;
-				if(!ct.calc_all) break;
-      }
-    }
-    else
-    {
-      /*
-       * If point is not inside any of the other objects,
-       * and is inside the first object add it to the final hit list.
-       */
-      ol = csg->olist;
-      if(ol->obj->procs->IsInside(ol->obj, &Q))
-      {
-        for(ol = ol->next; ol != NULL; ol = ol->next)
-          if(ol->obj != h->obj)
-          {
-            if(ol->obj->procs->IsInside(ol->obj, &Q))
-              break;
-          }
-        if(ol == NULL)  /* Point not inside other objects. */
-        {
-          h2->obj = h->obj;
-          hits->obj = obj;
-          h2->entering = hits->entering = entering;
-          h2->t = hits->t = h->t;
-          h2 = GetNextHit(h2);
-          hits = hits->next;
-          csg->nhits++;
-          entering = 1 - entering;
-					if(!ct.calc_all) break;
-        }
-      }
-    }
-    h = h->next;
+    kid = (probeall) ? i : csg->probes[i];
+    if(kid < from || &csg->kids[kid] == self)
+      continue;
+    if(CSGKidIsInside(&csg->kids[kid], Q) != all)
+      return !all;
   }
-
-  return csg->nhits;
+  return all;
 }
 
-#ifdef USE_IS_INSIDE
-int IntersectCSGIntersection(Object *obj, HitData *hits)
+
+int IntersectCSGSpans(Object *obj, HitData *hits, int op)
 {
   CSGData *csg = obj->data.csg;
   HitData *h, *h2;
-  int i, nhits, inside, entering;
-  double tmp;
+  CSGKid *k, *first;
+  int j, nhits, keep, entering, inside, ninside, nfirst, ntracked, tracked;
+  int self, probeall;
+  double t;
   Vec3 Q;
-  ObjectList *ol;
+  Object *o;
 
 	/* Check user-supplied bound object(s), if present... */
 	if(csg->boundobj != NULL)
 	{
-		Object *o;
 		nhits = 0;
 		for(o = csg->boundobj; o != NULL && nhits == 0; o = o->next)
 		{
@@ -687,136 +579,154 @@ int IntersectCSGIntersection(Object *obj, HitData *hits)
 			return 0;
 	}
 
-  /* Get all ray/object intersections for each child... */
-  tmp = ct.tmax;
-  ct.tmax = HUGE;
+  if(csg->kids == NULL && !SetupCSGSpans(obj))
+    return 0;
+
+  /*
+   * Get the ray/object intersections of each child. The state of every
+   * child at the start of the ray is found below, so hits beyond the
+   * caller's tmax are of no use.
+   */
   nhits = FindAllIntersections(csg->children, hits);
-  ct.tmax = tmp;
   if(nhits == 0)
     return 0;
 
   SortHits(hits, nhits);
 
   /*
-   * Determine if ray is originating from within object...
-   * If inside is equal to the number of children, ray is
-   * originating from within the object.
+   * Shadow rays may skip some children entirely, which breaks the
+   * span tracking. Fall back on probing every child in that case.
    */
-  inside = 0;
-  h = hits;
-  for(i = nhits; i > 0; i--)
-  {
-    if(h->entering)
-      inside--;
-    else
-      inside++;
-    h = h->next;
-  }
+  probeall = (csg->noshadow && (ct.ray_flags & RAY_SHADOW));
 
-  if(inside == csg->nchildren)
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 1 : 0;
-  else
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 0 : 1;
-
-  h = hits;
-  h2 = csg->hits;
-  csg->nhits = 0;
-  while(nhits-- && (h->t < ct.tmax))
+  /*
+   * Find the state of each child, and of the whole object, between the
+   * ray base and the first hit.
+   */
+  t = (ct.tmin + hits->t) * 0.5;
+  Q.x = ct.B.x + ct.D.x * t;
+  Q.y = ct.B.y + ct.D.y * t;
+  Q.z = ct.B.z + ct.D.z * t;
+  first = &csg->kids[0];
+  ntracked = 0;
+  ninside = 0;
+  inside = (op == CSG_OP_INTERSECTION);
+  for(j = 0; j < csg->nchildren; j++)
   {
-    Q.x = ct.B.x + ct.D.x * h->t;
-    Q.y = ct.B.y + ct.D.y * h->t;
-    Q.z = ct.B.z + ct.D.z * h->t;
-    /*
-     * If point is inside all of the other objects,
-     * add it to the final hit list.
-     */
-    for(ol = csg->olist; ol != NULL; ol = ol->next)
-      if(ol->obj != h->obj && ! ol->obj->procs->IsInside(ol->obj, &Q))
-        break;
-    if(ol == NULL)  /* Point not inside other objects. */
+    k = &csg->kids[j];
+    k->inside = CSGKidIsInside(k, &Q);
+    k->last = k->inside;
+    if(!k->probe)
     {
-      h2->obj = h->obj;
-      hits->obj = obj;
-      h2->entering = hits->entering = entering;
-      h2->t = hits->t = h->t;
-      h2 = GetNextHit(h2);
-      hits = hits->next;
-      csg->nhits++;
-      entering = 1 - entering;
-			if(!ct.calc_all) break;
+      ntracked++;
+      ninside += k->inside;
+    }
+    switch(op)
+    {
+      case CSG_OP_UNION:
+        inside |= k->inside;
+        break;
+      case CSG_OP_DIFFERENCE:
+        inside = (k == first) ? k->inside : (inside && !k->inside);
+        break;
+      default:
+        inside &= k->inside;
+        break;
     }
-    h = h->next;
   }
 
-  return csg->nhits;
-}
-
-#else
-
-int IntersectCSGIntersection(Object *obj, HitData *hits)
-{
-  CSGData *csg = obj->data.csg;
-  HitData *h, *h2;
-  int i, nhits, inside, entering;
-  double tmp;
-
-	/* Check user-supplied bound object(s), if present... */
-	if(csg->boundobj != NULL)
-	{
-		Object *o;
-		nhits = 0;
-		for(o = csg->boundobj; o != NULL && nhits == 0; o = o->next)
-		{
-			if(o->procs->Intersect(o, hits))
-			{
-				nhits++;
-				break;
-			}
-		}
-		if(nhits == 0)
-			return 0;
-	}
-
-  /* Get all ray/object intersections for each child... */
-  tmp = ct.tmax;
-  ct.tmax = HUGE;
-  nhits = FindAllIntersections(csg->children, hits);
-  ct.tmax = tmp;
-  if(nhits == 0)
-    return 0;
-
-  SortHits(hits, nhits);
-
   /*
-   * Determine if ray is originating from within object...
-   * If inside is equal to the number of children, ray is
-   * originating from within the object.
+   * The hits of a tracked child must take it in and out in turn from
+   * there. One that lost a root on this ray (a grazing hit on a blob or
+   * torus, say) doesn't, and its state can't be followed from its hits.
+   * Probe every child instead, as above.
    */
-  inside = 0;
   h = hits;
-  for(i = nhits; i > 0; i--)
+  for(j = nhits; j > 0 && !probeall; j--)
   {
-    if(h->entering)
-      inside--;
-    else
-      inside++;
+    k = FindCSGKid(csg, h->obj);
+    if(k != NULL && !k->probe)
+    {
+      if(h->entering == k->last)
+        probeall = 1;
+      k->last = h->entering;
+    }
     h = h->next;
   }
+  if(probeall)
+  {
+    ntracked = 0;
+    ninside = 0;
+  }
 
-  if(inside == csg->nchildren)
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 1 : 0;
-  else
-    entering = (obj->flags & OBJ_FLAG_INVERSE) ? 0 : 1;
-
+  /*
+   * Walk the hits in order, keeping those where the state of the
+   * whole object changes.
+   */
   h = hits;
   h2 = csg->hits;
   csg->nhits = 0;
   while(nhits-- && (h->t < ct.tmax))
   {
-    if(h->entering)
-      inside++;
-    if(inside == csg->nchildren)  /* Point inside all other objects. */
+    k = FindCSGKid(csg, h->obj);
+    if(k == NULL)
+    {
+      h = h->next;
+      continue;
+    }
+
+    Q.x = ct.B.x + ct.D.x * h->t;
+    Q.y = ct.B.y + ct.D.y * h->t;
+    Q.z = ct.B.z + ct.D.z * h->t;
+    tracked = !(probeall || k->probe);
+    self = (tracked) ? k->inside : 0;
+    switch(op)
+    {
+      case CSG_OP_UNION:
+        /* Boundary if not inside any of the other objects. */
+        keep = (ninside - self == 0) &&
+          !ProbeCSGKids(csg, k, &Q, 0, 0, probeall);
+        break;
+
+      case CSG_OP_DIFFERENCE:
+        /*
+         * Boundary if inside the first object (unless this is it)
+         * and not inside any of the other objects.
+         */
+        nfirst = (probeall || first->probe) ? 0 : first->inside;
+        if(k == first)
+          keep = (ninside - self == 0);
+        else
+        {
+          keep = (ninside - nfirst - self == 0);
+          if(keep)
+            keep = (probeall || first->probe) ?
+              CSGKidIsInside(first, &Q) : first->inside;
+        }
+        if(keep)
+          keep = !ProbeCSGKids(csg, k, &Q, 0, 1, probeall);
+        break;
+
+      default:
+        /* Boundary if inside all of the other objects. */
+        keep = (ninside - self == ntracked - tracked) &&
+          ProbeCSGKids(csg, k, &Q, 1, 0, probeall);
+        break;
+    }
+
+    if(tracked)
+    {
+      ninside += h->entering - k->inside;
+      k->inside = h->entering;
+    }
+
+    if(keep)
     {
+      /* Each boundary takes the whole object in or out in turn. */
+      entering = !inside;
+      inside = entering;
+      if(obj->flags & OBJ_FLAG_INVERSE)
+        entering = !entering;
       h2->obj = h->obj;
       hits->obj = obj;
       h2->entering = hits->entering = entering;
@@ -824,19 +734,14 @@ int IntersectCSGIntersection(Object *obj, HitData *hits)
       h2 = GetNextHit(h2);
       hits = hits->next;
       csg->nhits++;
-      entering = 1 - entering;
 			if(!ct.calc_all) break;
     }
-    if(!h->entering)
-      inside--;
     h = h->next;
   }
 
   return csg->nhits;
 }
 
-#endif
-
 int IntersectCSGClip(Object *obj, HitData *hits)
 {
   CSGData *csg = obj->data.csg;
@@ -916,8 +821,16 @@ int IsInsideCSGUnion(Object *obj, Vec3 *P)
 {
   CSGData *csg = obj->data.csg;
   ObjectList *ol;
+  int i;
 
   /* We are "inside" if point is inside any of the child objects. */
+  if(csg->kids != NULL)
+  {
+    for(i = 0; i < csg->nchildren; i++)
+      if(CSGKidIsInside(&csg->kids[i], P))
+        return (!(obj->flags & OBJ_FLAG_INVERSE));
+    return (obj->flags & OBJ_FLAG_INVERSE);
+  }
   for(ol = csg->olist; ol != NULL; ol = ol->next)
     if(ol->obj->procs->IsInside(ol->obj, P))
       return (!(obj->flags & OBJ_FLAG_INVERSE));
@@ -929,11 +842,23 @@ int IsInsideCSGDifference(Object *obj, Vec3 *P)
 {
   CSGData *csg = obj->data.csg;
   ObjectList *ol;
+  int i;
 
   /*
    * We are "inside" if point is inside first object but not
    * inside any of the other objects.
    */
+  if(csg->kids != NULL)
+  {
+    if(CSGKidIsInside(&csg->kids[0], P))
+    {
+      for(i = 1; i < csg->nchildren; i++)
+        if(CSGKidIsInside(&csg->kids[i], P))
+          return (obj->flags & OBJ_FLAG_INVERSE);
+      return (!(obj->flags & OBJ_FLAG_INVERSE));
+    }
+    return (obj->flags & OBJ_FLAG_INVERSE);
+  }
   ol = csg->olist;
   if(ol->obj->procs->IsInside(ol->obj, P))
   {
@@ -950,8 +875,16 @@ int IsInsideCSGIntersection(Object *obj, Vec3 *P)
 {
   CSGData *csg = obj->data.csg;
   ObjectList *ol;
+  int i;
 
   /* We are "inside" if point is inside all of the child objects. */
+  if(csg->kids != NULL)
+  {
+    for(i = 0; i < csg->nchildren; i++)
+      if(!CSGKidIsInside(&csg->kids[i], P))
+        return (obj->flags & OBJ_FLAG_INVERSE);
+    return(!(obj->flags & OBJ_FLAG_INVERSE));
+  }
   for(ol = csg->olist; ol != NULL; ol = ol->next)
     if(!(ol->obj->procs->IsInside(ol->obj, P)))
       return (obj->flags & OBJ_FLAG_INVERSE);
@@ -1021,31 +954,132 @@ void CalcUVMapCSG(Object *obj, Vec3 *P, double *u, double *v)
 }
 
 
+/* Grow or shrink box "omin", "omax" to the union or intersection with another. */
+static void MergeExtents(Vec3 *omin, Vec3 *omax, Vec3 *bmin, Vec3 *bmax,
+  int intersect)
+{
+  if(intersect)
+  {
+    omin->x = fmax(omin->x, bmin->x);
+    omax->x = fmin(omax->x, bmax->x);
+    omin->y = fmax(omin->y, bmin->y);
+    omax->y = fmin(omax->y, bmax->y);
+    omin->z = fmax(omin->z, bmin->z);
+    omax->z = fmin(omax->z, bmax->z);
+  }
+  else
+  {
+    omin->x = fmin(omin->x, bmin->x);
+    omax->x = fmax(omax->x, bmax->x);
+    omin->y = fmin(omin->y, bmin->y);
+    omax->y = fmax(omax->y, bmax->y);
+    omin->z = fmin(omin->z, bmin->z);
+    omax->z = fmax(omax->z, bmax->z);
+  }
+}
+
+
+/*
+ * True if the extents of "obj" enclose all the space its IsInside()
+ * counts as inside, so that an intersection may be cut down to them.
+ * Inverted objects, and flat ones whose inside is a half-space, don't.
+ */
+static int ExtentsEncloseInside(Object *obj)
+{
+  ObjectList *ol;
+
+  if(obj->flags & OBJ_FLAG_INVERSE)
+    return 0;
+  switch(obj->procs->type)
+  {
+    case OBJ_SPHERE:
+    case OBJ_BOX:
+    case OBJ_BLOB:
+    case OBJ_CONE:
+    case OBJ_TORUS:
+      return 1;
+    case OBJ_CSGUNION:
+      for(ol = obj->data.csg->olist; ol != NULL; ol = ol->next)
+        if(!ExtentsEncloseInside(ol->obj))
+          return 0;
+      return 1;
+    case OBJ_CSGDIFFERENCE:
+      return ExtentsEncloseInside(obj->data.csg->olist->obj);
+    case OBJ_CSGCLIP:
+      return ExtentsEncloseInside(obj->data.csg->children);
+    case OBJ_CSGINTERSECTION:
+      for(ol = obj->data.csg->olist; ol != NULL; ol = ol->next)
+        if(ExtentsEncloseInside(ol->obj))
+          return 1;
+      return 0;
+  }
+  return 0;
+}
+
+
 void CalcExtentsCSG(Object *obj, Vec3 *omin, Vec3 *omax)
 {
   CSGData *csg = obj->data.csg;
   Object *o;
+  ObjectList *ol;
   Vec3 bmin, bmax;
+  int n;
 
-  /* Get cummulative bounds of all child objects. */
-  o = csg->children;
-  o->procs->CalcExtents(o, omin, omax);
-  for(o = o->next; o != NULL; o = o->next)
+  switch(obj->procs->type)
   {
-    o->procs->CalcExtents(o, &bmin, &bmax);
-    if(bmin.x < omin->x)
-      omin->x = bmin.x;
-    if(bmax.x > omax->x)
-      omax->x = bmax.x;
-    if(bmin.y < omin->y)
-      omin->y = bmin.y;
-    if(bmax.y > omax->y)
-      omax->y = bmax.y;
-    if(bmin.z < omin->z)
-      omin->z = bmin.z;
-    if(bmax.z > omax->z)
-      omax->z = bmax.z;
+    case OBJ_CSGDIFFERENCE:
+      /* Nothing can be added to the first object, unless it is inverted. */
+      o = csg->olist->obj;
+      if(!ExtentsEncloseInside(o))
+        goto AllChildren;
+      o->procs->CalcExtents(o, omin, omax);
+      break;
+
+    case OBJ_CSGINTERSECTION:
+      /*
+       * Only the space common to the child objects whose extents
+       * enclose their inside; the others can't narrow it down.
+       */
+      n = 0;
+      for(ol = csg->olist; ol != NULL; ol = ol->next)
+      {
+        if(!ExtentsEncloseInside(ol->obj))
+          continue;
+        if(n++ == 0)
+          ol->obj->procs->CalcExtents(ol->obj, omin, omax);
+        else
+        {
+          ol->obj->procs->CalcExtents(ol->obj, &bmin, &bmax);
+          MergeExtents(omin, omax, &bmin, &bmax, 1);
+        }
+      }
+      if(n == 0)
+        goto AllChildren;
+      break;
+
+    case OBJ_CSGCLIP:
+      /* Only the first object's surface is drawn. */
+      o = csg->children;
+      o->procs->CalcExtents(o, omin, omax);
+      break;
+
+    default:
+    AllChildren:
+      /* Get cummulative bounds of all child objects. */
+      o = csg->children;
+      o->procs->CalcExtents(o, omin, omax);
+      for(o = o->next; o != NULL; o = o->next)
+      {
+        o->procs->CalcExtents(o, &bmin, &bmax);
+        MergeExtents(omin, omax, &bmin, &bmax, 0);
+      }
+      break;
   }
+
+  /* An empty intersection still needs a valid box. */
+  if(omax->x < omin->x) omax->x = omin->x;
+  if(omax->y < omin->y) omax->y = omin->y;
+  if(omax->z < omin->z) omax->z = omin->z;
 }
 
 
@@ -1113,6 +1147,9 @@ void CopyCSG(Object *destobj, Object *srcobj)
 			else
 				o = destcsg->boundobj = Ray_CloneObject(srccsg->boundobj);
 		}
+		destcsg->kids = NULL;
+		destcsg->kidorder = NULL;
+		destcsg->probes = NULL;
 		destcsg->hits = NewHitData();
 	}
 }
@@ -1142,6 +1179,7 @@ void DeleteCSG(Object *obj)
     csg->olist = ol->next;
     Free(ol, sizeof(ObjectList));
   }
+  DeleteCSGSpans(csg);
   DeleteHits(csg->hits);
   Free(csg, sizeof(CSGData));
 }
@@ -1182,6 +1220,30 @@ void PostProcessCSG(Object *obj)
 	if(obj->procs->type != OBJ_CSGGROUP)
 		csg_non_group--;
 
+	/* Groups within groups are merged into this one. */
+	if(obj->procs->type == OBJ_CSGGROUP)
+	{
+		Object **link, *flat;
+
+		link = &csg->children;
+		while(*link != NULL)
+		{
+			o = *link;
+			if((flat = Ray_FlattenCSGGroup(o)) != NULL)
+			{
+				*link = flat;
+				while(flat->next != NULL)
+					flat = flat->next;
+				flat->next = o->next;
+				o->next = NULL;
+				Ray_DeleteObject(o);
+				link = &flat->next;
+			}
+			else
+				link = &o->next;
+		}
+	}
+
 	if(obj->procs->type == OBJ_CSGCLIP)
 	{
 		assert(csg->children->next != NULL);
@@ -1189,6 +1251,96 @@ void PostProcessCSG(Object *obj)
 	}
 	else
 		Ray_BuildBounds(&csg->children);
+
+	if(obj->procs->type == OBJ_CSGUNION ||
+		obj->procs->type == OBJ_CSGDIFFERENCE ||
+		obj->procs->type == OBJ_CSGINTERSECTION)
+		(void)SetupCSGSpans(obj);
+}
+
+
+/*
+ * True if transforms "A" and "B" do the same thing. Children share
+ * their parent's transform by reference, but one built up separately
+ * may still hold the same matrix.
+ */
+static int SameXform(Xform *A, Xform *B)
+{
+	if(A == B)
+		return 1;
+	if(A == NULL || B == NULL)
+		return 0;
+	return memcmp(&A->M, &B->M, sizeof(Mat4x4)) == 0;
+}
+
+
+/*
+ * A plain group only shares its transform and surface with its
+ * children. Children with no surface of their own take the group's,
+ * which is only the same thing if they use the group's transform
+ * for texturing as well.
+ */
+static int CSGGroupCanFlatten(Object *group, Object *o)
+{
+	for( ; o != NULL; o = o->next)
+	{
+		if(o->procs->type == OBJ_BBOX)
+		{
+			if(!CSGGroupCanFlatten(group, o->data.bbox->objects))
+				return 0;
+		}
+		else if(o->surface == NULL && group->surface != NULL &&
+			!SameXform(o->T, group->T))
+			return 0;
+	}
+	return 1;
+}
+
+
+static void CSGGroupPushDown(Object *group, Object *o)
+{
+	for( ; o != NULL; o = o->next)
+	{
+		if(o->procs->type == OBJ_BBOX)
+		{
+			CSGGroupPushDown(group, o->data.bbox->objects);
+			continue;
+		}
+		o->flags |= (group->flags & OBJ_FLAG_NO_SHADOW);
+		if(o->surface == NULL && group->surface != NULL)
+		{
+			o->surface = Ray_ShareSurface(group->surface);
+			o->flags |= (group->flags & OBJ_FLAG_TRANSMISSIVE);
+		}
+	}
+}
+
+
+/*
+ * If "obj" is a post-processed group that doesn't need all-hit
+ * semantics, hand its surface and flags down to its children and
+ * return them so that they can be bounded along with the objects
+ * around the group. The children are detached from "obj", which the
+ * caller should then delete. Returns NULL if "obj" must stay whole.
+ */
+Object *Ray_FlattenCSGGroup(Object *obj)
+{
+	CSGData *csg;
+	Object *children;
+
+	if(obj->procs->type != OBJ_CSGGROUP ||
+		!(obj->flags & OBJ_FLAG_GROUP_ONLY) ||
+		(obj->flags & (OBJ_FLAG_INVERSE | OBJ_FLAG_NO_SELF_INTERSECT)))
+		return NULL;
+	csg = obj->data.csg;
+	if(csg->boundobj != NULL || csg->children == NULL ||
+		!CSGGroupCanFlatten(obj, csg->children))
+		return NULL;
+
+	CSGGroupPushDown(obj, csg->children);
+	children = csg->children;
+	csg->children = NULL;
+	return children;
 }
 
 
@@ -394,3 +394,323 @@ void DrawDisc(Object *obj)
 		Line_To(0);
 	}
 }
+
+
+/*************************************************************************
+*
+*  Disc batches.
+*
+*  Discs in the same bounding tree leaf are tested together. The ray is
+*  taken in to every disc's coordinate system, hit with its plane and
+*  clipped to its radii in one pass over the batch arrays, which the
+*  compiler can vectorize. Hits are reported on the discs themselves,
+*  so the batch never shows up as the object hit.
+*
+*************************************************************************/
+
+static int IntersectDiscBatch(Object *obj, HitData *hits);
+static void CalcNormalDiscBatch(Object *obj, Vec3 *P, Vec3 *N);
+static int IsInsideDiscBatch(Object *obj, Vec3 *P);
+static void CalcUVMapDiscBatch(Object *obj, Vec3 *P, double *u, double *v);
+static void CalcExtentsDiscBatch(Object *obj, Vec3 *omin, Vec3 *omax);
+static void TransformDiscBatch(Object *obj, Vec3 *params, int type);
+static void CopyDiscBatch(Object *destobj, Object *srcobj);
+static void DeleteDiscBatch(Object *obj);
+static void DrawDiscBatch(Object *obj);
+
+static ObjectProcs discbatch_procs =
+{
+	OBJ_DISCBATCH,
+	IntersectDiscBatch,
+	CalcNormalDiscBatch,
+	IsInsideDiscBatch,
+	CalcUVMapDiscBatch,
+	CalcExtentsDiscBatch,
+	TransformDiscBatch,
+	CopyDiscBatch,
+	DeleteDiscBatch,
+	DrawDiscBatch
+};
+
+
+static void SetDiscBatch(DiscBatchData *db)
+{
+	Object *o;
+	DiscData *disc;
+	int i, k;
+
+	for(i = 0, o = db->objects; o != NULL; i++, o = o->next)
+	{
+		assert(i < DISC_BATCH_MAX);
+		disc = o->data.disc;
+		db->obj[i] = o;
+		for(k = 0; k < 12; k++)
+			db->I[k][i] = (o->T != NULL) ? o->T->I.e[k / 3][k % 3] :
+				((k / 3 == k % 3) ? 1.0 : 0.0);
+		db->lx[i] = disc->loc.x;
+		db->ly[i] = disc->loc.y;
+		db->lz[i] = disc->loc.z;
+		db->nx[i] = disc->norm.x;
+		db->ny[i] = disc->norm.y;
+		db->nz[i] = disc->norm.z;
+		db->d[i] = disc->d;
+		db->inrsq[i] = disc->inrsq;
+		db->outrsq[i] = disc->outrsq;
+	}
+	db->n = i;
+}
+
+
+/*
+ * Make a batch of the list of discs "discs", which must have no more
+ * than DISC_BATCH_MAX members.
+ */
+Object *Ray_MakeDiscBatch(Object *discs)
+{
+	Object *obj = NewObject();
+	if(obj != NULL)
+	{
+		DiscBatchData *db = (DiscBatchData *)Malloc(sizeof(DiscBatchData));
+		if(db != NULL)
+		{
+			db->objects = discs;
+			SetDiscBatch(db);
+			obj->data.discbatch = db;
+			obj->procs = &discbatch_procs;
+		}
+		else
+			obj = Ray_DeleteObject(obj);
+	}
+
+	return obj;
+}
+
+
+int IntersectDiscBatch(Object *obj, HitData *hits)
+{
+	DiscBatchData *db = obj->data.discbatch;
+	double t[DISC_BATCH_MAX], denom[DISC_BATCH_MAX];
+	double live[DISC_BATCH_MAX];
+	double bx, by, bz, dx, dy, dz, hd, x, y, z, d;
+	double closest_t = HUGE;
+	Object *closest_obj = NULL, *o;
+	HitData *h = hits;
+	int i, entering, nhits, closest_entering = 0;
+
+	/*
+	 * Hit the plane of every disc in the batch and clip to its radii.
+	 * This is the same arithmetic as IntersectDisc(), with conditions
+	 * turned in to selects so the loop is free of branches and can be
+	 * vectorized when the compiler may ignore floating point exceptions
+	 * (e.g. -fno-trapping-math -fno-math-errno).
+	 */
+	for(i = 0; i < db->n; i++)
+	{
+		bx = ct.B.x * db->I[0][i] + ct.B.y * db->I[3][i] + ct.B.z * db->I[6][i] + db->I[9][i];
+		by = ct.B.x * db->I[1][i] + ct.B.y * db->I[4][i] + ct.B.z * db->I[7][i] + db->I[10][i];
+		bz = ct.B.x * db->I[2][i] + ct.B.y * db->I[5][i] + ct.B.z * db->I[8][i] + db->I[11][i];
+		dx = ct.D.x * db->I[0][i] + ct.D.y * db->I[3][i] + ct.D.z * db->I[6][i];
+		dy = ct.D.x * db->I[1][i] + ct.D.y * db->I[4][i] + ct.D.z * db->I[7][i];
+		dz = ct.D.x * db->I[2][i] + ct.D.y * db->I[5][i] + ct.D.z * db->I[8][i];
+
+		/* The ray is parallel to the plane if denom is 0. */
+		denom[i] = db->nx[i] * dx + db->ny[i] * dy + db->nz[i] * dz;
+		live[i] = (fabs(denom[i]) < EPSILON) ? 0.0 : 1.0;
+		hd = (fabs(denom[i]) < EPSILON) ? 1.0 : denom[i];
+		t[i] = - ((db->nx[i] * bx + db->ny[i] * by + db->nz[i] * bz) + db->d[i]) / hd;
+		live[i] = ((t[i] < ct.tmin) | (t[i] > ct.tmax)) ? 0.0 : live[i];
+
+		/* Is the point on the plane within the clipping radii? */
+		x = (bx + dx * t[i]) - db->lx[i];
+		y = (by + dy * t[i]) - db->ly[i];
+		z = (bz + dz * t[i]) - db->lz[i];
+		d = x * x + y * y + z * z;
+		live[i] = ((d > db->outrsq[i]) | (d < db->inrsq[i])) ? 0.0 : live[i];
+	}
+
+	/* Report the hits. */
+	nhits = 0;
+	for(i = 0; i < db->n; i++)
+	{
+		o = db->obj[i];
+		if(skip_object(o))
+			continue;
+		ray_disc_tests++;
+		if(live[i] == 0.0)
+			continue;
+		ray_disc_hits++;
+
+		entering = (denom[i] < 0.0) ? 1 : 0;
+		if(o->flags & OBJ_FLAG_INVERSE)
+			entering = 1 - entering;
+
+		if(!ct.calc_all)
+		{
+			/* Only the closest hit is wanted. */
+			if(t[i] < closest_t)
+			{
+				closest_t = t[i];
+				closest_obj = o;
+				closest_entering = entering;
+			}
+			continue;
+		}
+
+		if(nhits++ > 0)
+			h = GetNextHit(h);
+		h->t = t[i];
+		h->obj = o;
+		h->entering = entering;
+	}
+
+	if(closest_obj != NULL)
+	{
+		hits->t = closest_t;
+		hits->obj = closest_obj;
+		hits->entering = closest_entering;
+		return 1;
+	}
+
+	SortHits(hits, nhits);
+	return nhits;
+}
+
+
+/*
+ * Hits on a batch are reported on its discs, so normals and uv maps are
+ * only asked of the batch from outside the ray tracer. Hand those to the
+ * disc nearest P.
+ */
+static Object *NearestDisc(Object *obj, Vec3 *Q)
+{
+	Object *o, *best;
+	DiscData *disc;
+	Vec3 P;
+	double h, r, e, d, bestd;
+
+	best = obj->data.discbatch->objects;
+	bestd = HUGE;
+	for(o = best; o != NULL; o = o->next)
+	{
+		disc = o->data.disc;
+		V3Copy(&P, Q);
+		if(o->T != NULL)
+			PointToObject(&P, o->T);
+
+		/* Height above the plane and distance from the axis. */
+		h = V3Dot(&P, &disc->norm) + disc->d;
+		P.x -= disc->loc.x;
+		P.y -= disc->loc.y;
+		P.z -= disc->loc.z;
+		r = sqrt(fmax(V3Dot(&P, &P) - h * h, 0.0));
+
+		/* How far the foot of P lies outside of the annulus. */
+		e = fmax(r - sqrt(disc->outrsq), sqrt(disc->inrsq) - r);
+		e = fmax(e, 0.0);
+		d = h * h + e * e;
+		if(d < bestd)
+		{
+			bestd = d;
+			best = o;
+		}
+	}
+	return best;
+}
+
+
+void CalcNormalDiscBatch(Object *obj, Vec3 *P, Vec3 *N)
+{
+	Object *o = NearestDisc(obj, P);
+
+	o->procs->CalcNormal(o, P, N);
+}
+
+
+void CalcUVMapDiscBatch(Object *obj, Vec3 *P, double *u, double *v)
+{
+	Object *o = NearestDisc(obj, P);
+
+	o->procs->CalcUVMap(o, P, u, v);
+}
+
+
+int IsInsideDiscBatch(Object *obj, Vec3 *P)
+{
+	Object *o;
+
+	for(o = obj->data.discbatch->objects; o != NULL; o = o->next)
+		if(o->procs->IsInside(o, P))
+			return 1;
+	return 0;
+}
+
+
+void CalcExtentsDiscBatch(Object *obj, Vec3 *omin, Vec3 *omax)
+{
+	Object *o = obj->data.discbatch->objects;
+	Vec3 bmin, bmax;
+
+	o->procs->CalcExtents(o, omin, omax);
+	for(o = o->next; o != NULL; o = o->next)
+	{
+		o->procs->CalcExtents(o, &bmin, &bmax);
+		omin->x = fmin(omin->x, bmin.x);
+		omax->x = fmax(omax->x, bmax.x);
+		omin->y = fmin(omin->y, bmin.y);
+		omax->y = fmax(omax->y, bmax.y);
+		omin->z = fmin(omin->z, bmin.z);
+		omax->z = fmax(omax->z, bmax.z);
+	}
+}
+
+
+void TransformDiscBatch(Object *obj, Vec3 *params, int type)
+{
+	Object *o;
+
+	for(o = obj->data.discbatch->objects; o != NULL; o = o->next)
+		Ray_Transform_Object(o, params, type);
+	SetDiscBatch(obj->data.discbatch);
+}
+
+
+void CopyDiscBatch(Object *destobj, Object *srcobj)
+{
+	DiscBatchData *db = (DiscBatchData *)Malloc(sizeof(DiscBatchData));
+	Object *o, *last = NULL;
+
+	db->objects = NULL;
+	for(o = srcobj->data.discbatch->objects; o != NULL; o = o->next)
+	{
+		if(last != NULL)
+			last = last->next = Ray_CloneObject(o);
+		else
+			last = db->objects = Ray_CloneObject(o);
+	}
+	SetDiscBatch(db);
+	destobj->data.discbatch = db;
+}
+
+
+void DeleteDiscBatch(Object *obj)
+{
+	DiscBatchData *db = obj->data.discbatch;
+	Object *o;
+
+	while(db->objects != NULL)
+	{
+		o = db->objects;
+		db->objects = o->next;
+		Ray_DeleteObject(o);
+	}
+	Free(db, sizeof(DiscBatchData));
+}
+
+
+void DrawDiscBatch(Object *obj)
+{
+	Object *o;
+
+	for(o = obj->data.discbatch->objects; o != NULL; o = o->next)
+		o->procs->Draw(o);
+}
@@ -23,6 +23,7 @@ static void DrawMesh(Object *obj);
 static MeshNode *NewMeshNode(void);
 static void DeleteMeshNode(MeshNode *n);
 static MeshNode *BuildTriTree(MeshTri *tris, int ntris);
+static void CollapseTriTree(MeshNode *n);
 static void DeleteTriTree(MeshNode *n);
 static MeshLocalData *NewMeshLocalData(void);
 static void DeleteMeshLocalData(MeshLocalData *ml);
@@ -36,7 +37,7 @@ static int CalcTriListExtents(MeshTri *tris, int ntris,
 static void SplitTriList(MeshTri *tris, double median, int axis,
 	MeshTri **lo, MeshTri **hi);
 static void IntersectTriTree(MeshLocalData *ml, MeshNode *tree,
-	Vec3 *B, Vec3 *D);
+	SlabRay *sr, Vec3 *B, Vec3 *D);
 static void IntersectTriList(MeshLocalData *ml, MeshTri *tris,
 	Vec3 *B, Vec3 *D);
 static void InsertHit(MeshLocalData *ml, MeshTri *tri, double t,
@@ -224,6 +225,7 @@ Object *Ray_FinishMesh(void)
 	/* Build the triangle tree. (do this last) */
 	if ((mesh->tree = BuildTriTree(mesh->tris, ntris)) == NULL)
 		goto fail_finish;
+	CollapseTriTree(mesh->tree);
 
 	mesh_obj = NULL;
 	return obj;
@@ -266,6 +268,7 @@ Object *Ray_MakeMeshFromData(MeshData *mesh, MeshTri *tris, int ntris)
 	/* Build the triangle tree. (do this last) */
 	if ((mesh->tree = BuildTriTree(tris, ntris)) == NULL)
 		goto fail_create;
+	CollapseTriTree(mesh->tree);
 
 #ifndef NDEBUG
 /*	FPrintTree(mesh); */
@@ -410,6 +413,8 @@ int IntersectMesh(Object *obj, HitData *hits)
 	MeshLocalData *ml;
 	MeshHit *h;
 	Vec3 B, D;
+	SlabRay sr;
+	double t1, t2;
 	int i, entering;
 
 	ray_mesh_tests++;
@@ -429,7 +434,10 @@ int IntersectMesh(Object *obj, HitData *hits)
 
 	/* Traverse the triangle tree, testing for intersections. */
 	ml->nhits = 0;
-	IntersectTriTree(ml, m->tree, &B, &D);
+	SetupSlabRay(&sr, &B, &D);
+	if (IntersectSlabs(&sr, &m->tree->bmin, &m->tree->bmax, &t1, &t2) &&
+		(t2 > ct.tmin) && (t1 < ct.tmax))
+		IntersectTriTree(ml, m->tree, &sr, &B, &D);
 
 	/* Copy hit data, if any, to caller's hit list. */
 	if (ml->nhits)
@@ -594,26 +602,29 @@ void DeleteMesh(Object *obj)
 *
 *************************************************************************/
 
+/*
+ * Test the triangles under "tree", whose own bounding box the ray is
+ * known to hit.
+ */
 void IntersectTriTree(MeshLocalData *ml, MeshNode *tree,
-	Vec3 *B, Vec3 *D)
+	SlabRay *sr, Vec3 *B, Vec3 *D)
 {
 	double t1, t2;
+	MeshNode *n;
 
-	/* Step thru the node list for this level. */
-	while (tree != NULL)
+	if (tree->nodes == NULL)
 	{
-		/* See if ray hits this node's bounding box */
-		if (Intersect_Box(B, D, &tree->bmin, &tree->bmax, &t1, &t2))
-		{
-			if ((t2 > ct.tmin) && (t1 < ct.tmax))
-			{
-				if (tree->nodes != NULL) /* Check child nodes. */
-					IntersectTriTree(ml, tree->nodes, B, D);
-				else	/* Test triangle list for intersections. */
-					IntersectTriList(ml, tree->tris, B, D);
-			}
-		}
-		tree = tree->next;
+		/* Test triangle list for intersections. */
+		IntersectTriList(ml, tree->tris, B, D);
+		return;
+	}
+
+	/* Step thru the sub nodes, entering those the ray hits. */
+	for (n = tree->nodes; n != NULL; n = n->next)
+	{
+		if (IntersectSlabs(sr, &n->bmin, &n->bmax, &t1, &t2) &&
+			(t2 > ct.tmin) && (t1 < ct.tmax))
+			IntersectTriTree(ml, n, sr, B, D);
 	}
 }
 
@@ -974,6 +985,76 @@ MeshNode *BuildTriTree(MeshTri *tris, int ntris)
 	return n;
 }
 
+static double NodeArea(MeshNode *n)
+{
+	double dx = n->bmax.x - n->bmin.x;
+	double dy = n->bmax.y - n->bmin.y;
+	double dz = n->bmax.z - n->bmin.z;
+
+	return dx * dy + dy * dz + dz * dx;
+}
+
+/*
+ * Collapse the binary tree built by BuildTriTree() into one with up to
+ * MESH_NODE_WIDTH sub nodes per node, by pulling up the sub nodes of
+ * the largest sub node while they still fit.
+ */
+void CollapseTriTree(MeshNode *n)
+{
+	MeshNode *kids[MESH_NODE_WIDTH], *k, *sub;
+	double area, best_area;
+	int i, j, nkids, nsub, best;
+
+	if (n->nodes == NULL)
+		return;
+
+	nkids = 0;
+	for (k = n->nodes; k != NULL; k = k->next)
+		kids[nkids++] = k;
+
+	for (;;)
+	{
+		best = -1;
+		best_area = -1.0;
+		for (i = 0; i < nkids; i++)
+		{
+			if (kids[i]->nodes == NULL)
+				continue;
+			for (k = kids[i]->nodes, nsub = 0; k != NULL; k = k->next)
+				nsub++;
+			if (nkids - 1 + nsub > MESH_NODE_WIDTH)
+				continue;
+			area = NodeArea(kids[i]);
+			if (area > best_area)
+			{
+				best_area = area;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+
+		/* Put the sub nodes of "best" in its place. */
+		k = kids[best];
+		for (sub = k->nodes, nsub = 0; sub != NULL; sub = sub->next)
+			nsub++;
+		for (j = nkids - 1; j > best; j--)
+			kids[j + nsub - 1] = kids[j];
+		for (sub = k->nodes, j = best; sub != NULL; sub = sub->next)
+			kids[j++] = sub;
+		nkids += nsub - 1;
+		DeleteMeshNode(k);
+	}
+
+	/* Relink the sub nodes. */
+	n->nodes = kids[0];
+	for (i = 0; i < nkids; i++)
+	{
+		kids[i]->next = (i + 1 < nkids) ? kids[i + 1] : NULL;
+		CollapseTriTree(kids[i]);
+	}
+}
+
 void DeleteTriTree(MeshNode *n)
 {
 	while (n != NULL)
@@ -12,6 +12,10 @@
 //
 Surface *DefaultSurface;
 
+// Id of the next Surface made.
+//
+static unsigned int next_surface_id;
+
 /**
  * Initialize the surface stuff.
  * Called by Ray_Initialize() in raytrace.c when the renderer is initialized.
@@ -20,6 +24,7 @@ Surface *DefaultSurface;
  */
 int InitializeSurface(void)
 {
+	next_surface_id = 0;
 	DefaultSurface = Ray_NewSurface();
 	if (DefaultSurface == NULL)
   		return 0;
@@ -61,6 +66,7 @@ Surface *Ray_NewSurface(void)
 		s->outior = ray_global_ior;
 		s->nrefs = 1;
 		s->shaders = NULL;
+		s->id = next_surface_id++;
 	}
 
 	return s;
@@ -117,6 +123,7 @@ Surface *Ray_ShareSurface(Surface *s)
 Surface *Ray_CloneSurface(Surface *srcsurf)
 {
 	Surface	*newsurf = NULL;
+	unsigned int id;
 	
 	// If srcsurf is NULL, behavior is just like Ray_NewSurface()
 	//
@@ -127,9 +134,11 @@ Surface *Ray_CloneSurface(Surface *srcsurf)
 		newsurf = Ray_NewSurface();
 		if (newsurf != NULL)
 		{
-			// Shallow copy all Surface struct members.
+			// Shallow copy all Surface struct members, but the id.
 			//
+			id = newsurf->id;
 			*newsurf = *srcsurf;
+			newsurf->id = id;
 			
 			// Reset the share counter.
 			//
@@ -168,67 +177,102 @@ void Ray_Transform_Surface(Surface *s, Vec3 *params, int type)
  */
 void ShadeSurface(void)
 {
-	Xform *T;
-	Shader	*shader;
+	SurfaceHit sh;
 
+	FindHitSurface(&sh);
+	ShadeSurfaceHit(&sh);
+}
+
+/**
+ * Look up the surface of the current hit, and if it has shaders, where
+ * the hit is in the surface's space. This has to be done while the hit
+ * is the latest one found, as some objects keep the details of their
+ * last hits, but the shading itself can be put off.
+ *
+ * @param sh - SurfaceHit* - Receives the surface of the hit.
+ */
+void FindHitSurface(SurfaceHit *sh)
+{
 	assert(ct.objhit != NULL);
-	Object_GetTextureInfo(ct.objhit, &ct.surface, &T);
+	Object_GetTextureInfo(ct.objhit, &sh->surface, &sh->T);
+	if (sh->surface == NULL)
+	{
+		sh->surface = DefaultSurface;
+		return;
+	}
 
-	rt_surface = ct.surface;
+	if (sh->surface->shaders != NULL)
+	{
+		sh->O = ct.Q;
+		sh->ON = ct.N;
+		if (sh->surface->T != NULL)
+		{
+			PointToObject(&sh->O, sh->surface->T);
+			NormToObject(&sh->ON, sh->surface->T);
+		}
+		if (sh->T != NULL)
+		{
+			PointToObject(&sh->O, sh->T);
+			NormToObject(&sh->ON, sh->T);
+		}
+
+      // TODO: Check at compile time to see if "u" or "v" are used and set a flag if so.
+      // Do this calculation only if "u" or "v" are used.
+		ct.objhit->procs->CalcUVMap(ct.objhit, &sh->O, &sh->u, &sh->v);
+	}
+}
+
+/**
+ * Shade the current hit with the surface found for it by
+ * FindHitSurface(), running the surface's shaders if it has any.
+ *
+ * @param sh - SurfaceHit* - The surface of the hit.
+ */
+void ShadeSurfaceHit(SurfaceHit *sh)
+{
+	Shader	*shader;
 
-	if (rt_surface != NULL)
+	ct.surface = rt_surface = sh->surface;
+	Ray_AddSurfaceContributor(rt_surface, ray_contrib);
+
+	if (rt_surface->shaders != NULL)
 	{
-		if (ct.surface->shaders != NULL)
+		// Update run-time variables.
+		//
+		rt_W = ct.Q;
+		rt_WN = ct.N;
+		rt_O = sh->O;
+		rt_ON = sh->ON;
+		rt_u = sh->u;
+		rt_v = sh->v;
+		rt_D = ct.D;
+
+		// Run the shader(s)
+		//
+		for (shader = ct.surface->shaders;
+			shader != NULL;
+			shader = shader->next)
 		{
-			// Update run-time variables.
-			//
-			rt_O = rt_W = ct.Q;
-			rt_ON = rt_WN = ct.N;
-			rt_D = ct.D;
-			if (ct.surface->T != NULL)
-			{
-				PointToObject(&rt_O, ct.surface->T);
-				NormToObject(&rt_ON, ct.surface->T);
-			}
-			if (T != NULL)
-			{
-				PointToObject(&rt_O, T);
-				NormToObject(&rt_ON, T);
-			}
-
-         // TODO: Check at compile time to see if "u" or "v" are used and set a flag if so.
-         // Do this calculation only if "u" or "v" are used.
-			ct.objhit->procs->CalcUVMap(ct.objhit, &rt_O, &rt_u, &rt_v);
-			
-			// Run the shader(s)
-			//
-			for (shader = ct.surface->shaders;
-				shader != NULL;
-				shader = shader->next)
-			{
-				Ray_RunShader(shader, ct.surface); 
-			}
-
-			if (ct.surface->T != NULL)
-			{
-				NormToWorld(&rt_ON, ct.surface->T);
-			}
-			if (T != NULL)
-			{
-				NormToWorld(&rt_ON, T);
-			}
-			V3Copy(&ct.N, &rt_ON);
-
-			// Check for a changed transmission value and set the
-			// object transmissive flag if necessary.
-			//
-			if (((ct.objhit->flags & OBJ_FLAG_TRANSMISSIVE) == 0) &&
-					!V3IsZero(&ct.surface->kt))
-				ct.objhit->flags |= OBJ_FLAG_TRANSMISSIVE;
+			Ray_RunShader(shader, ct.surface); 
+		}
+
+		if (ct.surface->T != NULL)
+		{
+			NormToWorld(&rt_ON, ct.surface->T);
 		}
+		if (sh->T != NULL)
+		{
+			NormToWorld(&rt_ON, sh->T);
+		}
+		V3Copy(&ct.N, &rt_ON);
+
+		// Check for a changed transmission value and set the
+		// object transmissive flag if necessary.
+		//
+		if (((ct.objhit->flags & OBJ_FLAG_TRANSMISSIVE) == 0) &&
+				!V3IsZero(&ct.surface->kt))
+			ct.objhit->flags |= OBJ_FLAG_TRANSMISSIVE;
 	}
-	else
-		ct.surface = rt_surface = DefaultSurface;
 
 	// Save all of the lighting constants for this level that
 	// might be changed on the surface during a recursive trace.
@@ -243,6 +287,41 @@ void ShadeSurface(void)
 	ct.Phong = rt_surface->spec_power;
 }
 
+
+/*
+ * Returns the surface ShadeSurface() would shade "obj", just hit by the
+ * current ray, with.
+ */
+Surface *HitSurface(Object *obj)
+{
+	Surface *surf;
+	Xform *T;
+
+	Object_GetTextureInfo(obj, &surf, &T);
+	return (surf != NULL) ? surf : DefaultSurface;
+}
+
+
+/*
+ * True if "obj", just hit by the current ray, lets no light through.
+ */
+int SurfaceIsOpaque(Object *obj)
+{
+	return !SurfaceLetsLightThrough(HitSurface(obj));
+}
+
+
+/*
+ * True if "surf" may let light through: it has shaders that could
+ * change kt, or kt is strong enough for a shadow ray to be traced on
+ * through it.
+ */
+int SurfaceLetsLightThrough(Surface *surf)
+{
+	return (surf->shaders != NULL) ||
+		(V3Mag(&surf->kt) > ray_min_color_weight);
+}
+
 // TODO:
 #if 0
 void SMApplyShader( SurfaceModifier *sm, Surface *surf )
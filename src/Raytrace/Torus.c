@@ -45,6 +45,7 @@ Object *Ray_MakeTorus(Vec3 *loc, double rmajor, double rminor)
 		if (tor != NULL)
 		{
 			Ray_SetTorus(tor, loc, rmajor, rminor);
+			tor->solver = SOLVER_CLOSED_FORM;
 			obj->data.torus = tor;
 			obj->procs = &torus_procs;
 		}
@@ -74,13 +75,73 @@ void Ray_SetTorus(TorusData *torus, Vec3 *loc, double rmajor, double rminor)
 }
 
 
+/*
+ * Finish a ray/torus test once the ray is known to hit the torus'
+ * bounding sphere at "t1" and "t2" and to cross its slab. "o" and "d"
+ * are the ray in the torus' coordinate system and "c0".."c3" the
+ * constants for the "t" equation. Returns the roots in "t".
+ */
+static int SolveTorus(TorusData *tor, double ox, double oy, double oz,
+	double dx, double dy, double dz, double c0, double c1, double c2,
+	double c3, double t1, double t2, double *t)
+{
+	double c[5];  /* Coeffs for quartic in "t". */
+	double lo, hi;  /* Range of "t" that can hold roots. */
+
+	/* All roots lie within the bounding sphere hits. */
+	lo = (t2 - EPSILON > ct.tmin) ? t2 - EPSILON : ct.tmin;
+	hi = (t1 + EPSILON < ct.tmax) ? t1 + EPSILON : ct.tmax;
+
+	/*
+	 * If the minor radius is less than the major radius, the torus
+	 * has a hole. Get ray intersections with the plane pair and see
+	 * if both hits are within the inner diameter of the hole.
+	 * If so, return a miss.
+	 */
+	if (tor->r < tor->R && dz > EPSILON)
+	{
+		double x, y, rsq;
+
+		t1 = (tor->r - oz) / dz;
+		x = ox + t1 * dx;
+		y = oy + t1 * dy;
+		rsq = tor->R - tor->r;
+		rsq = rsq * rsq;
+		if((x*x + y*y) < rsq)
+		{
+			t2 = (-tor->r - oz) / dz;
+			x = ox + t2 * dx;
+			y = oy + t2 * dy;
+			if((x*x + y*y) < rsq)
+				return 0;
+		}
+	}
+
+	/*
+	 * Note: All of the (dx^2 + dy^2 + dz^2) parts of the "t" equation are
+	 * equal to one because the ray direction vector is normalized.
+	 */
+	c3 += tor->dr; /* Add on the pre-computed (R^2 - r^2) constant. */
+
+	c[4] = 1.0;
+	c[3] = 4.0 * c1;
+	c[2] = 2.0 * c3 + 4.0 * (c1 * c1 - tor->R2 * (1.0 - dz * dz));
+	c[1] = 4.0 * c1 * c3 - 8.0 * tor->R2 * c0;
+	c[0] = c3 * c3 - 4.0 * tor->R2 * c2;
+
+	if (tor->solver == SOLVER_STURM)
+		return SolvePolySturm(c, t, 4, lo, hi);
+	return SolvePoly(c, t, 4, ct.tmin, ct.tmax);
+}
+
+
 int IntersectTorus(Object *obj, HitData *hits)
 {
 	TorusData *tor;
-	double c[5];  /* Coeffs for quartic in "t". */
 	double t[4];  /* The roots (up to 4 "t" values). */
 	double ox, oy, oz ,dx, dy, dz;  /* Transformed ray origin & direction. */
 	double c0, c1, c2, c3; /* Constants for the "t" equation. */
+	double t1, t2;  /* Bounding sphere hits. */
 	int nhits;
 	Vec3 B, D;
 	double ray_scale;
@@ -121,7 +182,7 @@ int IntersectTorus(Object *obj, HitData *hits)
 
 	/* Check bounds... */
 	{
-		double t1, t2, b, c, d, z1, z2;
+		double b, c, d, z1, z2;
 
 		/* Does ray hit sphere containing torus? */
 		b = 2.0 * c1;
@@ -144,46 +205,10 @@ int IntersectTorus(Object *obj, HitData *hits)
 		if((z1 > tor->r && z2 > tor->r) ||
 			 (z1 < -tor->r && z2 < -tor->r))
 			return 0;
-
-		/*
-		 * If the minor radius is less than the major radius, the torus
-		 * has a hole. Get ray intersections with the plane pair and see
-		 * if both hits are within the inner diameter of the hole.
-		 * If so, return a miss.
-		 */
-		if (tor->r < tor->R && dz > EPSILON)
-		{
-			double x, y, rsq;
-
-			t1 = (tor->r - oz) / dz;
-			x = ox + t1 * dx;
-			y = oy + t1 * dy;
-			rsq = tor->R - tor->r;
-			rsq = rsq * rsq;
-			if((x*x + y*y) < rsq)
-			{
-				t2 = (-tor->r - oz) / dz;
-				x = ox + t2 * dx;
-				y = oy + t2 * dy;
-				if((x*x + y*y) < rsq)
-        	return 0;
-			}
-		}
 	}
 
-	/*
-	 * Note: All of the (dx^2 + dy^2 + dz^2) parts of the "t" equation are
-	 * equal to one because the ray direction vector is normalized.
-	 */
-	c3 += tor->dr; /* Add on the pre-computed (R^2 - r^2) constant. */
-
-	c[4] = 1.0;
-	c[3] = 4.0 * c1;
-	c[2] = 2.0 * c3 + 4.0 * (c1 * c1 - tor->R2 * (1.0 - dz * dz));
-	c[1] = 4.0 * c1 * c3 - 8.0 * tor->R2 * c0;
-	c[0] = c3 * c3 - 4.0 * tor->R2 * c2;
-
-	nhits = SolvePoly(c, t, 4, ct.tmin, ct.tmax);
+	nhits = SolveTorus(tor, ox, oy, oz, dx, dy, dz, c0, c1, c2, c3,
+		t1, t2, t);
 	if (nhits > 0)
 	{
 		int i;
@@ -479,3 +504,418 @@ void DrawTorus(Object *obj)
 		}
 	}
 }
+
+
+/*************************************************************************
+*
+*  Torus batches.
+*
+*  Tori in the same bounding tree leaf are tested together. The ray is
+*  taken in to every torus' coordinate system and culled against the
+*  bounding spheres and slabs in one pass over the batch arrays, which
+*  the compiler can vectorize. The survivors that miss the holes then
+*  have their quartics solved together by SolveQuarticN(), except for
+*  tori using the Sturm solver, which are solved one at a time.
+*  Hits are reported on the tori themselves, so the batch never shows
+*  up as the object hit.
+*
+*************************************************************************/
+
+static int IntersectTorusBatch(Object *obj, HitData *hits);
+static void CalcNormalTorusBatch(Object *obj, Vec3 *P, Vec3 *N);
+static int IsInsideTorusBatch(Object *obj, Vec3 *P);
+static void CalcUVMapTorusBatch(Object *obj, Vec3 *P, double *u, double *v);
+static void CalcExtentsTorusBatch(Object *obj, Vec3 *omin, Vec3 *omax);
+static void TransformTorusBatch(Object *obj, Vec3 *params, int type);
+static void CopyTorusBatch(Object *destobj, Object *srcobj);
+static void DeleteTorusBatch(Object *obj);
+static void DrawTorusBatch(Object *obj);
+
+static ObjectProcs torusbatch_procs =
+{
+	OBJ_TORUSBATCH,
+	IntersectTorusBatch,
+	CalcNormalTorusBatch,
+	IsInsideTorusBatch,
+	CalcUVMapTorusBatch,
+	CalcExtentsTorusBatch,
+	TransformTorusBatch,
+	CopyTorusBatch,
+	DeleteTorusBatch,
+	DrawTorusBatch
+};
+
+
+static void SetTorusBatch(TorusBatchData *tb)
+{
+	Object *o;
+	TorusData *tor;
+	double d;
+	int i, k;
+
+	for (i = 0, o = tb->objects; o != NULL; i++, o = o->next)
+	{
+		assert(i < TORUS_BATCH_MAX);
+		tor = o->data.torus;
+		tb->obj[i] = o;
+		tb->xform[i] = (o->T != NULL) ? 1.0 : 0.0;
+		for (k = 0; k < 12; k++)
+			tb->I[k][i] = (o->T != NULL) ? o->T->I.e[k / 3][k % 3] :
+				((k / 3 == k % 3) ? 1.0 : 0.0);
+		tb->lx[i] = tor->loc.x;
+		tb->ly[i] = tor->loc.y;
+		tb->lz[i] = tor->loc.z;
+		tb->r[i] = tor->r;
+		tb->R2[i] = tor->R2;
+		tb->dr[i] = tor->dr;
+		d = tor->R - tor->r;
+		tb->hole_rsq[i] = (tor->r < tor->R) ? d * d : 0.0;
+		tb->bound_rsq[i] = tor->bound_rsq;
+	}
+	tb->n = i;
+}
+
+
+/*
+ * Make a batch of the list of tori "tori", which must have no more
+ * than TORUS_BATCH_MAX members.
+ */
+Object *Ray_MakeTorusBatch(Object *tori)
+{
+	Object *obj = NewObject();
+	if (obj != NULL)
+	{
+		TorusBatchData *tb = (TorusBatchData *)Malloc(sizeof(TorusBatchData));
+		if (tb != NULL)
+		{
+			tb->objects = tori;
+			SetTorusBatch(tb);
+			obj->data.torusbatch = tb;
+			obj->procs = &torusbatch_procs;
+		}
+		else
+			obj = Ray_DeleteObject(obj);
+	}
+
+	return obj;
+}
+
+
+int IntersectTorusBatch(Object *obj, HitData *hits)
+{
+	TorusBatchData *tb = obj->data.torusbatch;
+	double ox[TORUS_BATCH_MAX], oy[TORUS_BATCH_MAX], oz[TORUS_BATCH_MAX];
+	double dx[TORUS_BATCH_MAX], dy[TORUS_BATCH_MAX], dz[TORUS_BATCH_MAX];
+	double ray_scale[TORUS_BATCH_MAX];
+	double t1[TORUS_BATCH_MAX], t2[TORUS_BATCH_MAX];
+	double live[TORUS_BATCH_MAX];
+	double q0[TORUS_BATCH_MAX], q1[TORUS_BATCH_MAX];
+	double q2[TORUS_BATCH_MAX], q3[TORUS_BATCH_MAX];
+	double qlo[TORUS_BATCH_MAX], qhi[TORUS_BATCH_MAX];
+	double t[TORUS_BATCH_MAX][4], qt[TORUS_BATCH_MAX][4], c[5];
+	double bx, by, bz, ex, ey, ez, b, d, z1, z2, x, y, hz, lo, hi;
+	double c0, c1, c2, c3, k0, k1, k2, k3;
+	double closest_t = HUGE;
+	Object *closest_obj = NULL, *o;
+	HitData *h = hits;
+	int nt[TORUS_BATCH_MAX], qn[TORUS_BATCH_MAX], qi[TORUS_BATCH_MAX];
+	int i, j, n, m, nhits, closest_entering = 0;
+
+	/*
+	 * Set up and cull the ray for every torus in the batch. This is the same arithmetic as IntersectTorus() and
+	 * SolveTorus(); an identity transform leaves the ray bit for bit
+	 * unchanged. Everything here is a double and conditions are selects
+	 * rather than branches, so the loop can be vectorized when the
+	 * compiler is allowed to ignore floating point exceptions
+	 * (e.g. -fno-trapping-math -fno-math-errno).
+	 */
+	for (i = 0; i < tb->n; i++)
+	{
+		bx = ct.B.x * tb->I[0][i] + ct.B.y * tb->I[3][i] + ct.B.z * tb->I[6][i] + tb->I[9][i];
+		by = ct.B.x * tb->I[1][i] + ct.B.y * tb->I[4][i] + ct.B.z * tb->I[7][i] + tb->I[10][i];
+		bz = ct.B.x * tb->I[2][i] + ct.B.y * tb->I[5][i] + ct.B.z * tb->I[8][i] + tb->I[11][i];
+		ex = ct.D.x * tb->I[0][i] + ct.D.y * tb->I[3][i] + ct.D.z * tb->I[6][i];
+		ey = ct.D.x * tb->I[1][i] + ct.D.y * tb->I[4][i] + ct.D.z * tb->I[7][i];
+		ez = ct.D.x * tb->I[2][i] + ct.D.y * tb->I[5][i] + ct.D.z * tb->I[8][i];
+		d = sqrt(ex * ex + ey * ey + ez * ez);
+		d = (tb->xform[i] != 0.0) ? d : 1.0;
+		live[i] = (d < EPSILON) ? 0.0 : 1.0;
+		ray_scale[i] = (d < EPSILON) ? 1.0 : d;
+		dx[i] = ex / ray_scale[i];
+		dy[i] = ey / ray_scale[i];
+		dz[i] = ez / ray_scale[i];
+		ox[i] = bx - tb->lx[i];
+		oy[i] = by - tb->ly[i];
+		oz[i] = bz - tb->lz[i];
+
+		/* Does ray hit sphere containing torus? */
+		c1 = dx[i] * ox[i] + dy[i] * oy[i] + dz[i] * oz[i];
+		c3 = ox[i] * ox[i] + oy[i] * oy[i] + oz[i] * oz[i];
+		b = 2.0 * c1;
+		d = b * b - (c3 - tb->bound_rsq[i]) * 4.0;
+		live[i] = (d < EPSILON) ? 0.0 : live[i];
+		d = (d > 0.0) ? d : 0.0;
+		d = sqrt(d);
+		t1[i] = (-b + d) / 2.0;
+		t2[i] = (-b - d) / 2.0;
+		live[i] = (((t1[i] < ct.tmin) & (t2[i] < ct.tmin)) |
+			((t1[i] > ct.tmax) & (t2[i] > ct.tmax))) ? 0.0 : live[i];
+
+		/* Do hits on sphere straddle one or both planes containing torus? */
+		z1 = oz[i] + t1[i] * dz[i];
+		z2 = oz[i] + t2[i] * dz[i];
+		live[i] = (((z1 > tb->r[i]) & (z2 > tb->r[i])) |
+			((z1 < -tb->r[i]) & (z2 < -tb->r[i]))) ? 0.0 : live[i];
+	}
+
+	/*
+	 * Make the quartics of the survivors, solving those for the Sturm
+	 * solver one at a time and gathering the rest to be solved together.
+	 */
+	m = 0;
+	for (i = 0; i < tb->n; i++)
+	{
+		nt[i] = 0;
+		o = tb->obj[i];
+		if (skip_object(o))
+			continue;
+		ray_torus_tests++;
+		if (live[i] == 0.0)
+			continue;
+
+		/* Does the ray go through the hole at both planes? */
+		if (tb->hole_rsq[i] > 0.0 && dz[i] > EPSILON)
+		{
+			hz = (tb->r[i] - oz[i]) / dz[i];
+			x = ox[i] + hz * dx[i];
+			y = oy[i] + hz * dy[i];
+			if (x * x + y * y < tb->hole_rsq[i])
+			{
+				hz = (-tb->r[i] - oz[i]) / dz[i];
+				x = ox[i] + hz * dx[i];
+				y = oy[i] + hz * dy[i];
+				if (x * x + y * y < tb->hole_rsq[i])
+					continue;
+			}
+		}
+
+		/* The monic quartic in "t". */
+		c0 = dx[i] * ox[i] + dy[i] * oy[i];
+		c1 = c0 + dz[i] * oz[i];
+		c2 = ox[i] * ox[i] + oy[i] * oy[i];
+		c3 = c2 + oz[i] * oz[i] + tb->dr[i];
+		k3 = 4.0 * c1;
+		k2 = 2.0 * c3 + 4.0 * (c1 * c1 - tb->R2[i] * (1.0 - dz[i] * dz[i]));
+		k1 = 4.0 * c1 * c3 - 8.0 * tb->R2[i] * c0;
+		k0 = c3 * c3 - 4.0 * tb->R2[i] * c2;
+
+		if (o->data.torus->solver == SOLVER_STURM)
+		{
+			/* All roots lie within the bounding sphere hits. */
+			lo = (t2[i] - EPSILON > ct.tmin) ? t2[i] - EPSILON : ct.tmin;
+			hi = (t1[i] + EPSILON < ct.tmax) ? t1[i] + EPSILON : ct.tmax;
+			c[0] = k0;
+			c[1] = k1;
+			c[2] = k2;
+			c[3] = k3;
+			c[4] = 1.0;
+			nt[i] = SolvePolySturm(c, t[i], 4, lo, hi);
+			continue;
+		}
+
+		qi[m] = i;
+		q0[m] = k0;
+		q1[m] = k1;
+		q2[m] = k2;
+		q3[m] = k3;
+		qlo[m] = ct.tmin;
+		qhi[m] = ct.tmax;
+		m++;
+	}
+	if (m > 0)
+	{
+		/* Solve the gathered quartics and scatter their roots back. */
+		SolveQuarticN(q0, q1, q2, q3, m, qlo, qhi, qt, qn);
+		for (j = 0; j < m; j++)
+		{
+			nt[qi[j]] = qn[j];
+			memcpy(t[qi[j]], qt[j], qn[j] * sizeof(double));
+		}
+	}
+
+	nhits = 0;
+	for (i = 0; i < tb->n; i++)
+	{
+		n = nt[i];
+		if (n == 0)
+			continue;
+		o = tb->obj[i];
+		ray_torus_hits++;
+
+		if (!ct.calc_all)
+		{
+			/* Only the closest hit is wanted. */
+			if (t[i][0] / ray_scale[i] < closest_t)
+			{
+				closest_t = t[i][0] / ray_scale[i];
+				closest_obj = o;
+				closest_entering = ((n & 1) == 0);
+			}
+			continue;
+		}
+
+		for (j = 0; j < n; j++)
+		{
+			if (nhits++ > 0)
+				h = GetNextHit(h);
+			h->t = t[i][j] / ray_scale[i];
+			h->obj = o;
+			h->entering = (((n - j) & 1) == 0);
+		}
+	}
+
+	if (closest_obj != NULL)
+	{
+		hits->t = closest_t;
+		hits->obj = closest_obj;
+		hits->entering = closest_entering;
+		return 1;
+	}
+
+	SortHits(hits, nhits);
+	return nhits;
+}
+
+
+/* Hits are reported on the tori, so this is never called. */
+/*
+ * Hits on a batch are reported on its tori, so normals and uv maps are
+ * only asked of the batch from outside the ray tracer. Hand those to the
+ * torus whose surface is nearest P.
+ */
+static Object *NearestTorus(Object *obj, Vec3 *P)
+{
+	Object *o, *best;
+	TorusData *tor;
+	Vec3 P2;
+	double px, py, pz, d, bestd;
+
+	best = obj->data.torusbatch->objects;
+	bestd = HUGE;
+	for (o = best; o != NULL; o = o->next)
+	{
+		tor = o->data.torus;
+		V3Copy(&P2, P);
+		if (o->T != NULL)
+			PointToObject(&P2, o->T);
+		px = P2.x - tor->loc.x;
+		py = P2.y - tor->loc.y;
+		pz = P2.z - tor->loc.z;
+		d = sqrt(px * px + py * py) - tor->R;
+		d = fabs(sqrt(d * d + pz * pz) - tor->r);
+		if (d < bestd)
+		{
+			bestd = d;
+			best = o;
+		}
+	}
+	return best;
+}
+
+
+void CalcNormalTorusBatch(Object *obj, Vec3 *P, Vec3 *N)
+{
+	Object *o = NearestTorus(obj, P);
+
+	o->procs->CalcNormal(o, P, N);
+}
+
+
+void CalcUVMapTorusBatch(Object *obj, Vec3 *P, double *u, double *v)
+{
+	Object *o = NearestTorus(obj, P);
+
+	o->procs->CalcUVMap(o, P, u, v);
+}
+
+
+int IsInsideTorusBatch(Object *obj, Vec3 *P)
+{
+	Object *o;
+
+	for (o = obj->data.torusbatch->objects; o != NULL; o = o->next)
+		if (o->procs->IsInside(o, P))
+			return 1;
+	return 0;
+}
+
+
+void CalcExtentsTorusBatch(Object *obj, Vec3 *omin, Vec3 *omax)
+{
+	Object *o = obj->data.torusbatch->objects;
+	Vec3 bmin, bmax;
+
+	o->procs->CalcExtents(o, omin, omax);
+	for (o = o->next; o != NULL; o = o->next)
+	{
+		o->procs->CalcExtents(o, &bmin, &bmax);
+		omin->x = fmin(omin->x, bmin.x);
+		omax->x = fmax(omax->x, bmax.x);
+		omin->y = fmin(omin->y, bmin.y);
+		omax->y = fmax(omax->y, bmax.y);
+		omin->z = fmin(omin->z, bmin.z);
+		omax->z = fmax(omax->z, bmax.z);
+	}
+}
+
+
+void TransformTorusBatch(Object *obj, Vec3 *params, int type)
+{
+	Object *o;
+
+	for (o = obj->data.torusbatch->objects; o != NULL; o = o->next)
+		Ray_Transform_Object(o, params, type);
+	SetTorusBatch(obj->data.torusbatch);
+}
+
+
+void CopyTorusBatch(Object *destobj, Object *srcobj)
+{
+	TorusBatchData *tb = (TorusBatchData *)Malloc(sizeof(TorusBatchData));
+	Object *o, *last = NULL;
+
+	tb->objects = NULL;
+	for (o = srcobj->data.torusbatch->objects; o != NULL; o = o->next)
+	{
+		if (last != NULL)
+			last = last->next = Ray_CloneObject(o);
+		else
+			last = tb->objects = Ray_CloneObject(o);
+	}
+	SetTorusBatch(tb);
+	destobj->data.torusbatch = tb;
+}
+
+
+void DeleteTorusBatch(Object *obj)
+{
+	TorusBatchData *tb = obj->data.torusbatch;
+	Object *o;
+
+	while (tb->objects != NULL)
+	{
+		o = tb->objects;
+		tb->objects = o->next;
+		Ray_DeleteObject(o);
+	}
+	Free(tb, sizeof(TorusBatchData));
+}
+
+
+void DrawTorusBatch(Object *obj)
+{
+	Object *o;
+
+	for (o = obj->data.torusbatch->objects; o != NULL; o = o->next)
+		o->procs->Draw(o);
+}
@@ -228,6 +228,123 @@ int Intersect_Box(Vec3 *B, Vec3 *D, Vec3 *bmin, Vec3 *bmax,
 	return 0;
 }
 
+
+/*
+ * Set up "r" for slab tests of the ray "B", "D". Axes the ray is
+ * parallel to, by the same test Intersect_Box() uses, get an infinite
+ * inverse; where the base point lies on such a slab plane the product is
+ * NaN, which the comparisons in the slab tests ignore, so the point
+ * counts as inside the slab, as it does in Intersect_Box().
+ */
+void SetupSlabRay(SlabRay *r, Vec3 *B, Vec3 *D)
+{
+	r->B = *B;
+	if(fabs(D->x) > EPSILON)
+		r->inv.x = 1.0 / D->x;
+	else
+		r->inv.x = (D->x < 0.0) ? -HUGE_VAL : HUGE_VAL;
+	if(fabs(D->y) > EPSILON)
+		r->inv.y = 1.0 / D->y;
+	else
+		r->inv.y = (D->y < 0.0) ? -HUGE_VAL : HUGE_VAL;
+	if(fabs(D->z) > EPSILON)
+		r->inv.z = 1.0 / D->z;
+	else
+		r->inv.z = (D->z < 0.0) ? -HUGE_VAL : HUGE_VAL;
+	r->sx = (r->inv.x < 0.0);
+	r->sy = (r->inv.y < 0.0);
+	r->sz = (r->inv.z < 0.0);
+}
+
+
+/*
+ * Branch free equivalent of Intersect_Box() for a ray set up by
+ * SetupSlabRay(). The sign bits pick the near and far plane of each
+ * slab, so there is no division and no min/max per axis.
+ */
+int IntersectSlabs(SlabRay *r, Vec3 *bmin, Vec3 *bmax,
+	double *T1, double *T2)
+{
+	double t1, t2, tn, tf;
+
+	t1 = ((r->sx ? bmax->x : bmin->x) - r->B.x) * r->inv.x;
+	t2 = ((r->sx ? bmin->x : bmax->x) - r->B.x) * r->inv.x;
+	t1 = (t1 == t1) ? t1 : -HUGE_VAL;
+	t2 = (t2 == t2) ? t2 : HUGE_VAL;
+	tn = ((r->sy ? bmax->y : bmin->y) - r->B.y) * r->inv.y;
+	tf = ((r->sy ? bmin->y : bmax->y) - r->B.y) * r->inv.y;
+	t1 = (tn > t1) ? tn : t1;
+	t2 = (tf < t2) ? tf : t2;
+	tn = ((r->sz ? bmax->z : bmin->z) - r->B.z) * r->inv.z;
+	tf = ((r->sz ? bmin->z : bmax->z) - r->B.z) * r->inv.z;
+	t1 = (tn > t1) ? tn : t1;
+	t2 = (tf < t2) ? tf : t2;
+
+	/* Empty, or behind ya. */
+	if(t1 < t2 && !(t2 < EPSILON))
+	{
+		*T1 = t1;
+		*T2 = t2;
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Slab test of up to SLAB_CHUNK boxes at once. "bounds" holds the boxes
+ * by field, min x, y, z then max x, y, z, each "stride" values apart.
+ * On return T1[i] and T2[i] are the entry and exit distances of box i,
+ * with T1[i] set to HUGE if the ray misses it. The loop has no branches
+ * and writes to local arrays, so the compiler can vectorize it over the
+ * boxes without checking the arguments for overlap.
+ */
+void IntersectSlabsN(SlabRay *r, double *bounds, int stride, int n,
+	double *T1, double *T2)
+{
+	double *xn, *xf, *yn, *yf, *zn, *zf;
+	double t1, t2, tn, tf, bx, by, bz, ix, iy, iz;
+	double lo[SLAB_CHUNK], hi[SLAB_CHUNK];
+	int i;
+
+	if(n > SLAB_CHUNK)
+		n = SLAB_CHUNK;
+
+	/* Near and far planes of each slab, from the signs of the ray. */
+	xn = bounds + (r->sx ? 3 : 0) * stride;
+	xf = bounds + (r->sx ? 0 : 3) * stride;
+	yn = bounds + (r->sy ? 4 : 1) * stride;
+	yf = bounds + (r->sy ? 1 : 4) * stride;
+	zn = bounds + (r->sz ? 5 : 2) * stride;
+	zf = bounds + (r->sz ? 2 : 5) * stride;
+	bx = r->B.x;
+	by = r->B.y;
+	bz = r->B.z;
+	ix = r->inv.x;
+	iy = r->inv.y;
+	iz = r->inv.z;
+
+	for(i = 0; i < n; i++)
+	{
+		t1 = (xn[i] - bx) * ix;
+		t2 = (xf[i] - bx) * ix;
+		t1 = (t1 == t1) ? t1 : -HUGE_VAL;
+		t2 = (t2 == t2) ? t2 : HUGE_VAL;
+		tn = (yn[i] - by) * iy;
+		tf = (yf[i] - by) * iy;
+		t1 = (tn > t1) ? tn : t1;
+		t2 = (tf < t2) ? tf : t2;
+		tn = (zn[i] - bz) * iz;
+		tf = (zf[i] - bz) * iz;
+		t1 = (tn > t1) ? tn : t1;
+		t2 = (tf < t2) ? tf : t2;
+		lo[i] = (t1 < t2 && !(t2 < EPSILON)) ? t1 : HUGE;
+		hi[i] = t2;
+	}
+	memcpy(T1, lo, n * sizeof(double));
+	memcpy(T2, hi, n * sizeof(double));
+}
+
 void CalcNormalBox(Object *obj, Vec3 *P, Vec3 *N)
 {
 	BoxData *box;
@@ -448,3 +565,354 @@ void DrawBox(Object *obj)
 	Move_To(2);
 	Line_To(6);
 }
+
+
+/*************************************************************************
+*
+*  Box batches.
+*
+*  Boxes in the same bounding tree leaf are tested together. The ray is
+*  taken in to every box's coordinate system and clipped against its
+*  slabs in one pass over the batch arrays, which the compiler can
+*  vectorize. Hits are reported on the boxes themselves, so the batch
+*  never shows up as the object hit.
+*
+*************************************************************************/
+
+static int IntersectBoxBatch(Object *obj, HitData *hits);
+static void CalcNormalBoxBatch(Object *obj, Vec3 *P, Vec3 *N);
+static int IsInsideBoxBatch(Object *obj, Vec3 *P);
+static void CalcUVMapBoxBatch(Object *obj, Vec3 *P, double *u, double *v);
+static void CalcExtentsBoxBatch(Object *obj, Vec3 *omin, Vec3 *omax);
+static void TransformBoxBatch(Object *obj, Vec3 *params, int type);
+static void CopyBoxBatch(Object *destobj, Object *srcobj);
+static void DeleteBoxBatch(Object *obj);
+static void DrawBoxBatch(Object *obj);
+
+static ObjectProcs boxbatch_procs =
+{
+	OBJ_BOXBATCH,
+	IntersectBoxBatch,
+	CalcNormalBoxBatch,
+	IsInsideBoxBatch,
+	CalcUVMapBoxBatch,
+	CalcExtentsBoxBatch,
+	TransformBoxBatch,
+	CopyBoxBatch,
+	DeleteBoxBatch,
+	DrawBoxBatch
+};
+
+
+static void SetBoxBatch(BoxBatchData *bb)
+{
+	Object *o;
+	BoxData *box;
+	int i, k;
+
+	for(i = 0, o = bb->objects; o != NULL; i++, o = o->next)
+	{
+		assert(i < BOX_BATCH_MAX);
+		box = o->data.box;
+		bb->obj[i] = o;
+		for(k = 0; k < 12; k++)
+			bb->I[k][i] = (o->T != NULL) ? o->T->I.e[k / 3][k % 3] :
+				((k / 3 == k % 3) ? 1.0 : 0.0);
+		bb->x1[i] = box->x1;
+		bb->y1[i] = box->y1;
+		bb->z1[i] = box->z1;
+		bb->x2[i] = box->x2;
+		bb->y2[i] = box->y2;
+		bb->z2[i] = box->z2;
+	}
+	bb->n = i;
+}
+
+
+/*
+ * Make a batch of the list of boxes "boxes", which must have no more
+ * than BOX_BATCH_MAX members.
+ */
+Object *Ray_MakeBoxBatch(Object *boxes)
+{
+	Object *obj = NewObject();
+	if(obj != NULL)
+	{
+		BoxBatchData *bb = (BoxBatchData *)Malloc(sizeof(BoxBatchData));
+		if(bb != NULL)
+		{
+			bb->objects = boxes;
+			SetBoxBatch(bb);
+			obj->data.boxbatch = bb;
+			obj->procs = &boxbatch_procs;
+		}
+		else
+			obj = Ray_DeleteObject(obj);
+	}
+
+	return obj;
+}
+
+
+int IntersectBoxBatch(Object *obj, HitData *hits)
+{
+	BoxBatchData *bb = obj->data.boxbatch;
+	double t1[BOX_BATCH_MAX], t2[BOX_BATCH_MAX];
+	double live[BOX_BATCH_MAX];
+	double bx, by, bz, dx, dy, dz, hd, lo, hi, tn, tf, a1, a2;
+	double t, closest_t = HUGE;
+	Object *closest_obj = NULL, *o;
+	HitData *h = hits;
+	int i, inverse, entering, both, nhits, closest_entering = 0;
+
+	/*
+	 * Clip the ray to the slabs of every box in the batch. This is the
+	 * same arithmetic as Intersect_Box(), with conditions turned in to
+	 * selects so the loop is free of branches and can be vectorized
+	 * when the compiler may ignore floating point exceptions
+	 * (e.g. -fno-trapping-math -fno-math-errno). An axis the ray is
+	 * parallel to divides by one and only tests the base point.
+	 */
+	for(i = 0; i < bb->n; i++)
+	{
+		bx = ct.B.x * bb->I[0][i] + ct.B.y * bb->I[3][i] + ct.B.z * bb->I[6][i] + bb->I[9][i];
+		by = ct.B.x * bb->I[1][i] + ct.B.y * bb->I[4][i] + ct.B.z * bb->I[7][i] + bb->I[10][i];
+		bz = ct.B.x * bb->I[2][i] + ct.B.y * bb->I[5][i] + ct.B.z * bb->I[8][i] + bb->I[11][i];
+		dx = ct.D.x * bb->I[0][i] + ct.D.y * bb->I[3][i] + ct.D.z * bb->I[6][i];
+		dy = ct.D.x * bb->I[1][i] + ct.D.y * bb->I[4][i] + ct.D.z * bb->I[7][i];
+		dz = ct.D.x * bb->I[2][i] + ct.D.y * bb->I[5][i] + ct.D.z * bb->I[8][i];
+
+		hd = (fabs(dx) > EPSILON) ? dx : 1.0;
+		a1 = (bb->x1[i] - bx) / hd;
+		a2 = (bb->x2[i] - bx) / hd;
+		live[i] = (fabs(dx) > EPSILON) ?
+			!((a1 < EPSILON) & (a2 < EPSILON)) :
+			!((bx < bb->x1[i]) | (bx > bb->x2[i]));
+		lo = (fabs(dx) > EPSILON) ? ((a1 < a2) ? a1 : a2) : -HUGE;
+		hi = (fabs(dx) > EPSILON) ? ((a1 > a2) ? a1 : a2) : HUGE;
+
+		hd = (fabs(dy) > EPSILON) ? dy : 1.0;
+		a1 = (bb->y1[i] - by) / hd;
+		a2 = (bb->y2[i] - by) / hd;
+		live[i] = ((fabs(dy) > EPSILON) ?
+			!((a1 < EPSILON) & (a2 < EPSILON)) :
+			!((by < bb->y1[i]) | (by > bb->y2[i]))) ? live[i] : 0.0;
+		tn = (fabs(dy) > EPSILON) ? ((a1 < a2) ? a1 : a2) : -HUGE;
+		tf = (fabs(dy) > EPSILON) ? ((a1 > a2) ? a1 : a2) : HUGE;
+		lo = (tn > lo) ? tn : lo;
+		hi = (tf < hi) ? tf : hi;
+
+		hd = (fabs(dz) > EPSILON) ? dz : 1.0;
+		a1 = (bb->z1[i] - bz) / hd;
+		a2 = (bb->z2[i] - bz) / hd;
+		live[i] = ((fabs(dz) > EPSILON) ?
+			!((a1 < EPSILON) & (a2 < EPSILON)) :
+			!((bz < bb->z1[i]) | (bz > bb->z2[i]))) ? live[i] : 0.0;
+		tn = (fabs(dz) > EPSILON) ? ((a1 < a2) ? a1 : a2) : -HUGE;
+		tf = (fabs(dz) > EPSILON) ? ((a1 > a2) ? a1 : a2) : HUGE;
+		lo = (tn > lo) ? tn : lo;
+		hi = (tf < hi) ? tf : hi;
+
+		live[i] = (lo < hi) ? live[i] : 0.0;
+		live[i] = ((hi > ct.tmin) & (lo < ct.tmax)) ? live[i] : 0.0;
+		t1[i] = lo;
+		t2[i] = hi;
+	}
+
+	/* Report the hits. */
+	nhits = 0;
+	for(i = 0; i < bb->n; i++)
+	{
+		o = bb->obj[i];
+		if(skip_object(o))
+			continue;
+		ray_box_tests++;
+		if(live[i] == 0.0)
+			continue;
+
+		inverse = (o->flags & OBJ_FLAG_INVERSE);
+		if(t1[i] > ct.tmin)
+		{
+			t = t1[i];
+			entering = !inverse;
+			both = (t2[i] < ct.tmax);
+		}
+		else if(t2[i] < ct.tmax)
+		{
+			t = t2[i];
+			entering = inverse;
+			both = 0;
+		}
+		else
+			continue;
+		ray_box_hits++;
+
+		if(!ct.calc_all)
+		{
+			/* Only the closest hit is wanted. */
+			if(t < closest_t)
+			{
+				closest_t = t;
+				closest_obj = o;
+				closest_entering = entering;
+			}
+			continue;
+		}
+
+		if(nhits++ > 0)
+			h = GetNextHit(h);
+		h->t = t;
+		h->obj = o;
+		h->entering = entering;
+		if(both)
+		{
+			nhits++;
+			h = GetNextHit(h);
+			h->t = t2[i];
+			h->obj = o;
+			h->entering = inverse;
+		}
+	}
+
+	if(closest_obj != NULL)
+	{
+		hits->t = closest_t;
+		hits->obj = closest_obj;
+		hits->entering = closest_entering;
+		return 1;
+	}
+
+	SortHits(hits, nhits);
+	return nhits;
+}
+
+
+/*
+ * Hits on a batch are reported on its boxes, so normals and uv maps are
+ * only asked of the batch from outside the ray tracer. Hand those to the
+ * box whose surface is nearest P, going by the farthest slab distance.
+ */
+static Object *NearestBox(Object *obj, Vec3 *P)
+{
+	Object *o, *best;
+	BoxData *box;
+	Vec3 Pt;
+	double d, bestd;
+
+	best = obj->data.boxbatch->objects;
+	bestd = HUGE;
+	for(o = best; o != NULL; o = o->next)
+	{
+		box = o->data.box;
+		Pt = *P;
+		if(o->T != NULL)
+			PointToObject(&Pt, o->T);
+		d = fmax(box->x1 - Pt.x, Pt.x - box->x2);
+		d = fmax(d, fmax(box->y1 - Pt.y, Pt.y - box->y2));
+		d = fabs(fmax(d, fmax(box->z1 - Pt.z, Pt.z - box->z2)));
+		if(d < bestd)
+		{
+			bestd = d;
+			best = o;
+		}
+	}
+	return best;
+}
+
+
+void CalcNormalBoxBatch(Object *obj, Vec3 *P, Vec3 *N)
+{
+	Object *o = NearestBox(obj, P);
+
+	o->procs->CalcNormal(o, P, N);
+}
+
+
+void CalcUVMapBoxBatch(Object *obj, Vec3 *P, double *u, double *v)
+{
+	Object *o = NearestBox(obj, P);
+
+	o->procs->CalcUVMap(o, P, u, v);
+}
+
+
+int IsInsideBoxBatch(Object *obj, Vec3 *P)
+{
+	Object *o;
+
+	for(o = obj->data.boxbatch->objects; o != NULL; o = o->next)
+		if(o->procs->IsInside(o, P))
+			return 1;
+	return 0;
+}
+
+
+void CalcExtentsBoxBatch(Object *obj, Vec3 *omin, Vec3 *omax)
+{
+	Object *o = obj->data.boxbatch->objects;
+	Vec3 bmin, bmax;
+
+	o->procs->CalcExtents(o, omin, omax);
+	for(o = o->next; o != NULL; o = o->next)
+	{
+		o->procs->CalcExtents(o, &bmin, &bmax);
+		omin->x = fmin(omin->x, bmin.x);
+		omax->x = fmax(omax->x, bmax.x);
+		omin->y = fmin(omin->y, bmin.y);
+		omax->y = fmax(omax->y, bmax.y);
+		omin->z = fmin(omin->z, bmin.z);
+		omax->z = fmax(omax->z, bmax.z);
+	}
+}
+
+
+void TransformBoxBatch(Object *obj, Vec3 *params, int type)
+{
+	Object *o;
+
+	for(o = obj->data.boxbatch->objects; o != NULL; o = o->next)
+		Ray_Transform_Object(o, params, type);
+	SetBoxBatch(obj->data.boxbatch);
+}
+
+
+void CopyBoxBatch(Object *destobj, Object *srcobj)
+{
+	BoxBatchData *bb = (BoxBatchData *)Malloc(sizeof(BoxBatchData));
+	Object *o, *last = NULL;
+
+	bb->objects = NULL;
+	for(o = srcobj->data.boxbatch->objects; o != NULL; o = o->next)
+	{
+		if(last != NULL)
+			last = last->next = Ray_CloneObject(o);
+		else
+			last = bb->objects = Ray_CloneObject(o);
+	}
+	SetBoxBatch(bb);
+	destobj->data.boxbatch = bb;
+}
+
+
+void DeleteBoxBatch(Object *obj)
+{
+	BoxBatchData *bb = obj->data.boxbatch;
+	Object *o;
+
+	while(bb->objects != NULL)
+	{
+		o = bb->objects;
+		bb->objects = o->next;
+		Ray_DeleteObject(o);
+	}
+	Free(bb, sizeof(BoxBatchData));
+}
+
+
+void DrawBoxBatch(Object *obj)
+{
+	Object *o;
+
+	for(o = obj->data.boxbatch->objects; o != NULL; o = o->next)
+		o->procs->Draw(o);
+}
@@ -14,8 +14,12 @@
  */
 /* Ptr to function expression used by root polishing routines. */
 static VMExpr *fn_expr;
+/* True if fn_expr can be evaluated with its analytic gradient. */
+static int fn_has_grad;
 /* Transformed ray base and direction vectors. */
 static Vec3 B, D;
+/* Ray step sizes for root search along each axis, smallest first. */
+static double fn_sa, fn_sb, fn_sc;
 
 /* Tolerance for root (t) accuracy. */
 #define FN_RELERROR    1e-10
@@ -23,6 +27,12 @@ static Vec3 B, D;
 #define FN_MAXIT       800
 
 static int find_root(double a, double b, double *val);
+static void SampleNormalFnxyz(Object *obj, Vec3 *P, Vec3 *N);
+static void BuildFnxyzGrid(FnxyzData *imp, Vec3 *nsteps, double max_slope);
+static void search_grid(Object *obj, FnxyzData *imp, double lo, double hi,
+	HitData **hits, int *nhits);
+static int search_span(Object *obj, double lo, double hi,
+	HitData **hits, int *nhits);
 
 /* Distance from point hit to side of sample box for normal calculation. */
 #define FN_OFFSET       0.01
@@ -57,7 +67,8 @@ static ObjectProcs fnxyz_procs =
 };
 
 
-Object *Ray_MakeFnxyz(VMExpr *expr, Vec3 *bmin, Vec3 *bmax, Vec3 *steps)
+Object *Ray_MakeFnxyz(VMExpr *expr, Vec3 *bmin, Vec3 *bmax, Vec3 *steps,
+	double max_slope)
 {
 	Object *obj = NewObject();
 	if(obj != NULL)
@@ -66,11 +77,16 @@ Object *Ray_MakeFnxyz(VMExpr *expr, Vec3 *bmin, Vec3 *bmax, Vec3 *steps)
 		if(imp != NULL)
 		{
 			double t;
+			Vec3 nsteps;
 
 			imp->nrefs = 1;
+			imp->grid = NULL;
+			imp->gridsize = 0;
 			/* The function (required!). */
 			assert(expr != NULL);
 			imp->fn = expr;
+			/* Use analytic normals and Newton steps if fn allows it. */
+			imp->has_grad = vm_prepare_evalgrad(expr);
 			/* Bounds of area in which to search. */
 			if(bmin != NULL)
 				V3Copy(&imp->bmin, bmin);
@@ -102,12 +118,19 @@ Object *Ray_MakeFnxyz(VMExpr *expr, Vec3 *bmin, Vec3 *bmax, Vec3 *steps)
 				{ t = imp->bmin.z; imp->bmin.z = imp->bmax.z; imp->bmax.z = t; }
 
 			if(imp->xinc < 1.0) imp->xinc = 1.0;
+			nsteps.x = imp->xinc;
 			imp->xinc = (imp->bmax.x - imp->bmin.x) / imp->xinc;
 			if(imp->yinc < 1.0) imp->yinc = 1.0;
+			nsteps.y = imp->yinc;
 			imp->yinc = (imp->bmax.y - imp->bmin.y) / imp->yinc;
 			if(imp->zinc < 1.0) imp->zinc = 1.0;
+			nsteps.z = imp->zinc;
 			imp->zinc = (imp->bmax.z - imp->bmin.z) / imp->zinc;
 
+			/* Mark the parts of the search box the surface may pass through. */
+			if(max_slope > 0.0)
+				BuildFnxyzGrid(imp, &nsteps, max_slope);
+
 	  	obj->data.fnxyz = imp;
   		obj->procs = &fnxyz_procs;
 		}
@@ -118,6 +141,118 @@ Object *Ray_MakeFnxyz(VMExpr *expr, Vec3 *bmin, Vec3 *bmax, Vec3 *steps)
 }
 
 
+/*
+ * Sample the function at the corners of a coarse grid of cells over
+ * the search box and set a bit for each cell that may contain part of
+ * the surface. Every point of a cell is within half its diagonal of a
+ * corner, so with fn's slope never above max_slope a cell whose corners
+ * all have the same sign, and are all further than max_slope times half
+ * the diagonal from zero, cannot hold a root.
+ */
+static void BuildFnxyzGrid(FnxyzData *imp, Vec3 *nsteps, double max_slope)
+{
+	int nx, ny, nz, nvx, nvy, nvz, i, j, k, c;
+	size_t nverts, vsize, n;
+	double *vals, f, fmin, fmax, amin, reach;
+	Vec3 Ptmp;
+	unsigned char *grid;
+
+	nx = (nsteps->x < (double)FNXYZ_GRID_MAX) ? (int)nsteps->x : FNXYZ_GRID_MAX;
+	ny = (nsteps->y < (double)FNXYZ_GRID_MAX) ? (int)nsteps->y : FNXYZ_GRID_MAX;
+	nz = (nsteps->z < (double)FNXYZ_GRID_MAX) ? (int)nsteps->z : FNXYZ_GRID_MAX;
+	if(nx < 1) nx = 1;
+	if(ny < 1) ny = 1;
+	if(nz < 1) nz = 1;
+
+	imp->cell.x = (imp->bmax.x - imp->bmin.x) / (double)nx;
+	imp->cell.y = (imp->bmax.y - imp->bmin.y) / (double)ny;
+	imp->cell.z = (imp->bmax.z - imp->bmin.z) / (double)nz;
+	if(imp->cell.x < EPSILON || imp->cell.y < EPSILON || imp->cell.z < EPSILON)
+		return;
+
+	nvx = nx + 1;
+	nvy = ny + 1;
+	nvz = nz + 1;
+	nverts = (size_t)nvx * nvy * nvz;
+	vsize = nverts * sizeof(double);
+	vals = (double *)Malloc(vsize);
+	imp->gridsize = ((size_t)nx * ny * nz + 7) / 8;
+	grid = (unsigned char *)Malloc(imp->gridsize);
+	if(vals == NULL || grid == NULL)
+	{
+		if(vals != NULL)
+			Free(vals, vsize);
+		if(grid != NULL)
+			Free(grid, imp->gridsize);
+		imp->gridsize = 0;
+		return;
+	}
+	memset(grid, 0, imp->gridsize);
+
+	/* Evaluate fn at each grid vertex. */
+	V3Copy(&Ptmp, &rt_O);
+	n = 0;
+	for(k = 0; k < nvz; k++)
+	{
+		rt_O.z = imp->bmin.z + imp->cell.z * k;
+		for(j = 0; j < nvy; j++)
+		{
+			for(i = 0; i < nvx; i++)
+			{
+				rt_O.x = imp->bmin.x + imp->cell.x * i;
+				rt_O.y = imp->bmin.y + imp->cell.y * j;
+				vals[n++] = vm_evaldouble(imp->fn);
+			}
+		}
+	}
+	V3Copy(&rt_O, &Ptmp);
+
+	reach = max_slope * 0.5 * sqrt(imp->cell.x * imp->cell.x +
+		imp->cell.y * imp->cell.y + imp->cell.z * imp->cell.z);
+
+	/* Classify each cell from its eight corners. */
+	n = 0;
+	for(k = 0; k < nz; k++)
+	{
+		for(j = 0; j < ny; j++)
+		{
+			for(i = 0; i < nx; i++, n++)
+			{
+				size_t v = ((size_t)k * nvy + j) * nvx + i;
+
+				fmin = fmax = vals[v];
+				for(c = 1; c < 8; c++)
+				{
+					f = vals[v + ((c & 1) ? 1 : 0) +
+						((c & 2) ? (size_t)nvx : 0) +
+						((c & 4) ? (size_t)nvx * nvy : 0)];
+					if(f != f)	/* NaN */
+					{
+						fmin = fmax = f;
+						break;
+					}
+					if(f < fmin) fmin = f;
+					if(f > fmax) fmax = f;
+				}
+
+				amin = (fmin > 0.0) ? fmin : -fmax;
+
+				/* Written so that a NaN anywhere keeps the cell. */
+				if(!((fmin > 0.0 || fmax < 0.0) && (amin > reach)))
+					grid[n >> 3] |= (unsigned char)(1 << (n & 7));
+			}
+		}
+	}
+
+	Free(vals, vsize);
+
+	imp->grid = grid;
+	imp->nx = nx;
+	imp->ny = ny;
+	imp->nz = nz;
+}
+
+
 int IntersectFnxyz(Object *obj, HitData *hits)
 {
 	FnxyzData *imp = obj->data.fnxyz;
@@ -148,11 +283,12 @@ int IntersectFnxyz(Object *obj, HitData *hits)
 		{
 			int i, nhits, ray_entering;
 			Vec3 Ptmp;
-			double p, t, sa, sb, sc, ta, tb, tc;
+			double t;
 			HitData *hitlist;
 
 			V3Copy(&Ptmp, &rt_O);
 			fn_expr = imp->fn;
+			fn_has_grad = imp->has_grad;
 			hitlist = hits;
 
 			/* Truncate parts of interval that are out of ray's bounds... */
@@ -161,53 +297,20 @@ int IntersectFnxyz(Object *obj, HitData *hits)
 			if(hi > ct.tmax)
 				hi = ct.tmax;
 
-			/* Slice interval into small steps and check each for a root... */
-			sa = (fabs(D.x) > EPSILON) ? fabs(imp->xinc / D.x) : HUGE;
-			sb = (fabs(D.y) > EPSILON) ? fabs(imp->yinc / D.y) : HUGE;
-			sc = (fabs(D.z) > EPSILON) ? fabs(imp->zinc / D.z) : HUGE;
-			if(sb > sc) { t = sb; sb = sc; sc = t; }
-			if(sa > sb) { t = sa; sa = sb; sb = t; }
-			if(sb > sc) { t = sb; sb = sc; sc = t; }
-			ta = lo + sa;
-			tb = lo + sb;
-			tc = lo + sc;
+			/* Step sizes along the ray for each axis, smallest first. */
+			fn_sa = (fabs(D.x) > EPSILON) ? fabs(imp->xinc / D.x) : HUGE;
+			fn_sb = (fabs(D.y) > EPSILON) ? fabs(imp->yinc / D.y) : HUGE;
+			fn_sc = (fabs(D.z) > EPSILON) ? fabs(imp->zinc / D.z) : HUGE;
+			if(fn_sb > fn_sc) { t = fn_sb; fn_sb = fn_sc; fn_sc = t; }
+			if(fn_sa > fn_sb) { t = fn_sa; fn_sa = fn_sb; fn_sb = t; }
+			if(fn_sb > fn_sc) { t = fn_sb; fn_sb = fn_sc; fn_sc = t; }
+
 			nhits = 0;
-			while(lo < hi)
-			{
-				if(ta > tc)
-				{
-					if(tb > tc)
-					{
-						p = tc;
-						tc += sc;
-					}
-					else
-					{
-						p = tb;
-						tb += sb;
-					}
-				}
-				else if(ta > tb)
-				{
-					p = tb;
-					tb += sb;
-				}
-				else
-				{
-					p = ta;
-					ta += sa;
-				}
-				if(find_root(lo, p, &t))
-				{
-					if(nhits++ > 0)
-						hits = GetNextHit(hits);
-					hits->t = t;
-					hits->obj = obj;
-					if(! ct.calc_all)
-						break;   /* from loop */
-				}
-				lo = p;
-			}
+			if(imp->grid != NULL)
+				search_grid(obj, imp, lo, hi, &hits, &nhits);
+			else
+				(void)search_span(obj, lo, hi, &hits, &nhits);
+
 			if(nhits)
 			{
 				ray_fnxyz_hits++;
@@ -226,10 +329,194 @@ int IntersectFnxyz(Object *obj, HitData *hits)
 	return 0;
 }
 
+
+/*
+ * Walk the ray through the occupancy grid, cell by cell, and search
+ * only the runs of cells that may hold part of the surface.
+ */
+static void search_grid(Object *obj, FnxyzData *imp, double lo, double hi,
+	HitData **hits, int *nhits)
+{
+	int i, j, k, di, dj, dk, inrun;
+	double t, tend, runlo, nx, ny, nz, dx, dy, dz;
+	size_t n;
+
+	/* Find the cell the ray starts in. */
+	t = lo;
+	i = (int)floor((B.x + D.x * t - imp->bmin.x) / imp->cell.x);
+	j = (int)floor((B.y + D.y * t - imp->bmin.y) / imp->cell.y);
+	k = (int)floor((B.z + D.z * t - imp->bmin.z) / imp->cell.z);
+	i = CLAMP(i, 0, imp->nx - 1);
+	j = CLAMP(j, 0, imp->ny - 1);
+	k = CLAMP(k, 0, imp->nz - 1);
+
+	/* Ray distances to the next cell boundary and across a cell per axis. */
+	if(D.x > EPSILON)
+	{
+		di = 1;
+		dx = imp->cell.x / D.x;
+		nx = (imp->bmin.x + imp->cell.x * (i + 1) - B.x) / D.x;
+	}
+	else if(D.x < -EPSILON)
+	{
+		di = -1;
+		dx = -imp->cell.x / D.x;
+		nx = (imp->bmin.x + imp->cell.x * i - B.x) / D.x;
+	}
+	else
+	{
+		di = 0;
+		dx = nx = HUGE;
+	}
+	if(D.y > EPSILON)
+	{
+		dj = 1;
+		dy = imp->cell.y / D.y;
+		ny = (imp->bmin.y + imp->cell.y * (j + 1) - B.y) / D.y;
+	}
+	else if(D.y < -EPSILON)
+	{
+		dj = -1;
+		dy = -imp->cell.y / D.y;
+		ny = (imp->bmin.y + imp->cell.y * j - B.y) / D.y;
+	}
+	else
+	{
+		dj = 0;
+		dy = ny = HUGE;
+	}
+	if(D.z > EPSILON)
+	{
+		dk = 1;
+		dz = imp->cell.z / D.z;
+		nz = (imp->bmin.z + imp->cell.z * (k + 1) - B.z) / D.z;
+	}
+	else if(D.z < -EPSILON)
+	{
+		dk = -1;
+		dz = -imp->cell.z / D.z;
+		nz = (imp->bmin.z + imp->cell.z * k - B.z) / D.z;
+	}
+	else
+	{
+		dk = 0;
+		dz = nz = HUGE;
+	}
+
+	inrun = 0;
+	runlo = lo;
+	for(;;)
+	{
+		n = ((size_t)k * imp->ny + j) * imp->nx + i;
+		if(imp->grid[n >> 3] & (1 << (n & 7)))
+		{
+			if(!inrun)
+			{
+				runlo = t;
+				inrun = 1;
+			}
+		}
+		else if(inrun)
+		{
+			inrun = 0;
+			if(search_span(obj, runlo, t, hits, nhits))
+				return;
+		}
+
+		/* Step to the next cell. */
+		if(nx < ny && nx < nz)
+		{
+			tend = nx;
+			nx += dx;
+			i += di;
+			if(i < 0 || i >= imp->nx)
+				break;
+		}
+		else if(ny < nz)
+		{
+			tend = ny;
+			ny += dy;
+			j += dj;
+			if(j < 0 || j >= imp->ny)
+				break;
+		}
+		else
+		{
+			tend = nz;
+			nz += dz;
+			k += dk;
+			if(k < 0 || k >= imp->nz)
+				break;
+		}
+		if(tend >= hi)
+			break;
+		if(tend > t)
+			t = tend;
+	}
+
+	if(inrun)
+		(void)search_span(obj, runlo, hi, hits, nhits);
+}
+
+
+/*
+ * Slice the interval into small steps and check each for a root.
+ * Returns non-zero if the search along the ray is finished.
+ */
+static int search_span(Object *obj, double lo, double hi,
+	HitData **hits, int *nhits)
+{
+	double p, t, ta, tb, tc;
+
+	ta = lo + fn_sa;
+	tb = lo + fn_sb;
+	tc = lo + fn_sc;
+	while(lo < hi)
+	{
+		if(ta > tc)
+		{
+			if(tb > tc)
+			{
+				p = tc;
+				tc += fn_sc;
+			}
+			else
+			{
+				p = tb;
+				tb += fn_sb;
+			}
+		}
+		else if(ta > tb)
+		{
+			p = tb;
+			tb += fn_sb;
+		}
+		else
+		{
+			p = ta;
+			ta += fn_sa;
+		}
+		if(p > hi)
+			p = hi;
+		if(find_root(lo, p, &t))
+		{
+			if((*nhits)++ > 0)
+				*hits = GetNextHit(*hits);
+			(*hits)->t = t;
+			(*hits)->obj = obj;
+			if(! ct.calc_all)
+				return 1;
+		}
+		lo = p;
+	}
+	return 0;
+}
+
 static int find_root(double a, double b, double *val)
 {
 	int i;
-	double fa, fb, m, fm, lfm;
+	double fa, fb, m, fm, lfm, dfm, n;
+	Vec3 grad;
 
 	/* Get start & end points for interval... */
 	rt_O.x = B.x + D.x * a;
@@ -257,14 +544,21 @@ static int find_root(double a, double b, double *val)
 		return 0;
 
 	lfm = fa;
+	dfm = 0.0;
+	m = (fb * a - fa * b) / (fb - fa);
 
 	for(i = FN_MAXIT; i != 0; i--)
 	{
-		m = (fb * a - fa * b) / (fb - fa);
 		rt_O.x = B.x + D.x * m;
 		rt_O.y = B.y + D.y * m;
 		rt_O.z = B.z + D.z * m;
-		fm = vm_evaldouble(fn_expr);
+		if(fn_has_grad)
+		{
+			fm = vm_evalgrad(fn_expr, &grad);
+			dfm = V3Dot(&grad, &D);
+		}
+		else
+			fm = vm_evaldouble(fn_expr);
 		if(fabs(m) > FN_RELERROR)
 		{
 			if(fabs(fm / m) < FN_RELERROR)
@@ -295,6 +589,21 @@ static int find_root(double a, double b, double *val)
 		}
 
 		lfm = fm;
+
+		/*
+		 * Take a Newton step if it stays inside the bracket,
+		 * otherwise fall back to regula falsi.
+		 */
+		if(fn_has_grad && (fabs(dfm) > EPSILON))
+		{
+			n = m - fm / dfm;
+			if((n > a) && (n < b))
+			{
+				m = n;
+				continue;
+			}
+		}
+		m = (fb * a - fa * b) / (fb - fa);
 	}
 	return 0;
 }
@@ -316,6 +625,36 @@ static int sign_change(double a, double b)
 
 
 void CalcNormalFnxyz(Object *obj, Vec3 *P, Vec3 *N)
+{
+	FnxyzData *imp = obj->data.fnxyz;
+	Vec3 Ptmp;
+
+	/*
+	 * The normal is the gradient of the function at the point hit.
+	 * Evaluate it analytically if we can, else estimate it by sampling.
+	 */
+	if(imp->has_grad)
+	{
+		V3Copy(&Ptmp, &rt_O);
+		V3Copy(&rt_O, P);
+		if(obj->T != NULL)
+			PointToObject(&rt_O, obj->T);
+		(void)vm_evalgrad(imp->fn, N);
+		V3Copy(&rt_O, &Ptmp);
+		if(V3Mag(N) > EPSILON)
+		{
+			if(obj->T != NULL)
+				NormToWorld(N, obj->T);
+			V3Normalize(N);
+			return;
+		}
+	}
+
+	SampleNormalFnxyz(obj, P, N);
+}
+
+
+static void SampleNormalFnxyz(Object *obj, Vec3 *P, Vec3 *N)
 {
 	#define NSIDES 12
 	FnxyzData *imp;
@@ -325,6 +664,7 @@ void CalcNormalFnxyz(Object *obj, Vec3 *P, Vec3 *N)
 
 	imp = obj->data.fnxyz;
 	fn_expr = imp->fn;
+	fn_has_grad = 0;
 
 	/*
 	 * Transform world point, "P", to point in function's coordinate
@@ -755,6 +1095,8 @@ void DeleteFnxyz(Object *obj)
 	if (--imp->nrefs == 0)
 	{
 		delete_exprtree(imp->fn);
+		if(imp->grid != NULL)
+			Free(imp->grid, imp->gridsize);
 		Free(imp, sizeof(FnxyzData));
 	}
 }
@@ -19,10 +19,24 @@ struct BBQ
   double t;                 /* Closest positive "t" value for BBox. */
 };
 
+/*************************************************************************
+ *  Packet traversal queue element.
+ */
+struct PKQ
+{
+  BBoxData *bbox;                     /* Bounding box still to be entered. */
+  unsigned long mask[PACKET_WORDS];   /* Rays that reached its list. */
+};
+
+#define MASK_TEST(m, i)  ((m)[(i) >> 5] & (1UL << ((i) & 31)))
+#define MASK_SET(m, i)   ((m)[(i) >> 5] |= (1UL << ((i) & 31)))
+
 /*************************************************************************
  *  Local stuff...
  */
 static struct BBQ *bbq_pool;
+static struct PKQ *pkq_queue;
+static int pkq_size;
 
 static struct BBQ *fetch_bbq(void)
 {
@@ -44,12 +58,134 @@ static struct BBQ *fetch_bbq(void)
 }
 
 
-int FindClosestIntersection(Object *first_obj, HitData *hits)
+/*
+ * True if "obj" is not tested against the current ray.
+ */
+int skip_object(Object *obj)
+{
+  return ((ct.ray_flags & RAY_SHADOW) &&
+          ((obj->flags & OBJ_FLAG_NO_SHADOW) ||
+          ((obj == ct.baseobj) && (obj->flags & OBJ_FLAG_NO_SELF_INTERSECT))));
+}
+
+/*
+ * Add bounding box "obj", entered at "t", to the end of the queue.
+ */
+static void queue_bbox(Object *obj, double t, struct BBQ **first,
+  struct BBQ **last)
+{
+  struct BBQ *bbq;
+
+  bbq = fetch_bbq();
+  bbq->bbox = obj->data.bbox;
+  bbq->t = t;
+  if(*last == NULL)
+    *first = bbq;
+  else
+    (*last)->next = bbq;
+  *last = bbq;
+}
+
+/*
+ * Entry distance of a bounding box the ray hits from "t1" on, clipped
+ * to the ray's range the same way IntersectBBox() does.
+ */
+static int bbox_entry(double t1, double *t)
+{
+  if(t1 < ct.tmax)
+  {
+    if(t1 < ct.tmin)
+      t1 = ct.tmin + EPSILON;
+    if(t1 < ct.tmax)
+    {
+      *t = t1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Test a bounding box in a list that has no packed child bounds.
+ */
+static void test_bbox(SlabRay *sr, Object *obj, struct BBQ **first,
+  struct BBQ **last)
+{
+  BBoxData *bb = obj->data.bbox;
+  double t1, t2;
+
+  if(IntersectSlabs(sr, &bb->bmin, &bb->bmax, &t1, &t2) &&
+    bbox_entry(t1, &t1))
+    queue_bbox(obj, t1, first, last);
+}
+
+/*
+ * Test all of the bounding boxes in the list of "bb" at once, in list
+ * order, queuing those that are hit.
+ */
+static void test_bbox_boxes(SlabRay *sr, BBoxData *bb, struct BBQ **first,
+  struct BBQ **last)
+{
+  double t1[SLAB_CHUNK], t2[SLAB_CHUNK], t;
+  int i, j, n;
+
+  for(j = 0; j < bb->num_boxes; j += SLAB_CHUNK)
+  {
+    n = bb->num_boxes - j;
+    if(n > SLAB_CHUNK)
+      n = SLAB_CHUNK;
+    IntersectSlabsN(sr, bb->box_bounds + j, bb->num_boxes, n, t1, t2);
+    for(i = 0; i < n; i++)
+      if(bbox_entry(t1[i], &t) && !skip_object(bb->boxes[j + i]))
+        queue_bbox(bb->boxes[j + i], t, first, last);
+  }
+}
+
+
+/*
+ * Make "obj", hit at "t", the closest hit of the current ray.
+ */
+static void set_closest_hit(Object *obj, double t, int entering)
+{
+  ct.objhit = obj;
+  ct.t = t;
+  ct.entering = entering;
+  ct.Q.x = ct.B.x + t * ct.D.x;
+  ct.Q.y = ct.B.y + t * ct.D.y;
+  ct.Q.z = ct.B.z + t * ct.D.z;
+}
+
+
+/*
+ * Compute the normal at the current ray's closest hit, facing the ray.
+ */
+void CalcHitNormal(void)
+{
+  ct.objhit->procs->CalcNormal(ct.objhit, &ct.Q, &ct.N);
+  if(V3Dot(&ct.N, &ct.D) > 0.0)
+  {
+    ct.N.x = -ct.N.x;
+    ct.N.y = -ct.N.y;
+    ct.N.z = -ct.N.z;
+  }
+}
+
+
+/*
+ * Bounding boxes are tested here rather than through their Intersect
+ * proc, with the ray set up once for slab tests. When a list is entered
+ * from a bounding box with packed child bounds, its boxes are all tested
+ * up front and skipped in the list itself. The normal at the closest hit
+ * is only computed if "normal" is set.
+ */
+static int find_closest(Object *first_obj, HitData *hits, int normal)
 {
   Object *obj, *closest_obj;
   struct BBQ *first_bbox_queued, *last_bbox_queued, *bbq;
+  BBoxData *bb;
+  SlabRay sr;
   double closest_t;
-  int entering = 0;
+  int entering = 0, packed;
 
   last_bbox_queued = NULL;
   first_bbox_queued = NULL;
@@ -57,32 +193,25 @@ int FindClosestIntersection(Object *first_obj, HitData *hits)
   closest_t = HUGE;
   closest_obj = NULL;
   obj = first_obj;
+  packed = 0;
+  SetupSlabRay(&sr, &ct.B, &ct.D);
 
   while(obj != NULL)
   {
-    if( ! ((ct.ray_flags & RAY_SHADOW) &&
-          ((obj->flags & OBJ_FLAG_NO_SHADOW) ||
-          ((obj == ct.baseobj) && (obj->flags & OBJ_FLAG_NO_SELF_INTERSECT))))
-      )
+    if(obj->procs->type == OBJ_BBOX)
+    {
+      /*
+       * Place bounding boxes in queue to be tested
+       * after the non-BBox objects in this list are tested.
+       */
+      if(!packed && !skip_object(obj))
+        test_bbox(&sr, obj, &first_bbox_queued, &last_bbox_queued);
+    }
+    else if(!skip_object(obj))
     {
       if((obj->procs->Intersect)(obj, hits))
       {
-        if(obj->procs->type == OBJ_BBOX)
-        {
-          /*
-           * Place bounding boxes in queue to be tested
-           * after the non-BBox objects in this list are tested.
-           */
-          bbq = fetch_bbq();
-          bbq->bbox = obj->data.bbox;
-          bbq->t = hits->t;
-          if(last_bbox_queued == NULL)
-            first_bbox_queued = bbq;
-          else
-            last_bbox_queued->next = bbq;
-          last_bbox_queued = bbq;
-        }
-        else if(hits->t < closest_t)
+        if(hits->t < closest_t)
         {
           closest_obj = hits->obj;
           closest_t = hits->t;
@@ -111,12 +240,19 @@ int FindClosestIntersection(Object *first_obj, HitData *hits)
         if(first_bbox_queued == NULL)  /* This was the only one... */
           last_bbox_queued = NULL;        /* ...Clear the queue. */
         /* Get potential new object list to test... */
-        obj = bbq->bbox->objects;
+        bb = bbq->bbox;
+        obj = bb->objects;
         /* Flag this queue element as "free" in the global pool. */
         bbq->bbox = NULL;
         /* See if BBox is closer than closest object... */
         if(bbq->t < closest_t)
-          break;  /* BBox is closer, recycle with the new list... */
+        {
+          /* BBox is closer, recycle with the new list... */
+          packed = (bb->boxes != NULL);
+          if(packed)
+            test_bbox_boxes(&sr, bb, &first_bbox_queued, &last_bbox_queued);
+          break;
+        }
         /* BBox is not closer, discard the new list... */
         obj = NULL;
         /* Move on to next BBox, if any. */
@@ -126,19 +262,9 @@ int FindClosestIntersection(Object *first_obj, HitData *hits)
 
   if(closest_obj != NULL)
   {
-    ct.objhit = closest_obj;
-    ct.t = closest_t;
-    ct.entering = entering;
-    ct.Q.x = ct.B.x + closest_t * ct.D.x;
-    ct.Q.y = ct.B.y + closest_t * ct.D.y;
-    ct.Q.z = ct.B.z + closest_t * ct.D.z;
-    closest_obj->procs->CalcNormal(closest_obj, &ct.Q, &ct.N);
-    if(V3Dot(&ct.N, &ct.D) > 0.0)
-    {
-      ct.N.x = -ct.N.x;
-      ct.N.y = -ct.N.y;
-      ct.N.z = -ct.N.z;
-    }
+    set_closest_hit(closest_obj, closest_t, entering);
+    if(normal)
+      CalcHitNormal();
     return 1;
   }
 
@@ -146,50 +272,58 @@ int FindClosestIntersection(Object *first_obj, HitData *hits)
 }
 
 
+int FindClosestIntersection(Object *first_obj, HitData *hits)
+{
+  return find_closest(first_obj, hits, 1);
+}
+
+
+/*
+ * As FindClosestIntersection(), but leaves the normal at the hit to be
+ * computed by CalcHitNormal() if it turns out to be needed.
+ */
+int FindClosestHit(Object *first_obj, HitData *hits)
+{
+  return find_closest(first_obj, hits, 0);
+}
+
+
 int FindAllIntersections(Object *first_obj, HitData *hits)
 {
   Object *obj;
-  int nhits, nobjhits;
+  int nhits, nobjhits, packed;
   struct BBQ *first_bbox_queued, *last_bbox_queued, *bbq;
+  BBoxData *bb;
+  SlabRay sr;
 
   last_bbox_queued = NULL;
   first_bbox_queued = NULL;
   nhits = 0;
   ct.calc_all++;
   obj = first_obj;
+  packed = 0;
+  SetupSlabRay(&sr, &ct.B, &ct.D);
 
   while(obj != NULL)
   {
-    if( ! ((ct.ray_flags & RAY_SHADOW) &&
-          ((obj->flags & OBJ_FLAG_NO_SHADOW) ||
-          ((obj == ct.baseobj) && (obj->flags & OBJ_FLAG_NO_SELF_INTERSECT))))
-      )
+    if(obj->procs->type == OBJ_BBOX)
+    {
+      /*
+       * Place bounding boxes in queue to be tested
+       * after the non-BBox objects in this list are tested.
+       */
+      if(!packed && !skip_object(obj))
+        test_bbox(&sr, obj, &first_bbox_queued, &last_bbox_queued);
+    }
+    else if(!skip_object(obj))
     {
       nobjhits = (obj->procs->Intersect)(obj, hits);
       if(nobjhits)
       {
-        if(obj->procs->type == OBJ_BBOX)
-        {
-          /*
-           * Place bounding boxes in queue to be tested
-           * after the non-BBox objects in this list are tested.
-           */
-          bbq = fetch_bbq();
-          bbq->bbox = obj->data.bbox;
-          bbq->t = hits->t;
-          if(last_bbox_queued == NULL)
-            first_bbox_queued = bbq;
-          else
-            last_bbox_queued->next = bbq;
-          last_bbox_queued = bbq;
-        }
-        else
-        {
-          nhits += nobjhits;
-          while(--nobjhits)
-            hits = hits->next;
-          hits = GetNextHit(hits);
-        }
+        nhits += nobjhits;
+        while(--nobjhits)
+          hits = hits->next;
+        hits = GetNextHit(hits);
       }
     }
     obj = obj->next;
@@ -209,10 +343,14 @@ int FindAllIntersections(Object *first_obj, HitData *hits)
         if(first_bbox_queued == NULL)  /* This was the only one... */
           last_bbox_queued = NULL;        /* ...Clear the queue. */
         /* Get new object list to test... */
-        obj = bbq->bbox->objects;
+        bb = bbq->bbox;
+        obj = bb->objects;
         /* Flag this queue element as "free" in the global pool. */
         bbq->bbox = NULL;
         /* Recycle with new object list. */
+        packed = (bb->boxes != NULL);
+        if(packed)
+          test_bbox_boxes(&sr, bb, &first_bbox_queued, &last_bbox_queued);
       }
     }
   }
@@ -222,6 +360,284 @@ int FindAllIntersections(Object *first_obj, HitData *hits)
 }
 
 
+/*
+ * Any-hit test for shadow rays. Returns the first object found that
+ * blocks the current ray outright, without looking for the closest hit
+ * or computing a normal. Sets "see_through" if objects that may let
+ * light through were hit along the way.
+ */
+Object *FindAnyIntersection(Object *first_obj, HitData *hits, int *see_through)
+{
+  Object *obj;
+  struct BBQ *first_bbox_queued, *last_bbox_queued, *bbq;
+  BBoxData *bb;
+  SlabRay sr;
+  int packed;
+
+  last_bbox_queued = NULL;
+  first_bbox_queued = NULL;
+  ct.calc_all = 0;
+  *see_through = 0;
+  obj = first_obj;
+  packed = 0;
+  SetupSlabRay(&sr, &ct.B, &ct.D);
+
+  while(obj != NULL)
+  {
+    if(obj->procs->type == OBJ_BBOX)
+    {
+      if(!packed && !skip_object(obj))
+        test_bbox(&sr, obj, &first_bbox_queued, &last_bbox_queued);
+    }
+    else if(!skip_object(obj) && (obj->procs->Intersect)(obj, hits))
+    {
+      /* Composite objects look up the surface hit by its "t". */
+      ct.t = hits->t;
+      *see_through = !SurfaceIsOpaque(hits->obj);
+      /* Done; free the boxes still queued in the global pool. */
+      for(bbq = first_bbox_queued; bbq != NULL; bbq = bbq->next)
+        bbq->bbox = NULL;
+      return *see_through ? NULL : hits->obj;
+    }
+    obj = obj->next;
+
+    if((obj == NULL) && (first_bbox_queued != NULL))
+    {
+      /* Pull first bounding box from the queue and recycle. */
+      bbq = first_bbox_queued;
+      first_bbox_queued = first_bbox_queued->next;
+      if(first_bbox_queued == NULL)
+        last_bbox_queued = NULL;
+      bb = bbq->bbox;
+      obj = bb->objects;
+      bbq->bbox = NULL;
+      packed = (bb->boxes != NULL);
+      if(packed)
+        test_bbox_boxes(&sr, bb, &first_bbox_queued, &last_bbox_queued);
+    }
+  }
+
+  return NULL;
+}
+
+
+/*************************************************************************
+ *  Eye ray packets.
+ */
+
+/*
+ * Set up packet "pk", whose "n", "B", "D", "u" and "v" are filled in,
+ * for tracing: no hits yet, and the range of directions for culling
+ * boxes against the whole packet.
+ */
+void SetupPacket(RayPacket *pk)
+{
+  SlabRay *sr;
+  int i;
+
+  pk->sx = pk->sy = pk->sz = 0;
+  for(i = 0; i < pk->n; i++)
+  {
+    sr = &pk->sr[i];
+    SetupSlabRay(sr, &pk->B, &pk->D[i]);
+    if(i == 0)
+    {
+      pk->inv_min = pk->inv_max = sr->inv;
+      pk->sx = sr->sx;
+      pk->sy = sr->sy;
+      pk->sz = sr->sz;
+    }
+    if(sr->inv.x < pk->inv_min.x)
+      pk->inv_min.x = sr->inv.x;
+    if(sr->inv.y < pk->inv_min.y)
+      pk->inv_min.y = sr->inv.y;
+    if(sr->inv.z < pk->inv_min.z)
+      pk->inv_min.z = sr->inv.z;
+    if(sr->inv.x > pk->inv_max.x)
+      pk->inv_max.x = sr->inv.x;
+    if(sr->inv.y > pk->inv_max.y)
+      pk->inv_max.y = sr->inv.y;
+    if(sr->inv.z > pk->inv_max.z)
+      pk->inv_max.z = sr->inv.z;
+    /* Axes the rays cross in both directions, or run along, don't cull. */
+    if(sr->sx != pk->sx || pk->D[i].x == 0.0)
+      pk->sx = -1;
+    if(sr->sy != pk->sy || pk->D[i].y == 0.0)
+      pk->sy = -1;
+    if(sr->sz != pk->sz || pk->D[i].z == 0.0)
+      pk->sz = -1;
+    pk->t[i] = HUGE;
+    pk->obj[i] = NULL;
+  }
+}
+
+/*
+ * Narrow the packet's range of entry and exit distances, "lo" and "hi",
+ * to those possible through the planes "pmin", "pmax" of one slab,
+ * taken relative to the packet's base point. With 1 / D of one sign,
+ * each distance is bounded by its values at the ends of that range.
+ */
+static void packet_slab(int s, double pmin, double pmax, double imin,
+  double imax, double *lo, double *hi)
+{
+  double n, f, t;
+
+  if(s < 0)
+    return;
+  n = s ? pmax : pmin;
+  f = s ? pmin : pmax;
+  t = (n * imin < n * imax) ? n * imin : n * imax;
+  if(t > *lo)
+    *lo = t;
+  t = (f * imin > f * imax) ? f * imin : f * imax;
+  if(t < *hi)
+    *hi = t;
+}
+
+/*
+ * True if no ray of the packet can hit box "bb": the frustum test.
+ */
+static int packet_misses_box(RayPacket *pk, BBoxData *bb)
+{
+  double lo = -HUGE, hi = HUGE;
+
+  packet_slab(pk->sx, bb->bmin.x - pk->B.x, bb->bmax.x - pk->B.x,
+    pk->inv_min.x, pk->inv_max.x, &lo, &hi);
+  packet_slab(pk->sy, bb->bmin.y - pk->B.y, bb->bmax.y - pk->B.y,
+    pk->inv_min.y, pk->inv_max.y, &lo, &hi);
+  packet_slab(pk->sz, bb->bmin.z - pk->B.z, bb->bmax.z - pk->B.z,
+    pk->inv_min.z, pk->inv_max.z, &lo, &hi);
+  return (lo >= hi || hi < EPSILON);
+}
+
+/*
+ * Narrow "mask" to the rays that enter box "bb" closer than their
+ * closest hit so far. Returns 0 if none do.
+ */
+static int packet_enter_box(RayPacket *pk, BBoxData *bb, unsigned long *mask)
+{
+  unsigned long in[PACKET_WORDS];
+  double t1, t2;
+  int i, any = 0;
+
+  memcpy(in, mask, sizeof(in));
+  memset(mask, 0, sizeof(in));
+  for(i = 0; i < pk->n; i++)
+    if(MASK_TEST(in, i) &&
+      IntersectSlabs(&pk->sr[i], &bb->bmin, &bb->bmax, &t1, &t2) &&
+      bbox_entry(t1, &t1) && t1 < pk->t[i])
+    {
+      MASK_SET(mask, i);
+      any = 1;
+    }
+  return any;
+}
+
+static int queue_packet_box(int last, BBoxData *bb, unsigned long *mask)
+{
+  struct PKQ *newqueue;
+
+  if(last == pkq_size)
+  {
+    newqueue = (struct PKQ *)Realloc(pkq_queue,
+      pkq_size * sizeof(struct PKQ), (pkq_size + 64) * sizeof(struct PKQ));
+    if(newqueue == NULL)
+      return last;
+    pkq_queue = newqueue;
+    pkq_size += 64;
+  }
+  pkq_queue[last].bbox = bb;
+  memcpy(pkq_queue[last].mask, mask, sizeof(pkq_queue[last].mask));
+  return last + 1;
+}
+
+
+/*
+ * Find the closest hit of each eye ray in packet "pk" among "first_obj"
+ * and its bounding boxes. The packet walks the bounding tree as one,
+ * carrying a mask of the rays still in play: a box is skipped when the
+ * frustum test says no ray can reach it, and otherwise entered by the
+ * rays that hit it closer than their closest hit so far. Boxes are
+ * queued in the same order as by FindClosestIntersection(), so each ray
+ * meets the same objects in the same order, and breaks ties between
+ * equally close hits the same way, as when traced on its own.
+ * Objects are tested one ray at a time, and only the object reporting
+ * each closest hit is kept; ResolvePacketHit() finishes a ray's hit.
+ */
+void FindClosestIntersections(Object *first_obj, RayPacket *pk,
+  HitData *hits)
+{
+  unsigned long mask[PACKET_WORDS];
+  Object *obj;
+  BBoxData *bb;
+  int i, first, last;
+
+  ct.calc_all = 0;
+  ct.B = pk->B;
+  memset(mask, 0, sizeof(mask));
+  for(i = 0; i < pk->n; i++)
+    MASK_SET(mask, i);
+  first = last = 0;
+  obj = first_obj;
+
+  for(;;)
+  {
+    for(; obj != NULL; obj = obj->next)
+    {
+      if(obj->procs->type == OBJ_BBOX)
+      {
+        /* Entered after the rest of this list is tested. */
+        last = queue_packet_box(last, obj->data.bbox, mask);
+        continue;
+      }
+      for(i = 0; i < pk->n; i++)
+      {
+        if(!MASK_TEST(mask, i))
+          continue;
+        ct.D = pk->D[i];
+        rt_uscreen = pk->u[i];
+        rt_vscreen = pk->v[i];
+        if((obj->procs->Intersect)(obj, hits) && hits->t < pk->t[i])
+        {
+          pk->t[i] = hits->t;
+          pk->obj[i] = obj;
+        }
+      }
+    }
+
+    /* Pull boxes from the queue until one is entered by some ray. */
+    do
+    {
+      if(first == last)
+        return;
+      bb = pkq_queue[first].bbox;
+      memcpy(mask, pkq_queue[first].mask, sizeof(mask));
+      first++;
+    } while(packet_misses_box(pk, bb) || !packet_enter_box(pk, bb, mask));
+    obj = bb->objects;
+  }
+}
+
+
+/*
+ * Make the closest hit found for ray "i" of packet "pk", whose base
+ * and direction are in "ct", the current hit. The object reporting it
+ * is tested again to restore its state for CalcNormal and shading, as
+ * other rays of the packet have been tested against it since.
+ */
+int ResolvePacketHit(RayPacket *pk, int i, HitData *hits)
+{
+  Object *obj = pk->obj[i];
+
+  ct.calc_all = 0;
+  if(obj == NULL || !(obj->procs->Intersect)(obj, hits))
+    return 0;
+  set_closest_hit(hits->obj, hits->t, hits->entering);
+  CalcHitNormal();
+  return 1;
+}
+
+
 void SortHits(HitData *hits, int nhits)
 {
   HitData tmphit;
@@ -291,6 +707,8 @@ HitData *GetNextHit(HitData *hit)
 void InitializeInter(void)
 {
   bbq_pool = NULL;
+  pkq_queue = NULL;
+  pkq_size = 0;
 }
 
 
@@ -298,6 +716,10 @@ void CloseInter(void)
 {
   struct BBQ *bbq;
 
+  Free(pkq_queue, pkq_size * sizeof(struct PKQ));
+  pkq_queue = NULL;
+  pkq_size = 0;
+
   while((bbq = bbq_pool) != NULL)
   {
     bbq_pool = bbq_pool->pool_next;
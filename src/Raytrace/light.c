@@ -13,12 +13,73 @@ double min_light_tol = 0.003;
 
 Light *ray_light_list = NULL;
 
+/* If non-zero, most lights to sample per hit when more can contribute. */
+int ray_light_samples;
+
 static long light_jitter_seed;
+static unsigned int next_light_id;
+static long light_sample_seed;
+
+/* Fewest lights of limited reach worth building a light tree for. */
+#define LIGHT_TREE_THRESHOLD 8
+/* Most lights in a light tree leaf. */
+#define LIGHT_LEAF_SIZE 4
+/* Deepest light tree that can be searched. */
+#define LIGHT_TREE_DEPTH 64
+
+/* What a shadow sample of a light found. */
+#define LIGHT_DARK		0	/* Culled or blocked. */
+#define LIGHT_LIT		1	/* Nothing in the way. */
+#define LIGHT_PARTIAL	2	/* Filtered by something see-through. */
+
+/*
+ * A light along with the box outside which it cannot light anything.
+ * Order is the light's position in ray_light_list, so lights found in
+ * the tree can be shaded in the same order as the list.
+ */
+typedef struct tag_lightref
+{
+	Light *lite;
+	int order;
+	Vec3 bmin, bmax;
+} LightRef;
+
+/*
+ * Light tree node. Leaves hold "count" lights starting at "first" in
+ * light_refs. Inner nodes have a count of zero and their two sub nodes
+ * at "first" and "first + 1" in light_nodes.
+ */
+typedef struct tag_lightnode
+{
+	Vec3 bmin, bmax;
+	int first, count;
+} LightNode;
+
+static LightRef *light_refs = NULL;			/* Lights of limited reach. */
+static LightNode *light_nodes = NULL;
+static LightRef *light_globals = NULL;		/* Lights that reach everywhere. */
+static Light **light_visit = NULL;			/* Lights found for a hit. */
+static LightRef **light_found = NULL;
+static double *light_cdf = NULL;
+static int light_nrefs, light_nnodes, light_nglobals, light_total;
+static int light_sort_axis;
+
+static void FreeLightTree(void);
+static int GatherLights(void);
+static void ShadeLight(Light *lite, double weight, Vec3 *color,
+	Vec3 *base_color, int has_diffuse, int has_specular);
+static void BuildLightTree(void);
+static void SampleJitteredLight(Light *lite, double weight, Vec3 *color,
+	Vec3 *base_color, int has_diffuse, int has_specular);
+static int LightSample(Light *lite, Vec3 *loc, double weight, Vec3 *color,
+	Vec3 *base_color, int has_diffuse, int has_specular);
 
 int InitializeLight(void)
 {
   ray_light_list = NULL;
 	light_jitter_seed = -1;
+	light_sample_seed = -1;
+	next_light_id = 0;
   return 1;
 }
 
@@ -26,6 +87,7 @@ int InitializeLight(void)
 void CloseLight(void)
 {
   Light *l;
+  FreeLightTree();
   while(ray_light_list != NULL)
   {
     l = ray_light_list;
@@ -59,6 +121,335 @@ void SetupLight(void)
 				l->color.z /= (double)n_auto;
 			}
 	}
+
+	BuildLightTree();
+}
+
+
+/*************************************************************************
+*
+*  Light tree
+*
+*  A light with a falloff fades below min_light_tol beyond some distance,
+*  and a spot light only lights the inside of its cone, so each such light
+*  can be given a box outside which it adds nothing. With enough of these
+*  lights they are kept in a tree of boxes so a hit only needs to look at
+*  the lights whose box it is in.
+*
+*************************************************************************/
+
+/*
+ * Find the box a light can reach. Returns 0 if the light can reach
+ * anywhere.
+ */
+static int LightReach(Light *lite, Vec3 *bmin, Vec3 *bmax)
+{
+	double r, cos_cone, a[3], lo[3], hi[3], *p, *q, *j;
+	int i;
+
+	if (lite->type == LIGHT_INFINITE || lite->falloff <= 0.0)
+		return 0;
+
+	/* 1 / (1 + falloff * r^2) is min_light_tol at distance r. */
+	r = sqrt((1.0 / min_light_tol - 1.0) / lite->falloff);
+
+	if (lite->type == LIGHT_DIRECTIONAL)
+	{
+		/* Points lit are within the cone about -dir. */
+		cos_cone = (lite->angle_min > 0.0) ? lite->angle_min : EPSILON;
+		a[0] = -lite->dir.x;
+		a[1] = -lite->dir.y;
+		a[2] = -lite->dir.z;
+		for (i = 0; i < 3; i++)
+		{
+			double phi = acos(a[i] > 1.0 ? 1.0 : (a[i] < -1.0 ? -1.0 : a[i]));
+			double theta = acos(cos_cone);
+			/* Furthest the cone goes along the +axis and -axis. */
+			hi[i] = (phi <= theta) ? 1.0 : cos(phi - theta);
+			lo[i] = (PI - phi <= theta) ? -1.0 : -cos(PI - phi - theta);
+			if (hi[i] < 0.0) hi[i] = 0.0;
+			if (lo[i] > 0.0) lo[i] = 0.0;
+		}
+	}
+	else
+	{
+		for (i = 0; i < 3; i++)
+		{
+			lo[i] = -1.0;
+			hi[i] = 1.0;
+		}
+	}
+
+	p = &bmin->x;
+	q = &bmax->x;
+	j = &lite->jitter.x;
+	for (i = 0; i < 3; i++)
+	{
+		double jit = (lite->flags & LIGHT_FLAG_JITTER) ? fabs(j[i]) * 0.5 : 0.0;
+		p[i] = (&lite->loc.x)[i] + r * lo[i] - jit - EPSILON;
+		q[i] = (&lite->loc.x)[i] + r * hi[i] + jit + EPSILON;
+	}
+	return 1;
+}
+
+
+static int CompareLightRefs(const void *a, const void *b)
+{
+	const LightRef *la = (const LightRef *)a, *lb = (const LightRef *)b;
+	double ca = (&la->bmin.x)[light_sort_axis] + (&la->bmax.x)[light_sort_axis];
+	double cb = (&lb->bmin.x)[light_sort_axis] + (&lb->bmax.x)[light_sort_axis];
+	if (ca < cb)
+		return -1;
+	if (ca > cb)
+		return 1;
+	return la->order - lb->order;
+}
+
+
+/*
+ * Fill in node "n" for the lights first to first + count - 1 of
+ * light_refs, splitting them in half along the longest side of their
+ * box until few enough are left for a leaf.
+ */
+static void BuildLightNode(int n, int first, int count)
+{
+	LightNode *node = &light_nodes[n];
+	Vec3 size;
+	int i, half;
+
+	node->bmin = light_refs[first].bmin;
+	node->bmax = light_refs[first].bmax;
+	for (i = first + 1; i < first + count; i++)
+	{
+		LightRef *ref = &light_refs[i];
+		if (ref->bmin.x < node->bmin.x) node->bmin.x = ref->bmin.x;
+		if (ref->bmin.y < node->bmin.y) node->bmin.y = ref->bmin.y;
+		if (ref->bmin.z < node->bmin.z) node->bmin.z = ref->bmin.z;
+		if (ref->bmax.x > node->bmax.x) node->bmax.x = ref->bmax.x;
+		if (ref->bmax.y > node->bmax.y) node->bmax.y = ref->bmax.y;
+		if (ref->bmax.z > node->bmax.z) node->bmax.z = ref->bmax.z;
+	}
+
+	if (count <= LIGHT_LEAF_SIZE)
+	{
+		node->first = first;
+		node->count = count;
+		return;
+	}
+
+	V3Sub(&size, &node->bmax, &node->bmin);
+	light_sort_axis = (size.x > size.y) ?
+		((size.x > size.z) ? X_AXIS : Z_AXIS) :
+		((size.y > size.z) ? Y_AXIS : Z_AXIS);
+	qsort(&light_refs[first], count, sizeof(LightRef), CompareLightRefs);
+
+	half = count / 2;
+	node->first = light_nnodes;
+	node->count = 0;
+	light_nnodes += 2;
+	BuildLightNode(node->first, first, half);
+	BuildLightNode(light_nodes[n].first + 1, first + half, count - half);
+}
+
+
+static void BuildLightTree(void)
+{
+	Light *l;
+	Vec3 bmin, bmax;
+	int n;
+
+	FreeLightTree();
+
+	for (l = ray_light_list; l != NULL; l = l->next)
+	{
+		light_total++;
+		if (LightReach(l, &bmin, &bmax))
+			light_nrefs++;
+	}
+	if (light_nrefs < LIGHT_TREE_THRESHOLD && ray_light_samples <= 0)
+	{
+		light_nrefs = 0;
+		light_total = 0;
+		return;
+	}
+
+	light_visit = (Light **)Malloc(light_total * sizeof(Light *));
+	light_found = (LightRef **)Malloc(light_total * sizeof(LightRef *));
+	light_cdf = (double *)Malloc(light_total * sizeof(double));
+	light_globals = (LightRef *)Malloc(light_total * sizeof(LightRef));
+	if (light_nrefs > 0)
+	{
+		light_refs = (LightRef *)Malloc(light_nrefs * sizeof(LightRef));
+		light_nodes = (LightNode *)Malloc(2 * light_nrefs * sizeof(LightNode));
+	}
+	if (light_visit == NULL || light_found == NULL || light_cdf == NULL ||
+		light_globals == NULL ||
+		(light_nrefs > 0 && (light_refs == NULL || light_nodes == NULL)))
+	{
+		/* Fall back to looking at every light. */
+		FreeLightTree();
+		return;
+	}
+
+	light_nrefs = 0;
+	for (l = ray_light_list, n = 0; l != NULL; l = l->next, n++)
+	{
+		LightRef *ref = &light_refs[light_nrefs];
+		if (light_refs != NULL && LightReach(l, &ref->bmin, &ref->bmax))
+		{
+			ref->lite = l;
+			ref->order = n;
+			light_nrefs++;
+		}
+		else
+		{
+			light_globals[light_nglobals].lite = l;
+			light_globals[light_nglobals++].order = n;
+		}
+	}
+
+	if (light_nrefs > 0)
+	{
+		light_nnodes = 1;
+		BuildLightNode(0, 0, light_nrefs);
+	}
+}
+
+
+static void FreeLightTree(void)
+{
+	if (light_refs != NULL)
+		Free(light_refs, light_nrefs * sizeof(LightRef));
+	if (light_nodes != NULL)
+		Free(light_nodes, 2 * light_nrefs * sizeof(LightNode));
+	if (light_globals != NULL)
+		Free(light_globals, light_total * sizeof(LightRef));
+	if (light_visit != NULL)
+		Free(light_visit, light_total * sizeof(Light *));
+	if (light_found != NULL)
+		Free(light_found, light_total * sizeof(LightRef *));
+	if (light_cdf != NULL)
+		Free(light_cdf, light_total * sizeof(double));
+	light_refs = NULL;
+	light_nodes = NULL;
+	light_globals = NULL;
+	light_visit = NULL;
+	light_found = NULL;
+	light_cdf = NULL;
+	light_nrefs = light_nnodes = light_nglobals = light_total = 0;
+}
+
+
+/*
+ * Put the lights that may reach ct.Q into light_visit, in the order they
+ * are in ray_light_list, and return how many there are.
+ */
+static int GatherLights(void)
+{
+	int stack[LIGHT_TREE_DEPTH];
+	int sp = 0, nfound = 0, i, j, k;
+	LightNode *node;
+
+	if (light_nnodes > 0)
+		stack[sp++] = 0;
+	while (sp > 0)
+	{
+		node = &light_nodes[stack[--sp]];
+		if (ct.Q.x < node->bmin.x || ct.Q.x > node->bmax.x ||
+			ct.Q.y < node->bmin.y || ct.Q.y > node->bmax.y ||
+			ct.Q.z < node->bmin.z || ct.Q.z > node->bmax.z)
+			continue;
+		if (node->count == 0)
+		{
+			if (sp + 2 > LIGHT_TREE_DEPTH)
+				continue;
+			stack[sp++] = node->first + 1;
+			stack[sp++] = node->first;
+			continue;
+		}
+		for (i = node->first; i < node->first + node->count; i++)
+		{
+			LightRef *ref = &light_refs[i];
+			if (ct.Q.x < ref->bmin.x || ct.Q.x > ref->bmax.x ||
+				ct.Q.y < ref->bmin.y || ct.Q.y > ref->bmax.y ||
+				ct.Q.z < ref->bmin.z || ct.Q.z > ref->bmax.z)
+				continue;
+			/* Keep the found lights in list order. */
+			for (j = nfound; j > 0 && light_found[j - 1]->order > ref->order; j--)
+				light_found[j] = light_found[j - 1];
+			light_found[j] = ref;
+			nfound++;
+		}
+	}
+
+	/* Merge with the lights that reach everywhere. */
+	for (i = j = k = 0; i < nfound || j < light_nglobals; k++)
+	{
+		if (j >= light_nglobals ||
+			(i < nfound && light_found[i]->order < light_globals[j].order))
+			light_visit[k] = light_found[i++]->lite;
+		else
+			light_visit[k] = light_globals[j++].lite;
+	}
+	return k;
+}
+
+
+/*
+ * How much a light might add at ct.Q, for choosing which lights to sample.
+ */
+static double LightImportance(Light *lite)
+{
+	double w = (fabs(lite->color.x) + fabs(lite->color.y) +
+		fabs(lite->color.z)) / 3.0;
+	if (lite->type != LIGHT_INFINITE && lite->falloff > 0.0)
+	{
+		Vec3 d;
+		V3Sub(&d, &lite->loc, &ct.Q);
+		w /= 1.0 + lite->falloff * V3Dot(&d, &d);
+	}
+	return w;
+}
+
+
+/*
+ * Shade ct with ray_light_samples lights from the n in light_visit,
+ * picked at random in proportion to their importance. Each is weighted
+ * by how unlikely it was to be picked, so on average the sum is the same
+ * as shading with all of them.
+ */
+static void SampleLights(int n, Vec3 *color, Vec3 *base_color,
+	int has_diffuse, int has_specular)
+{
+	double total = 0.0, x, p;
+	int i, lo, hi, s;
+
+	for (i = 0; i < n; i++)
+	{
+		total += LightImportance(light_visit[i]);
+		light_cdf[i] = total;
+	}
+	if (total <= 0.0)
+		return;
+
+	for (s = 0; s < ray_light_samples; s++)
+	{
+		/* Find the first light whose running total is past x. */
+		x = Frand1(&light_sample_seed) * total;
+		lo = 0;
+		hi = n - 1;
+		while (lo < hi)
+		{
+			i = (lo + hi) / 2;
+			if (light_cdf[i] > x)
+				hi = i;
+			else
+				lo = i + 1;
+		}
+		p = (light_cdf[lo] - ((lo > 0) ? light_cdf[lo - 1] : 0.0)) / total;
+		ShadeLight(light_visit[lo], 1.0 / (ray_light_samples * p), color,
+			base_color, has_diffuse, has_specular);
+	}
 }
 
 
@@ -74,9 +465,7 @@ void CalcLighting(void)
 {
 	Vec3		color, shadow_color, base_color;
 	Light		*lite;
-	double		NdotL, lite_scale, lite_dist;
-	Vec3		lite_dir;
-	int			has_diffuse, has_specular;
+	int			has_diffuse, has_specular, i, n;
 
 	V3Copy(&base_color, &ct.color);
 
@@ -102,122 +491,247 @@ void CalcLighting(void)
 	if (!has_diffuse && !has_specular)
 		goto FinishCalcLighting;
 
-	/* Calc falloff and add in the diffuse and specular contributions
-	 * of each light source.
+	/* Add in the diffuse and specular contributions of each light
+	 * source. With a light tree only the lights that reach this point
+	 * are looked at. Every light that reaches it is recorded as lighting
+	 * it, even those that sampling passes over this time.
 	 */
-	for (lite = ray_light_list; lite != NULL; lite = lite->next)
+	if (light_total > 0)
 	{
-		lite_scale = 1.0;
-		V3Set(&shadow_color, 1.0, 1.0, 1.0);
-
-		if (lite->type != LIGHT_INFINITE)
-		{
-			Vec3 loc;
-			V3Copy(&loc, &lite->loc);
-			/* Add jitter to light's from point if any. */
-			if (lite->flags & LIGHT_FLAG_JITTER)
-			{
-				loc.x += lite->jitter.x * (Frand1(&light_jitter_seed) - 0.5);
-				loc.y += lite->jitter.y * (Frand1(&light_jitter_seed) - 0.5);
-				loc.z += lite->jitter.z * (Frand1(&light_jitter_seed) - 0.5);
-			}
-			/* Get direction vector to light source... */
-			V3Sub(&lite_dir, &loc, &ct.Q);
-			lite_dist = V3Mag(&lite_dir);
-			if (lite_dist > EPSILON)
-			{
-				lite_dir.x /= lite_dist;
-				lite_dir.y /= lite_dist;
-				lite_dir.z /= lite_dist;
-			}
-		}
+		n = GatherLights();
+		for (i = 0; i < n; i++)
+			Ray_AddLightContributor(light_visit[i], ray_contrib);
+		if (ray_light_samples > 0 && n > ray_light_samples)
+			SampleLights(n, &color, &base_color, has_diffuse, has_specular);
 		else
+			for (i = 0; i < n; i++)
+				ShadeLight(light_visit[i], 1.0, &color, &base_color,
+					has_diffuse, has_specular);
+	}
+	else
+		for (lite = ray_light_list; lite != NULL; lite = lite->next)
 		{
-			lite_dir = lite->dir;
-			lite_dist = 0.0;
+			Ray_AddLightContributor(lite, ray_contrib);
+			ShadeLight(lite, 1.0, &color, &base_color, has_diffuse, has_specular);
 		}
 
-		NdotL = V3Dot(&ct.N, &lite_dir);
+	FinishCalcLighting:
+	ct.total_color.x += color.x;
+	ct.total_color.y += color.y;
+	ct.total_color.z += color.z;
+}
 
-		/* If light is behind object go on to next light. */
-		if (NdotL < 0.0)
-			continue;
 
-		/* Determine effect of distance falloff... */
-		if (lite->falloff > 0.0)
+/*
+ * Add the diffuse and specular contribution of one light source, scaled
+ * by weight, to color.
+ */
+static void ShadeLight(Light *lite, double weight, Vec3 *color,
+	Vec3 *base_color, int has_diffuse, int has_specular)
+{
+	Vec3 loc;
+
+	if (lite->type == LIGHT_INFINITE)
+	{
+		LightSample(lite, NULL, weight, color, base_color,
+			has_diffuse, has_specular);
+		return;
+	}
+
+	V3Copy(&loc, &lite->loc);
+	/* Add jitter to light's from point if any. */
+	if (lite->flags & LIGHT_FLAG_JITTER)
+	{
+		if (lite->samples > 1)
 		{
-			lite_scale *= 1.0 / (1.0 + lite->falloff * lite_dist * lite_dist);
-			/* If light is completely diminished go on to next light. */
-			if (lite_scale < min_light_tol)
-				continue;
+			SampleJitteredLight(lite, weight, color, base_color,
+				has_diffuse, has_specular);
+			return;
 		}
+		loc.x += lite->jitter.x * (Frand1(&light_jitter_seed) - 0.5);
+		loc.y += lite->jitter.y * (Frand1(&light_jitter_seed) - 0.5);
+		loc.z += lite->jitter.z * (Frand1(&light_jitter_seed) - 0.5);
+	}
+	LightSample(lite, &loc, weight, color, base_color,
+		has_diffuse, has_specular);
+}
 
-		/* If this is a directional light, add in its direction angle falloff... */
-		if (lite->type == LIGHT_DIRECTIONAL)
-		{
-			double cosa = V3Dot(&lite->dir, &lite_dir);
-			if (cosa < EPSILON)
-				continue;
-			if (lite->angle_min > 0.0)
+
+/*
+ * Shade with lite->samples shadow samples spread over the light's jitter
+ * box. The box is split into a grid of cells across its two widest sides,
+ * one sample in each cell. The corner cells are sampled first, and if
+ * they all agree the point is taken to be fully lit or fully shadowed and
+ * the rest are skipped, so only the penumbra pays for every sample.
+ */
+static void SampleJitteredLight(Light *lite, double weight, Vec3 *color,
+	Vec3 *base_color, int has_diffuse, int has_specular)
+{
+	Vec3 sum, loc;
+	double *jit = &lite->jitter.x, *pos = &loc.x, *center = &lite->loc.x;
+	int g, i, j, pass, corner, state, first = -1, agree = 1, taken = 0;
+	int ua, va, wa;
+
+	/* The two widest sides of the box get stratified. */
+	ua = (fabs(jit[X_AXIS]) >= fabs(jit[Y_AXIS])) ? X_AXIS : Y_AXIS;
+	va = (ua == X_AXIS) ? Y_AXIS : X_AXIS;
+	wa = Z_AXIS;
+	if (fabs(jit[Z_AXIS]) > fabs(jit[va]))
+	{
+		wa = va;
+		va = Z_AXIS;
+	}
+
+	g = (int)ceil(sqrt((double)lite->samples));
+	V3Zero(&sum);
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (i = 0; i < g; i++)
+			for (j = 0; j < g; j++)
 			{
-				/* See if we are within cone aperture... */
-				if (cosa < lite->angle_min)
+				corner = (i == 0 || i == g - 1) && (j == 0 || j == g - 1);
+				if (corner != (pass == 0))
 					continue;
-				if (cosa < lite->angle_max)
-				{
-					/* Cone has a soft edge, factor in its falloff... */
-					lite_scale *= (cosa - lite->angle_min) / lite->angle_diff;
-				}
+				pos[ua] = center[ua] +
+					jit[ua] * ((i + Frand1(&light_jitter_seed)) / g - 0.5);
+				pos[va] = center[va] +
+					jit[va] * ((j + Frand1(&light_jitter_seed)) / g - 0.5);
+				pos[wa] = center[wa] +
+					jit[wa] * (Frand1(&light_jitter_seed) - 0.5);
+				state = LightSample(lite, &loc, 1.0, &sum, base_color,
+					has_diffuse, has_specular);
+				if (first < 0)
+					first = state;
+				else if (state != first)
+					agree = 0;
+				taken++;
 			}
-			lite_scale *= pow(cosa, lite->focus);
-			/* If light is completely diminished goto next light. */
-			if(lite_scale < min_light_tol)
-				continue;
-		}
+		/* Corners all lit or all blocked, so no penumbra here. */
+		if (agree && first != LIGHT_PARTIAL)
+			break;
+	}
+
+	weight /= (double)taken;
+	color->x += sum.x * weight;
+	color->y += sum.y * weight;
+	color->z += sum.z * weight;
+}
 
-		/* Calc shadow weight. */
-		if ((lite->flags & LIGHT_FLAG_NO_SHADOW) == 0)
-		{
-			if (Ray_TraceShadowRay(&lite_dir, lite, &shadow_color))
-				continue;
-		}
-		else
-			V3Set(&shadow_color, 1.0, 1.0, 1.0);
 
-		shadow_color.x *= lite_scale;
-		shadow_color.y *= lite_scale;
-		shadow_color.z *= lite_scale;
+/*
+ * Calc falloff and add the diffuse and specular contribution of a light
+ * source at loc, or of an infinite light if loc is NULL, scaled by weight,
+ * to color. Returns LIGHT_DARK if nothing was added, LIGHT_LIT if the
+ * light was unshadowed, or LIGHT_PARTIAL if it shone through something.
+ */
+static int LightSample(Light *lite, Vec3 *loc, double weight, Vec3 *color,
+	Vec3 *base_color, int has_diffuse, int has_specular)
+{
+	Vec3		shadow_color;
+	double		NdotL, lite_scale, lite_dist;
+	Vec3		lite_dir;
+	int			state;
 
-		/* Add in diffuse contribution... */
-		if (has_diffuse)
+	lite_scale = 1.0;
+	V3Set(&shadow_color, 1.0, 1.0, 1.0);
+
+	if (loc != NULL)
+	{
+		/* Get direction vector to light source... */
+		V3Sub(&lite_dir, loc, &ct.Q);
+		lite_dist = V3Mag(&lite_dir);
+		if (lite_dist > EPSILON)
 		{
-			color.x += lite->color.x * NdotL * ct.kd.x * shadow_color.x
-				* base_color.x;
-			color.y += lite->color.y * NdotL * ct.kd.y * shadow_color.y
-				* base_color.y;
-			color.z += lite->color.z * NdotL * ct.kd.z * shadow_color.z
-				* base_color.z;
+			lite_dir.x /= lite_dist;
+			lite_dir.y /= lite_dist;
+			lite_dir.z /= lite_dist;
 		}
+	}
+	else
+	{
+		lite_dir = lite->dir;
+		lite_dist = 0.0;
+	}
 
-		/* Add in specular contribution... */
-		if (has_specular && !(lite->flags & LIGHT_FLAG_NO_SPECULAR))
+	NdotL = V3Dot(&ct.N, &lite_dir);
+
+	/* If light is behind object go on to next light. */
+	if (NdotL < 0.0)
+		return LIGHT_DARK;
+
+	/* Determine effect of distance falloff... */
+	if (lite->falloff > 0.0)
+	{
+		lite_scale *= 1.0 / (1.0 + lite->falloff * lite_dist * lite_dist);
+		/* If light is completely diminished go on to next light. */
+		if (lite_scale < min_light_tol)
+			return LIGHT_DARK;
+	}
+
+	/* If this is a directional light, add in its direction angle falloff... */
+	if (lite->type == LIGHT_DIRECTIONAL)
+	{
+		double cosa = V3Dot(&lite->dir, &lite_dir);
+		if (cosa < EPSILON)
+			return LIGHT_DARK;
+		if (lite->angle_min > 0.0)
 		{
-			double RdotV, spec;
-			lite_dir.x -= ct.N.x * NdotL * 2.0;
-			lite_dir.y -= ct.N.y * NdotL * 2.0;
-			lite_dir.z -= ct.N.z * NdotL * 2.0;
-			RdotV = V3Dot(&lite_dir, &ct.D);
-			spec = pow(RdotV, ct.Phong) * lite_scale;
-			color.x += lite->color.x * spec * ct.ks.x * shadow_color.x;
-			color.y += lite->color.y * spec * ct.ks.y * shadow_color.y;
-			color.z += lite->color.z * spec * ct.ks.z * shadow_color.z;
+			/* See if we are within cone aperture... */
+			if (cosa < lite->angle_min)
+				return LIGHT_DARK;
+			if (cosa < lite->angle_max)
+			{
+				/* Cone has a soft edge, factor in its falloff... */
+				lite_scale *= (cosa - lite->angle_min) / lite->angle_diff;
+			}
 		}
+		lite_scale *= pow(cosa, lite->focus);
+		/* If light is completely diminished goto next light. */
+		if(lite_scale < min_light_tol)
+			return LIGHT_DARK;
 	}
 
-	FinishCalcLighting:
-	ct.total_color.x += color.x;
-	ct.total_color.y += color.y;
-	ct.total_color.z += color.z;
+	/* Calc shadow weight. */
+	if ((lite->flags & LIGHT_FLAG_NO_SHADOW) == 0)
+	{
+		if (Ray_TraceShadowRay(&lite_dir, lite, &shadow_color))
+			return LIGHT_DARK;
+	}
+	else
+		V3Set(&shadow_color, 1.0, 1.0, 1.0);
+	state = (shadow_color.x == 1.0 && shadow_color.y == 1.0 &&
+		shadow_color.z == 1.0) ? LIGHT_LIT : LIGHT_PARTIAL;
+
+	shadow_color.x *= lite_scale * weight;
+	shadow_color.y *= lite_scale * weight;
+	shadow_color.z *= lite_scale * weight;
+
+	/* Add in diffuse contribution... */
+	if (has_diffuse)
+	{
+		color->x += lite->color.x * NdotL * ct.kd.x * shadow_color.x
+			* base_color->x;
+		color->y += lite->color.y * NdotL * ct.kd.y * shadow_color.y
+			* base_color->y;
+		color->z += lite->color.z * NdotL * ct.kd.z * shadow_color.z
+			* base_color->z;
+	}
+
+	/* Add in specular contribution... */
+	if (has_specular && !(lite->flags & LIGHT_FLAG_NO_SPECULAR))
+	{
+		double RdotV, spec;
+		lite_dir.x -= ct.N.x * NdotL * 2.0;
+		lite_dir.y -= ct.N.y * NdotL * 2.0;
+		lite_dir.z -= ct.N.z * NdotL * 2.0;
+		RdotV = V3Dot(&lite_dir, &ct.D);
+		spec = pow(RdotV, ct.Phong) * lite_scale;
+		color->x += lite->color.x * spec * ct.ks.x * shadow_color.x;
+		color->y += lite->color.y * spec * ct.ks.y * shadow_color.y;
+		color->z += lite->color.z * spec * ct.ks.z * shadow_color.z;
+	}
+
+	return state;
 }
 
 Light *NewLight(void)
@@ -237,7 +751,8 @@ Light *NewLight(void)
     V3Set(&lite->color, 1.0, 1.0, 1.0);
     V3Set(&lite->dir, 0.0, 0.0, 1.0);
     V3Set(&lite->jitter, 0.0, 0.0, 0.0);
-    lite->block_obj_cached = NULL;
+    lite->samples = 1;
+    lite->id = next_light_id++;
   }
   return lite;
 }
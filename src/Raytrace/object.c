@@ -11,11 +11,15 @@
 unsigned long ray_num_objects = 0;
 Object* ray_object_list = NULL;
 
+/* Id of the next Object made. */
+static unsigned long next_object_id;
+
 
 int InitializeObject(void)
 {
 	ray_object_list = NULL;
 	ray_num_objects = 0;
+	next_object_id = 0;
 
 	/* Reset the statistics counters. */
 	ray_blob_tests = 0;
@@ -68,6 +72,7 @@ Object *NewObject(void)
 		obj->next = NULL;
 		obj->surface = NULL;
 		obj->T = NULL;
+		obj->id = next_object_id++;
 		ray_num_objects++;
 	}
 	return obj;
@@ -130,10 +135,24 @@ Object *Ray_DeleteObject(Object *obj)
 
 void Ray_AddObject(Object **olist, Object *obj)
 {
+	Object *flat, *last;
+
 	if (obj != NULL)
 	{
 		csg_nest_level = 0;
 		Ray_PostProcessObject(obj);
+
+		/* Plain groups are bounded along with everything else. */
+		if ((flat = Ray_FlattenCSGGroup(obj)) != NULL)
+		{
+			Ray_DeleteObject(obj);
+			for (last = flat; last->next != NULL; last = last->next)
+				;
+			last->next = *olist;
+			*olist = flat;
+			return;
+		}
+
 		obj->next = *olist;
 		*olist = obj;
 	}
@@ -172,6 +191,53 @@ Object *Ray_CloneObject(Object *srcobj)
 }
 
 
+/*
+ * True if any object in list "objs", or inside its bounding boxes, CSG
+ * objects and batches, has a surface that may let light through.
+ */
+int ObjectsLetLightThrough(Object *objs)
+{
+	Object *obj, *inner;
+
+	for (obj = objs; obj != NULL; obj = obj->next)
+	{
+		if (obj->surface != NULL && SurfaceLetsLightThrough(obj->surface))
+			return 1;
+		switch (obj->procs->type)
+		{
+			case OBJ_BBOX:
+				inner = obj->data.bbox->objects;
+				break;
+			case OBJ_CSGGROUP:
+			case OBJ_CSGUNION:
+			case OBJ_CSGDIFFERENCE:
+			case OBJ_CSGINTERSECTION:
+			case OBJ_CSGCLIP:
+				inner = obj->data.csg->children;
+				break;
+			case OBJ_BOXBATCH:
+				inner = obj->data.boxbatch->objects;
+				break;
+			case OBJ_DISCBATCH:
+				inner = obj->data.discbatch->objects;
+				break;
+			case OBJ_SPHEREBATCH:
+				inner = obj->data.spherebatch->objects;
+				break;
+			case OBJ_TORUSBATCH:
+				inner = obj->data.torusbatch->objects;
+				break;
+			default:
+				inner = NULL;
+				break;
+		}
+		if (inner != NULL && ObjectsLetLightThrough(inner))
+			return 1;
+	}
+	return 0;
+}
+
+
 void Object_GetTextureInfo(Object *obj, Surface **surf, Xform **T)
 {
 	switch (obj->procs->type)
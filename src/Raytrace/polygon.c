@@ -20,6 +20,8 @@ static void TransformPolygon(Object *obj, Vec3 *params, int type);
 static void CopyPolygon(Object *destobj, Object *srcobj);
 static void DeletePolygon(Object *obj);
 static void DrawPolygon(Object *obj);
+static void BuildPolygonBands(PolygonData *ply);
+static void FreePolygonBands(PolygonData *ply);
 
 static ObjectProcs polygon_procs =
 {
@@ -84,6 +86,112 @@ void SetupPolygon(PolygonData *ply)
 		ply->axis = Y_AXIS;
 	else
 		ply->axis = Z_AXIS;
+
+	BuildPolygonBands(ply);
+}
+
+
+/*
+ * Band containing projected coordinate y. Monotone in y, so an edge that
+ * spans y always lies in a band between those of its two end points.
+ */
+static int PolygonBand(PolygonData *ply, double y)
+{
+	int k = (int)((y - ply->band_ymin) * ply->band_scale);
+
+	if(k < 0)
+		return 0;
+	if(k >= ply->nbands)
+		return ply->nbands - 1;
+	return k;
+}
+
+
+static void FreePolygonBands(PolygonData *ply)
+{
+	if(ply->band_start != NULL)
+		Free(ply->band_start, (ply->nbands + 1) * sizeof(int));
+	if(ply->band_edges != NULL)
+		Free(ply->band_edges, ply->nbandedges * sizeof(int));
+	ply->band_start = NULL;
+	ply->band_edges = NULL;
+	ply->nbands = 0;
+	ply->nbandedges = 0;
+}
+
+
+/*
+ * Sort the projected edges of a large polygon into horizontal bands.
+ * Each edge is listed in every band its y range touches. A point can
+ * only be crossed by edges that straddle its y, so testing the edges
+ * of its band gives the same answer as testing them all.
+ * Small polygons are left without bands.
+ */
+static void BuildPolygonBands(PolygonData *ply)
+{
+	int i, j, k, lo, hi, B, nbands, total;
+	double y0, y1, ymin, ymax;
+	int *start;
+
+	FreePolygonBands(ply);
+	if(ply->npts < POLYGON_BAND_MIN)
+		return;
+
+	B = (ply->axis == Z_AXIS) ? 1 : 2;
+	ymin = ymax = ply->pts[B];
+	for(i = 1; i < ply->npts; i++)
+	{
+		y0 = ply->pts[i*3+B];
+		ymin = fmin(ymin, y0);
+		ymax = fmax(ymax, y0);
+	}
+	if(!(ymax > ymin))
+		return;
+
+	nbands = ply->npts / 2;
+	if(nbands > 1024)
+		nbands = 1024;
+	if((start = (int *)Calloc(nbands + 1, sizeof(int))) == NULL)
+		return;
+	ply->band_start = start;
+	ply->nbands = nbands;
+	ply->band_ymin = ymin;
+	ply->band_ymax = ymax;
+	ply->band_scale = (double)nbands / (ymax - ymin);
+
+	/* Count the edges in each band and turn the counts into end offsets. */
+	for(i = 0; i < ply->npts; i++)
+	{
+		j = (i < ply->npts - 1) ? i + 1 : 0;
+		y0 = ply->pts[i*3+B];
+		y1 = ply->pts[j*3+B];
+		lo = PolygonBand(ply, fmin(y0, y1));
+		hi = PolygonBand(ply, fmax(y0, y1));
+		for(k = lo; k <= hi; k++)
+			start[k]++;
+	}
+	for(k = 1; k < nbands; k++)
+		start[k] += start[k-1];
+	total = start[nbands] = start[nbands-1];
+
+	if((ply->band_edges = (int *)Malloc(total * sizeof(int))) == NULL)
+	{
+		FreePolygonBands(ply);
+		return;
+	}
+	ply->nbandedges = total;
+
+	/* Fill each band from its end, leaving start[k] at its first edge. */
+	for(i = 0; i < ply->npts; i++)
+	{
+		j = (i < ply->npts - 1) ? i + 1 : 0;
+		y0 = ply->pts[i*3+B];
+		y1 = ply->pts[j*3+B];
+		lo = PolygonBand(ply, fmin(y0, y1));
+		hi = PolygonBand(ply, fmax(y0, y1));
+		for(k = lo; k <= hi; k++)
+			ply->band_edges[--start[k]] = i;
+	}
 }
 
 
@@ -96,6 +204,10 @@ Object *Ray_MakePolygon(float *pts, int npts)
 		PolygonData *polygon = (PolygonData *)Malloc(sizeof(PolygonData));
 		if (polygon != NULL)
 		{
+			polygon->nbands = 0;
+			polygon->nbandedges = 0;
+			polygon->band_start = NULL;
+			polygon->band_edges = NULL;
 			if (npts >= 3)
 			{
 				polygon->npts = npts;
@@ -189,6 +301,8 @@ Object *Ray_MakeNPolygon(int npts)
 		ply->nx = 0.0;
 		ply->ny = 0.0;
 		ply->nz = 1.0;
+
+		BuildPolygonBands(ply);
 	}
 
 	return obj;
@@ -202,6 +316,10 @@ int Ray_PolygonAddVertex(Object *obj, Vec3 *point)
 	assert(obj != NULL);
 	assert(obj->data.polygon != NULL);
 	ply = obj->data.polygon;
+
+	/* Bands are rebuilt when the polygon is finished. */
+	FreePolygonBands(ply);
+
 	if((newpts = (float *)Calloc((ply->npts + 1) * 3, sizeof(float))) != NULL)
 	{
 		oldpts = ply->pts;
@@ -236,12 +354,48 @@ int Ray_PolygonFinish(Object *obj)
 }
 
 
+/*
+ * Crossing test of the projected point (x, y) against edge i.
+ * Returns 1 if a ray from the point toward +x crosses the edge.
+ */
+static int PolygonEdgeCrossing(PolygonData *ply, int i, int A, int B,
+	double x, double y)
+{
+	double d, x0, y0, x1, y1;
+
+	x0 = ply->pts[i*3+A];
+	y0 = ply->pts[i*3+B];
+	if(i < ply->npts - 1)
+	{
+		x1 = ply->pts[(i+1)*3+A];
+		y1 = ply->pts[(i+1)*3+B];
+	}
+	else
+	{
+		x1 = ply->pts[A];
+		y1 = ply->pts[B];
+	}
+
+	if((y0 < y && y1 < y) ||
+		 (y0 > y && y1 > y) ||
+		 (x0 < x && x1 < x)) return 0;
+
+	if(x0 > x && x1 > x)
+		return 1;
+
+	d = (y0 - y) / (y0 - y1);
+	d = x0 * (1.0 - d) + x1 * d;
+
+	return (x < d);
+}
+
+
 int IntersectPolygon(Object *obj, HitData *hits)
 {
 	PolygonData *ply;
-	double d, t, x, y, x0, y0, x1, y1;
+	double d, t, x, y;
 	Vec3 P;
-	int i, A, B, in;
+	int i, k, A, B, in;
 
 	ray_polygon_tests++;
 
@@ -301,36 +455,19 @@ int IntersectPolygon(Object *obj, HitData *hits)
 	 * see if it is within the bounds of the projected polygon.
 	 */
 	in = 0;
-	for(i = 0; i < ply->npts; i++)
+	if(ply->nbands > 0)
 	{
-		x0 = ply->pts[i*3+A];
-		y0 = ply->pts[i*3+B];
-		if(i < ply->npts - 1)
-		{
-			x1 = ply->pts[(i+1)*3+A];
-			y1 = ply->pts[(i+1)*3+B];
-		}
-		else
-		{
-			x1 = ply->pts[A];
-			y1 = ply->pts[B];
-		}
-
-		if((y0 < y && y1 < y) ||
-			 (y0 > y && y1 > y) ||
-			 (x0 < x && x1 < x)) continue;
-
-		if(x0 > x && x1 > x)
-		{
-			in = 1 - in;
-			continue;
-		}
-
-		d = (y0 - y) / (y0 - y1);
-		d = x0 * (1.0 - d) + x1 * d;
-
-		if(x < d)
-			in = 1 - in;
+		/* Only the edges in the point's band can straddle it. */
+		if(!(y >= ply->band_ymin && y <= ply->band_ymax))
+			return 0;
+		k = PolygonBand(ply, y);
+		for(i = ply->band_start[k]; i < ply->band_start[k+1]; i++)
+			in ^= PolygonEdgeCrossing(ply, ply->band_edges[i], A, B, x, y);
+	}
+	else
+	{
+		for(i = 0; i < ply->npts; i++)
+			in ^= PolygonEdgeCrossing(ply, i, A, B, x, y);
 	}
 
 	if(in)
@@ -489,10 +626,18 @@ void CopyPolygon(Object *destobj, Object *srcobj)
 	if(destpolygon != NULL)
 	{
 		*destpolygon = *srcpolygon;
+		destpolygon->nbands = 0;
+		destpolygon->nbandedges = 0;
+		destpolygon->band_start = NULL;
+		destpolygon->band_edges = NULL;
 		destpolygon->pts = (float *)Malloc(sizeof(float) * srcpolygon->npts * 3);
 		if(destpolygon->pts != NULL)
+		{
 			memcpy(destpolygon->pts, srcpolygon->pts, sizeof(float) *
 				srcpolygon->npts * 3);
+			if(srcpolygon->nbands > 0)
+				BuildPolygonBands(destpolygon);
+		}
 	}
 }
 
@@ -502,6 +647,7 @@ void DeletePolygon(Object *obj)
 	PolygonData *polygon = obj->data.polygon;
 	if(polygon != NULL)
 	{
+		FreePolygonBands(polygon);
 		Free(polygon->pts, sizeof(float) * polygon->npts * 3);
 		Free(polygon, sizeof(PolygonData));
 	}
@@ -26,6 +26,24 @@
 #define RAY_SHADOW        8
 #define RAY_USER          16
 
+/*
+ * Shadow blocker caches of the thread tracing a trace stack. Each light,
+ * by its id, has SHADOW_CACHE_BUCKETS buckets chosen by receiving object
+ * and screen cell, each holding the most recent blockers, newest first.
+ * Screen cells are 1/SHADOW_CACHE_CELLS of the screen height across.
+ */
+#define SHADOW_CACHE_BUCKETS 64
+#define SHADOW_CACHE_DEPTH 2
+#define SHADOW_CACHE_CELLS 8
+
+typedef struct tag_shadowcache
+{
+	Object **blockers;	/* The buckets of light 0, then light 1, ... */
+	unsigned int nlights;	/* Lights there are buckets for. */
+	unsigned long hits, misses;	/* Shadow rays settled, or not, by them. */
+	int see_through;	/* True if any object may let light through. */
+} ShadowCache;
+
 /**
  *	Ray-trace recursion stack element.
  */
@@ -46,8 +64,57 @@ typedef struct tag_tracestack
 	Surface *surface;	/* The surface to use for shading. */
 	Vec3 weight;		/* Contribution significance for this ray. */
 	Vec3 total_color;	/* Cummulative color total for this ray. */
+	int resume;			/* Secondary ray to trace on coming back to this level. */
+	ShadowCache *shadow_cache;	/* Shared by all levels of the stack. */
 } TraceStack;
 
+/**
+ *	What shading a hit with its surface needs to know that can only be
+ *	found while it is the latest hit. See FindHitSurface().
+ */
+typedef struct tag_surfacehit
+{
+	Surface *surface;	/* Surface to shade the hit with. */
+	Xform *T;			/* Texture transform of the object hit, if any. */
+	Vec3 O, ON;			/* Hit point and normal in the surface's space. */
+	double u, v;		/* UV map of the hit. */
+} SurfaceHit;
+
+/**
+ *	Ray set up for slab tests against many boxes.
+ */
+typedef struct tag_slabray
+{
+	Vec3 B;				/* Ray base point. */
+	Vec3 inv;			/* 1 / D, infinite where the ray is parallel to an axis. */
+	int sx, sy, sz;		/* 1 where D is negative, selects the near planes. */
+} SlabRay;
+
+/* Boxes tested at once by IntersectSlabsN(). */
+#define SLAB_CHUNK 8
+
+/* Most eye rays in a packet (a square tile), and words in a ray mask. */
+#define PACKET_SIDE 8
+#define PACKET_SIZE (PACKET_SIDE * PACKET_SIDE)
+#define PACKET_WORDS ((PACKET_SIZE + 31) / 32)
+
+/**
+ *	Eye rays from a shared base point, traced through the bounding
+ *	tree together.
+ */
+typedef struct tag_raypacket
+{
+	int n;					/* Number of rays. */
+	Vec3 B;					/* Shared ray base point. */
+	Vec3 D[PACKET_SIZE];	/* Ray directions. */
+	double u[PACKET_SIZE], v[PACKET_SIZE];	/* Screen UV of each ray. */
+	SlabRay sr[PACKET_SIZE];	/* Rays set up for slab tests. */
+	Vec3 inv_min, inv_max;	/* Range of 1 / D over the rays. */
+	int sx, sy, sz;			/* Shared SlabRay sign per axis, -1 if mixed. */
+	double t[PACKET_SIZE];	/* Closest hit of each ray... */
+	Object *obj[PACKET_SIZE];	/* ...and the listed object reporting it. */
+} RayPacket;
+
 
 
 /*
@@ -61,6 +128,7 @@ extern void Ray_DoBackground(void);
  * bound.c
  */
 extern void PostProcessBBox(Object *obj);
+extern void BatchBoundedObjects(Object **root);
 extern void BBox_GetTextureInfo(Object *obj, Surface **surf, Xform **T);
 
 /*
@@ -68,6 +136,11 @@ extern void BBox_GetTextureInfo(Object *obj, Surface **surf, Xform **T);
  */
 extern int Intersect_Box(Vec3 *B, Vec3 *D, Vec3 *bmin, Vec3 *bmax,
   double *T1, double *T2);
+extern void SetupSlabRay(SlabRay *r, Vec3 *B, Vec3 *D);
+extern int IntersectSlabs(SlabRay *r, Vec3 *bmin, Vec3 *bmax,
+  double *T1, double *T2);
+extern void IntersectSlabsN(SlabRay *r, double *bounds, int stride, int n,
+  double *T1, double *T2);
 
 /*
  * colortri.c
@@ -79,6 +152,7 @@ extern void ColorTriangleGetColor(Object *obj, Vec3 *color);
  */
 extern int csg_nest_level;
 extern void PostProcessCSG(Object *obj);
+extern Object *Ray_FlattenCSGGroup(Object *obj);
 extern void CSG_GetTextureInfo(Object *obj, Surface **surf, Xform **T);
 
 /*
@@ -90,8 +164,17 @@ extern HitData *NewHitData(void);
 extern HitData *DeleteHits(HitData *hits);
 extern HitData *GetNextHit(HitData *hit);
 extern int FindClosestIntersection(Object *first_obj, HitData *hits);
+extern int FindClosestHit(Object *first_obj, HitData *hits);
+extern void CalcHitNormal(void);
 extern int FindAllIntersections(Object *first_obj, HitData *hits);
+extern Object *FindAnyIntersection(Object *first_obj, HitData *hits,
+  int *see_through);
+extern void SetupPacket(RayPacket *pk);
+extern void FindClosestIntersections(Object *first_obj, RayPacket *pk,
+	HitData *hits);
+extern int ResolvePacketHit(RayPacket *pk, int i, HitData *hits);
 extern void SortHits(HitData *hits, int nhits);
+extern int skip_object(Object *obj);
 
 /*
  * light.c
@@ -125,6 +208,7 @@ extern void CalcBoundObjectExtents(Object *boundobjs,
 	Vec3 *omin, Vec3 *omax);
 extern void Ray_PostProcessObject(Object *obj);
 extern void Object_GetTextureInfo(Object *obj, Surface **surf, Xform **T);
+extern int ObjectsLetLightThrough(Object *objs);
 extern Object *ray_object_list;
 
 /*
@@ -142,9 +226,25 @@ extern void (*Set_Pt)(int pt_ndx, double x, double y, double z);
 extern void (*Move_To)(int pt_ndx);
 extern void (*Line_To)(int pt_ndx);
 
+/*
+ * box.c
+ */
+extern Object *Ray_MakeBoxBatch(Object *boxes);
+
+/*
+ * disc.c
+ */
+extern Object *Ray_MakeDiscBatch(Object *discs);
+
 /*
  * sphere.c
  */
+extern Object *Ray_MakeSphereBatch(Object *spheres);
+
+/*
+ * torus.c
+ */
+extern Object *Ray_MakeTorusBatch(Object *tori);
 
 /*
  * shader.c
@@ -158,6 +258,11 @@ extern void CloseShader(void);
 extern int InitializeSurface(void);
 extern void CloseSurface(void);
 extern void ShadeSurface(void);
+extern void FindHitSurface(SurfaceHit *sh);
+extern void ShadeSurfaceHit(SurfaceHit *sh);
+extern Surface *HitSurface(Object *obj);
+extern int SurfaceIsOpaque(Object *obj);
+extern int SurfaceLetsLightThrough(Surface *surf);
 extern Surface *DefaultSurface;
 
 /*
@@ -165,8 +270,15 @@ extern Surface *DefaultSurface;
  */
 extern int Ray_TraceRay(RayInitData *raydata);
 extern int Ray_TraceShadowRay(Vec3 *D, Light *light, Vec3 *color);
+extern int Ray_IsOccluded(Vec3 *color);
 extern void TraceRecursiveRay(void);
+extern int TracePacket(RayPacket *pk, Vec3 *colors);
+extern void TraceWavefront(void);
+extern void CloseTrace(void);
 extern void TraceRecursiveShadowRay(void);
+extern void AddContributor(unsigned int *bits, unsigned int key);
+/* Contributor filter of the rays traced since it was last got. */
+extern unsigned int ray_contrib[RAY_CONTRIB_WORDS];
 
 /*
  * tracestk.c
@@ -176,9 +288,10 @@ extern int SetupTraceStack(void);
 extern void CloseTraceStack(void);
 extern void PushTraceStack(void);
 extern void PopTraceStack(void);
-extern void UpdateTraceStack(void);
+extern void SetTraceStackLevel(int level);
 /* Current and previous trace levels. */
-extern TraceStack ct, pt;
+extern TraceStack *ray_ct, *pt;
+#define ct (*ray_ct)
 
 /*
  * viewport.c
@@ -191,6 +304,7 @@ extern void ViewportInitialize(void);
 extern void InitializeVisibility(void);
 extern void CloseVisibility(void);
 extern void Ray_ApplyVisibility(void);
+extern double Ray_VisibilityFactor(void);
 
 /*
  * xform.c
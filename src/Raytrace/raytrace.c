@@ -72,6 +72,9 @@ int Ray_Initialize(void)
 		ray_max_cluster_size = 8;
 		ray_global_ior = 1.0;
 		ray_use_fake_caustics = 0;
+		ray_use_wavefront = 0;
+		ray_use_deferred = 0;
+		ray_light_samples = 0;
 
 		ray_object_list = NULL;
 		ray_light_list = NULL;
@@ -126,6 +129,15 @@ int Ray_Setup(RaySetupData *rsd)
 	/* If true, generate fake caustics in shadows. */
 	ray_use_fake_caustics = rsd->use_fake_caustics;
 
+	/* If true, packets trace their secondary rays a bounce at a time. */
+	ray_use_wavefront = rsd->use_wavefront;
+
+	/* If true, packets shade their eye hits grouped by surface. */
+	ray_use_deferred = rsd->use_deferred;
+
+	/* If non-zero, most lights to sample per hit when more can contribute. */
+	ray_light_samples = rsd->light_samples;
+
 	/* Global index of refraction for the world. */
 	ray_global_ior = rsd->global_ior;
 
@@ -142,6 +154,7 @@ int Ray_Setup(RaySetupData *rsd)
 	SetupLight();
 
 	Ray_BuildBounds(&ray_object_list);
+	BatchBoundedObjects(&ray_object_list);
 	rsd->objects = ray_object_list;
 
 	if (SetupTraceStack())
@@ -186,6 +199,15 @@ void Ray_GetSetup(RaySetupData *rsd)
 	/* If true, generate fake caustics in shadows. */
 	rsd->use_fake_caustics = ray_use_fake_caustics;
 
+	/* If true, packets trace their secondary rays a bounce at a time. */
+	rsd->use_wavefront = ray_use_wavefront;
+
+	/* If true, packets shade their eye hits grouped by surface. */
+	rsd->use_deferred = ray_use_deferred;
+
+	/* If non-zero, most lights to sample per hit when more can contribute. */
+	rsd->light_samples = ray_light_samples;
+
 	/* Global index of refraction for the world. */
 	rsd->global_ior = ray_global_ior;
 
@@ -208,6 +230,7 @@ void Ray_Close(void)
     CloseVisibility();
 	CloseInter();
 	CloseTraceStack();
+	CloseTrace();
 	CloseLight();
 	CloseObject();
 	CloseSurface();
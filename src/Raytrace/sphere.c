@@ -471,3 +471,373 @@ void DrawSphere(Object *obj)
 		Line_To(1);
 	}
 }
+
+
+/*************************************************************************
+*
+*  Sphere batches.
+*
+*  Spheres in the same bounding tree leaf are tested together. The
+*  quadratic for every sphere in the batch is set up and solved in one
+*  pass over the batch arrays, which the compiler can vectorize. Spheres
+*  without a transform are kept at the front of the batch and skip the
+*  matrix work. Hits are reported on the spheres themselves, so the batch
+*  never shows up as the object hit.
+*
+*************************************************************************/
+
+static int IntersectSphereBatch(Object *obj, HitData *hits);
+static void CalcNormalSphereBatch(Object *obj, Vec3 *P, Vec3 *N);
+static int IsInsideSphereBatch(Object *obj, Vec3 *P);
+static void CalcUVMapSphereBatch(Object *obj, Vec3 *P, double *u, double *v);
+static void CalcExtentsSphereBatch(Object *obj, Vec3 *omin, Vec3 *omax);
+static void TransformSphereBatch(Object *obj, Vec3 *params, int type);
+static void CopySphereBatch(Object *destobj, Object *srcobj);
+static void DeleteSphereBatch(Object *obj);
+static void DrawSphereBatch(Object *obj);
+
+static ObjectProcs spherebatch_procs =
+{
+	OBJ_SPHEREBATCH,
+	IntersectSphereBatch,
+	CalcNormalSphereBatch,
+	IsInsideSphereBatch,
+	CalcUVMapSphereBatch,
+	CalcExtentsSphereBatch,
+	TransformSphereBatch,
+	CopySphereBatch,
+	DeleteSphereBatch,
+	DrawSphereBatch
+};
+
+
+static void SetSphereBatch(SphereBatchData *sb)
+{
+	Object *o, *plain, **plainlink, *xformed, **xformedlink;
+	SphereData *s;
+	int i, k;
+
+	/* Put the spheres without a transform first. */
+	plainlink = &plain;
+	xformedlink = &xformed;
+	sb->nplain = 0;
+	for(o = sb->objects; o != NULL; o = o->next)
+	{
+		if(o->T == NULL)
+		{
+			*plainlink = o;
+			plainlink = &o->next;
+			sb->nplain++;
+		}
+		else
+		{
+			*xformedlink = o;
+			xformedlink = &o->next;
+		}
+	}
+	*xformedlink = NULL;
+	*plainlink = xformed;
+	sb->objects = plain;
+
+	for(i = 0, o = sb->objects; o != NULL; i++, o = o->next)
+	{
+		assert(i < SPHERE_BATCH_MAX);
+		s = o->data.sphere;
+		sb->obj[i] = o;
+		for(k = 0; k < 12; k++)
+			sb->I[k][i] = (o->T != NULL) ? o->T->I.e[k / 3][k % 3] :
+				((k / 3 == k % 3) ? 1.0 : 0.0);
+		sb->x[i] = s->x;
+		sb->y[i] = s->y;
+		sb->z[i] = s->z;
+		sb->rsq[i] = s->r;
+	}
+	sb->n = i;
+}
+
+
+/*
+ * Make a batch of the list of spheres "spheres", which must have no more
+ * than SPHERE_BATCH_MAX members.
+ */
+Object *Ray_MakeSphereBatch(Object *spheres)
+{
+	Object *obj = NewObject();
+	if(obj != NULL)
+	{
+		SphereBatchData *sb = (SphereBatchData *)Malloc(sizeof(SphereBatchData));
+		if(sb != NULL)
+		{
+			sb->objects = spheres;
+			SetSphereBatch(sb);
+			obj->data.spherebatch = sb;
+			obj->procs = &spherebatch_procs;
+		}
+		else
+			obj = Ray_DeleteObject(obj);
+	}
+
+	return obj;
+}
+
+
+int IntersectSphereBatch(Object *obj, HitData *hits)
+{
+	SphereBatchData *sb = obj->data.spherebatch;
+	double t1[SPHERE_BATCH_MAX], t2[SPHERE_BATCH_MAX];
+	double live[SPHERE_BATCH_MAX];
+	double bx, by, bz, dx, dy, dz, a, b, c, d, lo, hi;
+	double t, closest_t = HUGE;
+	Object *closest_obj = NULL, *o;
+	HitData *h = hits;
+	int i, inverse, entering, both, nhits, closest_entering = 0;
+
+	/*
+	 * Solve the quadratic for every sphere in the batch. This is the
+	 * same arithmetic as IntersectSphere(), with conditions turned in
+	 * to selects so the loop is free of branches and can be vectorized
+	 * when the compiler may ignore floating point exceptions
+	 * (e.g. -fno-trapping-math -fno-math-errno). Spheres without a
+	 * transform come first and use the ray as it is.
+	 */
+	a = ct.D.x * ct.D.x + ct.D.y * ct.D.y + ct.D.z * ct.D.z;
+	for(i = 0; i < sb->nplain; i++)
+	{
+		bx = ct.B.x - sb->x[i];
+		by = ct.B.y - sb->y[i];
+		bz = ct.B.z - sb->z[i];
+		b = (ct.D.x * bx + ct.D.y * by + ct.D.z * bz) * 2.0;
+		c = (bx * bx + by * by + bz * bz) - sb->rsq[i];
+		d = b * b - 4.0 * a * c;
+		live[i] = (d < 0.0) ? 0.0 : 1.0;
+		d = (d > 0.0) ? d : 0.0;
+		d = sqrt(d);
+		lo = (-b + d) / (2.0 * a);
+		hi = (-b - d) / (2.0 * a);
+		t1[i] = (lo > hi) ? hi : lo;
+		t2[i] = (lo > hi) ? lo : hi;
+		live[i] = ((t2[i] > ct.tmin) & (t1[i] < ct.tmax)) ? live[i] : 0.0;
+	}
+	for(; i < sb->n; i++)
+	{
+		bx = ct.B.x * sb->I[0][i] + ct.B.y * sb->I[3][i] + ct.B.z * sb->I[6][i] + sb->I[9][i];
+		by = ct.B.x * sb->I[1][i] + ct.B.y * sb->I[4][i] + ct.B.z * sb->I[7][i] + sb->I[10][i];
+		bz = ct.B.x * sb->I[2][i] + ct.B.y * sb->I[5][i] + ct.B.z * sb->I[8][i] + sb->I[11][i];
+		dx = ct.D.x * sb->I[0][i] + ct.D.y * sb->I[3][i] + ct.D.z * sb->I[6][i];
+		dy = ct.D.x * sb->I[1][i] + ct.D.y * sb->I[4][i] + ct.D.z * sb->I[7][i];
+		dz = ct.D.x * sb->I[2][i] + ct.D.y * sb->I[5][i] + ct.D.z * sb->I[8][i];
+		bx -= sb->x[i];
+		by -= sb->y[i];
+		bz -= sb->z[i];
+		a = dx * dx + dy * dy + dz * dz;
+		b = (dx * bx + dy * by + dz * bz) * 2.0;
+		c = (bx * bx + by * by + bz * bz) - sb->rsq[i];
+		d = b * b - 4.0 * a * c;
+		live[i] = (d < 0.0) ? 0.0 : 1.0;
+		d = (d > 0.0) ? d : 0.0;
+		d = sqrt(d);
+		lo = (-b + d) / (2.0 * a);
+		hi = (-b - d) / (2.0 * a);
+		t1[i] = (lo > hi) ? hi : lo;
+		t2[i] = (lo > hi) ? lo : hi;
+		live[i] = ((t2[i] > ct.tmin) & (t1[i] < ct.tmax)) ? live[i] : 0.0;
+	}
+
+	/* Report the hits. */
+	nhits = 0;
+	for(i = 0; i < sb->n; i++)
+	{
+		o = sb->obj[i];
+		if(skip_object(o))
+			continue;
+		ray_sphere_tests++;
+		if(live[i] == 0.0)
+			continue;
+
+		inverse = (o->flags & OBJ_FLAG_INVERSE);
+		if(t1[i] > ct.tmin)
+		{
+			t = t1[i];
+			entering = !inverse;
+			both = (t2[i] < ct.tmax);
+		}
+		else if(t2[i] < ct.tmax)
+		{
+			t = t2[i];
+			entering = inverse;
+			both = 0;
+		}
+		else
+			continue;
+		ray_sphere_hits++;
+
+		if(!ct.calc_all)
+		{
+			/* Only the closest hit is wanted. */
+			if(t < closest_t)
+			{
+				closest_t = t;
+				closest_obj = o;
+				closest_entering = entering;
+			}
+			continue;
+		}
+
+		if(nhits++ > 0)
+			h = GetNextHit(h);
+		h->t = t;
+		h->obj = o;
+		h->entering = entering;
+		if(both)
+		{
+			nhits++;
+			h = GetNextHit(h);
+			h->t = t2[i];
+			h->obj = o;
+			h->entering = inverse;
+		}
+	}
+
+	if(closest_obj != NULL)
+	{
+		hits->t = closest_t;
+		hits->obj = closest_obj;
+		hits->entering = closest_entering;
+		return 1;
+	}
+
+	SortHits(hits, nhits);
+	return nhits;
+}
+
+
+/*
+ * Hits on a batch are reported on its spheres, so normals and uv maps
+ * are only asked of the batch from outside the ray tracer. Hand those
+ * to the sphere whose surface is nearest P.
+ */
+static Object *NearestSphere(Object *obj, Vec3 *P)
+{
+	Object *o, *best;
+	SphereData *s;
+	Vec3 P2;
+	double px, py, pz, d, bestd;
+
+	best = obj->data.spherebatch->objects;
+	bestd = HUGE;
+	for(o = best; o != NULL; o = o->next)
+	{
+		s = o->data.sphere;
+		V3Copy(&P2, P);
+		if(o->T != NULL)
+			PointToObject(&P2, o->T);
+		px = P2.x - s->x;
+		py = P2.y - s->y;
+		pz = P2.z - s->z;
+		d = fabs(sqrt(px * px + py * py + pz * pz) - sqrt(s->r));
+		if(d < bestd)
+		{
+			bestd = d;
+			best = o;
+		}
+	}
+	return best;
+}
+
+
+void CalcNormalSphereBatch(Object *obj, Vec3 *P, Vec3 *N)
+{
+	Object *o = NearestSphere(obj, P);
+
+	o->procs->CalcNormal(o, P, N);
+}
+
+
+void CalcUVMapSphereBatch(Object *obj, Vec3 *P, double *u, double *v)
+{
+	Object *o = NearestSphere(obj, P);
+
+	o->procs->CalcUVMap(o, P, u, v);
+}
+
+
+int IsInsideSphereBatch(Object *obj, Vec3 *P)
+{
+	Object *o;
+
+	for(o = obj->data.spherebatch->objects; o != NULL; o = o->next)
+		if(o->procs->IsInside(o, P))
+			return 1;
+	return 0;
+}
+
+
+void CalcExtentsSphereBatch(Object *obj, Vec3 *omin, Vec3 *omax)
+{
+	Object *o = obj->data.spherebatch->objects;
+	Vec3 bmin, bmax;
+
+	o->procs->CalcExtents(o, omin, omax);
+	for(o = o->next; o != NULL; o = o->next)
+	{
+		o->procs->CalcExtents(o, &bmin, &bmax);
+		omin->x = fmin(omin->x, bmin.x);
+		omax->x = fmax(omax->x, bmax.x);
+		omin->y = fmin(omin->y, bmin.y);
+		omax->y = fmax(omax->y, bmax.y);
+		omin->z = fmin(omin->z, bmin.z);
+		omax->z = fmax(omax->z, bmax.z);
+	}
+}
+
+
+void TransformSphereBatch(Object *obj, Vec3 *params, int type)
+{
+	Object *o;
+
+	for(o = obj->data.spherebatch->objects; o != NULL; o = o->next)
+		Ray_Transform_Object(o, params, type);
+	SetSphereBatch(obj->data.spherebatch);
+}
+
+
+void CopySphereBatch(Object *destobj, Object *srcobj)
+{
+	SphereBatchData *sb = (SphereBatchData *)Malloc(sizeof(SphereBatchData));
+	Object *o, *last = NULL;
+
+	sb->objects = NULL;
+	for(o = srcobj->data.spherebatch->objects; o != NULL; o = o->next)
+	{
+		if(last != NULL)
+			last = last->next = Ray_CloneObject(o);
+		else
+			last = sb->objects = Ray_CloneObject(o);
+	}
+	SetSphereBatch(sb);
+	destobj->data.spherebatch = sb;
+}
+
+
+void DeleteSphereBatch(Object *obj)
+{
+	SphereBatchData *sb = obj->data.spherebatch;
+	Object *o;
+
+	while(sb->objects != NULL)
+	{
+		o = sb->objects;
+		sb->objects = o->next;
+		Ray_DeleteObject(o);
+	}
+	Free(sb, sizeof(SphereBatchData));
+}
+
+
+void DrawSphereBatch(Object *obj)
+{
+	Object *o;
+
+	for(o = obj->data.spherebatch->objects; o != NULL; o = o->next)
+		o->procs->Draw(o);
+}
@@ -12,6 +12,13 @@
 /* If true, generate fake caustics in shadows. */
 int ray_use_fake_caustics;
 
+/* If true, packets trace their secondary rays a bounce at a time. */
+int ray_use_wavefront;
+
+/* If true, packets shade their eye hits grouped by surface before
+ * lighting them. */
+int ray_use_deferred;
+
 /* Minimum and maximum trace distances. */
 double ray_min_trace_dist;
 double ray_min_shadow_dist;
@@ -27,6 +34,9 @@ unsigned long ray_eye_rays_transmitted;
 unsigned long ray_shadow_rays;
 unsigned long ray_shadow_rays_transmitted;
 
+/* Surfaces shaded and lights lit since Ray_GetContributors() was called. */
+unsigned int ray_contrib[RAY_CONTRIB_WORDS];
+
 /* Scaling factor for faked caustics in shadow rays. */
 static double caustics_scale;
 /* True if any shadow rays get refracted during trace. */
@@ -35,12 +45,125 @@ static int rays_bent;
 static Vec3 light_dir;
 /* Current light source being tested for shadows. */
 static Light *shadow_light;
+/* Its blocker cache bucket for the current shadow ray, if any. */
+static Object **shadow_bucket;
+
+/*
+ * A secondary ray waiting for its bounce in the wavefront queue.
+ */
+typedef struct tag_waveray
+{
+	Vec3 B, D;			/* Base point and direction. */
+	Vec3 weight;		/* Contribution significance, as for ct.weight. */
+	Vec3 scale;			/* Factor weighing the ray's color into its pixel. */
+	Vec3 *color;		/* Pixel color receiving the ray's contribution. */
+	double u, v;		/* Screen UV of the pixel. */
+	Object *baseobj;	/* Object the ray is originating from. */
+	int ray_flags;		/* Ray type ID flags. */
+	int trace_level;	/* Depth of the ray on the trace stack. */
+	unsigned long key;	/* Sort key; direction octant, then origin cell. */
+	int seq;			/* Order queued, to keep the sort stable. */
+} WaveRay;
+
+typedef struct tag_wavequeue
+{
+	WaveRay *rays;
+	int n, size;
+} WaveQueue;
+
+/* Rays of the bounce being traced and of the next bounce. */
+static WaveQueue wave_queue[2];
+static int wave_next;
+
+/* Origin cells per axis for sorting a bounce's rays (a power of two). */
+#define WAVE_CELLS 16
+
+/*
+ * The hit of an eye ray in a packet, recorded so that the packet's hits
+ * can be shaded a surface at a time, and the shading that gave.
+ */
+typedef struct tag_deferredhit
+{
+	int hit;			/* False if the ray missed. */
+	int ray;			/* Index of the ray in its packet. */
+	Object *objhit;		/* The hit, as for ct. */
+	Vec3 Q, N;
+	double t;
+	int entering;
+	SurfaceHit sh;		/* Its surface. */
+	Vec3 color, ka, kd, kr, ks, kt;	/* Lighting constants once shaded. */
+	double ior, Phong;
+} DeferredHit;
+
+/* Hits of the packet being traced, in ray order and in shading order. */
+static DeferredHit deferred_hits[PACKET_SIZE];
+static DeferredHit *deferred_order[PACKET_SIZE];
 
 /* Apply index of refraction to ray. */
 static int Refract( Vec3 *dir, Vec3 *norm, double r );
+/* Shade the current ray's closest hit and trace its secondary rays. */
+static void ShadeHit( void );
+static void LightHit( void );
+/* Push the first secondary ray of the current ray's hit, if any. */
+static int StartSecondaryRays( void );
+/* Set up the pushed trace level as a secondary ray. */
+static void SetupReflectedRay( void );
+static void SetupTransmittedRay( void );
+/* Shade the current ray's closest hit and queue its secondary rays. */
+static void ShadeWaveHit( WaveRay *wr );
+static void LightWaveHit( WaveRay *wr );
+/* Set up the current trace level as eye ray "i" of a packet. */
+static void SetupPacketRay( RayPacket *pk, int i );
+/* Record and shade the eye hits of a packet, grouped by surface. */
+static void ShadePacketHits( RayPacket *pk );
+static int LoadDeferredHit( int i );
+/* Weigh the current ray's color into the pixel of "wr". */
+static void AddWaveColor( WaveRay *wr );
+/* Per light cache of objects that blocked shadow rays, kept by the trace stack. */
+static Object **ShadowCacheBucket( Light *light );
+static void CacheShadowBlocker( Object *obj );
+static int TestShadowCache( void );
 
 static double a;
 
+/*
+ * Copy to "bits" the contributor filter of the rays traced since the
+ * last call, and start a new one.
+ */
+void Ray_GetContributors( unsigned int *bits )
+{
+	memcpy( bits, ray_contrib, sizeof( ray_contrib ) );
+	memset( ray_contrib, 0, sizeof( ray_contrib ) );
+}
+
+
+/*
+ * Add surface "s", or light "lite", to contributor filter "bits".
+ * Surfaces and lights are known by the order they were made in, so the
+ * filters of a scene built again the same way still match.
+ */
+void Ray_AddSurfaceContributor( Surface *s, unsigned int *bits )
+{
+	AddContributor( bits, s->id * 2 );
+}
+
+void Ray_AddLightContributor( Light *lite, unsigned int *bits )
+{
+	AddContributor( bits, lite->id * 2 + 1 );
+}
+
+
+/*
+ * Set the bit of contributor "key" in filter "bits".
+ */
+void AddContributor( unsigned int *bits, unsigned int key )
+{
+	/* Fibonacci hash, keeping the top bits for the bit index. */
+	key = ( ( key * 2654435769U ) & 0xFFFFFFFFU ) >> 25;
+	bits[key >> 5] |= 1U << ( key & 31 );
+}
+
+
 int Ray_TraceRay( RayInitData *raydata )
 {
 	ct.ray_flags = RAY_EYE;
@@ -55,6 +178,194 @@ int Ray_TraceRay( RayInitData *raydata )
 }
 
 
+/*
+ * Trace the eye rays of packet "pk", leaving their colors in "colors".
+ * The packet finds its closest hits together; each ray is then shaded,
+ * and its secondary rays traced, one at a time as for Ray_TraceRay().
+ * With ray_use_wavefront set, the secondary rays are queued instead and
+ * "colors" is incomplete until TraceWavefront() has been called.
+ * Returns the number of rays that hit an object.
+ */
+int TracePacket( RayPacket *pk, Vec3 *colors )
+{
+	WaveRay eye;
+	int i, nhit = 0;
+
+	ct.ray_flags = RAY_EYE;
+	ct.tmax = ct.t = ray_max_trace_dist;
+	ct.tmin = ray_min_trace_dist;
+	SetupPacket( pk );
+	FindClosestIntersections( ray_object_list, pk, ct.hits );
+	if ( ray_use_deferred )
+		ShadePacketHits( pk );
+
+	for ( i = 0; i < pk->n; i++ )
+	{
+		SetupPacketRay( pk, i );
+		ray_eye_rays++;
+
+		if ( ray_use_wavefront )
+		{
+			V3Set( &colors[i], 0.0, 0.0, 0.0 );
+			V3Set( &eye.scale, 1.0, 1.0, 1.0 );
+			eye.color = &colors[i];
+			eye.u = pk->u[i];
+			eye.v = pk->v[i];
+			if ( ray_use_deferred ? LoadDeferredHit( i ) :
+				ResolvePacketHit( pk, i, ct.hits ) )
+			{
+				if ( ray_use_deferred )
+					LightWaveHit( &eye );
+				else
+					ShadeWaveHit( &eye );
+				nhit++;
+			}
+			else
+			{
+				Ray_DoBackground( );
+				AddWaveColor( &eye );
+			}
+			continue;
+		}
+
+		if ( ray_use_deferred ? LoadDeferredHit( i ) :
+			ResolvePacketHit( pk, i, ct.hits ) )
+		{
+			if ( ray_use_deferred )
+				LightHit( );
+			else
+				ShadeHit( );
+			nhit++;
+		}
+		else
+			Ray_DoBackground( );
+		Ray_ApplyVisibility();
+		colors[i] = ct.total_color;
+	}
+
+	return nhit;
+}
+
+
+static void SetupPacketRay( RayPacket *pk, int i )
+{
+	rt_uscreen = pk->u[i];
+	rt_vscreen = pk->v[i];
+	ct.ray_flags = RAY_EYE;
+	ct.B = pk->B;
+	ct.D = pk->D[i];
+	V3Set( &ct.weight, 1.0, 1.0, 1.0 );
+	ct.tmax = ct.t = ray_max_trace_dist;
+	ct.tmin = ray_min_trace_dist;
+	V3Set( &ct.total_color, 0.0, 0.0, 0.0 );
+	rt_D = ct.D;
+}
+
+
+/*
+ * Order deferred hits by surface, then by ray.
+ */
+static int CompareDeferredHits( const void *a, const void *b )
+{
+	const DeferredHit *ha = *(const DeferredHit **)a;
+	const DeferredHit *hb = *(const DeferredHit **)b;
+
+	if ( ha->sh.surface != hb->sh.surface )
+		return ( (size_t)ha->sh.surface < (size_t)hb->sh.surface ) ? -1 : 1;
+	return ha->ray - hb->ray;
+}
+
+
+/*
+ * Deferred shading of a packet's eye hits. Every ray's closest hit is
+ * first recorded with its surface, then the hits are shaded grouped by
+ * surface, so each surface's shaders run over all of its hits in the
+ * packet in one go. Lighting the hits and tracing their secondary rays
+ * is left to TracePacket(), which loads each shaded hit back in turn
+ * with LoadDeferredHit().
+ */
+static void ShadePacketHits( RayPacket *pk )
+{
+	DeferredHit *dh;
+	int i, n = 0;
+
+	for ( i = 0; i < pk->n; i++ )
+	{
+		dh = &deferred_hits[i];
+		SetupPacketRay( pk, i );
+		dh->hit = ResolvePacketHit( pk, i, ct.hits );
+		if ( ! dh->hit )
+			continue;
+		dh->ray = i;
+		dh->objhit = ct.objhit;
+		dh->Q = ct.Q;
+		dh->N = ct.N;
+		dh->t = ct.t;
+		dh->entering = ct.entering;
+		FindHitSurface( &dh->sh );
+		deferred_order[n++] = dh;
+	}
+
+	qsort( deferred_order, n, sizeof(DeferredHit *), CompareDeferredHits );
+
+	for ( i = 0; i < n; i++ )
+	{
+		dh = deferred_order[i];
+		SetupPacketRay( pk, dh->ray );
+		ct.objhit = dh->objhit;
+		ct.Q = dh->Q;
+		ct.N = dh->N;
+		ct.t = dh->t;
+		ct.entering = dh->entering;
+		ShadeSurfaceHit( &dh->sh );
+
+		/* Shaders may bend the normal. */
+		dh->N = ct.N;
+		dh->color = ct.color;
+		dh->ka = ct.ka;
+		dh->kd = ct.kd;
+		dh->kr = ct.kr;
+		dh->ks = ct.ks;
+		dh->kt = ct.kt;
+		dh->ior = ct.ior;
+		dh->Phong = ct.Phong;
+	}
+}
+
+
+/*
+ * Make the shaded hit of eye ray "i" the current ray's hit, ready to be
+ * lit. Returns 0 if the ray missed.
+ */
+static int LoadDeferredHit( int i )
+{
+	DeferredHit *dh = &deferred_hits[i];
+	Vec3 N;
+
+	if ( ! dh->hit )
+		return 0;
+	ct.objhit = dh->objhit;
+	ct.Q = dh->Q;
+	ct.N = dh->N;
+	ct.t = dh->t;
+	ct.entering = dh->entering;
+	ct.surface = dh->sh.surface;
+	ct.color = dh->color;
+	ct.ka = dh->ka;
+	ct.kd = dh->kd;
+	ct.kr = dh->kr;
+	ct.ks = dh->ks;
+	ct.kt = dh->kt;
+	ct.ior = dh->ior;
+	ct.Phong = dh->Phong;
+
+	/* A colored triangle keeps the color at its last normal. */
+	if ( ct.objhit->procs->type == OBJ_COLORTRIANGLE )
+		ct.objhit->procs->CalcNormal( ct.objhit, &ct.Q, &N );
+	return 1;
+}
+
+
 void TraceRecursiveRay( void )
 {
 	ct.tmax = ct.t = ray_max_trace_dist;
@@ -63,95 +374,508 @@ void TraceRecursiveRay( void )
 	rt_D = ct.D;
 
 	if ( FindClosestIntersection( ray_object_list, ct.hits ) )
+		ShadeHit( );
+	else
+		Ray_DoBackground( );
+   Ray_ApplyVisibility();
+}
+
+
+/*
+ * Shade the current ray's hit, then light it and trace its secondary
+ * rays with LightHit().
+ */
+void ShadeHit( void )
+{
+	ShadeSurface( );
+	LightHit( );
+}
+
+
+/*
+ * Light the current ray's shaded hit, then trace its reflected and
+ * transmitted rays and theirs in turn. Rather than recursing, each
+ * secondary ray is traced on the next trace level up, and the level it
+ * came from records in "resume" which of its rays comes next. When a ray
+ * is done its color is weighed into the level below, which goes on from
+ * where it left off, until the level this started on is done too.
+ */
+static void LightHit( void )
+{
+	int base = ct.trace_level;
+
+	CalcLighting( );
+	if ( ! StartSecondaryRays( ) )
+		return;
+
+	for ( ;; )
 	{
-		ShadeSurface( );
-		CalcLighting( );
+		/* Trace the secondary ray set up on this level... */
+		ct.tmax = ct.t = ray_max_trace_dist;
+		ct.tmin = ray_min_trace_dist;
+		V3Set( &ct.total_color, 0.0, 0.0, 0.0 );
+		rt_D = ct.D;
 
-		/*
-		 * Test for reflecting rays...
-		 */
-		if ( ( V3Mag( &ct.weight ) > ray_min_color_weight ) &&
-			( ct.trace_level < ray_max_trace_depth ) )
+		if ( FindClosestIntersection( ray_object_list, ct.hits ) )
 		{
-			PushTraceStack( );
-			ct.ray_flags = RAY_REFLECTED;
-			V3Mul( &ct.weight, &pt.weight, &pt.kr );
-			ray_eye_rays_reflected++;
-			ct.B = pt.Q;
-			a = - V3Dot( &pt.D, &pt.N ) * 2.0;
-			ct.D.x = pt.D.x + pt.N.x * a;
-			ct.D.y = pt.D.y + pt.N.y * a;
-			ct.D.z = pt.D.z + pt.N.z * a;
-			V3Normalize( &ct.D );
-
-			TraceRecursiveRay( ); /* Do reflecting rays. */
+			ShadeSurface( );
+			CalcLighting( );
+			if ( StartSecondaryRays( ) )
+				continue;
+		}
+		else
+			Ray_DoBackground( );
+		Ray_ApplyVisibility( );
 
-			/*
-			 * Restore this state and weigh in the color returned from
-			 * this ray.
-			 */
+		/* ...then weigh its color in below until a level has more to do. */
+		for ( ;; )
+		{
 			PopTraceStack( );
-			ct.total_color.x += pt.total_color.x * ct.kr.x;
-			ct.total_color.y += pt.total_color.y * ct.kr.y;
-			ct.total_color.z += pt.total_color.z * ct.kr.z;
+			if ( ct.resume == RAY_TRANSMITTED )
+			{
+				ct.total_color.x += pt->total_color.x * ct.kr.x;
+				ct.total_color.y += pt->total_color.y * ct.kr.y;
+				ct.total_color.z += pt->total_color.z * ct.kr.z;
+
+				ct.resume = 0;
+				PushTraceStack( );
+				SetupTransmittedRay( );
+				break;
+			}
+
+			if ( ( pt->ray_flags & RAY_INTREFLECTED ) && ( ! ct.entering ) )
+			{
+				ct.total_color.x = pt->total_color.x;
+				ct.total_color.y = pt->total_color.y;
+				ct.total_color.z = pt->total_color.z;
+			}
+			else
+			{
+				ct.total_color.x += pt->total_color.x * ct.kt.x;
+				ct.total_color.y += pt->total_color.y * ct.kt.y;
+				ct.total_color.z += pt->total_color.z * ct.kt.z;
+			}
+
+			if ( ct.trace_level == base )
+				return;
+			Ray_ApplyVisibility( );
 		}
+	}
+}
 
+
+/*
+ * If the current ray's hit is significant enough, push its reflected
+ * ray, to be followed by its transmitted ray, and return 1.
+ */
+static int StartSecondaryRays( void )
+{
+	if ( ( V3Mag( &ct.weight ) <= ray_min_color_weight ) ||
+		( ct.trace_level >= ray_max_trace_depth ) )
+		return 0;
+
+	ct.resume = RAY_TRANSMITTED;
+	PushTraceStack( );
+	SetupReflectedRay( );
+	return 1;
+}
+
+
+/*
+ * Set up the pushed trace level as the ray reflected from the hit
+ * of the level below it.
+ */
+static void SetupReflectedRay( void )
+{
+	ct.ray_flags = RAY_REFLECTED;
+	ct.baseobj = NULL;
+	V3Mul( &ct.weight, &pt->weight, &pt->kr );
+	ray_eye_rays_reflected++;
+	ct.B = pt->Q;
+	a = - V3Dot( &pt->D, &pt->N ) * 2.0;
+	ct.D.x = pt->D.x + pt->N.x * a;
+	ct.D.y = pt->D.y + pt->N.y * a;
+	ct.D.z = pt->D.z + pt->N.z * a;
+	V3Normalize( &ct.D );
+}
+
+
+/*
+ * Set up the pushed trace level as the ray transmitted through the hit
+ * of the level below it.
+ */
+static void SetupTransmittedRay( void )
+{
+	ct.ray_flags = RAY_TRANSMITTED;
+	ct.baseobj = NULL;
+	V3Mul( &ct.weight, &pt->weight, &pt->kt );
+	ct.B = pt->Q;
+	ct.D = pt->D;
+	a = ( pt->entering ) ?
+		pt->surface->outior / pt->surface->ior :
+		pt->surface->ior / pt->surface->outior;
+	if ( Refract( &ct.D, &pt->N, a ) )
+	{
 		/*
-		 * Test for transmitting rays...
+		 * This ray reflects internally within the rafractive object.
+		 * Treat it as a reflecting ray.
 		 */
-		if ( ( V3Mag( &ct.weight ) > ray_min_color_weight ) &&
-			( ct.trace_level < ray_max_trace_depth ) )
+		ct.ray_flags = RAY_INTREFLECTED;
+		ray_eye_rays_reflected++;
+	}
+	else
+		ray_eye_rays_transmitted++;
+}
+
+
+/*
+ * Weigh the current ray's color, after visibility, into the pixel of
+ * wavefront ray "wr".
+ */
+static void AddWaveColor( WaveRay *wr )
+{
+	Ray_ApplyVisibility( );
+	wr->color->x += ct.total_color.x * wr->scale.x;
+	wr->color->y += ct.total_color.y * wr->scale.y;
+	wr->color->z += ct.total_color.z * wr->scale.z;
+}
+
+
+/*
+ * Queue the ray set up on the pushed trace level for the next bounce,
+ * its color to be weighed by "scale" into the pixel of "parent". If the
+ * queue can't grow, the ray is traced right away instead.
+ */
+static void QueueWaveRay( WaveRay *parent, Vec3 *scale )
+{
+	WaveQueue *q = &wave_queue[wave_next];
+	WaveRay *wr;
+
+	if ( q->n == q->size )
+	{
+		wr = (WaveRay *)Realloc( q->rays, q->size * sizeof(WaveRay),
+			( q->size + 256 ) * sizeof(WaveRay) );
+		if ( wr == NULL )
 		{
-			PushTraceStack( );
-			ct.ray_flags = RAY_TRANSMITTED;
-			V3Mul( &ct.weight, &pt.weight, &pt.kt );
-			ct.B = pt.Q;
-			ct.D = pt.D;
-			a = ( pt.entering ) ?
-				pt.surface->outior / pt.surface->ior :
-				pt.surface->ior / pt.surface->outior;
-			if ( Refract( &ct.D, &pt.N, a ) )
-			{
-				/*
-				 * This ray reflects internally within the rafractive object.
-				 * Treat it as a reflecting ray.
-				 */
-				ct.ray_flags = RAY_INTREFLECTED;
-				ray_eye_rays_reflected++;
-			}
-			else
-				ray_eye_rays_transmitted++;
+			TraceRecursiveRay( );
+			parent->color->x += ct.total_color.x * scale->x;
+			parent->color->y += ct.total_color.y * scale->y;
+			parent->color->z += ct.total_color.z * scale->z;
+			return;
+		}
+		q->rays = wr;
+		q->size += 256;
+	}
+
+	wr = &q->rays[q->n];
+	wr->B = ct.B;
+	wr->D = ct.D;
+	wr->weight = ct.weight;
+	wr->scale = *scale;
+	wr->color = parent->color;
+	wr->u = parent->u;
+	wr->v = parent->v;
+	wr->baseobj = ct.baseobj;
+	wr->ray_flags = ct.ray_flags;
+	wr->trace_level = ct.trace_level;
+	wr->seq = q->n++;
+}
+
+
+/*
+ * Wavefront version of ShadeHit(). The hit's own color goes straight
+ * into the pixel of "wr", and its reflected and transmitted rays are
+ * queued for the next bounce, weighted as ShadeHit() would weigh in
+ * their colors.
+ */
+void ShadeWaveHit( WaveRay *wr )
+{
+	ShadeSurface( );
+	LightWaveHit( wr );
+}
 
-			TraceRecursiveRay( ); /* Do transmitting rays. */
 
+/*
+ * ShadeWaveHit() for a hit that has already been shaded.
+ */
+static void LightWaveHit( WaveRay *wr )
+{
+	Vec3 scale;
+	double v;
+
+	CalcLighting( );
+
+	if ( ( V3Mag( &ct.weight ) > ray_min_color_weight ) &&
+		( ct.trace_level < ray_max_trace_depth ) )
+	{
+		/* Visibility fades out everything weighed into this ray. */
+		v = Ray_VisibilityFactor( );
+
+		PushTraceStack( );
+		SetupTransmittedRay( );
+		if ( ( ct.ray_flags & RAY_INTREFLECTED ) && ( ! pt->entering ) )
+		{
 			/*
-			 * Restore this state and weigh in the color returned from
-			 * this ray.
+			 * The transmitted ray's color replaces this ray's own and
+			 * that of its reflected ray, which needn't be traced.
 			 */
+			V3ScalMul( &scale, &wr->scale, v );
+			QueueWaveRay( wr, &scale );
 			PopTraceStack( );
-			if ( ( pt.ray_flags & RAY_INTREFLECTED ) && ( ! ct.entering ) )
+			V3Set( &ct.total_color, 0.0, 0.0, 0.0 );
+			AddWaveColor( wr );
+			return;
+		}
+		V3Mul( &scale, &wr->scale, &pt->kt );
+		V3ScalMul( &scale, &scale, v );
+		QueueWaveRay( wr, &scale );
+		PopTraceStack( );
+
+		PushTraceStack( );
+		SetupReflectedRay( );
+		V3Mul( &scale, &wr->scale, &pt->kr );
+		V3ScalMul( &scale, &scale, v );
+		QueueWaveRay( wr, &scale );
+		PopTraceStack( );
+	}
+	AddWaveColor( wr );
+}
+
+
+/*
+ * Order wavefront rays by direction octant, then origin cell, then the
+ * order they were queued in.
+ */
+static int CompareWaveRays( const void *a, const void *b )
+{
+	const WaveRay *ra = (const WaveRay *)a;
+	const WaveRay *rb = (const WaveRay *)b;
+
+	if ( ra->key != rb->key )
+		return ( ra->key < rb->key ) ? -1 : 1;
+	return ra->seq - rb->seq;
+}
+
+
+/*
+ * Sort the rays of a bounce so rays heading the same way from nearby
+ * points are traced together. Origin cells are numbered along a Morton
+ * curve through the bounds of the bounce's base points.
+ */
+static void SortWaveRays( WaveQueue *q )
+{
+	WaveRay *wr;
+	Vec3 lo, hi, sc;
+	unsigned long cx, cy, cz, key;
+	int i, bit;
+
+	if ( q->n < 2 )
+		return;
+
+	lo = hi = q->rays[0].B;
+	for ( i = 1, wr = q->rays + 1; i < q->n; i++, wr++ )
+	{
+		if ( wr->B.x < lo.x ) lo.x = wr->B.x;
+		if ( wr->B.x > hi.x ) hi.x = wr->B.x;
+		if ( wr->B.y < lo.y ) lo.y = wr->B.y;
+		if ( wr->B.y > hi.y ) hi.y = wr->B.y;
+		if ( wr->B.z < lo.z ) lo.z = wr->B.z;
+		if ( wr->B.z > hi.z ) hi.z = wr->B.z;
+	}
+	sc.x = ( hi.x - lo.x > EPSILON ) ? ( WAVE_CELLS - 0.5 ) / ( hi.x - lo.x ) : 0.0;
+	sc.y = ( hi.y - lo.y > EPSILON ) ? ( WAVE_CELLS - 0.5 ) / ( hi.y - lo.y ) : 0.0;
+	sc.z = ( hi.z - lo.z > EPSILON ) ? ( WAVE_CELLS - 0.5 ) / ( hi.z - lo.z ) : 0.0;
+
+	for ( i = 0, wr = q->rays; i < q->n; i++, wr++ )
+	{
+		cx = (unsigned long)( ( wr->B.x - lo.x ) * sc.x );
+		cy = (unsigned long)( ( wr->B.y - lo.y ) * sc.y );
+		cz = (unsigned long)( ( wr->B.z - lo.z ) * sc.z );
+		key = ( wr->D.x < 0.0 ) | ( ( wr->D.y < 0.0 ) << 1 ) |
+			( ( wr->D.z < 0.0 ) << 2 );
+		for ( bit = WAVE_CELLS >> 1; bit > 0; bit >>= 1 )
+		{
+			key = ( key << 3 ) | ( ( cx & bit ) ? 4 : 0 ) |
+				( ( cy & bit ) ? 2 : 0 ) | ( ( cz & bit ) ? 1 : 0 );
+		}
+		wr->key = key;
+	}
+
+	qsort( q->rays, q->n, sizeof(WaveRay), CompareWaveRays );
+}
+
+
+/*
+ * Trace the secondary rays queued by TracePacket(), a bounce at a time,
+ * weighing their colors into the pixels they were queued for. Each
+ * bounce is sorted before it is traced, and queues the next one.
+ */
+void TraceWavefront( void )
+{
+	WaveQueue *q;
+	WaveRay *wr;
+	int i;
+
+	while ( wave_queue[wave_next].n > 0 )
+	{
+		q = &wave_queue[wave_next];
+		wave_next ^= 1;
+		SortWaveRays( q );
+
+		for ( i = 0, wr = q->rays; i < q->n; i++, wr++ )
+		{
+			SetTraceStackLevel( wr->trace_level );
+			ct.ray_flags = wr->ray_flags;
+			ct.B = wr->B;
+			ct.D = wr->D;
+			ct.weight = wr->weight;
+			ct.baseobj = wr->baseobj;
+			rt_uscreen = wr->u;
+			rt_vscreen = wr->v;
+			ct.tmax = ct.t = ray_max_trace_dist;
+			ct.tmin = ray_min_trace_dist;
+			V3Set( &ct.total_color, 0.0, 0.0, 0.0 );
+			rt_D = ct.D;
+
+			if ( FindClosestIntersection( ray_object_list, ct.hits ) )
+				ShadeWaveHit( wr );
+			else
 			{
-				ct.total_color.x = pt.total_color.x;
-				ct.total_color.y = pt.total_color.y;
-				ct.total_color.z = pt.total_color.z;
+				Ray_DoBackground( );
+				AddWaveColor( wr );
 			}
-			else
+		}
+		q->n = 0;
+	}
+	SetTraceStackLevel( 0 );
+}
+
+
+/*
+ * Release the wavefront queues.
+ */
+void CloseTrace( void )
+{
+	int i;
+
+	for ( i = 0; i < 2; i++ )
+	{
+		if ( wave_queue[i].rays != NULL )
+			Free( wave_queue[i].rays, wave_queue[i].size * sizeof(WaveRay) );
+		wave_queue[i].rays = NULL;
+		wave_queue[i].n = wave_queue[i].size = 0;
+	}
+	wave_next = 0;
+}
+
+
+/*
+ * Returns the bucket of "light"'s blocker cache for the current shadow
+ * ray, chosen by the object it starts from and the screen cell of its
+ * eye ray, or NULL if the light has no cache. Objects are known by the
+ * order they were made in, so the same scene always fills the same
+ * buckets.
+ */
+static Object **ShadowCacheBucket( Light *light )
+{
+	ShadowCache *sc = ct.shadow_cache;
+	unsigned long h;
+
+	if ( light->id >= sc->nlights )
+		return NULL;
+
+	h = ( ct.baseobj != NULL ) ? ct.baseobj->id : 0;
+	h = h * 31 + (unsigned long)(long)floor( rt_uscreen * SHADOW_CACHE_CELLS );
+	h = h * 31 + (unsigned long)(long)floor( rt_vscreen * SHADOW_CACHE_CELLS );
+	return sc->blockers + ( light->id * SHADOW_CACHE_BUCKETS +
+		h % SHADOW_CACHE_BUCKETS ) * SHADOW_CACHE_DEPTH;
+}
+
+
+/*
+ * Make "obj" the newest blocker in the current cache bucket. Only
+ * objects that block without being shaded (see SurfaceIsOpaque()) are
+ * cached, so that a cached blocker settles a ray as tracing it would.
+ */
+static void CacheShadowBlocker( Object *obj )
+{
+	int i;
+
+	if ( shadow_bucket == NULL )
+		return;
+	for ( i = 0; i < SHADOW_CACHE_DEPTH - 1; i++ )
+		if ( shadow_bucket[i] == obj )
+			break;
+	for ( ; i > 0; i-- )
+		shadow_bucket[i] = shadow_bucket[i - 1];
+	shadow_bucket[0] = obj;
+}
+
+
+/*
+ * Test the blockers in the current cache bucket against the current
+ * shadow ray, newest first. Returns 1 if one of them blocks it. In a
+ * scene with objects that may let light through, a blocker only counts
+ * if none of them lies in front of it: tracing the ray would shade such
+ * an object, and its shaders may change the surface state later hits
+ * are shaded with.
+ */
+static int TestShadowCache( void )
+{
+	ShadowCache *sc = ct.shadow_cache;
+	Object *obj;
+	Surface *surf;
+	double tmax;
+	int i, see_through;
+
+	if ( shadow_bucket == NULL )
+		return 0;
+
+	for ( i = 0; i < SHADOW_CACHE_DEPTH; i++ )
+	{
+		obj = shadow_bucket[i];
+		if ( obj == NULL )
+			break;
+		if ( ( obj == ct.baseobj ) && ( obj->flags & OBJ_FLAG_NO_SELF_INTERSECT ) )
+			continue;
+		if ( ! ( obj->procs->Intersect )( obj, ct.hits ) )
+			continue;
+		/* Composite objects look up the surface hit by its "t". */
+		ct.t = ct.hits->t;
+		surf = HitSurface( ct.hits->obj );
+		if ( SurfaceLetsLightThrough( surf ) )
+			continue;
+
+		if ( sc->see_through )
+		{
+			/* Close in on the nearest opaque object in the way. */
+			tmax = ct.tmax;
+			do
 			{
-				ct.total_color.x += pt.total_color.x * ct.kt.x;
-				ct.total_color.y += pt.total_color.y * ct.kt.y;
-				ct.total_color.z += pt.total_color.z * ct.kt.z;
+				surf = HitSurface( ct.hits->obj );
+				ct.tmax = ct.hits->t - EPSILON;
 			}
+			while ( FindAnyIntersection( ray_object_list, ct.hits,
+				&see_through ) != NULL );
+			ct.tmax = ct.t = tmax;
+			if ( see_through )
+				break;
 		}
+
+		Ray_AddSurfaceContributor( surf, ray_contrib );
+		CacheShadowBlocker( obj );
+		sc->hits++;
+		return 1;
 	}
-	else
-		Ray_DoBackground( );
-   Ray_ApplyVisibility();
+
+	sc->misses++;
+	return 0;
 }
 
 
 int Ray_TraceShadowRay( Vec3 *D, Light *light, Vec3 *color )
 {
-	Object *obj;
+	int blocked;
 
 	if ( ct.trace_level >= ray_max_trace_depth )
 		return 1;
@@ -159,9 +883,9 @@ int Ray_TraceShadowRay( Vec3 *D, Light *light, Vec3 *color )
 	PushTraceStack( );
 	ct.ray_flags = RAY_SHADOW;
 	ray_shadow_rays++;
-	ct.B = pt.Q;
+	ct.B = pt->Q;
 	ct.D = *D;
-	ct.baseobj = pt.objhit;
+	ct.baseobj = pt->objhit;
 	rays_bent = 0;
 	caustics_scale = 1.0;
 	shadow_light = light;
@@ -178,27 +902,29 @@ int Ray_TraceShadowRay( Vec3 *D, Light *light, Vec3 *color )
 	}
 
 	/*
-	 * First, check our cached object, if present.
+	 * First, check the objects that last blocked this light nearby.
 	 */
-	obj = light->block_obj_cached;
-	if ( ( obj != NULL ) && ( ! ray_use_fake_caustics ) )
+	shadow_bucket = ShadowCacheBucket( light );
+	if ( TestShadowCache( ) )
 	{
-		if ( ( obj->procs->Intersect )( obj, ct.hits ) )
-		{
-			/* shadow_ray_hits++; */
-			PopTraceStack( );
-			return 1;
-		}
-		light->block_obj_cached = NULL;
+		PopTraceStack( );
+		return 1;
+	}
+
+	if ( ! ray_use_fake_caustics )
+	{
+		blocked = Ray_IsOccluded( color );
+		PopTraceStack( );
+		return blocked;
 	}
 
 	TraceRecursiveShadowRay( );
 	PopTraceStack( );
 	if ( caustics_scale > 0.0 )
 	{
-		color->x = pt.total_color.x * caustics_scale;
-		color->y = pt.total_color.y * caustics_scale;
-		color->z = pt.total_color.z * caustics_scale;
+		color->x = pt->total_color.x * caustics_scale;
+		color->y = pt->total_color.y * caustics_scale;
+		color->z = pt->total_color.z * caustics_scale;
 	}
 	else
 	{
@@ -209,6 +935,81 @@ int Ray_TraceShadowRay( Vec3 *D, Light *light, Vec3 *color )
 }
 
 
+/*
+ * Occlusion query for the shadow ray set up on the current trace level,
+ * for rays that aren't bent by fake caustics. Any opaque object along
+ * the ray settles the query without finding the closest one, shading it
+ * or computing its normal; a clear ray needs no shading either. When
+ * an object that may let light through is found first, the objects in
+ * the way are walked nearest first instead, multiplying in their kt.
+ * Returns 1 if the ray is blocked, otherwise 0 with the light let
+ * through in "color".
+ */
+int Ray_IsOccluded( Vec3 *color )
+{
+	Object *obj;
+	Surface *surf;
+	Vec3 kt;
+	int see_through, level;
+
+	obj = FindAnyIntersection( ray_object_list, ct.hits, &see_through );
+	if ( obj != NULL )
+	{
+		Ray_AddSurfaceContributor( HitSurface( obj ), ray_contrib );
+		if ( ( obj->flags & OBJ_FLAG_TRANSMISSIVE ) == 0 )
+			CacheShadowBlocker( obj );
+		return 1;
+	}
+
+	V3Set( color, 1.0, 1.0, 1.0 );
+	if ( ! see_through )
+		return 0;
+
+	/*
+	 * Walk the objects in the way nearest first, as
+	 * TraceRecursiveShadowRay() would, but on this trace level.
+	 * Only shaders, which may change kt, need the hit shaded.
+	 */
+	for ( level = ct.trace_level; ; level++ )
+	{
+		if ( ! FindClosestHit( ray_object_list, ct.hits ) )
+			return 0;
+		surf = HitSurface( ct.objhit );
+		if ( surf->shaders != NULL )
+		{
+			CalcHitNormal( );
+			ShadeSurface( );
+			kt = ct.kt;
+		}
+		else
+		{
+			Ray_AddSurfaceContributor( surf, ray_contrib );
+			kt = surf->kt;
+		}
+
+		if ( ( V3Mag( &kt ) <= ray_min_color_weight ) ||
+			( level >= ray_max_trace_depth ) )
+		{
+			if ( SurfaceIsOpaque( ct.objhit ) )
+				CacheShadowBlocker( ct.objhit );
+			return 1;
+		}
+		V3Mul( color, color, &kt );
+
+		ct.B = ct.Q;
+		ct.baseobj = ct.objhit;
+		ct.tmin = ray_min_shadow_dist;
+		if ( shadow_light->type != LIGHT_INFINITE )
+		{
+			V3Sub( &light_dir, &shadow_light->loc, &ct.B );
+			ct.tmax = ct.t = V3Mag( &light_dir );
+		}
+		else
+			ct.tmax = ct.t = ray_max_trace_dist;
+	}
+}
+
+
 void TraceRecursiveShadowRay( void )
 {
 	ct.tmin = ray_min_shadow_dist;
@@ -221,7 +1022,6 @@ void TraceRecursiveShadowRay( void )
 	{
 		ct.tmax = ct.t = ray_max_trace_dist;
 	}
-	UpdateTraceStack( );
 
 	if ( FindClosestIntersection( ray_object_list, ct.hits ) )
 	{
@@ -232,16 +1032,16 @@ void TraceRecursiveShadowRay( void )
 			ct.total_color = ct.kt;
 			PushTraceStack( );
 			ct.ray_flags = RAY_SHADOW | RAY_TRANSMITTED;
-			ct.B = pt.Q;
-			ct.D = pt.D;
-			ct.baseobj = pt.objhit;
+			ct.B = pt->Q;
+			ct.D = pt->D;
+			ct.baseobj = pt->objhit;
 			if ( ray_use_fake_caustics )
 			{
 				rays_bent = 1;
-				a = ( pt.entering ) ?
-					pt.surface->outior / pt.surface->ior :
-					pt.surface->ior / pt.surface->outior;
-				if ( ! Refract( &ct.D, &pt.N, a ) )
+				a = ( pt->entering ) ?
+					pt->surface->outior / pt->surface->ior :
+					pt->surface->ior / pt->surface->outior;
+				if ( ! Refract( &ct.D, &pt->N, a ) )
 				{
 					V3Normalize( &light_dir );
 					caustics_scale = V3Dot( &light_dir, &ct.D );
@@ -259,16 +1059,16 @@ void TraceRecursiveShadowRay( void )
 			PopTraceStack( );
 
 			/* Weigh in transmitted ray's shadow level. */
-			ct.total_color.x *= pt.total_color.x;
-			ct.total_color.y *= pt.total_color.y;
-			ct.total_color.z *= pt.total_color.z;
+			ct.total_color.x *= pt->total_color.x;
+			ct.total_color.y *= pt->total_color.y;
+			ct.total_color.z *= pt->total_color.z;
 		}
 		else  /* Shadow ray is completely blocked. */
 		{
 			if ( rays_bent == 0 )
 			{
-				if ( ( ct.objhit->flags & OBJ_FLAG_TRANSMISSIVE ) == 0 )
-					shadow_light->block_obj_cached = ct.objhit;
+				if ( SurfaceIsOpaque( ct.objhit ) )
+					CacheShadowBlocker( ct.objhit );
 			}
 			caustics_scale = 0.0;
 		}
@@ -18,6 +18,7 @@ static int viewport_projection = VIEWPORT_PERSPECTIVE;
 
 static void ViewportSetupViewport(Viewport *pvp,
 	Vec3 *from, Vec3 *at, Vec3 *up, double FOVdegrees);
+static void ViewportRayDir(Viewport *pvp, double u, double v, Vec3 *D);
 
 void Ray_SetupViewport(Vec3 *fromleft, Vec3 *fromright,
 	Vec3 *at, Vec3 *up, double FOVdegrees, int projection)
@@ -45,7 +46,7 @@ void Ray_GetViewportInfo(Viewport *pvp, Vec3 *fromright, int *projection_mode)
 
 int Ray_TraceRayFromViewport(double u, double v, Vec3 *color)
 {
-	static RayInitData raydata;
+	RayInitData raydata;
 	int result;
 
 	rt_uscreen = u;
@@ -90,6 +91,205 @@ int Ray_TraceRayFromViewport(double u, double v, Vec3 *color)
 }
 
 
+/*
+ * Trace the eye rays through the "n" screen points "u", "v", leaving
+ * their colors in "colors". Rays are traced as packets of up to
+ * PACKET_SIZE consecutive points, so points near each other on the
+ * screen, such as a small tile of pixels, should be passed together.
+ * With ray_use_wavefront set, the secondary rays of all the points are
+ * traced a bounce at a time once their eye rays are done.
+ * Returns the number of rays that hit an object.
+ */
+int Ray_TracePacketFromViewport(int n, double *u, double *v, Vec3 *colors)
+{
+	static RayPacket packet;
+	int i, j, result = 0;
+
+	/* Stereograms trace two rays per point. */
+	if (viewport_projection == VIEWPORT_ANAGLYPH)
+	{
+		for (i = 0; i < n; i++)
+			result += Ray_TraceRayFromViewport(u[i], v[i], &colors[i]);
+		return result;
+	}
+
+	packet.B = left_viewport.LookFrom;
+	for (i = 0; i < n; i += packet.n)
+	{
+		packet.n = (n - i < PACKET_SIZE) ? n - i : PACKET_SIZE;
+		for (j = 0; j < packet.n; j++)
+		{
+			packet.u[j] = u[i + j];
+			packet.v[j] = v[i + j];
+			packet.D[j].x = left_viewport.N.x + u[i + j] * left_viewport.U.x +
+				v[i + j] * left_viewport.V.x;
+			packet.D[j].y = left_viewport.N.y + u[i + j] * left_viewport.U.y +
+				v[i + j] * left_viewport.V.y;
+			packet.D[j].z = left_viewport.N.z + u[i + j] * left_viewport.U.z +
+				v[i + j] * left_viewport.V.z;
+			V3Normalize(&packet.D[j]);
+		}
+		result += TracePacket(&packet, &colors[i]);
+	}
+
+	/* Trace the secondary rays of all the packets together. */
+	if (ray_use_wavefront)
+		TraceWavefront();
+
+	return result;
+}
+
+
+/*
+ * Trace the "n" rays in "rays", leaving the color of each in its
+ * "color" field. Runs of consecutive rays sharing a base point are
+ * traced together as packets of up to PACKET_SIZE rays, so rays that
+ * are near each other, such as those from one eye or light, should be
+ * passed in order. As for Ray_TraceRay(), the intersection interval
+ * is that of the current setup rather than "tmin" and "tmax".
+ * Returns the number of rays that hit an object, or -1 if out of
+ * memory.
+ */
+int Ray_TraceRays(RayInitData *rays, int n)
+{
+	static RayPacket packet;
+	Vec3 *colors;
+	int i, j, result = 0;
+
+	if (n <= 0)
+		return 0;
+	if ((colors = (Vec3 *)Malloc(sizeof(Vec3) * n)) == NULL)
+		return -1;
+
+	for (i = 0; i < n; i += packet.n)
+	{
+		packet.B = rays[i].B;
+		for (j = 0; j < PACKET_SIZE && i + j < n; j++)
+		{
+			if (rays[i + j].B.x != packet.B.x || rays[i + j].B.y != packet.B.y ||
+				rays[i + j].B.z != packet.B.z)
+				break;
+			packet.D[j] = rays[i + j].D;
+			packet.u[j] = packet.v[j] = 0.0;
+		}
+		packet.n = j;
+		result += TracePacket(&packet, &colors[i]);
+	}
+	if (ray_use_wavefront)
+		TraceWavefront();
+
+	for (i = 0; i < n; i++)
+		rays[i].color = colors[i];
+	Free(colors, sizeof(Vec3) * n);
+	return result;
+}
+
+
+/*
+ * Trace the eye rays of a "w" x "h" grid of screen points, starting at
+ * "u0", "v0" and stepping by "du" across and "dv" down, leaving their
+ * colors as unclamped RGB triples in "rgb_out". Rows of the grid start
+ * "stride" floats apart, so a block of a larger image can be written
+ * in place. The rays are made a packet-sized tile at a time, stepping
+ * the direction of the tile's first ray rather than evaluating the
+ * viewport at every point.
+ * Returns the number of rays that hit an object, or -1 if out of
+ * memory.
+ */
+int Ray_TraceViewportBlock(double u0, double v0, double du, double dv,
+	int w, int h, float *rgb_out, int stride)
+{
+	static RayPacket packet;
+	Vec3 *colors, *c, D, Drow, dU, dV;
+	int x, y, x0, y0, xn, yn, result = 0;
+	float *rgb;
+
+	if (w <= 0 || h <= 0)
+		return 0;
+	if ((colors = (Vec3 *)Malloc(sizeof(Vec3) * w * h)) == NULL)
+		return -1;
+
+	if (viewport_projection == VIEWPORT_ANAGLYPH)
+	{
+		/* Stereograms trace two rays per point. */
+		for (y = 0, c = colors; y < h; y++)
+			for (x = 0; x < w; x++, c++)
+				result += Ray_TraceRayFromViewport(u0 + x * du, v0 + y * dv, c);
+	}
+	else
+	{
+		V3ScalMul(&dU, &left_viewport.U, du);
+		V3ScalMul(&dV, &left_viewport.V, dv);
+		packet.B = left_viewport.LookFrom;
+		for (y0 = 0; y0 < h; y0 += PACKET_SIDE)
+		{
+			yn = (h - y0 < PACKET_SIDE) ? h - y0 : PACKET_SIDE;
+			for (x0 = 0; x0 < w; x0 += PACKET_SIDE)
+			{
+				xn = (w - x0 < PACKET_SIDE) ? w - x0 : PACKET_SIDE;
+				packet.n = 0;
+				ViewportRayDir(&left_viewport, u0 + x0 * du, v0 + y0 * dv, &Drow);
+				for (y = 0; y < yn; y++)
+				{
+					D = Drow;
+					for (x = 0; x < xn; x++)
+					{
+						packet.u[packet.n] = u0 + (x0 + x) * du;
+						packet.v[packet.n] = v0 + (y0 + y) * dv;
+						packet.D[packet.n] = D;
+						V3Normalize(&packet.D[packet.n]);
+						packet.n++;
+						V3Add(&D, &D, &dU);
+					}
+					V3Add(&Drow, &Drow, &dV);
+				}
+				/* Tiles are traced in order, so their colors follow one another. */
+				result += TracePacket(&packet, &colors[y0 * w + x0 * yn]);
+			}
+		}
+		if (ray_use_wavefront)
+			TraceWavefront();
+	}
+
+	/* Copy the colors out, untangling the tiles. */
+	for (y = 0; y < h; y++)
+	{
+		rgb = rgb_out + y * stride;
+		for (x = 0; x < w; x++)
+		{
+			if (viewport_projection == VIEWPORT_ANAGLYPH)
+				c = &colors[y * w + x];
+			else
+			{
+				y0 = y - y % PACKET_SIDE;
+				x0 = x - x % PACKET_SIDE;
+				yn = (h - y0 < PACKET_SIDE) ? h - y0 : PACKET_SIDE;
+				xn = (w - x0 < PACKET_SIDE) ? w - x0 : PACKET_SIDE;
+				c = &colors[y0 * w + x0 * yn + (y - y0) * xn + (x - x0)];
+			}
+			*rgb++ = (float)c->x;
+			*rgb++ = (float)c->y;
+			*rgb++ = (float)c->z;
+		}
+	}
+
+	Free(colors, sizeof(Vec3) * w * h);
+	return result;
+}
+
+
+/*
+ * Unnormalized direction of the eye ray through screen point "u", "v"
+ * of viewport "pvp".
+ */
+static void ViewportRayDir(Viewport *pvp, double u, double v, Vec3 *D)
+{
+	D->x = pvp->N.x + u * pvp->U.x + v * pvp->V.x;
+	D->y = pvp->N.y + u * pvp->U.y + v * pvp->V.y;
+	D->z = pvp->N.z + u * pvp->U.z + v * pvp->V.z;
+}
+
+
 /*
  * Initialize Viewport to default values.
  */
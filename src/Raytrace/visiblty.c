@@ -30,3 +30,15 @@ void Ray_ApplyVisibility(void)
       V3Interpolate(&ct.total_color, &ray_visibility_color, v, &ct.total_color);
    }
 }
+
+
+/*
+ * Returns the factor Ray_ApplyVisibility() scales the current ray's
+ * color by; the rest of the color is made up by the visibility color.
+ */
+double Ray_VisibilityFactor(void)
+{
+   if (ray_visibility_distance > EPSILON)
+      return exp(ct.t/-ray_visibility_distance);
+   return 1.0;
+}
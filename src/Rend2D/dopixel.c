@@ -18,20 +18,37 @@ typedef struct tag_icolor
 	int r, g, b;
 } IColor;
 
-#define AAGRIDSIZE  (1<<MAX_AA_DEPTH)
-int threshsqrd;
-int level;
+#define AAGRIDSIZE  REND2D_AA_GRID_SIZE
+
+/* Adaptive anti-aliasing sample grid of a pixel. */
+typedef struct tag_aagrid
+{
+	const Rend2D *rend;	/* Renderer settings. */
+	int x, y;			/* Pixel being sampled. */
+	int threshsqrd;
+	int level;
+	int nsamples;		/* Calls made to the color proc. */
+	double uinc, vinc;
+	unsigned char cooked[AAGRIDSIZE+1][AAGRIDSIZE+1];
+	IColor samples[AAGRIDSIZE+1][AAGRIDSIZE+1];
+} AAGrid;
+
 double uinc, vinc;
 unsigned char *this_line, *next_line, *this_line_ptr, *next_line_ptr;
 
-unsigned char cooked[AAGRIDSIZE+1][AAGRIDSIZE+1];
-IColor samples[AAGRIDSIZE+1][AAGRIDSIZE+1];
+/* Sample grid of the line at a time renderer. */
+static AAGrid grid;
 
 
-static int SampleColorGrid(int gridx, int gridy, int size);
-static void SubDividePixel(IColor *color, int gridx, int gridy, int size); 
+static void SetupAAGrid(AAGrid *g, const Rend2D *r);
+static void ShiftAAGrid(AAGrid *g);
+static int SampleColorGrid(AAGrid *g, int gridx, int gridy, int size);
+static void SubDividePixel(AAGrid *g, IColor *color, int gridx, int gridy, int size); 
+static void LoadPreviewCorners(AAGrid *g);
 static double Frand(register long s);
 static void Jitter(double *u, double *v, double uscale, double vscale);
+static float *PreviewSample(int x, int y);
+static void SampleCorner(const Rend2D *r, int x, int y, float *rgb);
 
 /*************************************************************************
 *
@@ -43,6 +60,14 @@ static void Jitter(double *u, double *v, double uscale, double vscale);
 void DoPixelOnce(Rend2DPixel *pixel)
 {
 	double u, v;
+	float *c;
+	if((c = PreviewSample(pixel->x, pixel->y)) != NULL)
+	{
+		pixel->r = FloatToByte(c[0]);
+		pixel->g = FloatToByte(c[1]);
+		pixel->b = FloatToByte(c[2]);
+		return;
+	}
 	u = rend.umin + ((double)pixel->x /	(double)rend.xres) * rend.uwidth;
 	v = rend.vmin + ((double)pixel->y /	(double)rend.yres) * rend.vheight;
 	Jitter(&u, &v, uinc * rend.jitter, vinc * rend.jitter); 
@@ -69,6 +94,197 @@ void DoPixelCleanupOnce(void)
 }
 
 
+/*************************************************************************
+*
+*  DoPixelPreview()
+*
+*  Sample the top-left corner of pixel, as DoPixelOnce(), for one of the
+*  coarse preview passes. Every pixel a preview pass samples lies an even
+*  number of pixels across and down from the start, so the samples are
+*  kept, a quarter of the frame's worth, for the final pass to use
+*  rather than sample those points again.
+*
+*************************************************************************/
+static float *preview_buf;	/* Colors sampled by the preview passes. */
+static int preview_width;	/* Samples per line of "preview_buf". */
+
+void DoPixelPreview(Rend2DPixel *pixel)
+{
+	double u, v;
+	float *c;
+	int x, y;
+
+	x = (pixel->x - rend.xstart) / 2;
+	y = (pixel->y - rend.ystart) / 2;
+	c = preview_buf + (y * preview_width + x) * 3;
+	/* Sample as the final pass would, so that its results don't change. */
+	if(rend.mode == REND2D_MODE_ADAPTIVE_VARIANCE)
+	{
+		SampleCorner(&rend, pixel->x, pixel->y, c);
+		pixel->r = FloatToByte(c[0]);
+		pixel->g = FloatToByte(c[1]);
+		pixel->b = FloatToByte(c[2]);
+	}
+	else
+	{
+		u = rend.umin + ((double)pixel->x / (double)rend.xres) * rend.uwidth;
+		v = rend.vmin + ((double)pixel->y / (double)rend.yres) * rend.vheight;
+		Jitter(&u, &v, uinc * rend.jitter, vinc * rend.jitter);
+		rend.calc_color(u, v, &pixel->r, &pixel->g, &pixel->b);
+		c[0] = (float)pixel->r / 255.0f;
+		c[1] = (float)pixel->g / 255.0f;
+		c[2] = (float)pixel->b / 255.0f;
+	}
+}
+
+void DoPixelStartOfLinePreview(void)
+{
+}
+
+void DoPixelEndOfLinePreview(void)
+{
+}
+
+void DoPixelSetupPreview(void)
+{
+	preview_width = (rend.xend - rend.xstart + 1) / 2;
+	preview_buf = (float *)malloc(sizeof(float) * preview_width *
+		((rend.yend - rend.ystart + 1) / 2) * 3);
+	if(preview_buf == NULL)
+	{
+		rend.status = REND2D_STATUS_OUT_OF_MEMORY;
+		return;
+	}
+	uinc = rend.uwidth / (double)rend.xres;
+	vinc = rend.vheight / (double)rend.yres;
+	rend.status = REND2D_STATUS_READY;
+}
+
+void DoPixelCleanupPreview(void)
+{
+	if(preview_buf != NULL)
+		free(preview_buf);
+	preview_buf = NULL;
+}
+
+
+/*
+ * The color of the top-left corner of pixel "x", "y" sampled by the
+ * preview passes, or NULL if they didn't sample it.
+ */
+float *PreviewSample(int x, int y)
+{
+	x -= rend.xstart;
+	y -= rend.ystart;
+	if(preview_buf == NULL || (x & 1) || (y & 1) ||
+		x >= rend.xend - rend.xstart || y >= rend.yend - rend.ystart)
+		return NULL;
+	return preview_buf + ((y / 2) * preview_width + x / 2) * 3;
+}
+
+
+/*************************************************************************
+*
+*  DoPixelTiled()
+*
+*  Sample the top-left corner of pixel, as DoPixelOnce(), but with the
+*  colors of each band of REND2D_TILE_SIZE lines found up front by the
+*  block color proc, a tile of pixels at a time.
+*
+*************************************************************************/
+static unsigned char *band;	/* Colors of the current band of lines. */
+static int band_y;			/* First line of the band. */
+static int band_width;		/* Pixels per line of the band. */
+
+void DoPixelTiled(Rend2DPixel *pixel)
+{
+	unsigned char *c;
+
+	c = band + ((rend.y - band_y) * band_width + (pixel->x - rend.xstart)) * 3;
+	pixel->r = c[0];
+	pixel->g = c[1];
+	pixel->b = c[2];
+}
+
+void DoPixelStartOfLineTiled(void)
+{
+	double u[REND2D_TILE_SIZE * REND2D_TILE_SIZE];
+	double v[REND2D_TILE_SIZE * REND2D_TILE_SIZE];
+	unsigned char rgb[REND2D_TILE_SIZE * REND2D_TILE_SIZE * 3], *p;
+	float *c;
+	int x, y, x0, xn, yn, n;
+
+	if(rend.y < band_y + REND2D_TILE_SIZE)
+		return;
+
+	/* Start a new band of lines. */
+	band_y = rend.y;
+	yn = rend.yend - band_y;
+	if(yn > REND2D_TILE_SIZE)
+		yn = REND2D_TILE_SIZE;
+	for(x0 = rend.xstart; x0 < rend.xend; x0 += REND2D_TILE_SIZE)
+	{
+		xn = rend.xend - x0;
+		if(xn > REND2D_TILE_SIZE)
+			xn = REND2D_TILE_SIZE;
+		/* Points the preview passes sampled are left out. */
+		n = 0;
+		for(y = 0; y < yn; y++)
+			for(x = 0; x < xn; x++)
+				if(PreviewSample(x0 + x, band_y + y) == NULL)
+				{
+					u[n] = rend.umin + ((double)(x0 + x) / (double)rend.xres) * rend.uwidth;
+					v[n] = rend.vmin + ((double)(band_y + y) / (double)rend.yres) * rend.vheight;
+					Jitter(&u[n], &v[n], uinc * rend.jitter, vinc * rend.jitter);
+					n++;
+				}
+		if(n > 0)
+			rend.calc_colors(n, u, v, rgb);
+		n = 0;
+		for(y = 0; y < yn; y++)
+			for(x = 0; x < xn; x++)
+			{
+				p = band + (y * band_width + x0 - rend.xstart + x) * 3;
+				if((c = PreviewSample(x0 + x, band_y + y)) != NULL)
+				{
+					p[0] = FloatToByte(c[0]);
+					p[1] = FloatToByte(c[1]);
+					p[2] = FloatToByte(c[2]);
+				}
+				else
+					memcpy(p, &rgb[n++ * 3], 3);
+			}
+	}
+}
+
+void DoPixelEndOfLineTiled(void)
+{
+}
+
+void DoPixelSetupTiled(void)
+{
+	band_width = rend.xend - rend.xstart;
+	band = (unsigned char *)malloc(sizeof(unsigned char) * band_width *
+		REND2D_TILE_SIZE * 3);
+	if(band == NULL)
+	{
+		rend.status = REND2D_STATUS_OUT_OF_MEMORY;
+		return;
+	}
+	band_y = rend.ystart - REND2D_TILE_SIZE;
+	uinc = rend.uwidth / (double)rend.xres;
+	vinc = rend.vheight / (double)rend.yres;
+	rend.status = REND2D_STATUS_READY;
+}
+
+void DoPixelCleanupTiled(void)
+{
+	if(band != NULL)
+		free(band);
+	band = NULL;
+}
+
+
 /*************************************************************************
 *
 *  DoPixelAdaptiveAA()
@@ -79,7 +295,6 @@ void DoPixelCleanupOnce(void)
 *************************************************************************/
 void DoPixelAdaptiveAA(Rend2DPixel *pixel)
 {
-  int i;
 	IColor c;
 	if(rend.y > rend.ystart)
 	{
@@ -87,26 +302,24 @@ void DoPixelAdaptiveAA(Rend2DPixel *pixel)
 		 * Load the top right corner of sample grid with coresponding value
 		 * saved from the previous line. 
 		 */
-		samples[0][AAGRIDSIZE].r = *this_line_ptr++;
-		samples[0][AAGRIDSIZE].g = *this_line_ptr++;
-		samples[0][AAGRIDSIZE].b = *this_line_ptr++;
-		cooked[0][AAGRIDSIZE] = 1;
+		grid.samples[0][AAGRIDSIZE].r = *this_line_ptr++;
+		grid.samples[0][AAGRIDSIZE].g = *this_line_ptr++;
+		grid.samples[0][AAGRIDSIZE].b = *this_line_ptr++;
+		grid.cooked[0][AAGRIDSIZE] = 1;
 	}
 	/* Sub divide pixel. */
-	level = rend.aa_level;
-	SubDividePixel(&c, 0, 0, AAGRIDSIZE);
+	grid.x = rend.x;
+	grid.y = rend.y;
+	grid.level = rend.aa_level;
+	LoadPreviewCorners(&grid);
+	SubDividePixel(&grid, &c, 0, 0, AAGRIDSIZE);
 	pixel->r = (unsigned char)c.r;
 	pixel->g = (unsigned char)c.g;
 	pixel->b = (unsigned char)c.b;
-	*next_line_ptr++ = (unsigned char)samples[AAGRIDSIZE][0].r;
-	*next_line_ptr++ = (unsigned char)samples[AAGRIDSIZE][0].g;
-	*next_line_ptr++ = (unsigned char)samples[AAGRIDSIZE][0].b;
-	for(i = 0; i <= AAGRIDSIZE; i++)
-	{
-		cooked[i][0] = cooked[i][AAGRIDSIZE];
-		memset(&cooked[i][1], 0, sizeof(unsigned char)*AAGRIDSIZE);
-		samples[i][0] = samples[i][AAGRIDSIZE];
-	}
+	*next_line_ptr++ = (unsigned char)grid.samples[AAGRIDSIZE][0].r;
+	*next_line_ptr++ = (unsigned char)grid.samples[AAGRIDSIZE][0].g;
+	*next_line_ptr++ = (unsigned char)grid.samples[AAGRIDSIZE][0].b;
+	ShiftAAGrid(&grid);
 }
 
 void DoPixelStartOfLineAdaptiveAA(void)
@@ -115,17 +328,17 @@ void DoPixelStartOfLineAdaptiveAA(void)
 	this_line_ptr = this_line;
 	next_line_ptr = next_line;
 	/* Clear all "cooked" flags. */
-	memset(cooked, 0, sizeof(unsigned char)*(AAGRIDSIZE+1)*(AAGRIDSIZE+1));
+	memset(grid.cooked, 0, sizeof(grid.cooked));
 	/*
 	 * Load the top left corner of sample grid with coresponding value
 	 * saved from the previous line if this is not the first line. 
 	 */
 	if(rend.y > rend.ystart)
 	{
-		samples[0][0].r = *this_line_ptr++;
-		samples[0][0].g = *this_line_ptr++;
-		samples[0][0].b = *this_line_ptr++;
-		cooked[0][0] = 1;
+		grid.samples[0][0].r = *this_line_ptr++;
+		grid.samples[0][0].g = *this_line_ptr++;
+		grid.samples[0][0].b = *this_line_ptr++;
+		grid.cooked[0][0] = 1;
 	}
 }
 
@@ -135,9 +348,9 @@ void DoPixelEndOfLineAdaptiveAA(void)
 	 * Save the sample at the far end of the next line.
 	 * (Which has been moved to the first column of the sample grid.)
 	 */
-	*next_line_ptr++ = (unsigned char)samples[AAGRIDSIZE][0].r;
-	*next_line_ptr++ = (unsigned char)samples[AAGRIDSIZE][0].g;
-	*next_line_ptr++ = (unsigned char)samples[AAGRIDSIZE][0].b;
+	*next_line_ptr++ = (unsigned char)grid.samples[AAGRIDSIZE][0].r;
+	*next_line_ptr++ = (unsigned char)grid.samples[AAGRIDSIZE][0].g;
+	*next_line_ptr++ = (unsigned char)grid.samples[AAGRIDSIZE][0].b;
   /* "next_line" becomes "this_line". */
 	this_line_ptr = this_line;
 	this_line = next_line;
@@ -147,7 +360,7 @@ void DoPixelEndOfLineAdaptiveAA(void)
 void DoPixelSetupAdaptiveAA(void)
 {
 	size_t line_size;
-	threshsqrd = rend.aa_threshold * rend.aa_threshold;
+	SetupAAGrid(&grid, &rend);
 	line_size = sizeof(unsigned char) * (rend.xend - rend.xstart + 1) * 3;
 	if((this_line = (unsigned char *)malloc(line_size)) == NULL)
 	{
@@ -165,8 +378,6 @@ void DoPixelSetupAdaptiveAA(void)
 	memset(next_line, 0, line_size);
 	this_line_ptr = this_line;
 	next_line_ptr = next_line;
-	uinc = rend.uwidth / (double)rend.xres;
-	vinc = rend.vheight / (double)rend.yres;
 	rend.status = REND2D_STATUS_READY;
 }
 
@@ -181,20 +392,77 @@ void DoPixelCleanupAdaptiveAA(void)
 }
 
 
-void SubDividePixel(IColor *color, int gridx, int gridy, int size)
+/*
+ * Set up sample grid "g" for renderer settings "r", with nothing cooked.
+ */
+void SetupAAGrid(AAGrid *g, const Rend2D *r)
 {
-	if(SampleColorGrid(gridx, gridy, size) /* There's a color difference... */
-		 && (size > 1 && level > 1)) /* ...and more sub-division can be done. */
+	g->rend = r;
+	g->x = r->xstart;
+	g->y = r->ystart;
+	g->threshsqrd = r->aa_threshold * r->aa_threshold;
+	g->level = r->aa_level;
+	g->nsamples = 0;
+	g->uinc = r->uwidth / (double)r->xres;
+	g->vinc = r->vheight / (double)r->yres;
+	memset(g->cooked, 0, sizeof(g->cooked));
+}
+
+
+/*
+ * Move the right column of sample grid "g" to the left column, ready
+ * for the next pixel along the line.
+ */
+void ShiftAAGrid(AAGrid *g)
+{
+	int i;
+	for(i = 0; i <= AAGRIDSIZE; i++)
+	{
+		g->cooked[i][0] = g->cooked[i][AAGRIDSIZE];
+		memset(&g->cooked[i][1], 0, sizeof(unsigned char)*AAGRIDSIZE);
+		g->samples[i][0] = g->samples[i][AAGRIDSIZE];
+	}
+}
+
+
+/*
+ * Fill in the corners of the pixel of sample grid "g" that aren't
+ * already, from the samples of the preview passes.
+ */
+void LoadPreviewCorners(AAGrid *g)
+{
+	IColor *s;
+	float *c;
+	int i, j;
+
+	for(j = 0; j <= AAGRIDSIZE; j += AAGRIDSIZE)
+		for(i = 0; i <= AAGRIDSIZE; i += AAGRIDSIZE)
+			if(!g->cooked[j][i] &&
+				(c = PreviewSample(g->x + i / AAGRIDSIZE, g->y + j / AAGRIDSIZE)) != NULL)
+			{
+				s = &g->samples[j][i];
+				s->r = FloatToByte(c[0]);
+				s->g = FloatToByte(c[1]);
+				s->b = FloatToByte(c[2]);
+				g->cooked[j][i] = 1;
+			}
+}
+
+
+void SubDividePixel(AAGrid *g, IColor *color, int gridx, int gridy, int size)
+{
+	if(SampleColorGrid(g, gridx, gridy, size) /* There's a color difference... */
+		 && (size > 1 && g->level > 1)) /* ...and more sub-division can be done. */
 	{
 		IColor tr, bl, br; /* "color" is top left. */
 		/* Split grid into quadrants and recursively sub-divide each one. */
 		size /= 2;
-		level--;
-		SubDividePixel(color, gridx, gridy, size);
-		SubDividePixel(&tr, gridx+size, gridy, size);
-		SubDividePixel(&bl, gridx, gridy+size, size);
-		SubDividePixel(&br, gridx+size, gridy+size, size);
-		level++;
+		g->level--;
+		SubDividePixel(g, color, gridx, gridy, size);
+		SubDividePixel(g, &tr, gridx+size, gridy, size);
+		SubDividePixel(g, &bl, gridx, gridy+size, size);
+		SubDividePixel(g, &br, gridx+size, gridy+size, size);
+		g->level++;
 		/* Average the color values from each quadrant. */
 		color->r += tr.r + bl.r + br.r;
 		color->r /= 4;
@@ -206,18 +474,18 @@ void SubDividePixel(IColor *color, int gridx, int gridy, int size)
 	else
 	{
 		/* Average the four corners. */
-		color->r = (samples[gridy][gridx].r +
-		  samples[gridy][gridx+size].r +
-			samples[gridy+size][gridx].r +
-			samples[gridy+size][gridx+size].r) / 4;
-		color->g = (samples[gridy][gridx].g +
-		  samples[gridy][gridx+size].g +
-			samples[gridy+size][gridx].g +
-			samples[gridy+size][gridx+size].g) / 4;
-		color->b = (samples[gridy][gridx].b +
-		  samples[gridy][gridx+size].b +
-			samples[gridy+size][gridx].b +
-			samples[gridy+size][gridx+size].b) / 4;
+		color->r = (g->samples[gridy][gridx].r +
+		  g->samples[gridy][gridx+size].r +
+			g->samples[gridy+size][gridx].r +
+			g->samples[gridy+size][gridx+size].r) / 4;
+		color->g = (g->samples[gridy][gridx].g +
+		  g->samples[gridy][gridx+size].g +
+			g->samples[gridy+size][gridx].g +
+			g->samples[gridy+size][gridx+size].g) / 4;
+		color->b = (g->samples[gridy][gridx].b +
+		  g->samples[gridy][gridx+size].b +
+			g->samples[gridy+size][gridx].b +
+			g->samples[gridy+size][gridx+size].b) / 4;
 	} 
 }
 
@@ -226,34 +494,37 @@ void SubDividePixel(IColor *color, int gridx, int gridy, int size)
  * Sample the color grid and then compare the colors. If color
  * difference reaches threshold return 1, otherwise return 0.
  */
-int SampleColorGrid(int gridx, int gridy, int size)
+int SampleColorGrid(AAGrid *grid, int gridx, int gridy, int size)
 {
+	const Rend2D *rend = grid->rend;
 	double u1, v1, u2, v2, u, v, uscale, vscale;
 	IColor *c1, *c2, *c3, *c4;
 	int dr, dg, db;
 	unsigned char r, g, b;
+	unsigned char (*cooked)[AAGRIDSIZE+1] = grid->cooked;
 
-	c1 = &samples[gridy][gridx];
-	c2 = &samples[gridy][gridx+size];
-	c3 = &samples[gridy+size][gridx+size];
-	c4 = &samples[gridy+size][gridx];
-
-	u1 = rend.umin + ((double)rend.x / (double)rend.xres) * rend.uwidth +
-		(double)gridx / (double)AAGRIDSIZE * uinc;
-	v1 = rend.vmin + ((double)rend.y / (double)rend.yres) * rend.vheight +
-		(double)gridy / (double)AAGRIDSIZE * vinc;
-	uscale = (double)size / (double)AAGRIDSIZE * uinc;
-	vscale = (double)size / (double)AAGRIDSIZE * vinc;
+	c1 = &grid->samples[gridy][gridx];
+	c2 = &grid->samples[gridy][gridx+size];
+	c3 = &grid->samples[gridy+size][gridx+size];
+	c4 = &grid->samples[gridy+size][gridx];
+
+	u1 = rend->umin + ((double)grid->x / (double)rend->xres) * rend->uwidth +
+		(double)gridx / (double)AAGRIDSIZE * grid->uinc;
+	v1 = rend->vmin + ((double)grid->y / (double)rend->yres) * rend->vheight +
+		(double)gridy / (double)AAGRIDSIZE * grid->vinc;
+	uscale = (double)size / (double)AAGRIDSIZE * grid->uinc;
+	vscale = (double)size / (double)AAGRIDSIZE * grid->vinc;
 	u2 = u1 + uscale;
 	v2 = v1 + vscale;
-  uscale *= rend.jitter;
-  vscale *= rend.jitter;
+  uscale *= rend->jitter;
+  vscale *= rend->jitter;
 
 	if(!cooked[gridy][gridx])
 	{
 		u = u1; v = v1;
 		Jitter(&u, &v, uscale, vscale);
-		rend.calc_color(u, v, &r, &g, &b);
+		rend->calc_color(u, v, &r, &g, &b);
+		grid->nsamples++;
 		c1->r = r;
 		c1->g = g;
 		c1->b = b;
@@ -263,7 +534,8 @@ int SampleColorGrid(int gridx, int gridy, int size)
 	{
 		u = u2; v = v1;
 		Jitter(&u, &v, uscale, vscale);
-		rend.calc_color(u, v, &r, &g, &b);
+		rend->calc_color(u, v, &r, &g, &b);
+		grid->nsamples++;
 		c2->r = r;
 		c2->g = g;
 		c2->b = b;
@@ -273,7 +545,8 @@ int SampleColorGrid(int gridx, int gridy, int size)
 	{
 		u = u2; v = v2;
 		Jitter(&u, &v, uscale, vscale);
-		rend.calc_color(u, v, &r, &g, &b);
+		rend->calc_color(u, v, &r, &g, &b);
+		grid->nsamples++;
 		c3->r = r;
 		c3->g = g;
 		c3->b = b;
@@ -283,7 +556,8 @@ int SampleColorGrid(int gridx, int gridy, int size)
 	{
 		u = u1; v = v2;
 		Jitter(&u, &v, uscale, vscale);
-		rend.calc_color(u, v, &r, &g, &b);
+		rend->calc_color(u, v, &r, &g, &b);
+		grid->nsamples++;
 		c4->r = r;
 		c4->g = g;
 		c4->b = b;
@@ -293,27 +567,607 @@ int SampleColorGrid(int gridx, int gridy, int size)
 	dr = c1->r - c2->r;
 	dg = c1->g - c2->g;
 	db = c1->b - c2->b;
-	if((dr * dr + dg * dg + db * db) >= threshsqrd)
+	if((dr * dr + dg * dg + db * db) >= grid->threshsqrd)
 		return 1;
 	dr = c2->r - c3->r;
 	dg = c2->g - c3->g;
 	db = c2->b - c3->b;
-	if((dr * dr + dg * dg + db * db) >= threshsqrd)
+	if((dr * dr + dg * dg + db * db) >= grid->threshsqrd)
 		return 1;
 	dr = c3->r - c4->r;
 	dg = c3->g - c4->g;
 	db = c3->b - c4->b;
-	if((dr * dr + dg * dg + db * db) >= threshsqrd)
+	if((dr * dr + dg * dg + db * db) >= grid->threshsqrd)
 		return 1;
 	dr = c4->r - c1->r;
 	dg = c4->g - c1->g;
 	db = c4->b - c1->b;
-	if((dr * dr + dg * dg + db * db) >= threshsqrd)
+	if((dr * dr + dg * dg + db * db) >= grid->threshsqrd)
 		return 1;
 	return 0;
 }
 
 
+/*************************************************************************
+*
+*  DoPixelAdaptiveVariance()
+*
+*  Start from the colors at the four corners of pixel, shared with its
+*  neighbors as for adaptive anti-aliasing, and keep a running mean and
+*  variance of its color while adding samples spread evenly over the
+*  pixel, until the standard error of the mean is within the tolerance
+*  or the sample cap is reached. Colors come from the float color proc
+*  if there is one, so that highlights brighter than max are averaged
+*  unclamped rather than clipped before the average is taken.
+*
+*************************************************************************/
+static float *fthis_line, *fnext_line;	/* Corner colors above and below. */
+
+static void SampleColor(const Rend2D *r, double u, double v, float *rgb);
+static int SampleLineCorner(int x, int y, float *rgb);
+static int SamplePixelVariance(const Rend2D *r, int x, int y,
+	const float *top, const float *bottom, float *rgb);
+static double Halton(int base, int i);
+
+void DoPixelAdaptiveVariance(Rend2DPixel *pixel)
+{
+	float rgb[3], *top, *bottom;
+	int x = rend.x - rend.xstart;
+
+	top = fthis_line + x * 3;
+	bottom = fnext_line + x * 3;
+	pixel->samples = 0;
+	if(x == 0)
+		pixel->samples += SampleLineCorner(rend.x, rend.y + 1, bottom);
+	pixel->samples += SampleLineCorner(rend.x + 1, rend.y + 1, bottom + 3);
+	pixel->samples += SamplePixelVariance(&rend, rend.x, rend.y, top, bottom, rgb);
+	pixel->fr = rgb[0];
+	pixel->fg = rgb[1];
+	pixel->fb = rgb[2];
+	pixel->r = FloatToByte(rgb[0]);
+	pixel->g = FloatToByte(rgb[1]);
+	pixel->b = FloatToByte(rgb[2]);
+}
+
+void DoPixelStartOfLineAdaptiveVariance(void)
+{
+	int x;
+
+	/* The first line's top corners have no line above to come from. */
+	if(rend.y == rend.ystart)
+		for(x = rend.xstart; x <= rend.xend; x++)
+			SampleLineCorner(x, rend.y, fthis_line + (x - rend.xstart) * 3);
+}
+
+void DoPixelEndOfLineAdaptiveVariance(void)
+{
+	float *tmp;
+
+	/* "fnext_line" becomes "fthis_line". */
+	tmp = fthis_line;
+	fthis_line = fnext_line;
+	fnext_line = tmp;
+}
+
+void DoPixelSetupAdaptiveVariance(void)
+{
+	size_t line_size;
+	line_size = sizeof(float) * (rend.xend - rend.xstart + 1) * 3;
+	if((fthis_line = (float *)malloc(line_size)) == NULL)
+	{
+		rend.status = REND2D_STATUS_OUT_OF_MEMORY;
+		return;
+	}
+	if((fnext_line = (float *)malloc(line_size)) == NULL)
+	{
+		free(fthis_line);
+		fthis_line = NULL;
+		rend.status = REND2D_STATUS_OUT_OF_MEMORY;
+		return;
+	}
+	rend.status = REND2D_STATUS_READY;
+}
+
+void DoPixelCleanupAdaptiveVariance(void)
+{
+	if(fthis_line != NULL)
+		free(fthis_line);
+	fthis_line = NULL;
+	if(fnext_line != NULL)
+		free(fnext_line);
+	fnext_line = NULL;
+}
+
+
+/*
+ * Sample the color at the top-left corner of pixel "x", "y" for the line
+ * at a time renderer, unless the preview passes already have.
+ * Returns the number of samples taken.
+ */
+int SampleLineCorner(int x, int y, float *rgb)
+{
+	float *c;
+
+	if((c = PreviewSample(x, y)) != NULL)
+	{
+		memcpy(rgb, c, sizeof(float) * 3);
+		return 0;
+	}
+	SampleCorner(&rend, x, y, rgb);
+	return 1;
+}
+
+
+/*
+ * Sample the color at the top-left corner of pixel "x", "y".
+ */
+void SampleCorner(const Rend2D *r, int x, int y, float *rgb)
+{
+	double u, v;
+
+	u = r->umin + ((double)x / (double)r->xres) * r->uwidth;
+	v = r->vmin + ((double)y / (double)r->yres) * r->vheight;
+	Jitter(&u, &v, r->uwidth / (double)r->xres * r->jitter,
+		r->vheight / (double)r->yres * r->jitter);
+	SampleColor(r, u, v, rgb);
+}
+
+
+/*
+ * Sample the color at point "k" of the sequence of points spread over
+ * pixel "x", "y". Point 0 is the top left corner, unless jittered.
+ */
+void SamplePixelPoint(const Rend2D *r, int x, int y, int k, float *rgb)
+{
+	double u, v, du, dv;
+
+	/* With jitter, each pixel's sample pattern is shifted differently. */
+	du = (Frand((long)(x * 10709 + y * 11011)) + 1.0) * 0.5 * r->jitter;
+	dv = (Frand((long)(x * 12307 + y * 10909)) + 1.0) * 0.5 * r->jitter;
+	u = Halton(2, k) + du;
+	v = Halton(3, k) + dv;
+	u = r->umin + (((double)x + u - floor(u)) / (double)r->xres) * r->uwidth;
+	v = r->vmin + (((double)y + v - floor(v)) / (double)r->yres) * r->vheight;
+	SampleColor(r, u, v, rgb);
+}
+
+
+/*
+ * Sample the color at screen point "u", "v" as floats, from whichever
+ * color proc there is.
+ */
+void SampleColor(const Rend2D *r, double u, double v, float *rgb)
+{
+	unsigned char c[3];
+
+	if(r->calc_color_f != NULL)
+		r->calc_color_f(u, v, rgb);
+	else
+	{
+		r->calc_color(u, v, &c[0], &c[1], &c[2]);
+		rgb[0] = (float)c[0] / 255.0f;
+		rgb[1] = (float)c[1] / 255.0f;
+		rgb[2] = (float)c[2] / 255.0f;
+	}
+}
+
+
+/*
+ * Sample pixel "x", "y", given the colors of its corners in "top" and
+ * "bottom", until its mean color, left in "rgb", is good enough.
+ * Returns the number of samples taken, besides the corners.
+ */
+int SamplePixelVariance(const Rend2D *r, int x, int y,
+	const float *top, const float *bottom, float *rgb)
+{
+	double mean[3], smean[3], m2[3], s, d, err, tol;
+	const float *corner[4];
+	float f[3];
+	int i, k, n;
+
+	corner[0] = top;
+	corner[1] = top + 3;
+	corner[2] = bottom;
+	corner[3] = bottom + 3;
+
+	tol = r->aa_tolerance * r->aa_tolerance;
+	for(i = 0; i < 3; i++)
+		mean[i] = smean[i] = m2[i] = 0.0;
+
+	/*
+	 * The corners count as the first four samples. The first point of
+	 * the sequence, the top left corner, is then skipped.
+	 */
+	for(n = 0, k = -4;; k++)
+	{
+		if(k < 0)
+		{
+			f[0] = corner[k + 4][0];
+			f[1] = corner[k + 4][1];
+			f[2] = corner[k + 4][2];
+		}
+		else
+			SamplePixelPoint(r, x, y, k + 1, f);
+		n++;
+
+		/*
+		 * Running mean of the color, and running mean and variance of
+		 * the color scaled by c / (1 + c), which the error is judged by.
+		 */
+		err = 0.0;
+		for(i = 0; i < 3; i++)
+		{
+			mean[i] += (f[i] - mean[i]) / n;
+			s = (f[i] > 0.0f) ? f[i] / (1.0 + f[i]) : 0.0;
+			d = s - smean[i];
+			smean[i] += d / n;
+			m2[i] += d * (s - smean[i]);
+			/* Squared standard error of the mean. */
+			if(n > 1 && m2[i] / ((double)(n - 1) * n) > err)
+				err = m2[i] / ((double)(n - 1) * n);
+		}
+		if(k < -1)
+			continue;
+		if(err <= tol)
+			break;
+		if(r->aa_max_samples > 0 && k + 1 >= r->aa_max_samples)
+			break;
+	}
+
+	for(i = 0; i < 3; i++)
+		rgb[i] = (float)mean[i];
+	return k + 1;
+}
+
+
+/*
+ * Element "i" of the Halton sequence of "base", in [0, 1).
+ */
+double Halton(int base, int i)
+{
+	double h = 0.0, f = 1.0 / base;
+	for(; i > 0; i /= base, f /= base)
+		h += f * (i % base);
+	return h;
+}
+
+
+unsigned char FloatToByte(float c)
+{
+	if(c <= 0.0f)
+		return 0;
+	if(c >= 0.999999f)
+		return 255;
+	return (unsigned char)(c * 256.0f);
+}
+
+
+/*************************************************************************
+*
+*  Rend2D_RenderTile()
+*
+*  Render one tile of the frame into a frame buffer. Everything the tile
+*  needs comes from the job, and everything it leaves goes to the frame
+*  buffer and the result, so tiles may be rendered in any order, or at
+*  the same time if the color procs allow it.
+*
+*  Returns REND2D_STATUS_FINISH, or REND2D_STATUS_OUT_OF_MEMORY.
+*
+*************************************************************************/
+static void FillTileBlock(const Rend2DTileJob *job, int x, int y, int size,
+	unsigned char *rgb);
+static void RenderTileOnce(const Rend2D *r, const Rend2DTileJob *job,
+	Rend2DTileResult *result, int step);
+static void RenderTileBlocks(const Rend2D *r, const Rend2DTileJob *job,
+	Rend2DTileResult *result);
+static void RenderTileAdaptiveAA(const Rend2D *r, const Rend2DTileJob *job,
+	Rend2DTileResult *result);
+static void RenderTileAdaptiveVariance(const Rend2D *r,
+	const Rend2DTileJob *job, Rend2DTileResult *result);
+
+int Rend2D_RenderTile(const Rend2DTileJob *job, Rend2DTileResult *result)
+{
+	Rend2D r = *job->rend;
+
+	assert(r.calc_color != NULL);
+	r.uwidth = r.umax - r.umin;
+	r.vheight = r.vmax - r.vmin;
+	result->status = REND2D_STATUS_FINISH;
+	result->samples = 0;
+	if(job->width <= 0 || job->height <= 0)
+		return result->status;
+
+	if(r.preview)
+		RenderTileOnce(&r, job, result, 1 << job->pass);
+	else if(r.mode == REND2D_MODE_ADAPTIVE_ANTIALIAS)
+		RenderTileAdaptiveAA(&r, job, result);
+	else if(r.mode == REND2D_MODE_ADAPTIVE_VARIANCE)
+		RenderTileAdaptiveVariance(&r, job, result);
+	else if(r.calc_colors != NULL)
+		RenderTileBlocks(&r, job, result);
+	else
+		RenderTileOnce(&r, job, result, 1);
+	return result->status;
+}
+
+
+/*
+ * Set the "size" x "size" block of pixels at "x", "y" to color "rgb",
+ * as far as it lies within the tile.
+ */
+void FillTileBlock(const Rend2DTileJob *job, int x, int y, int size,
+	unsigned char *rgb)
+{
+	unsigned char *p;
+	int i, j, x1, y1;
+
+	x1 = x + size;
+	y1 = y + size;
+	if(x < job->x)
+		x = job->x;
+	if(y < job->y)
+		y = job->y;
+	if(x1 > job->x + job->width)
+		x1 = job->x + job->width;
+	if(y1 > job->y + job->height)
+		y1 = job->y + job->height;
+	for(j = y; j < y1; j++)
+	{
+		p = job->rgb + j * job->stride + x * 3;
+		for(i = x; i < x1; i++)
+		{
+			*p++ = rgb[0];
+			*p++ = rgb[1];
+			*p++ = rgb[2];
+		}
+	}
+}
+
+
+/*
+ * Sample the top-left corner of every "step"th pixel of the tile,
+ * counting from the start of the frame, and fill the block of pixels
+ * below and to the right with its color. For a preview pass, the pixels
+ * sampled by the previous, coarser, pass are skipped.
+ */
+void RenderTileOnce(const Rend2D *r, const Rend2DTileJob *job,
+	Rend2DTileResult *result, int step)
+{
+	double u, v, uinc, vinc;
+	int x, y, x0, y0, done;
+	unsigned char rgb[3];
+
+	uinc = r->uwidth / (double)r->xres;
+	vinc = r->vheight / (double)r->yres;
+	done = (r->preview && step < (1 << REND2D_PREVIEW_DEPTH)) ? step * 2 : 0;
+	/* Blocks are aligned with the start of the frame, not the tile. */
+	x0 = r->xstart + ((job->x - r->xstart) / step) * step;
+	y0 = r->ystart + ((job->y - r->ystart) / step) * step;
+	for(y = y0; y < job->y + job->height; y += step)
+		for(x = x0; x < job->x + job->width; x += step)
+		{
+			if(done && (x - r->xstart) % done == 0 && (y - r->ystart) % done == 0)
+				continue;
+			u = r->umin + ((double)x / (double)r->xres) * r->uwidth;
+			v = r->vmin + ((double)y / (double)r->yres) * r->vheight;
+			Jitter(&u, &v, uinc * r->jitter, vinc * r->jitter);
+			r->calc_color(u, v, &rgb[0], &rgb[1], &rgb[2]);
+			result->samples++;
+			FillTileBlock(job, x, y, step, rgb);
+		}
+}
+
+
+/*
+ * As RenderTileOnce() for whole pixels, but finding the colors with the
+ * block color proc, REND2D_TILE_SIZE square at a time.
+ */
+void RenderTileBlocks(const Rend2D *r, const Rend2DTileJob *job,
+	Rend2DTileResult *result)
+{
+	double u[REND2D_TILE_SIZE * REND2D_TILE_SIZE];
+	double v[REND2D_TILE_SIZE * REND2D_TILE_SIZE];
+	unsigned char rgb[REND2D_TILE_SIZE * REND2D_TILE_SIZE * 3];
+	double uinc, vinc;
+	int x, y, x0, y0, xn, yn, n;
+
+	uinc = r->uwidth / (double)r->xres;
+	vinc = r->vheight / (double)r->yres;
+	for(y0 = job->y; y0 < job->y + job->height; y0 += REND2D_TILE_SIZE)
+	{
+		yn = job->y + job->height - y0;
+		if(yn > REND2D_TILE_SIZE)
+			yn = REND2D_TILE_SIZE;
+		for(x0 = job->x; x0 < job->x + job->width; x0 += REND2D_TILE_SIZE)
+		{
+			xn = job->x + job->width - x0;
+			if(xn > REND2D_TILE_SIZE)
+				xn = REND2D_TILE_SIZE;
+			n = 0;
+			for(y = 0; y < yn; y++)
+				for(x = 0; x < xn; x++, n++)
+				{
+					u[n] = r->umin + ((double)(x0 + x) / (double)r->xres) * r->uwidth;
+					v[n] = r->vmin + ((double)(y0 + y) / (double)r->yres) * r->vheight;
+					Jitter(&u[n], &v[n], uinc * r->jitter, vinc * r->jitter);
+				}
+			r->calc_colors(n, u, v, rgb);
+			result->samples += n;
+			n = 0;
+			for(y = 0; y < yn; y++)
+				for(x = 0; x < xn; x++, n++)
+					memcpy(job->rgb + (y0 + y) * job->stride + (x0 + x) * 3,
+						&rgb[n * 3], 3);
+		}
+	}
+}
+
+
+/*
+ * Adaptive anti-aliasing a line of the tile at a time, as the line at a
+ * time renderer does for the frame. The pixel corners along the bottom
+ * of each line are kept for the next, and the sample grid column along
+ * the right of each pixel for the next pixel. The tile's own top and
+ * left edges come from "job", and its bottom and right edges are left
+ * in "result", for the tiles that follow.
+ */
+void RenderTileAdaptiveAA(const Rend2D *r, const Rend2DTileJob *job,
+	Rend2DTileResult *result)
+{
+	AAGrid g;
+	IColor c;
+	Rend2DSample *above, *below, *tmp, *s;
+	const Rend2DSample *top, *e;
+	unsigned char rgb[3];
+	size_t line_size;
+	int x, y, k;
+
+	line_size = sizeof(Rend2DSample) * (job->width + 1);
+	above = (Rend2DSample *)malloc(line_size);
+	below = (Rend2DSample *)malloc(line_size);
+	if(above == NULL || below == NULL)
+	{
+		if(above != NULL)
+			free(above);
+		if(below != NULL)
+			free(below);
+		result->status = REND2D_STATUS_OUT_OF_MEMORY;
+		return;
+	}
+
+	SetupAAGrid(&g, r);
+	top = job->top_edge;
+	for(y = 0; y < job->height; y++)
+	{
+		g.y = job->y + y;
+		memset(g.cooked, 0, sizeof(g.cooked));
+		if(job->left_edge != NULL)
+		{
+			for(k = 0; k <= AAGRIDSIZE; k++)
+			{
+				e = &job->left_edge[y * AAGRIDSIZE + k];
+				g.samples[k][0].r = e->r;
+				g.samples[k][0].g = e->g;
+				g.samples[k][0].b = e->b;
+				g.cooked[k][0] = e->valid;
+			}
+		}
+		for(x = 0; x < job->width; x++)
+		{
+			g.x = job->x + x;
+			if(top != NULL)
+			{
+				/* Load the top corners from the line above. */
+				for(k = (x == 0) ? 0 : 1; k <= 1; k++)
+				{
+					g.samples[0][k * AAGRIDSIZE].r = top[x + k].r;
+					g.samples[0][k * AAGRIDSIZE].g = top[x + k].g;
+					g.samples[0][k * AAGRIDSIZE].b = top[x + k].b;
+					g.cooked[0][k * AAGRIDSIZE] = top[x + k].valid;
+				}
+			}
+			g.level = r->aa_level;
+			SubDividePixel(&g, &c, 0, 0, AAGRIDSIZE);
+			rgb[0] = (unsigned char)c.r;
+			rgb[1] = (unsigned char)c.g;
+			rgb[2] = (unsigned char)c.b;
+			FillTileBlock(job, g.x, g.y, 1, rgb);
+
+			/* Keep the bottom corners for the line below. */
+			for(k = 0; k <= ((x == job->width - 1) ? 1 : 0); k++)
+			{
+				below[x + k].r = (unsigned char)g.samples[AAGRIDSIZE][k * AAGRIDSIZE].r;
+				below[x + k].g = (unsigned char)g.samples[AAGRIDSIZE][k * AAGRIDSIZE].g;
+				below[x + k].b = (unsigned char)g.samples[AAGRIDSIZE][k * AAGRIDSIZE].b;
+				below[x + k].valid = 1;
+			}
+			if(x == job->width - 1 && result->right_edge != NULL)
+			{
+				for(k = 0; k <= AAGRIDSIZE; k++)
+				{
+					s = &result->right_edge[y * AAGRIDSIZE + k];
+					s->r = (unsigned char)g.samples[k][AAGRIDSIZE].r;
+					s->g = (unsigned char)g.samples[k][AAGRIDSIZE].g;
+					s->b = (unsigned char)g.samples[k][AAGRIDSIZE].b;
+					s->valid = g.cooked[k][AAGRIDSIZE];
+				}
+			}
+			ShiftAAGrid(&g);
+		}
+		/* "below" becomes "above". */
+		tmp = above;
+		above = below;
+		below = tmp;
+		top = above;
+	}
+	if(result->bottom_edge != NULL)
+		memcpy(result->bottom_edge, above, line_size);
+	result->samples += g.nsamples;
+	free(above);
+	free(below);
+}
+
+
+/*
+ * Variance anti-aliasing a line of the tile at a time. The corners
+ * along the tile's edges are sampled again by the neighboring tiles, so
+ * no edges are shared.
+ */
+void RenderTileAdaptiveVariance(const Rend2D *r, const Rend2DTileJob *job,
+	Rend2DTileResult *result)
+{
+	unsigned char *p;
+	float rgb[3], *h, *above, *below, *tmp;
+	size_t line_size;
+	int x, y;
+
+	line_size = sizeof(float) * (job->width + 1) * 3;
+	above = (float *)malloc(line_size);
+	below = (float *)malloc(line_size);
+	if(above == NULL || below == NULL)
+	{
+		if(above != NULL)
+			free(above);
+		if(below != NULL)
+			free(below);
+		result->status = REND2D_STATUS_OUT_OF_MEMORY;
+		return;
+	}
+
+	for(x = 0; x <= job->width; x++)
+		SampleCorner(r, job->x + x, job->y, above + x * 3);
+	result->samples += job->width + 1;
+	for(y = job->y; y < job->y + job->height; y++)
+	{
+		p = job->rgb + y * job->stride + job->x * 3;
+		h = (job->hdr != NULL) ? job->hdr + y * job->hdr_stride + job->x * 3 : NULL;
+		SampleCorner(r, job->x, y + 1, below);
+		result->samples++;
+		for(x = 0; x < job->width; x++)
+		{
+			SampleCorner(r, job->x + x + 1, y + 1, below + (x + 1) * 3);
+			result->samples += 1 + SamplePixelVariance(r, job->x + x, y,
+				above + x * 3, below + x * 3, rgb);
+			*p++ = FloatToByte(rgb[0]);
+			*p++ = FloatToByte(rgb[1]);
+			*p++ = FloatToByte(rgb[2]);
+			if(h != NULL)
+			{
+				*h++ = rgb[0];
+				*h++ = rgb[1];
+				*h++ = rgb[2];
+			}
+		}
+		/* "below" becomes "above". */
+		tmp = above;
+		above = below;
+		below = tmp;
+	}
+	free(above);
+	free(below);
+}
+
+
 /*************************************************************************
 *
 *  Jitter generation functions.
@@ -329,7 +1183,7 @@ double Frand(register long s)
 
 void Jitter(double *u, double *v, double uscale, double vscale)
 {
-	if(rend.jitter)
+	if(uscale != 0.0 || vscale != 0.0)
 	{
 		double tmp = *u;
 		*u += Frand((long)(tmp * 10709 + *v * 11011)) * uscale;
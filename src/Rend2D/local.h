@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdio.h>
 #include <assert.h>
 
 /*
@@ -36,11 +37,32 @@ extern void DoPixelEndOfLineOnce(void);
 extern void DoPixelSetupOnce(void);
 extern void DoPixelCleanupOnce(void);
 
+extern void DoPixelPreview(Rend2DPixel *pixel);
+extern void DoPixelStartOfLinePreview(void);
+extern void DoPixelEndOfLinePreview(void);
+extern void DoPixelSetupPreview(void);
+extern void DoPixelCleanupPreview(void);
+
+extern void DoPixelTiled(Rend2DPixel *pixel);
+extern void DoPixelStartOfLineTiled(void);
+extern void DoPixelEndOfLineTiled(void);
+extern void DoPixelSetupTiled(void);
+extern void DoPixelCleanupTiled(void);
+
 extern void DoPixelAdaptiveAA(Rend2DPixel *pixel);
 extern void DoPixelStartOfLineAdaptiveAA(void);
 extern void DoPixelEndOfLineAdaptiveAA(void);
 extern void DoPixelSetupAdaptiveAA(void);
 extern void DoPixelCleanupAdaptiveAA(void);
 
+extern void DoPixelAdaptiveVariance(Rend2DPixel *pixel);
+extern void DoPixelStartOfLineAdaptiveVariance(void);
+extern void DoPixelEndOfLineAdaptiveVariance(void);
+extern void DoPixelSetupAdaptiveVariance(void);
+extern void DoPixelCleanupAdaptiveVariance(void);
+
+extern void SamplePixelPoint(const Rend2D *r, int x, int y, int k, float *rgb);
+extern unsigned char FloatToByte(float c);
+
 
 #endif  /* LOCAL_H */
\ No newline at end of file
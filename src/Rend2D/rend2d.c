@@ -10,12 +10,15 @@
 Rend2D rend;
 
 /* Preview sub-division depth. */
-#define PREVIEW_DEPTH    4
+#define PREVIEW_DEPTH    REND2D_PREVIEW_DEPTH
 
+/* Pass 0, the final pass, samples every pixel as if no preview. */
 static int xevenoffset[] =
-	{ 1, 2, 4, 8, 0 };
+	{ 0, 2, 4, 8, 0 };
 static int xevenstep[] =
-	{ 2, 4, 8, 16, 16 };
+	{ 1, 4, 8, 16, 16 };
+
+static void SetDoPixelProcs(void);
 
 static int DefaultCalcColor(double u, double v,
 	unsigned char *r, unsigned char *g, unsigned char *b)
@@ -51,6 +54,8 @@ static int DefaultCalcColor(double u, double v,
 int Rend2D_Init(void)
 {
 	rend.calc_color = DefaultCalcColor;
+	rend.calc_colors = NULL;
+	rend.calc_color_f = NULL;
 	rend.xstart = 0;
 	rend.xend = 160;
 	rend.ystart = 0;
@@ -65,6 +70,9 @@ int Rend2D_Init(void)
 	rend.preview = 0;
 	rend.aa_threshold = 5;
 	rend.aa_level = 2;
+	rend.aa_tolerance = 0.01;
+	rend.aa_max_samples = 16;
+	rend.get_contrib = NULL;
 	rend.jitter = 0.0;
 	rend.bgr = 0;
 	rend.bgg = 0;
@@ -85,6 +93,7 @@ void Rend2D_Close(void)
 	if(rend.status == REND2D_STATUS_RENDERING)
   {
   	DoPixelCleanup();
+  	DoPixelCleanupPreview();
   }
 	rend.status = REND2D_STATUS_NOT_INITIALIZED;
 }
@@ -118,35 +127,14 @@ void Rend2D_Start(void)
 			rend.xstep = 1 << rend.preview;
 			rend.ystep = 1 << rend.preview;
 			rend.xevenstep = xevenstep[rend.preview];
-			DoPixel = DoPixelOnce;
-			DoPixelStartOfLine = DoPixelStartOfLineOnce;
-			DoPixelEndOfLine = DoPixelEndOfLineOnce;
-			DoPixelSetup = DoPixelSetupOnce;
-			DoPixelCleanup = DoPixelCleanupOnce;
 		}
 		else
 		{
 			rend.xstep = 1;
 			rend.xevenstep = 1;
 			rend.ystep = 1;
-			switch(rend.mode)
-			{
-				case REND2D_MODE_ADAPTIVE_ANTIALIAS:
-					DoPixel = DoPixelAdaptiveAA;
-					DoPixelStartOfLine = DoPixelStartOfLineAdaptiveAA;
-					DoPixelEndOfLine = DoPixelEndOfLineAdaptiveAA;
-					DoPixelSetup = DoPixelSetupAdaptiveAA;
-					DoPixelCleanup = DoPixelCleanupAdaptiveAA;
-					break;
-				default: /* REND2D_MODE_ONCE_PER_PIXEL */
-					DoPixel = DoPixelOnce;
-					DoPixelStartOfLine = DoPixelStartOfLineOnce;
-					DoPixelEndOfLine = DoPixelEndOfLineOnce;
-					DoPixelSetup = DoPixelSetupOnce;
-					DoPixelCleanup = DoPixelCleanupOnce;
-					break;
-			}
 		}
+		SetDoPixelProcs();
 		DoPixelSetup();
 		if(rend.status == REND2D_STATUS_READY) /* Setup was successful. */
 			rend.status = REND2D_STATUS_RENDERING;
@@ -156,6 +144,57 @@ void Rend2D_Start(void)
 }
 
 
+/*
+ * Point the pixel procs at those for the preview passes, or for the
+ * rendering mode once the preview passes are done.
+ */
+void SetDoPixelProcs(void)
+{
+	if(rend.preview > 0)
+	{
+		DoPixel = DoPixelPreview;
+		DoPixelStartOfLine = DoPixelStartOfLinePreview;
+		DoPixelEndOfLine = DoPixelEndOfLinePreview;
+		DoPixelSetup = DoPixelSetupPreview;
+		DoPixelCleanup = DoPixelCleanupPreview;
+		return;
+	}
+	switch(rend.mode)
+	{
+		case REND2D_MODE_ADAPTIVE_ANTIALIAS:
+			DoPixel = DoPixelAdaptiveAA;
+			DoPixelStartOfLine = DoPixelStartOfLineAdaptiveAA;
+			DoPixelEndOfLine = DoPixelEndOfLineAdaptiveAA;
+			DoPixelSetup = DoPixelSetupAdaptiveAA;
+			DoPixelCleanup = DoPixelCleanupAdaptiveAA;
+			break;
+		case REND2D_MODE_ADAPTIVE_VARIANCE:
+			DoPixel = DoPixelAdaptiveVariance;
+			DoPixelStartOfLine = DoPixelStartOfLineAdaptiveVariance;
+			DoPixelEndOfLine = DoPixelEndOfLineAdaptiveVariance;
+			DoPixelSetup = DoPixelSetupAdaptiveVariance;
+			DoPixelCleanup = DoPixelCleanupAdaptiveVariance;
+			break;
+		default: /* REND2D_MODE_ONCE_PER_PIXEL */
+			if(rend.calc_colors != NULL)
+			{
+				DoPixel = DoPixelTiled;
+				DoPixelStartOfLine = DoPixelStartOfLineTiled;
+				DoPixelEndOfLine = DoPixelEndOfLineTiled;
+				DoPixelSetup = DoPixelSetupTiled;
+				DoPixelCleanup = DoPixelCleanupTiled;
+				break;
+			}
+			DoPixel = DoPixelOnce;
+			DoPixelStartOfLine = DoPixelStartOfLineOnce;
+			DoPixelEndOfLine = DoPixelEndOfLineOnce;
+			DoPixelSetup = DoPixelSetupOnce;
+			DoPixelCleanup = DoPixelCleanupOnce;
+			break;
+	}
+}
+
+
 int Rend2D_DoPixel(Rend2DPixel *pixel)
 {
 	if(rend.status == REND2D_STATUS_RENDERING)
@@ -195,9 +234,22 @@ int Rend2D_DoPixel(Rend2DPixel *pixel)
 						rend.ystep = 1 << rend.preview;
 						rend.xevenstep = xevenstep[rend.preview];
 						rend.even = 1;
+						if(rend.preview == 0)
+						{
+							/* On to the final pass, in the rendering mode. */
+							SetDoPixelProcs();
+							DoPixelSetup();
+							if(rend.status == REND2D_STATUS_READY)
+								rend.status = REND2D_STATUS_RENDERING;
+							else
+								DoPixelCleanupPreview();
+						}
 					}
 					else
+					{
 						DoPixelCleanup();
+						DoPixelCleanupPreview();
+					}
 				}
 				rend.x = rend.xstart + ((rend.even && rend.xevenstep > 1) ?
 					xevenoffset[rend.preview] : 0);
@@ -283,3 +335,348 @@ void Rend2D_SetState(Rend2D *r)
 	}
 }
 
+
+/*************************************************************************
+*
+*  Progressive rendering.
+*
+*************************************************************************/
+
+/* Passes before a pixel may be judged good enough. */
+#define PROGRESS_MIN_SAMPLES  4
+
+/* Progress file header - "G2DP" and the settings it was made with. */
+#define PROGRESS_MAGIC    0x50443247L
+#define PROGRESS_VERSION  1
+
+typedef struct tag_progressheader
+{
+	long magic;
+	int version;
+	int xres, yres, xstart, ystart, width, height;
+	double umin, umax, vmin, vmax, jitter;
+	int passes;
+} ProgressHeader;
+
+static void ProgressHeaderFrom(ProgressHeader *h, const Rend2DProgress *p);
+
+
+Rend2DProgress *Rend2D_NewProgress(const Rend2D *r)
+{
+	Rend2DProgress *p;
+
+	if((p = (Rend2DProgress *)malloc(sizeof(Rend2DProgress))) == NULL)
+		return NULL;
+	p->rend = *r;
+	p->rend.uwidth = p->rend.umax - p->rend.umin;
+	p->rend.vheight = p->rend.vmax - p->rend.vmin;
+	p->width = r->xend - r->xstart;
+	p->height = r->yend - r->ystart;
+	p->passes = 0;
+	p->accum = (Rend2DAccum *)calloc((size_t)p->width * p->height,
+		sizeof(Rend2DAccum));
+	if(p->accum == NULL)
+	{
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+
+void Rend2D_DeleteProgress(Rend2DProgress *p)
+{
+	if(p != NULL)
+	{
+		free(p->accum);
+		free(p);
+	}
+}
+
+
+/*
+ * Add a sample to each pixel still short of good enough.
+ * Returns the number of samples taken, zero once every pixel is done.
+ */
+int Rend2D_ProgressPass(Rend2DProgress *p)
+{
+	const Rend2D *r = &p->rend;
+	Rend2DAccum *a = p->accum;
+	double n, var, tol;
+	float rgb[3], s;
+	int x, y, i, nsamples = 0;
+
+	tol = r->aa_tolerance * r->aa_tolerance;
+	for(y = 0; y < p->height; y++)
+	{
+		for(x = 0; x < p->width; x++, a++)
+		{
+			n = (double)a->n;
+			if(a->n >= PROGRESS_MIN_SAMPLES)
+			{
+				if(r->aa_max_samples > 0 && a->n >= (unsigned int)r->aa_max_samples)
+					continue;
+				/* Squared standard error of the mean. */
+				var = (a->ssq - (double)a->ssum * a->ssum / n) / (n - 1.0);
+				if(var / n <= tol)
+					continue;
+			}
+			SamplePixelPoint(r, r->xstart + x, r->ystart + y, (int)a->n, rgb);
+			for(i = 0; i < 3; i++)
+				a->sum[i] += rgb[i];
+			s = 0.0f;
+			for(i = 0; i < 3; i++)
+				s += (rgb[i] > 0.0f) ? rgb[i] / (1.0f + rgb[i]) : 0.0f;
+			s /= 3.0f;
+			a->ssum += s;
+			a->ssq += s * s;
+			a->n++;
+			nsamples++;
+		}
+	}
+	p->passes++;
+	return nsamples;
+}
+
+
+/*
+ * Fill in "rgb", with "stride" bytes per line, and "hdr", if not NULL,
+ * with "hdr_stride" floats per line, with the mean colors so far.
+ */
+void Rend2D_GetProgressImage(const Rend2DProgress *p,
+	unsigned char *rgb, int stride, float *hdr, int hdr_stride)
+{
+	const Rend2DAccum *a = p->accum;
+	unsigned char *c;
+	float mean, *h;
+	int x, y, i;
+
+	for(y = 0; y < p->height; y++)
+	{
+		c = rgb + y * stride;
+		h = (hdr != NULL) ? hdr + y * hdr_stride : NULL;
+		for(x = 0; x < p->width; x++, a++)
+		{
+			for(i = 0; i < 3; i++)
+			{
+				mean = (a->n > 0) ? a->sum[i] / (float)a->n : 0.0f;
+				*c++ = FloatToByte(mean);
+				if(h != NULL)
+					*h++ = mean;
+			}
+		}
+	}
+}
+
+
+/*
+ * Save progress "p" to "filename", by way of a temporary file, so that
+ * an interrupted save leaves the last one whole.
+ * Returns non-zero on success.
+ */
+int Rend2D_SaveProgress(const Rend2DProgress *p, const char *filename)
+{
+	ProgressHeader h;
+	char tmpname[FILENAME_MAX];
+	size_t npixels;
+	FILE *fp;
+	int ok;
+
+	if(strlen(filename) + 5 > sizeof(tmpname))
+		return 0;
+	strcpy(tmpname, filename);
+	strcat(tmpname, ".tmp");
+	if((fp = fopen(tmpname, "wb")) == NULL)
+		return 0;
+	ProgressHeaderFrom(&h, p);
+	npixels = (size_t)p->width * p->height;
+	ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+		fwrite(p->accum, sizeof(Rend2DAccum), npixels, fp) == npixels;
+	if(fclose(fp) != 0)
+		ok = 0;
+	if(!ok)
+	{
+		remove(tmpname);
+		return 0;
+	}
+	/* Some systems won't rename over an existing file. */
+	if(rename(tmpname, filename) != 0)
+	{
+		remove(filename);
+		if(rename(tmpname, filename) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Load progress saved by Rend2D_SaveProgress() to "filename", to carry
+ * on with renderer setup "r".
+ * Returns NULL if there is no such file, or it was saved with a
+ * different setup.
+ */
+Rend2DProgress *Rend2D_LoadProgress(const Rend2D *r, const char *filename)
+{
+	Rend2DProgress *p;
+	ProgressHeader h, fh;
+	size_t npixels;
+	FILE *fp;
+
+	if((p = Rend2D_NewProgress(r)) == NULL)
+		return NULL;
+	if((fp = fopen(filename, "rb")) == NULL)
+	{
+		Rend2D_DeleteProgress(p);
+		return NULL;
+	}
+	npixels = (size_t)p->width * p->height;
+	ProgressHeaderFrom(&h, p);
+	if(fread(&fh, sizeof(fh), 1, fp) != 1 ||
+		fh.magic != h.magic || fh.version != h.version ||
+		fh.xres != h.xres || fh.yres != h.yres ||
+		fh.xstart != h.xstart || fh.ystart != h.ystart ||
+		fh.width != h.width || fh.height != h.height ||
+		fh.umin != h.umin || fh.umax != h.umax ||
+		fh.vmin != h.vmin || fh.vmax != h.vmax || fh.jitter != h.jitter ||
+		fread(p->accum, sizeof(Rend2DAccum), npixels, fp) != npixels)
+	{
+		fclose(fp);
+		Rend2D_DeleteProgress(p);
+		return NULL;
+	}
+	fclose(fp);
+	p->passes = fh.passes;
+	return p;
+}
+
+
+static void ProgressHeaderFrom(ProgressHeader *h, const Rend2DProgress *p)
+{
+	memset(h, 0, sizeof(ProgressHeader));
+	h->magic = PROGRESS_MAGIC;
+	h->version = PROGRESS_VERSION;
+	h->xres = p->rend.xres;
+	h->yres = p->rend.yres;
+	h->xstart = p->rend.xstart;
+	h->ystart = p->rend.ystart;
+	h->width = p->width;
+	h->height = p->height;
+	h->umin = p->rend.umin;
+	h->umax = p->rend.umax;
+	h->vmin = p->rend.vmin;
+	h->vmax = p->rend.vmax;
+	h->jitter = p->rend.jitter;
+	h->passes = p->passes;
+}
+
+
+/*************************************************************************
+*
+*  Frame cache.
+*
+*************************************************************************/
+
+Rend2DCache *Rend2D_NewCache(const Rend2D *r)
+{
+	Rend2DCache *c;
+
+	if((c = (Rend2DCache *)malloc(sizeof(Rend2DCache))) == NULL)
+		return NULL;
+	c->rend = *r;
+	c->rend.preview = 0;
+	c->xtiles = (r->xend - r->xstart + REND2D_CACHE_TILE - 1) / REND2D_CACHE_TILE;
+	c->ytiles = (r->yend - r->ystart + REND2D_CACHE_TILE - 1) / REND2D_CACHE_TILE;
+	c->rgb = (unsigned char *)calloc((size_t)r->xres * r->yres, 3);
+	c->contrib = (unsigned int *)calloc((size_t)c->xtiles * c->ytiles *
+		REND2D_CONTRIB_WORDS, sizeof(unsigned int));
+	c->rendered = 0;
+	if(c->rgb == NULL || c->contrib == NULL)
+	{
+		Rend2D_DeleteCache(c);
+		return NULL;
+	}
+	return c;
+}
+
+
+void Rend2D_DeleteCache(Rend2DCache *c)
+{
+	if(c != NULL)
+	{
+		free(c->rgb);
+		free(c->contrib);
+		free(c);
+	}
+}
+
+
+/*
+ * Render the tiles of cached frame "c" that "changed", a contributor
+ * filter, may have gone into, or all of them if "changed" is NULL or
+ * the frame hasn't been rendered yet. Without a contributor proc, a
+ * tile's filter is all ones, so that any change renders it again.
+ * Returns the number of tiles rendered, or -1 if out of memory.
+ */
+int Rend2D_RenderCache(Rend2DCache *c, const unsigned int *changed)
+{
+	const Rend2D *r = &c->rend;
+	Rend2DTileJob job;
+	Rend2DTileResult result;
+	unsigned int *bits;
+	int tx, ty, i, hit, ntiles = 0;
+
+	if(!c->rendered)
+		changed = NULL;
+	job.rend = r;
+	job.pass = 0;
+	job.top_edge = NULL;
+	job.left_edge = NULL;
+	job.rgb = c->rgb;
+	job.stride = r->xres * 3;
+	job.hdr = NULL;
+	job.hdr_stride = 0;
+	result.bottom_edge = NULL;
+	result.right_edge = NULL;
+	for(ty = 0; ty < c->ytiles; ty++)
+	{
+		for(tx = 0; tx < c->xtiles; tx++)
+		{
+			bits = c->contrib + (ty * c->xtiles + tx) * REND2D_CONTRIB_WORDS;
+			if(changed != NULL)
+			{
+				for(i = hit = 0; i < REND2D_CONTRIB_WORDS; i++)
+					hit |= (bits[i] & changed[i]) != 0;
+				if(!hit)
+					continue;
+			}
+
+			/*
+			 * Tiles don't share edges, so that each one's filter covers
+			 * every sample that went into it.
+			 */
+			job.x = r->xstart + tx * REND2D_CACHE_TILE;
+			job.y = r->ystart + ty * REND2D_CACHE_TILE;
+			job.width = r->xend - job.x;
+			if(job.width > REND2D_CACHE_TILE)
+				job.width = REND2D_CACHE_TILE;
+			job.height = r->yend - job.y;
+			if(job.height > REND2D_CACHE_TILE)
+				job.height = REND2D_CACHE_TILE;
+			if(r->get_contrib != NULL)
+				r->get_contrib(bits);
+			if(Rend2D_RenderTile(&job, &result) != REND2D_STATUS_FINISH)
+			{
+				memset(bits, 0xFF, sizeof(unsigned int) * REND2D_CONTRIB_WORDS);
+				return -1;
+			}
+			if(r->get_contrib != NULL)
+				r->get_contrib(bits);
+			else
+				memset(bits, 0xFF, sizeof(unsigned int) * REND2D_CONTRIB_WORDS);
+			ntiles++;
+		}
+	}
+	c->rendered = 1;
+	return ntiles;
+}
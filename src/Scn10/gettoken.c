@@ -104,6 +104,7 @@ static TOKEN tokens[] =
 	{ "rot_step", TK_ROT_STEP, 0 },
 	{ "rotate", TK_ROTATE, 0 },
 	{ "round", FN_ROUND, 0 },
+	{ "samples", TK_SAMPLES, 0 },
 	{ "scale", TK_SCALE, 0 },
 	{ "shader", TK_SHADER, 0 },
 	{ "sin", FN_SIN, 0 },
@@ -6,6 +6,9 @@
 *          light vexpr from, vexpr color;
 *          light vexpr from, vexpr color, fexpr falloff;
 *
+*  A jittered light takes "samples fexpr;" shadow samples across its
+*  jitter box at each point it lights.
+*
 *************************************************************************/
 
 #include "local.h"
@@ -42,6 +45,8 @@ static void ExecLightFlagStmt(Stmt *stmt);
 static void DeleteLightFlagStmt(Stmt *stmt);
 static void ExecLightJitterStmt(Stmt *stmt);
 static void DeleteLightJitterStmt(Stmt *stmt);
+static void ExecLightSamplesStmt(Stmt *stmt);
+static void DeleteLightSamplesStmt(Stmt *stmt);
 static void ExecLightAtStmt(Stmt *stmt);
 static void DeleteLightAtStmt(Stmt *stmt);
 static void ExecLightSpotStmt(Stmt *stmt);
@@ -86,6 +91,13 @@ StmtProcs light_jitter_stmt_procs =
 	DeleteLightJitterStmt
 };
 
+StmtProcs light_samples_stmt_procs =
+{
+	0,
+	ExecLightSamplesStmt,
+	DeleteLightSamplesStmt
+};
+
 StmtProcs light_at_stmt_procs =
 {
 	0,
@@ -248,6 +260,16 @@ int ParseLightDetails(Stmt **stmt)
 			}
 			break;
 
+		case TK_SAMPLES:
+			if((*stmt = NewStmt()) !=NULL)
+			{
+				(*stmt)->procs = &light_samples_stmt_procs;
+				if(((*stmt)->data = (void *)ExprParse()) != NULL)
+					if((token = GetToken()) != OP_SEMICOLON)
+						ErrUnknown(token, ";", "samples");
+			}
+			break;
+
 		case TK_AT:
 			if((*stmt = NewStmt()) !=NULL)
 			{
@@ -427,6 +449,20 @@ void DeleteLightJitterStmt(Stmt *stmt)
 }
 
 
+void ExecLightSamplesStmt(Stmt *stmt)
+{
+	assert(cur_light != NULL);
+	cur_light->samples = (int)ExprEvalDouble((Expr *)stmt->data);
+	if(cur_light->samples < 1)
+		cur_light->samples = 1;
+}
+
+void DeleteLightSamplesStmt(Stmt *stmt)
+{
+	ExprDelete((Expr *)stmt->data);
+}
+
+
 void ExecLightAtStmt(Stmt *stmt)
 {
 	assert(cur_light != NULL);
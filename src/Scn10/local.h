@@ -90,6 +90,7 @@ enum
 	TK_RETURN,
 	TK_ROT_STEP,
 	TK_ROTATE,
+	TK_SAMPLES,
 	TK_SCALE,
 	TK_SHADER,
 	TK_SIZE,
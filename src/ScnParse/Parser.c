@@ -210,6 +210,21 @@ static void Exec_Global_Settings(STATEMENT *stmt)
         RSD->use_fake_caustics = (int)par->V.x;
         break;
 
+      case TK_WAVEFRONT:
+         Eval_Params(par);
+        RSD->use_wavefront = (int)par->V.x;
+        break;
+
+      case TK_DEFERRED:
+         Eval_Params(par);
+        RSD->use_deferred = (int)par->V.x;
+        break;
+
+      case TK_LIGHT_SAMPLES:
+         Eval_Params(par);
+        RSD->light_samples = (int)par->V.x;
+        break;
+
       case TK_UP:
          Eval_Params(par);
         RSD->up_vector = par->V;
@@ -250,11 +265,14 @@ static STATEMENT *Parse_Global_Settings_Stmt(void)
         break;
 
       case TK_CAUSTICS:
+      case TK_DEFERRED:
       case TK_IOR:
+      case TK_LIGHT_SAMPLES:
       case TK_MAX_TRACE_DEPTH:
       case TK_MAX_TRACE_DIST:
       case TK_MIN_SHADOW_DIST:
       case TK_MIN_TRACE_DIST:
+      case TK_WAVEFRONT:
         s = New_Statement(token);
         s->params = Compile_Params("F");
         break;
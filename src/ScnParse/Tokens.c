@@ -75,6 +75,7 @@ static TOKEN tokens[] =
   { "cosh", FN_COSH, 0 },
   { "cylinder", TK_CYLINDER, TKFLAG_OBJECT },
   { "cylinder_map", FN_CYLINDER_MAP, 0 },
+  { "deferred", TK_DEFERRED, 0 },
   { "deg", FN_DEG, 0 },
   { "difference", TK_DIFFERENCE, TKFLAG_OBJECT },
   { "diffuse", TK_DIFFUSE, 0 },
@@ -112,6 +113,7 @@ static TOKEN tokens[] =
   { "ks", TK_SPECULAR, 0 },
   { "kt", TK_TRANSMISSION, 0 },
   { "light", TK_LIGHT, 0 },
+  { "light_samples", TK_LIGHT_SAMPLES, 0 },
   { "log", FN_LOG, 0 },
   { "log10", FN_LOG10, 0 },
   { "max_trace_depth", TK_MAX_TRACE_DEPTH, 0 },
@@ -180,6 +182,7 @@ static TOKEN tokens[] =
   { "vrand", FN_VRAND, 0 },
   { "vturb", FN_VTURB, 0 },
   { "vturb2", FN_VTURB2, 0 },
+  { "wavefront", TK_WAVEFRONT, 0 },
   { "while", TK_WHILE, TKFLAG_PROC },
   { "x", RT_x, TKFLAG_RTVAR },
   { "y", RT_y, TKFLAG_RTVAR },
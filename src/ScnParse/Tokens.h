@@ -74,6 +74,7 @@ typedef enum
   TK_COLORED_TRIANGLE,
   TK_CONE,
   TK_CYLINDER,
+  TK_DEFERRED,
   TK_DIFFERENCE,
   TK_DIFFUSE,
   TK_DIR,
@@ -96,6 +97,7 @@ typedef enum
   TK_INVERSE,
   TK_IOR,
   TK_LIGHT,
+  TK_LIGHT_SAMPLES,
   TK_MAX_TRACE_DEPTH,
   TK_MAX_TRACE_DIST,
   TK_MESH,
@@ -135,6 +137,7 @@ typedef enum
   TK_VECTOR,
   TK_VERTEX,
   TK_VIEWPORT,
+  TK_WAVEFRONT,
   TK_WHILE,
   /*
    * punctuator tokens
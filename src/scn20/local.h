@@ -370,11 +370,15 @@ extern TOKEN *g_cur_token;
 /*
  * noise.c
  */
+extern Vec3 Noise_Scale;
 extern void Noise_Initialize(long seed);
 extern double Noise3D(Vec3 *pt);
+extern double Noise3DGrad(Vec3 *pt, Vec3 *grad);
 extern void VNoise3D(Vec3 *pt, Vec3 *noise_vec);
 extern double Turb3D(Vec3 *pt, int octaves,
 	double freq_factor, double amp_factor);
+extern double Turb3DGrad(Vec3 *pt, int octaves,
+	double freq_factor, double amp_factor, Vec3 *grad);
 extern void VTurb3D(Vec3 *pt, int octaves, double freq_factor,
 	double amp_factor, Vec3 *turb_vec);
 extern void Wrinkles3D(Vec3 *N, Vec3 *P, int oct);
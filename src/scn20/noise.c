@@ -122,6 +122,70 @@ double Noise3D(Vec3 *pt)
 	return noise;
 }
 
+/*************************************************************************
+ *
+ *  NoiseWeight() - The spline-like lattice interpolation weight used by
+ *  Noise3D() for fractional offset "f", and its derivative in "dw".
+ *
+ ************************************************************************/
+static double NoiseWeight(double f, double *dw)
+{
+	if(f > 0.5)
+	{
+		*dw = 4.0 * (1.0 - f);
+		f = 1.0 - f;
+		f = 2.0 * f * f;
+		return 1.0 - f;
+	}
+	*dw = 4.0 * f;
+	return 2.0 * f * f;
+}
+
+/*************************************************************************
+ *
+ *  Noise3DGrad() - Same as Noise3D() but also returns the gradient of
+ *  the noise value at "pt" in "grad".
+ *
+ ************************************************************************/
+double Noise3DGrad(Vec3 *pt, Vec3 *grad)
+{
+	unsigned short n[8]; /* Noise values for eight corners of noise cube. */
+	int cx, cy, cz;      /* Integral corner of cube containing point. */
+	double noise, nv;    /* Final noise value and corner noise value. */
+	double wx, wy, wz;   /* Interpolation amounts for each axis. */
+	double dwx, dwy, dwz;	/* Derivatives of the above. */
+	double ax, ay, az;
+	int i;
+
+	for(i = 0; i < 8; i++)
+	{
+		cx = (int)((i & 1) ? ceil(pt->x) : floor(pt->x));
+		cy = (int)((i & 2) ? ceil(pt->y) : floor(pt->y));
+		cz = (int)((i & 4) ? ceil(pt->z) : floor(pt->z));
+		n[i] = Noise_Table[Hash3D(cx, cy, cz)];
+	}
+
+	wx = NoiseWeight(pt->x - floor(pt->x), &dwx);
+	wy = NoiseWeight(pt->y - floor(pt->y), &dwy);
+	wz = NoiseWeight(pt->z - floor(pt->z), &dwz);
+
+	noise = 0;
+	V3Zero(grad);
+	for(i = 0; i < 8; i++)
+	{
+		nv = ((double)n[i] / RAND_LOOKUP_MAX) * 2.0 - 1.0;
+		ax = (i & 1) ? wx : 1.0 - wx;
+		ay = (i & 2) ? wy : 1.0 - wy;
+		az = (i & 4) ? wz : 1.0 - wz;
+		noise += nv * ax * ay * az;
+		grad->x += nv * ((i & 1) ? dwx : -dwx) * ay * az;
+		grad->y += nv * ax * ((i & 2) ? dwy : -dwy) * az;
+		grad->z += nv * ax * ay * ((i & 4) ? dwz : -dwz);
+	}
+
+	return noise;
+}
+
 /*************************************************************************
  *
  *  VNoise3D() - Generate a smooth vector noise value in the range of
@@ -177,6 +241,39 @@ double Turb3D(Vec3 *pt, int octaves, double freq_factor,
 	return total_noise / total_amp_scale;
 }
 
+/*************************************************************************
+ *
+ *  Turb3DGrad() - Same as Turb3D() but also returns the gradient of
+ *  the turbulence value at "pt" in "grad".
+ *
+ ************************************************************************/
+double Turb3DGrad(Vec3 *pt, int octaves, double freq_factor,
+	double amp_factor, Vec3 *grad)
+{
+	int i;
+	double total_noise, freq_scale, amp_scale, total_amp_scale;
+	Vec3 p, g;
+
+	total_noise = Noise3DGrad(pt, grad);
+	total_amp_scale = 1.0;
+	freq_scale = freq_factor;
+	amp_scale = amp_factor;
+	for(i = 1; i < octaves; i++)
+	{
+		V3ScalMul(&p, pt, freq_scale);
+		total_noise += Noise3DGrad(&p, &g) * amp_scale;
+		grad->x += g.x * freq_scale * amp_scale;
+		grad->y += g.y * freq_scale * amp_scale;
+		grad->z += g.z * freq_scale * amp_scale;
+		total_amp_scale += fabs(amp_scale);
+		freq_scale *= freq_factor;
+		amp_scale *= amp_factor;
+	}
+
+	V3ScalDiv(grad, grad, total_amp_scale);
+	return total_noise / total_amp_scale;
+}
+
 /*************************************************************************
  *
  *  VTurb3D() - Generate a summation of recursively sub-divided noise values
@@ -21,6 +21,7 @@ typedef struct tVMStmtBlob
 {
 	VMStmtObj	vmstmtobj;
 	VMExpr		*expr_threshold;
+	VMLValue	*lv_sturm;
 } VMStmtBlob;
 
 
@@ -65,6 +66,13 @@ VMStmt * parse_vm_blob(void)
 	if (newstmt == NULL)
 		return NULL;
 
+	// Setting 'sturm' in the block selects the Sturm sequence root solver.
+	//
+	newstmt->lv_sturm = vm_new_lvalue(TK_FLOAT);
+	if (newstmt->lv_sturm != NULL)
+		pcontext_addsymbol("sturm", DECL_FLOAT, 0,
+			(void *) vm_copy_lvalue(newstmt->lv_sturm));
+
 	// Parse the blob's parameters and body.
 	// The threshold parameter must be supplied.
 	//
@@ -120,11 +128,16 @@ void vm_blob(VMStmt *curstmt)
 	}
 
 	vmstack_setcurobj(newobj);
+	if (stmtobj->lv_sturm != NULL)
+		stmtobj->lv_sturm->v.x = 0.0;
 
 	// Run the statements in the object's block.
 	//
 	vm_execute_object_block((VMStmtObj *) stmtobj);
 
+	if (stmtobj->lv_sturm != NULL && stmtobj->lv_sturm->v.x != 0.0)
+		newobj->data.blob->solver = SOLVER_STURM;
+
 	// Post process the object.
 	//
 	success = Ray_BlobFinish(newobj);
@@ -144,6 +157,11 @@ void vm_blob_cleanup(VMStmt *curstmt)
 	delete_exprtree(stmtobj->expr_threshold);
 	stmtobj->expr_threshold = NULL;
 
+	// Free the parameter l-values.
+	//
+	vm_delete_lvalue(stmtobj->lv_sturm);
+	stmtobj->lv_sturm = NULL;
+
 	// Cleanup the base object statement.
 	//
 	vm_object_cleanup(curstmt);
@@ -692,3 +692,669 @@ void vmeval_wrinkle(VMExpr *expr)
 	Wrinkles3D(&expr->v, &expr->l->v, (int)expr->r->v.x);
 }
 
+
+/*************************************************************************
+*
+*  Forward-mode differentiation of expression trees.
+*
+*  vm_evalgrad() evaluates an expression and its gradient with respect
+*  to the object point O (x, y, z) in one pass using dual numbers.
+*  Each node's "dfn" is the dual-number counterpart of its "fn" and is
+*  resolved once by vm_prepare_evalgrad(). Nodes that are piecewise
+*  constant (floor, comparisons, etc.) evaluate normally with a zero
+*  gradient.
+*
+*************************************************************************/
+
+/* Max # of variables that may be assigned within a differentiated expr. */
+#define MAX_DUAL_ASSIGN		16
+
+/* Gradients of variables assigned during the current vm_evalgrad(). */
+static struct
+{
+	VMLValue *lv;
+	VMDual d;
+} dual_assign[MAX_DUAL_ASSIGN];
+static int num_dual_assign;
+
+static void dual_zero_grad(VMDual *d)
+{
+	V3Zero(&d->dx);
+	V3Zero(&d->dy);
+	V3Zero(&d->dz);
+}
+
+/* Promote a scalar dual to a vector with the same value in x, y and z. */
+static void dual_splat(VMDual *d)
+{
+	d->v.y = d->v.z = d->v.x;
+	d->dy = d->dz = d->dx;
+}
+
+/* Dual-number version of vm_evaldouble(). */
+static double dual_evaldouble(VMExpr *expr, Vec3 *grad)
+{
+	VMDual d;
+	double mag;
+
+	expr->dfn(expr, &d);
+	if(! expr->isvec)
+	{
+		V3Copy(grad, &d.dx);
+		return d.v.x;
+	}
+	mag = V3Mag(&d.v);
+	if(mag > EPSILON)
+	{
+		grad->x = (d.v.x * d.dx.x + d.v.y * d.dy.x + d.v.z * d.dz.x) / mag;
+		grad->y = (d.v.x * d.dx.y + d.v.y * d.dy.y + d.v.z * d.dz.y) / mag;
+		grad->z = (d.v.x * d.dx.z + d.v.y * d.dy.z + d.v.z * d.dz.z) / mag;
+	}
+	else
+		V3Zero(grad);
+	return mag;
+}
+
+/* Dual-number version of a vector argument, as used by noise(), etc. */
+static void dual_evalvector(VMExpr *expr, VMDual *d)
+{
+	expr->dfn(expr, d);
+	if(! expr->isvec)
+		dual_splat(d);
+}
+
+static void vmdual_step(VMExpr *expr, VMDual *d)
+{
+	expr->fn(expr);
+	V3Copy(&d->v, &expr->v);
+	dual_zero_grad(d);
+}
+
+static void vmdual_rtfloat(VMExpr *expr, VMDual *d)
+{
+	d->v.x = *(double *)expr->data;
+	dual_zero_grad(d);
+	if(expr->data == &rt_O.x)
+		d->dx.x = 1.0;
+	else if(expr->data == &rt_O.y)
+		d->dx.y = 1.0;
+	else if(expr->data == &rt_O.z)
+		d->dx.z = 1.0;
+}
+
+static void vmdual_rtvec(VMExpr *expr, VMDual *d)
+{
+	V3Copy(&d->v, (Vec3 *)expr->data);
+	dual_zero_grad(d);
+	if(expr->data == &rt_O)
+	{
+		d->dx.x = 1.0;
+		d->dy.y = 1.0;
+		d->dz.z = 1.0;
+	}
+}
+
+static void vmdual_lvalue(VMExpr *expr, VMDual *d)
+{
+	int i;
+
+	for(i = 0; i < num_dual_assign; i++)
+	{
+		if(dual_assign[i].lv == (VMLValue *)expr->data)
+		{
+			*d = dual_assign[i].d;
+			return;
+		}
+	}
+	vmdual_step(expr, d);
+}
+
+static void vmdual_assign(VMExpr *expr, VMDual *d)
+{
+	VMLValue *lv = (VMLValue *)expr->l->data;
+	int i;
+
+	expr->r->dfn(expr->r, d);
+	if((! expr->r->isvec) && expr->l->isvec)
+		dual_splat(d);
+	V3Copy(&lv->v, &d->v);
+	expr->isvec = expr->l->isvec;
+
+	for(i = 0; i < num_dual_assign; i++)
+		if(dual_assign[i].lv == lv)
+			break;
+	assert(i < MAX_DUAL_ASSIGN);
+	if(i == num_dual_assign)
+		num_dual_assign++;
+	dual_assign[i].lv = lv;
+	dual_assign[i].d = *d;
+}
+
+static void vmdual_comma(VMExpr *expr, VMDual *d)
+{
+	expr->l->dfn(expr->l, d);
+	expr->r->dfn(expr->r, d);
+	expr->isvec = expr->r->isvec;
+}
+
+static void vmdual_vector(VMExpr *expr, VMDual *d)
+{
+	VMDual c;
+
+	expr->r->r->dfn(expr->r->r, &c);
+	d->v.x = c.v.x;
+	d->dx = c.dx;
+	expr->r->l->dfn(expr->r->l, &c);
+	d->v.y = c.v.x;
+	d->dy = c.dx;
+	expr->l->dfn(expr->l, &c);
+	d->v.z = c.v.x;
+	d->dz = c.dx;
+}
+
+static void vmdual_dot_x(VMExpr *expr, VMDual *d)
+{
+	expr->l->dfn(expr->l, d);
+}
+
+static void vmdual_dot_y(VMExpr *expr, VMDual *d)
+{
+	expr->l->dfn(expr->l, d);
+	d->v.x = d->v.y;
+	d->dx = d->dy;
+}
+
+static void vmdual_dot_z(VMExpr *expr, VMDual *d)
+{
+	expr->l->dfn(expr->l, d);
+	d->v.x = d->v.z;
+	d->dx = d->dz;
+}
+
+static void vmdual_uminus(VMExpr *expr, VMDual *d)
+{
+	expr->r->dfn(expr->r, d);
+	expr->isvec = expr->r->isvec;
+	d->v.x = -d->v.x;
+	V3ScalMul(&d->dx, &d->dx, -1.0);
+	if(expr->isvec)
+	{
+		d->v.y = -d->v.y;
+		d->v.z = -d->v.z;
+		V3ScalMul(&d->dy, &d->dy, -1.0);
+		V3ScalMul(&d->dz, &d->dz, -1.0);
+	}
+}
+
+/*
+ * Applies a component-wise binary operator with the same scalar/vector
+ * promotion rules as vmeval_plus() and friends.
+ */
+typedef void (*DualOp)(double a, Vec3 *da, double b, Vec3 *db,
+	double *c, Vec3 *dc);
+
+static void dual_binary(VMExpr *expr, VMDual *d, DualOp op)
+{
+	VMExpr *l = expr->l, *r = expr->r;
+	VMDual a, b;
+
+	l->dfn(l, &a);
+	r->dfn(r, &b);
+	expr->isvec = (l->isvec || r->isvec) ? 1 : 0;
+	if(expr->isvec)
+	{
+		if(! l->isvec)
+			dual_splat(&a);
+		if(! r->isvec)
+			dual_splat(&b);
+		op(a.v.y, &a.dy, b.v.y, &b.dy, &d->v.y, &d->dy);
+		op(a.v.z, &a.dz, b.v.z, &b.dz, &d->v.z, &d->dz);
+	}
+	op(a.v.x, &a.dx, b.v.x, &b.dx, &d->v.x, &d->dx);
+}
+
+static void dual_add(double a, Vec3 *da, double b, Vec3 *db,
+	double *c, Vec3 *dc)
+{
+	*c = a + b;
+	V3Add(dc, da, db);
+}
+
+static void dual_sub(double a, Vec3 *da, double b, Vec3 *db,
+	double *c, Vec3 *dc)
+{
+	*c = a - b;
+	V3Sub(dc, da, db);
+}
+
+static void dual_mul(double a, Vec3 *da, double b, Vec3 *db,
+	double *c, Vec3 *dc)
+{
+	*c = a * b;
+	V3Combine(dc, da, b, db, a);
+}
+
+static void dual_div(double a, Vec3 *da, double b, Vec3 *db,
+	double *c, Vec3 *dc)
+{
+	*c = a / b;
+	V3Combine(dc, da, 1.0 / b, db, -a / (b * b));
+}
+
+static void vmdual_plus(VMExpr *expr, VMDual *d)
+{
+	dual_binary(expr, d, dual_add);
+}
+
+static void vmdual_minus(VMExpr *expr, VMDual *d)
+{
+	dual_binary(expr, d, dual_sub);
+}
+
+static void vmdual_multiply(VMExpr *expr, VMDual *d)
+{
+	dual_binary(expr, d, dual_mul);
+}
+
+static void vmdual_divide(VMExpr *expr, VMDual *d)
+{
+	dual_binary(expr, d, dual_div);
+}
+
+static void vmdual_ternary(VMExpr *expr, VMDual *d)
+{
+	VMExpr *e;
+	e = (vm_evaldouble(expr->l)) ? expr->r->l : expr->r->r;
+	e->dfn(e, d);
+	expr->isvec = e->isvec;
+}
+
+static void vmdual_pow(VMExpr *expr, VMDual *d)
+{
+	Vec3 da, db;
+	double a, b;
+
+	a = dual_evaldouble(expr->l, &da);
+	b = dual_evaldouble(expr->r, &db);
+	d->v.x = pow(a, b);
+	/* d(a^b) = b*a^(b-1)*da + ln(a)*a^b*db */
+	V3ScalMul(&d->dx, &da, (a != 0.0) ? b * d->v.x / a : ((b == 1.0) ? 1.0 : 0.0));
+	if((a > 0.0) && ! V3IsZero(&db))
+	{
+		d->dx.x += log(a) * d->v.x * db.x;
+		d->dx.y += log(a) * d->v.x * db.y;
+		d->dx.z += log(a) * d->v.x * db.z;
+	}
+}
+
+static void vmdual_abs(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = fabs(a);
+	if(a < 0.0)
+		V3ScalMul(&d->dx, &d->dx, -1.0);
+}
+
+static void vmdual_acos(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = acos(a);
+	V3ScalMul(&d->dx, &d->dx, -1.0 / sqrt(1.0 - a * a));
+}
+
+static void vmdual_asin(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = asin(a);
+	V3ScalMul(&d->dx, &d->dx, 1.0 / sqrt(1.0 - a * a));
+}
+
+static void vmdual_atan(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = atan(a);
+	V3ScalMul(&d->dx, &d->dx, 1.0 / (1.0 + a * a));
+}
+
+static void vmdual_atan2(VMExpr *expr, VMDual *d)
+{
+	Vec3 dy, dx;
+	double y, x, r2;
+
+	y = dual_evaldouble(expr->l, &dy);
+	x = dual_evaldouble(expr->r, &dx);
+	d->v.x = atan2(y, x);
+	r2 = x * x + y * y;
+	if(r2 > 0.0)
+		V3Combine(&d->dx, &dy, x / r2, &dx, -y / r2);
+	else
+		V3Zero(&d->dx);
+}
+
+static void vmdual_clamp(VMExpr *expr, VMDual *d)
+{
+	VMDual lo, hi;
+
+	expr->l->l->dfn(expr->l->l, d);
+	expr->l->r->dfn(expr->l->r, &lo);
+	expr->r->dfn(expr->r, &hi);
+	if(d->v.x < lo.v.x)
+		*d = lo;
+	else if(d->v.x > hi.v.x)
+		*d = hi;
+}
+
+static void vmdual_cos(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = cos(a);
+	V3ScalMul(&d->dx, &d->dx, -sin(a));
+}
+
+static void vmdual_cosh(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = cosh(a);
+	V3ScalMul(&d->dx, &d->dx, sinh(a));
+}
+
+static void vmdual_exp(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = exp(a);
+	V3ScalMul(&d->dx, &d->dx, d->v.x);
+}
+
+static void vmdual_lerp(VMExpr *expr, VMDual *d)
+{
+	VMDual lo, hi;
+	double a;
+
+	expr->l->l->dfn(expr->l->l, d);
+	expr->l->r->dfn(expr->l->r, &lo);
+	expr->r->dfn(expr->r, &hi);
+	a = d->v.x;
+	d->v.x = LERP(a, lo.v.x, hi.v.x);
+	/* d(lo + a*(hi-lo)) = dlo + da*(hi-lo) + a*(dhi-dlo) */
+	d->dx.x = lo.dx.x + d->dx.x * (hi.v.x - lo.v.x) + a * (hi.dx.x - lo.dx.x);
+	d->dx.y = lo.dx.y + d->dx.y * (hi.v.x - lo.v.x) + a * (hi.dx.y - lo.dx.y);
+	d->dx.z = lo.dx.z + d->dx.z * (hi.v.x - lo.v.x) + a * (hi.dx.z - lo.dx.z);
+}
+
+static void vmdual_log(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = log(a);
+	V3ScalDiv(&d->dx, &d->dx, a);
+}
+
+static void vmdual_log10(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = log10(a);
+	V3ScalDiv(&d->dx, &d->dx, a * log(10.0));
+}
+
+/* Chain rule for a scalar function of a vector point: dn = J^T * grad. */
+static void dual_chain_point(VMDual *p, Vec3 *grad, Vec3 *dn)
+{
+	dn->x = grad->x * p->dx.x + grad->y * p->dy.x + grad->z * p->dz.x;
+	dn->y = grad->x * p->dx.y + grad->y * p->dy.y + grad->z * p->dz.y;
+	dn->z = grad->x * p->dx.z + grad->y * p->dy.z + grad->z * p->dz.z;
+}
+
+static void vmdual_noise(VMExpr *expr, VMDual *d)
+{
+	VMDual p;
+	Vec3 grad;
+
+	dual_evalvector(expr->l, &p);
+	d->v.x = Noise3DGrad(&p.v, &grad);
+	dual_chain_point(&p, &grad, &d->dx);
+}
+
+static void vmdual_sin(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = sin(a);
+	V3ScalMul(&d->dx, &d->dx, cos(a));
+}
+
+static void vmdual_sinh(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = sinh(a);
+	V3ScalMul(&d->dx, &d->dx, cosh(a));
+}
+
+static void vmdual_sqrt(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = sqrt(a);
+	if(d->v.x > 0.0)
+		V3ScalDiv(&d->dx, &d->dx, 2.0 * d->v.x);
+	else
+		V3Zero(&d->dx);
+}
+
+static void vmdual_tan(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = tan(a);
+	V3ScalMul(&d->dx, &d->dx, 1.0 + d->v.x * d->v.x);
+}
+
+static void vmdual_tanh(VMExpr *expr, VMDual *d)
+{
+	double a = dual_evaldouble(expr->l, &d->dx);
+	d->v.x = tanh(a);
+	V3ScalMul(&d->dx, &d->dx, 1.0 - d->v.x * d->v.x);
+}
+
+static void vmdual_turb(VMExpr *expr, VMDual *d)
+{
+	VMDual p;
+	Vec3 grad;
+
+	dual_evalvector(expr->l, &p);
+	expr->r->fn(expr->r);
+	d->v.x = Turb3DGrad(&p.v, (int)expr->r->v.x, 2.0, 0.5, &grad);
+	dual_chain_point(&p, &grad, &d->dx);
+}
+
+/* Octave, frequency and amplitude arguments are treated as constants. */
+static void vmdual_turb2(VMExpr *expr, VMDual *d)
+{
+	VMDual p;
+	Vec3 grad;
+
+	dual_evalvector(expr->l->l->l, &p);
+	expr->l->l->r->fn(expr->l->l->r);
+	expr->l->r->fn(expr->l->r);
+	expr->r->fn(expr->r);
+	d->v.x = Turb3DGrad(&p.v, (int)expr->l->l->r->v.x,
+		expr->l->r->v.x, expr->r->v.x, &grad);
+	dual_chain_point(&p, &grad, &d->dx);
+}
+
+static void vmdual_vcross(VMExpr *expr, VMDual *d)
+{
+	VMDual a, b;
+
+	expr->l->dfn(expr->l, &a);
+	expr->r->dfn(expr->r, &b);
+	V3Cross(&d->v, &a.v, &b.v);
+	/* d(a x b) = da x b + a x db, per component. */
+	V3Combine(&d->dx, &a.dy, b.v.z, &b.dz, a.v.y);
+	V3Combine(&d->dx, &d->dx, 1.0, &a.dz, -b.v.y);
+	V3Combine(&d->dx, &d->dx, 1.0, &b.dy, -a.v.z);
+	V3Combine(&d->dy, &a.dz, b.v.x, &b.dx, a.v.z);
+	V3Combine(&d->dy, &d->dy, 1.0, &a.dx, -b.v.z);
+	V3Combine(&d->dy, &d->dy, 1.0, &b.dz, -a.v.x);
+	V3Combine(&d->dz, &a.dx, b.v.y, &b.dy, a.v.x);
+	V3Combine(&d->dz, &d->dz, 1.0, &a.dy, -b.v.x);
+	V3Combine(&d->dz, &d->dz, 1.0, &b.dx, -a.v.y);
+}
+
+static void vmdual_vdot(VMExpr *expr, VMDual *d)
+{
+	VMDual a, b;
+
+	expr->l->dfn(expr->l, &a);
+	expr->r->dfn(expr->r, &b);
+	d->v.x = V3Dot(&a.v, &b.v);
+	V3Combine(&d->dx, &a.dx, b.v.x, &b.dx, a.v.x);
+	V3Combine(&d->dx, &d->dx, 1.0, &a.dy, b.v.y);
+	V3Combine(&d->dx, &d->dx, 1.0, &b.dy, a.v.y);
+	V3Combine(&d->dx, &d->dx, 1.0, &a.dz, b.v.z);
+	V3Combine(&d->dx, &d->dx, 1.0, &b.dz, a.v.z);
+}
+
+static void vmdual_vmag(VMExpr *expr, VMDual *d)
+{
+	VMDual a;
+	double mag;
+
+	expr->l->dfn(expr->l, &a);
+	d->v.x = mag = V3Mag(&a.v);
+	if(mag > 0.0)
+	{
+		V3Combine(&d->dx, &a.dx, a.v.x / mag, &a.dy, a.v.y / mag);
+		V3Combine(&d->dx, &d->dx, 1.0, &a.dz, a.v.z / mag);
+	}
+	else
+		V3Zero(&d->dx);
+}
+
+static void vmdual_vnoise(VMExpr *expr, VMDual *d)
+{
+	VMDual p;
+	Vec3 q, grad;
+
+	dual_evalvector(expr->l, &p);
+	V3Set(&q, p.v.x + Noise_Scale.x, p.v.y + Noise_Scale.y, p.v.z + Noise_Scale.z);
+	d->v.x = Noise3DGrad(&q, &grad);
+	dual_chain_point(&p, &grad, &d->dx);
+	V3Set(&q, p.v.x + Noise_Scale.z, p.v.y + Noise_Scale.x, p.v.z + Noise_Scale.y);
+	d->v.y = Noise3DGrad(&q, &grad);
+	dual_chain_point(&p, &grad, &d->dy);
+	V3Set(&q, p.v.x + Noise_Scale.y, p.v.y + Noise_Scale.z, p.v.z + Noise_Scale.x);
+	d->v.z = Noise3DGrad(&q, &grad);
+	dual_chain_point(&p, &grad, &d->dz);
+}
+
+/*
+ * Maps the evaluation function of each differentiable node type to its
+ * dual-number version.
+ */
+static const struct
+{
+	void (*fn)(VMExpr *expr);
+	void (*dfn)(VMExpr *expr, VMDual *d);
+} dual_fns[] =
+{
+	{ vmeval_const, vmdual_step },
+	{ vmeval_rtfloat, vmdual_rtfloat },
+	{ vmeval_rtvec, vmdual_rtvec },
+	{ vmeval_lvalue, vmdual_lvalue },
+	{ vmeval_assign, vmdual_assign },
+	{ vmeval_comma, vmdual_comma },
+	{ vmeval_vector, vmdual_vector },
+	{ vmeval_dot_x, vmdual_dot_x },
+	{ vmeval_dot_y, vmdual_dot_y },
+	{ vmeval_dot_z, vmdual_dot_z },
+	{ vmeval_uminus, vmdual_uminus },
+	{ vmeval_bitand, vmdual_step },
+	{ vmeval_bitor, vmdual_step },
+	{ vmeval_mod, vmdual_step },
+	{ vmeval_logicnot, vmdual_step },
+	{ vmeval_logicand, vmdual_step },
+	{ vmeval_logicor, vmdual_step },
+	{ vmeval_lessthan, vmdual_step },
+	{ vmeval_greaterthan, vmdual_step },
+	{ vmeval_lessequal, vmdual_step },
+	{ vmeval_greatequal, vmdual_step },
+	{ vmeval_isequal, vmdual_step },
+	{ vmeval_isnotequal, vmdual_step },
+	{ vmeval_plus, vmdual_plus },
+	{ vmeval_minus, vmdual_minus },
+	{ vmeval_multiply, vmdual_multiply },
+	{ vmeval_divide, vmdual_divide },
+	{ vmeval_ternary, vmdual_ternary },
+	{ vmeval_pow, vmdual_pow },
+	{ vmeval_abs, vmdual_abs },
+	{ vmeval_acos, vmdual_acos },
+	{ vmeval_asin, vmdual_asin },
+	{ vmeval_atan, vmdual_atan },
+	{ vmeval_atan2, vmdual_atan2 },
+	{ vmeval_ceil, vmdual_step },
+	{ vmeval_checker, vmdual_step },
+	{ vmeval_clamp, vmdual_clamp },
+	{ vmeval_cos, vmdual_cos },
+	{ vmeval_cosh, vmdual_cosh },
+	{ vmeval_exp, vmdual_exp },
+	{ vmeval_floor, vmdual_step },
+	{ vmeval_frand, vmdual_step },
+	{ vmeval_hexagon, vmdual_step },
+	{ vmeval_int, vmdual_step },
+	{ vmeval_irand, vmdual_step },
+	{ vmeval_lerp, vmdual_lerp },
+	{ vmeval_log, vmdual_log },
+	{ vmeval_log10, vmdual_log10 },
+	{ vmeval_noise, vmdual_noise },
+	{ vmeval_round, vmdual_step },
+	{ vmeval_sin, vmdual_sin },
+	{ vmeval_sinh, vmdual_sinh },
+	{ vmeval_sqrt, vmdual_sqrt },
+	{ vmeval_tan, vmdual_tan },
+	{ vmeval_tanh, vmdual_tanh },
+	{ vmeval_turb, vmdual_turb },
+	{ vmeval_turb2, vmdual_turb2 },
+	{ vmeval_vcross, vmdual_vcross },
+	{ vmeval_vdot, vmdual_vdot },
+	{ vmeval_vmag, vmdual_vmag },
+	{ vmeval_vnoise, vmdual_vnoise },
+	{ NULL, NULL }
+};
+
+static int prepare_dual(VMExpr *expr, int *nassign)
+{
+	int i;
+
+	if(expr == NULL)
+		return 1;
+	for(i = 0; dual_fns[i].fn != NULL; i++)
+		if(dual_fns[i].fn == expr->fn)
+			break;
+	if((expr->dfn = dual_fns[i].dfn) == NULL)
+		return 0;
+	if((expr->fn == vmeval_assign) && (++*nassign > MAX_DUAL_ASSIGN))
+		return 0;
+	return prepare_dual(expr->l, nassign) && prepare_dual(expr->r, nassign);
+}
+
+/*************************************************************************
+*
+*  vm_prepare_evalgrad - Sets up an expression tree for vm_evalgrad().
+*    Returns 1 if every node in the tree can be differentiated, 0 if
+*    not, in which case vm_evalgrad() must not be used on it.
+*
+*************************************************************************/
+int vm_prepare_evalgrad(VMExpr *expr)
+{
+	int nassign = 0;
+	return (expr != NULL) && prepare_dual(expr, &nassign);
+}
+
+/*************************************************************************
+*
+*  vm_evalgrad - Same as vm_evaldouble() but also returns the gradient
+*    of the result with respect to the object point, rt_O, in "grad".
+*
+*************************************************************************/
+double vm_evalgrad(VMExpr *expr, Vec3 *grad)
+{
+	assert(expr->dfn != NULL);
+	num_dual_assign = 0;
+	return dual_evaldouble(expr, grad);
+}
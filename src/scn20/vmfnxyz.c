@@ -24,6 +24,7 @@ typedef struct tVMStmtFnxyz
 	VMExpr		*expr_bmin;
 	VMExpr		*expr_bmax;
 	VMExpr		*expr_steps;
+	VMExpr		*expr_slope;
 } VMStmtFnxyz;
 
 
@@ -53,7 +54,7 @@ static VMStmtMethods s_fnxyz_stmt_methods =
 VMStmt * parse_vm_fnxyz(void)
 {
 	VMStmtFnxyz *	newstmt;
-	ParamList		params[5];
+	ParamList		params[6];
 	int				nparams, i;
 	char			name[] = "fn_xyz";
 
@@ -72,8 +73,11 @@ VMStmt * parse_vm_fnxyz(void)
 	// The function, low bound and high bound must be given.
 	// The fourth parameter, a vector specifying the x, y, and z steps
 	// is optional. This defaults to <32, 32, 32>.
+	// The fifth parameter, also optional, is the steepest slope (gradient
+	// magnitude) fn reaches inside the bounds. When given, an occupancy
+	// grid is built to skip the space the surface can't reach.
 	//
-	nparams = parse_paramlist("EEEOEOB", name, params);
+	nparams = parse_paramlist("EEEOEOEOB", name, params);
 
 	// Evaluate the parameters.
 	//
@@ -90,6 +94,8 @@ VMStmt * parse_vm_fnxyz(void)
 					newstmt->expr_bmax = params[i].data.expr;
 				else if (newstmt->expr_steps == NULL) // The steps parameter.
 					newstmt->expr_steps = params[i].data.expr;
+				else if (newstmt->expr_slope == NULL) // The max slope parameter.
+					newstmt->expr_slope = params[i].data.expr;
 				break;
 			case PARAM_BLOCK:
 				newstmt->vmstmtobj.block = params[i].data.block;
@@ -112,6 +118,7 @@ void vm_fnxyz(VMStmt *curstmt)
 	VMStmtFnxyz *	stmtobj = (VMStmtFnxyz *) curstmt;
 	Vec3			bmin, bmax, steps;
 	int				success = 0;
+	double			max_slope = 0.0;
 	Object *		newobj;
 	
 	vm_begin_object((VMStmtObj *) curstmt);
@@ -127,10 +134,13 @@ void vm_fnxyz(VMStmt *curstmt)
 		vm_evalvector(stmtobj->expr_bmax, &bmax);
 	if (stmtobj->expr_steps != NULL)
 		vm_evalvector(stmtobj->expr_steps, &steps);
+	if (stmtobj->expr_slope != NULL)
+		max_slope = vm_evaldouble(stmtobj->expr_slope);
 
 	// Create this object and store it in the VM stack.
 	//
-	newobj = Ray_MakeFnxyz(stmtobj->expr_fn, &bmin, &bmax, &steps);
+	newobj = Ray_MakeFnxyz(stmtobj->expr_fn, &bmin, &bmax, &steps,
+		max_slope);
 	if (newobj != NULL)
 	{
 		// The renderer now has the fn(x, y, z) expr, set the stmt's ptr to
@@ -171,6 +181,8 @@ void vm_fnxyz_cleanup(VMStmt *curstmt)
 	stmtobj->expr_bmax = NULL;
 	delete_exprtree(stmtobj->expr_steps);
 	stmtobj->expr_steps = NULL;
+	delete_exprtree(stmtobj->expr_slope);
+	stmtobj->expr_slope = NULL;
 
 	// Cleanup the base object statement.
 	//
@@ -811,6 +811,7 @@ typedef struct tVMStmtTorus
 	VMLValue	*lv_center;
 	VMLValue	*lv_rmajor;
 	VMLValue	*lv_rminor;
+	VMLValue	*lv_sturm;
 } VMStmtTorus;
 
 
@@ -857,6 +858,7 @@ VMStmt * parse_vm_torus(void)
 
 	// Add 'center', 'rmajor and 'rminor' to the local namespace.
 	// These will be bound at runtime to the actual fields in the object.
+	// Setting 'sturm' selects the Sturm sequence root solver.
 	//
 	newstmt->lv_center = vm_new_lvalue(TK_VECTOR);
 	if (newstmt->lv_center != NULL)
@@ -870,6 +872,10 @@ VMStmt * parse_vm_torus(void)
 	if (newstmt->lv_rminor != NULL)
 		pcontext_addsymbol("rminor", DECL_FLOAT, 0,
 			(void *) vm_copy_lvalue(newstmt->lv_rminor));
+	newstmt->lv_sturm = vm_new_lvalue(TK_FLOAT);
+	if (newstmt->lv_sturm != NULL)
+		pcontext_addsymbol("sturm", DECL_FLOAT, 0,
+			(void *) vm_copy_lvalue(newstmt->lv_sturm));
 
 	// Parse the torus's parameters and body.
 	//
@@ -939,6 +945,8 @@ void vm_torus(VMStmt *curstmt)
 		stmtobj->lv_rmajor->v.x = rmajor;
 	if (stmtobj->lv_rminor != NULL)
 		stmtobj->lv_rminor->v.x = rminor;
+	if (stmtobj->lv_sturm != NULL)
+		stmtobj->lv_sturm->v.x = 0.0;
 
 	// Run the statements in the object's block.
 	//
@@ -954,6 +962,8 @@ void vm_torus(VMStmt *curstmt)
 	if (stmtobj->lv_rminor != NULL)
 		rminor = stmtobj->lv_rminor->v.x;
 	Ray_SetTorus(newobj->data.torus, &center, rmajor, rminor);
+	if (stmtobj->lv_sturm != NULL && stmtobj->lv_sturm->v.x != 0.0)
+		newobj->data.torus->solver = SOLVER_STURM;
 
 	vm_finish_object((VMStmtObj *) curstmt, newobj, 1);
 }
@@ -984,6 +994,8 @@ void vm_torus_cleanup(VMStmt *curstmt)
 	stmtobj->lv_rmajor = NULL;
 	vm_delete_lvalue(stmtobj->lv_rminor);
 	stmtobj->lv_rminor = NULL;
+	vm_delete_lvalue(stmtobj->lv_sturm);
+	stmtobj->lv_sturm = NULL;
 	
 	// Cleanup the base object statement.
 	//